@@ -4,14 +4,14 @@
 #include "mongoose.h"
 
 // HTTP request handler function. It implements the following endpoints:
-//   /upload - Saves the next file chunk
+//   /upload - Streams the next file chunk to disk as it arrives
 //   all other URI - serves web_root/ directory
 static void cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
-  if (ev == MG_EV_HTTP_MSG) {
-    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
-    if (mg_http_match_uri(hm, "/upload")) {
-      mg_http_upload(c, hm, "/tmp");
-    } else {
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  if (ev == MG_EV_HTTP_HDRS && mg_http_match_uri(hm, "/upload")) {
+    mg_http_upload(c, hm, "/tmp");  // Replies when the upload is done
+  } else if (ev == MG_EV_HTTP_MSG) {
+    if (!mg_http_match_uri(hm, "/upload")) {
       struct mg_http_serve_opts opts = {.root_dir = "web_root"};
       mg_http_serve_dir(c, ev_data, &opts);
     }
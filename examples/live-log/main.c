@@ -52,7 +52,7 @@ int main(void) {
 
   mg_mgr_init(&mgr);
   mg_http_listen(&mgr, "http://localhost:8000", cb, NULL);
-  mg_timer_init(&t1, 1000, MG_TIMER_REPEAT, timer_fn, &mgr);
+  mg_timer_init(&mgr.timers, &t1, 1000, MG_TIMER_REPEAT, timer_fn, &mgr);
 
   for (;;) mg_mgr_poll(&mgr, 50);
   mg_timer_free(&t1);
@@ -69,18 +69,15 @@ static void disband(struct mg_connection *c) {
   c->fn_data = NULL;
 }
 
+// Target is connected. From now on, Mongoose moves data both ways by itself,
+// on Linux without copying it to user space
 static void exchange(struct mg_connection *c) {
   struct mg_connection *c2 = (struct mg_connection *) c->fn_data;
-  if (c2 != NULL) {
-    mg_send(c2, c->recv.buf, c->recv.len);
-    mg_iobuf_delete(&c->recv, c->recv.len);
-  } else {
-    c->is_draining = 1;
-  }
+  if (c2 == NULL || !mg_relay(c, c2)) c->is_draining = 1;
 }
 
 static void fn2(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
-  if (ev == MG_EV_READ) {
+  if (ev == MG_EV_CONNECT) {
     exchange(c);
   } else if (ev == MG_EV_CLOSE) {
     disband(c);
@@ -154,7 +151,6 @@ static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
     // We use the first label byte as a state
     if (c->label[0] == STATE_HANDSHAKE) handshake(c);
     if (c->label[0] == STATE_REQUEST) request(c);
-    if (c->label[0] == STATE_ESTABLISHED) exchange(c);
   } else if (ev == MG_EV_CLOSE) {
     disband(c);
   }
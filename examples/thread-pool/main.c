@@ -0,0 +1,81 @@
+// Copyright (c) 2020 Cesanta Software Limited
+// All rights reserved
+//
+// Thread pool example, POSIX only. See multi-threaded example for a portable
+// way to hand work over to threads.
+// For each incoming request, we submit a job to the worker thread pool.
+// The job sleeps for some time to simulate long processing time and produces
+// an output, which is handed over to the request handler function by the
+// MG_EV_WORK_DONE event. If all workers are busy and the queue is full,
+// the request is answered with 503.
+//
+// IMPORTANT: this program must be compiled with -DMG_ENABLE_WORKERS=1
+//
+// The following procedure is used to benchmark the multi-threaded codepath
+// against the single-threaded codepath on MacOS:
+//   $ make clean all CFLAGS="-DSLEEP_TIME=0 -DMG_ENABLE_WORKERS=1"
+//   $ siege -c50 -t5s http://localhost:8000/multi
+//   $ siege -c50 -t5s http://localhost:8000/fast
+//
+// If, during the test, there are socket errors, increase ephemeral port limit:
+//   $ sysctl -a | grep portrange
+//   $ sudo sysctl -w net.inet.ip.portrange.first=32768
+//   $ sudo sysctl -w net.inet.ip.portrange.hifirst=32768
+
+#include "mongoose.h"
+
+#ifndef SLEEP_TIME
+#define SLEEP_TIME 3  // Seconds to sleep to simulate calculation
+#endif
+
+#define NUM_WORKERS 4   // Number of worker threads
+#define MAX_QUEUED 100  // Maximum number of requests waiting for a worker
+
+// Runs in a worker thread. Must not touch connections
+static void thread_function(void *param) {
+  char *result = (char *) param;   // Buffer for the result
+  mg_usleep(SLEEP_TIME * 1000000);  // Simulate long execution
+  strcpy(result, "hello\n");        // Produce result
+}
+
+// HTTP request callback
+static void cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+
+    if (mg_http_match_uri(hm, "/fast")) {
+      // The /fast URI is for performance impact of the multithreading codepath
+      mg_printf(c,
+                "HTTP/1.1 200 OK\r\n"        // Reply success
+                "Host: foo\r\n"              // Mandatory header
+                "Content-Length: 3\r\n\r\n"  // Set to allow keep-alive
+                "hi\n");
+    } else {
+      // Hand the work over to the pool. The result buffer is ours again when
+      // MG_EV_WORK_DONE arrives; if the connection closes before that,
+      // Mongoose frees it
+      char *result = (char *) calloc(1, 100);
+      if (!mg_submit(c->mgr, c->id, thread_function, result)) {
+        free(result);
+        mg_http_reply(c, 503, "", "Busy, try again later\n");
+      }
+    }
+  } else if (ev == MG_EV_WORK_DONE) {
+    // Got the result from the worker
+    char *result = (char *) ev_data;
+    mg_printf(c, "HTTP/1.0 200 OK\r\nContent-Length: %d\r\n\r\n%s",
+              (int) strlen(result), result);
+    free(result);
+  }
+  (void) fn_data;
+}
+
+int main(void) {
+  struct mg_mgr mgr;
+  mg_mgr_init(&mgr);
+  mg_workers_init(&mgr, NUM_WORKERS, MAX_QUEUED);
+  mg_http_listen(&mgr, "http://localhost:8000", cb, NULL);
+  for (;;) mg_mgr_poll(&mgr, 1000);
+  mg_mgr_free(&mgr);
+  return 0;
+}
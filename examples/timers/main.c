@@ -45,7 +45,8 @@ int main(void) {
   struct mg_mgr mgr;   // Event manager
   struct mg_timer t1;  // Timer
   mg_mgr_init(&mgr);   // Initialise event manager
-  mg_timer_init(&t1, 300, MG_TIMER_REPEAT, timer_fn, &mgr);  // Init timer
+  // Init timer, it is run by mg_mgr_poll()
+  mg_timer_init(&mgr.timers, &t1, 300, MG_TIMER_REPEAT, timer_fn, &mgr);
   mg_http_listen(&mgr, s_listen_on, fn, NULL);  // Create HTTP listener
   for (;;) mg_mgr_poll(&mgr, 1000);             // Infinite event loop
   mg_timer_free(&t1);                           // Free timer resources
@@ -58,7 +58,7 @@ int main(void) {
 
   mg_mgr_init(&mgr);
   mg_http_listen(&mgr, "http://localhost:8000", cb, NULL);
-  mg_timer_init(&t1, 500, MG_TIMER_REPEAT, timer_callback, &mgr);
+  mg_timer_init(&mgr.timers, &t1, 500, MG_TIMER_REPEAT, timer_callback, &mgr);
   for (;;) mg_mgr_poll(&mgr, 50);
   mg_timer_free(&t1);
   mg_mgr_free(&mgr);
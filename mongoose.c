@@ -22,6 +22,86 @@
 #line 1 "src/private.h"
 #endif
 void mg_connect_resolved(struct mg_connection *);
+void mg_ready(struct mg_connection *);
+void mg_unready(struct mg_connection *);
+struct mg_connection *mg_alloc_conn(struct mg_mgr *);
+void mg_free_conn(struct mg_connection *);
+void mg_add_conn(struct mg_connection *);
+void mg_del_conn(struct mg_connection *);
+void mg_io_drained(struct mg_mgr *, struct mg_iobuf *);
+#if MG_ENABLE_SOCKET && MG_ENABLE_WAKEUP
+bool mg_wakeup_post(struct mg_mgr *, unsigned long id, int ev, const void *buf,
+                    size_t len);
+void mg_wakeup_free(struct mg_mgr *);
+#endif
+#if MG_ENABLE_SOCKET && MG_ENABLE_WORKERS
+void mg_workers_free(struct mg_mgr *);
+#endif
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_IO_URING
+struct mg_uring {
+  int fd;  // Ring file descriptor
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;  // Submission queue entries
+  struct io_uring_cqe *cqes;  // Completion queue entries
+  unsigned sq_entries;        // Submission queue size
+  void *sq_ptr, *cq_ptr;      // Mapped rings
+  size_t sq_len, cq_len, sqes_len;
+  unsigned char *bufs;            // Provided receive buffers
+  unsigned nbufs, bufsize;        // Number and size of receive buffers
+  unsigned *lost, nlost;  // Buffers not yet given back, as SQ was full
+  struct mg_uring_conn *zombies;  // Closed connections with in-flight IO
+};
+
+struct mg_uring *mg_uring_new(unsigned entries, unsigned nbufs,
+                              unsigned bufsize);
+void mg_uring_free(struct mg_uring *);
+struct io_uring_sqe *mg_uring_sqe(struct mg_uring *);
+int mg_uring_enter(struct mg_uring *, int wait_ms);
+struct io_uring_cqe *mg_uring_cqe(struct mg_uring *);
+void mg_uring_cqe_done(struct mg_uring *);
+unsigned char *mg_uring_buf(struct mg_uring *, unsigned bid);
+void mg_uring_provide(struct mg_uring *, unsigned bid);
+void mg_uring_close(struct mg_mgr *);
+#endif
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_REACTORS
+struct mg_reactors {
+  int n;                                // Number of reactors
+  int nthreads;                         // Number of threads created
+  int flags;                            // MG_REACTORS_* flags
+  void (*fn)(struct mg_mgr *, void *);  // Sets up listeners of each reactor
+  void *fn_data;                        // Parameter for fn
+  int started;                          // Number of reactors set up so far
+  int stop;                             // Tells reactors to exit, atomic
+  struct mg_mgr **mgrs;                 // Running reactors, to wake them up
+  pthread_mutex_t lock;                 // Protects started and mgrs
+  pthread_cond_t cond;                  // Signalled when started changes
+  pthread_t *threads;                   // Reactor threads
+};
+#endif
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_WORKERS
+struct mg_work {
+  struct mg_work *next;  // Linkage in struct mg_workers :: queue
+  unsigned long id;      // Connection that gets MG_EV_WORK_DONE
+  void (*fn)(void *);    // Work function, runs on a worker thread
+  void *arg;             // Parameter for fn
+};
+
+struct mg_workers {
+  struct mg_mgr *mgr;        // Manager to deliver MG_EV_WORK_DONE to
+  struct mg_work *queue;     // Work not yet picked up by workers
+  struct mg_work **tail;     // Where to append new work
+  int queued, max_queued;    // Queue length and its limit
+  int nthreads;              // Number of worker threads
+  int stop;                  // Tells workers to exit
+  pthread_mutex_t lock;      // Protects everything above
+  pthread_cond_t cond;       // Signalled when work is queued or stop is set
+  pthread_t *threads;        // Worker threads
+};
+#endif
 
 #if MG_ARCH == MG_ARCH_FREERTOS
 static inline void *mg_calloc(int cnt, size_t size) {
@@ -138,21 +218,21 @@ struct dns_data {
   uint16_t txnid;
 };
 
-static struct dns_data *s_reqs;  // Active DNS requests
-
 static void mg_sendnsreq(struct mg_connection *, struct mg_str *, int,
                          struct mg_dns *, bool);
 
-static void mg_dns_free(struct dns_data *d) {
-  LIST_DELETE(struct dns_data, &s_reqs, d);
+static void mg_dns_free(struct mg_mgr *mgr, struct dns_data *d) {
+  LIST_DELETE(struct dns_data, (struct dns_data **) &mgr->active_dns_requests,
+              d);
   free(d);
 }
 
 void mg_resolve_cancel(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
   struct dns_data *tmp, *d;
-  for (d = s_reqs; d != NULL; d = tmp) {
+  for (d = (struct dns_data *) mgr->active_dns_requests; d != NULL; d = tmp) {
     tmp = d->next;
-    if (d->c == c) mg_dns_free(d);
+    if (d->c == c) mg_dns_free(mgr, d);
   }
 }
 
@@ -258,10 +338,11 @@ bool mg_dns_parse(const uint8_t *buf, size_t len, struct mg_dns_message *dm) {
 
 static void dns_cb(struct mg_connection *c, int ev, void *ev_data,
                    void *fn_data) {
+  struct mg_mgr *mgr = c->mgr;
   struct dns_data *d, *tmp;
   if (ev == MG_EV_POLL) {
     unsigned long now = *(unsigned long *) ev_data;
-    for (d = s_reqs; d != NULL; d = tmp) {
+    for (d = (struct dns_data *) mgr->active_dns_requests; d != NULL; d = tmp) {
       tmp = d->next;
       // LOG(LL_DEBUG, ("%lu %lu dns poll", d->expire, now));
       if (now > d->expire) mg_error(d->c, "DNS timeout");
@@ -275,7 +356,8 @@ static void dns_cb(struct mg_connection *c, int ev, void *ev_data,
       free(s);
     } else {
       LOG(LL_VERBOSE_DEBUG, ("%s %d", dm.name, dm.resolved));
-      for (d = s_reqs; d != NULL; d = tmp) {
+      for (d = (struct dns_data *) mgr->active_dns_requests; d != NULL;
+           d = tmp) {
         tmp = d->next;
         // LOG(LL_INFO, ("d %p %hu %hu", d, d->txnid, dm.txnid));
         if (dm.txnid != d->txnid) continue;
@@ -301,16 +383,16 @@ static void dns_cb(struct mg_connection *c, int ev, void *ev_data,
         } else {
           LOG(LL_ERROR, ("%lu already resolved", d->c->id));
         }
-        mg_dns_free(d);
+        mg_dns_free(mgr, d);
         resolved = 1;
       }
     }
     if (!resolved) LOG(LL_ERROR, ("stray DNS reply"));
     c->recv.len = 0;
   } else if (ev == MG_EV_CLOSE) {
-    for (d = s_reqs; d != NULL; d = tmp) {
+    for (d = (struct dns_data *) mgr->active_dns_requests; d != NULL; d = tmp) {
       tmp = d->next;
-      mg_dns_free(d);
+      mg_dns_free(mgr, d);
     }
   }
   (void) fn_data;
@@ -352,6 +434,7 @@ void mg_dns_send(struct mg_connection *c, const struct mg_str *name,
 
 static void mg_sendnsreq(struct mg_connection *c, struct mg_str *name, int ms,
                          struct mg_dns *dnsc, bool ipv6) {
+  struct mg_mgr *mgr = c->mgr;
   struct dns_data *d = NULL;
   if (dnsc->url == NULL) {
     mg_error(c, "DNS server URL is NULL. Call mg_mgr_init()");
@@ -368,9 +451,10 @@ static void mg_sendnsreq(struct mg_connection *c, struct mg_str *name, int ms,
   } else if ((d = (struct dns_data *) calloc(1, sizeof(*d))) == NULL) {
     mg_error(c, "resolve OOM");
   } else {
-    d->txnid = s_reqs ? s_reqs->txnid + 1 : 1;
-    d->next = s_reqs;
-    s_reqs = d;
+    struct dns_data *reqs = (struct dns_data *) mgr->active_dns_requests;
+    d->txnid = reqs ? reqs->txnid + 1 : 1;
+    d->next = reqs;
+    mgr->active_dns_requests = d;
     d->expire = mg_millis() + ms;
     d->c = c;
     c->is_resolving = 1;
@@ -398,6 +482,7 @@ void mg_resolve(struct mg_connection *c, struct mg_str *name, int ms) {
 
 
 
+
 void mg_call(struct mg_connection *c, int ev, void *ev_data) {
   if (c->pfn != NULL) c->pfn(c, ev, ev_data, c->pfn_data);
   if (c->fn != NULL) c->fn(c, ev, ev_data, c->fn_data);
@@ -413,6 +498,7 @@ void mg_error(struct mg_connection *c, const char *fmt, ...) {
   mg_call(c, MG_EV_ERROR, buf);
   if (buf != mem) free(buf);
   c->is_closing = 1;
+  mg_ready(c);
 }
 
 #ifdef MG_ENABLE_LINES
@@ -429,6 +515,14 @@ void mg_error(struct mg_connection *c, const char *fmt, ...) {
 
 
 
+#if MG_ENABLE_SIMD && defined(__GNUC__) && defined(__SSE2__)
+#include <immintrin.h>
+#define MG_SIMD_SSE2 1
+#elif MG_ENABLE_SIMD && defined(__GNUC__) && defined(__aarch64__)
+#include <arm_neon.h>
+#define MG_SIMD_NEON 1
+#endif
+
 struct http_data {
   void *old_pfn_data;  // Previous pfn_data
   FILE *fp;            // For static file serving
@@ -514,11 +608,77 @@ int mg_url_decode(const char *src, size_t src_len, char *dst, size_t dst_len,
   return i >= src_len && j < dst_len ? (int) j : -1;
 }
 
-int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
-  size_t i;
-  for (i = 0; i < buf_len; i++) {
-    if (!isprint(buf[i]) && buf[i] != '\r' && buf[i] != '\n' && buf[i] < 128)
-      return -1;
+// Return the number of leading bytes in s, n that are not control characters
+static size_t mg_span_text(const unsigned char *s, size_t n) {
+  size_t i = 0;
+#if MG_SIMD_SSE2 && defined(__AVX2__)
+  const __m256i lim32 = _mm256_set1_epi8(0x1f), del32 = _mm256_set1_epi8(0x7f);
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) (s + i));
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(x, lim32), x),
+                                _mm256_cmpeq_epi8(x, del32));
+    unsigned bits = (unsigned) _mm256_movemask_epi8(m);
+    if (bits != 0) return i + (size_t) __builtin_ctz(bits);
+  }
+#endif
+#if MG_SIMD_SSE2
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i m = _mm_or_si128(
+        _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(0x1f)), x),
+        _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f)));
+    unsigned bits = (unsigned) _mm_movemask_epi8(m);
+    if (bits != 0) return i + (size_t) __builtin_ctz(bits);
+  }
+#elif MG_SIMD_NEON
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t x = vld1q_u8(s + i);
+    uint8x16_t m = vorrq_u8(vcltq_u8(x, vdupq_n_u8(0x20)),
+                            vceqq_u8(x, vdupq_n_u8(0x7f)));
+    if (vmaxvq_u8(m) != 0) break;  // Let the loop below find which byte
+  }
+#endif
+  while (i < n && s[i] >= 0x20 && s[i] != 0x7f) i++;
+  return i;
+}
+
+// Return pointer to the first '\n', NUL or one of d characters in s..e.
+// The vector loops compare 16 bytes at once against up to 4 delimiters
+static const char *mg_span_delim(const char *s, const char *e, const char *d) {
+#if MG_SIMD_SSE2 || MG_SIMD_NEON
+  size_t k, nd = strlen(d);
+  char c[4];
+  for (k = 0; k < 4; k++) c[k] = k < nd ? d[k] : '\n';
+  for (; nd <= 4 && s + 16 <= e; s += 16) {
+#if MG_SIMD_SSE2
+    __m128i x = _mm_loadu_si128((const __m128i *) s);
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')),
+                             _mm_cmpeq_epi8(x, _mm_setzero_si128()));
+    unsigned bits;
+    for (k = 0; k < 4; k++) {
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(c[k])));
+    }
+    bits = (unsigned) _mm_movemask_epi8(m);
+    if (bits != 0) return s + __builtin_ctz(bits);
+#else
+    uint8x16_t x = vld1q_u8((const uint8_t *) s);
+    uint8x16_t m = vorrq_u8(vceqq_u8(x, vdupq_n_u8('\n')), vceqzq_u8(x));
+    for (k = 0; k < 4; k++) m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8(c[k])));
+    if (vmaxvq_u8(m) != 0) break;
+#endif
+  }
+#endif
+  while (s < e && *s != '\n' && strchr(d, *s) == NULL) s++;
+  return s;
+}
+
+// Look for the end of headers, starting at offset i. Bytes before i must
+// have been checked by a previous call
+static int mg_http_scan(const unsigned char *buf, size_t i, size_t buf_len) {
+  for (; i < buf_len; i++) {
+    i += mg_span_text(buf + i, buf_len - i);  // Jump to next control character
+    if (i >= buf_len) break;
+    if (buf[i] != '\r' && buf[i] != '\n') return -1;
     if ((i > 0 && buf[i] == '\n' && buf[i - 1] == '\n') ||
         (i > 3 && buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n'))
       return (int) i + 1;
@@ -526,10 +686,14 @@ int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
   return 0;
 }
 
+int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
+  return mg_http_scan(buf, 0, buf_len);
+}
+
 static const char *skip(const char *s, const char *e, const char *d,
                         struct mg_str *v) {
   v->ptr = s;
-  while (s < e && *s != '\n' && strchr(d, *s) == NULL) s++;
+  s = mg_span_delim(s, e, d);
   v->len = s - v->ptr;
   while (s < e && strchr(d, *s) != NULL) s++;
   return s;
@@ -562,9 +726,17 @@ void mg_http_parse_headers(const char *s, const char *end,
   }
 }
 
-int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
-  int is_response, req_len = mg_http_get_request_len((unsigned char *) s, len);
+static bool mg_http_is_chunked(struct mg_http_message *hm) {
+  struct mg_str *te = mg_http_get_header(hm, "Transfer-Encoding");
+  return te != NULL && te->len >= 7 &&
+         mg_ncasecmp(te->ptr + te->len - 7, "chunked", 7) == 0;
+}
+
+// Parse request line and headers, which are known to be req_len bytes long
+static int mg_http_parse_head(const char *s, int req_len,
+                              struct mg_http_message *hm) {
   const char *end = s + req_len, *qs;
+  int is_response;
   struct mg_str *cl;
 
   memset(hm, 0, sizeof(*hm));
@@ -624,9 +796,42 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
     hm->message.len = req_len;
   }
 
+  // Chunked body length is not known until the last chunk, see http_chunks()
+  if (mg_http_is_chunked(hm)) hm->body.len = hm->message.len = (size_t) ~0;
+
   return req_len;
 }
 
+int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
+  int req_len = mg_http_get_request_len((unsigned char *) s, len);
+  return mg_http_parse_head(s, req_len, hm);
+}
+
+// Forget the current message. Streaming and upload settings are kept
+static void http_reset(struct mg_http_parser *p) {
+  p->scanned = p->head = p->body = p->decoded = p->deleted = p->owed = 0;
+  p->is_chunked = false;
+}
+
+int mg_http_feed(struct mg_http_parser *p, const char *s, size_t len,
+                 struct mg_http_message *hm) {
+  if (len < p->scanned || len < p->head) http_reset(p);
+  if (p->head == 0) {
+    int n = mg_http_scan((unsigned char *) s, p->scanned, len);
+    if (n <= 0) {
+      p->scanned = len;
+      return n;
+    }
+    if (mg_http_parse_head(s, n, hm) < 0) return -1;
+    p->head = (size_t) n;
+    p->body = hm->body.len;
+    p->is_chunked = mg_http_is_chunked(hm);
+    if (hm->body.len != (size_t) ~0 && len - p->head >= p->body) return n;
+  }
+  if (p->body == (size_t) ~0 || len - p->head < p->body) return 0;
+  return mg_http_parse_head(s, (int) p->head, hm);
+}
+
 static void mg_http_vprintf_chunk(struct mg_connection *c, const char *fmt,
                                   va_list ap) {
   char mem[256], *buf = mem;
@@ -664,8 +869,9 @@ void mg_http_reply(struct mg_connection *c, int code, const char *headers,
   if (buf != mem) free(buf);
 }
 
-#if MG_ENABLE_FS
 static void http_cb(struct mg_connection *, int, void *, void *);
+
+#if MG_ENABLE_FS
 static void restore_http_cb(struct mg_connection *c) {
   struct http_data *d = (struct http_data *) c->pfn_data;
   if (d->fp != NULL) fclose(d->fp);
@@ -680,6 +886,116 @@ char *mg_http_etag(char *buf, size_t len, mg_stat_t *st) {
   return buf;
 }
 
+// Upload sink of mg_http_upload(), kept in c->http->upload
+struct http_upload {
+#if MG_ENABLE_POSIX
+  int fd;  // Target file
+#else
+  FILE *fp;  // Target file
+#endif
+  size_t offset;        // File offset of the body start
+  size_t reserved;      // Space allocated up front, 0 if none
+  unsigned long start;  // Upload start time, ms
+};
+
+static struct http_upload *upload_open(const char *path, size_t oft,
+                                       size_t len) {
+  struct http_upload *u = (struct http_upload *) calloc(1, sizeof(*u));
+  if (u == NULL) return NULL;
+  u->offset = oft;
+  u->start = mg_millis();
+#if MG_ENABLE_POSIX
+  if ((u->fd = open(path, O_WRONLY | O_CREAT | (oft == 0 ? O_TRUNC : 0),
+                    0644)) < 0) {
+    free(u);
+    return NULL;
+  }
+#if defined(__linux__)
+  // Reserve space, so the file is less fragmented and a full disk fails early
+  if (len > 0 && len != (size_t) ~0) {
+    int rc = posix_fallocate(u->fd, (off_t) oft, (off_t) len);
+    if (rc == ENOSPC) {
+      close(u->fd);
+      free(u);
+      errno = rc;
+      return NULL;
+    }
+    if (rc == 0) u->reserved = len;
+  }
+#endif
+#else
+  if ((oft == 0 || (u->fp = mg_fopen(path, "r+b")) == NULL) &&
+      (u->fp = mg_fopen(path, "wb")) == NULL) {
+    free(u);
+    return NULL;
+  }
+#endif
+  (void) len;
+  return u;
+}
+
+// Write s at body offset ofs. Return 0 on success, -1 on error
+static int upload_write(struct http_upload *u, size_t ofs, struct mg_str s) {
+  ofs += u->offset;
+#if MG_ENABLE_POSIX
+  while (s.len > 0) {
+    ssize_t n = pwrite(u->fd, s.ptr, s.len, (off_t) ofs);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    s.ptr += n, s.len -= (size_t) n, ofs += (size_t) n;
+  }
+  return 0;
+#else
+  if (fseek(u->fp, (long) ofs, SEEK_SET) != 0) return -1;
+  return fwrite(s.ptr, 1, s.len, u->fp) == s.len ? 0 : -1;
+#endif
+}
+
+// Close upload file that has len body bytes. An unfinished upload is cut at
+// the data received, so space reserved for the rest is released
+static void upload_close(struct mg_connection *c, struct http_upload *u,
+                         size_t len, bool ok) {
+  unsigned long ms = mg_millis() - u->start;
+  LOG(LL_DEBUG, ("%lu %s, %lu bytes in %lu ms", c->id, ok ? "done" : "failed",
+                 (unsigned long) len, ms));
+#if MG_ENABLE_POSIX
+  if (!ok && u->reserved > 0 && ftruncate(u->fd, (off_t) (u->offset + len))) {
+    LOG(LL_ERROR, ("%lu ftruncate: %d", c->id, errno));
+  }
+  close(u->fd);
+#else
+  fclose(u->fp);
+#endif
+  free(u);
+}
+
+// Write streamed body data to the upload file, reply when the body is done.
+// Called before the user handler gets the event
+static void http_upload(struct mg_connection *c, int ev,
+                        struct mg_http_message *hm) {
+  struct mg_http_parser *p = c->http;
+  struct http_upload *u = (struct http_upload *) p->upload;
+  if (ev == MG_EV_HTTP_CHUNK) {
+    if (upload_write(u, p->decoded - hm->chunk.len, hm->chunk) != 0) {
+      mg_http_reply(c, 500, "", "write: %d", errno);
+      c->is_draining = 1;
+      upload_close(c, u, p->decoded - hm->chunk.len, false);
+      p->upload = NULL;
+    }
+  } else {
+    size_t n = c->recv.len - p->head, left = p->body - p->decoded;
+    if (ev == MG_EV_CLOSE && !p->is_chunked && n > 0) {
+      // Keep the last, partial block of an unfinished upload
+      struct mg_str s = mg_str_n((char *) c->recv.buf + p->head, n);
+      if (s.len > left) s.len = left;
+      if (upload_write(u, p->decoded, s) == 0) p->decoded += s.len;
+    }
+    if (ev == MG_EV_HTTP_MSG) mg_http_reply(c, 200, "", "");
+    upload_close(c, u, p->decoded, ev == MG_EV_HTTP_MSG);
+    p->upload = NULL;
+  }
+}
+
 int mg_http_upload(struct mg_connection *c, struct mg_http_message *hm,
                    const char *dir) {
   char offset[40] = "", name[200] = "", path[256];
@@ -689,19 +1005,33 @@ int mg_http_upload(struct mg_connection *c, struct mg_http_message *hm,
     mg_http_reply(c, 400, "", "%s", "name required");
     return -1;
   } else {
-    FILE *fp;
+    struct http_upload *u;
     size_t oft = strtoul(offset, NULL, 0);
+    // Body is complete when called on MG_EV_HTTP_MSG, and may be complete
+    // on MG_EV_HTTP_HDRS. Otherwise, the rest is streamed to the file
+    struct mg_http_parser *p = c->http;
+    bool complete = p == NULL || hm->message.len <= c->recv.len;
+    bool is_chunked = p != NULL && p->is_chunked;
+    size_t len = complete ? hm->body.len : p->body;
     snprintf(path, sizeof(path), "%s%c%s", dir, MG_DIRSEP, name);
-    LOG(LL_DEBUG,
-        ("%p %d bytes @ %d [%s]", c->fd, (int) hm->body.len, (int) oft, name));
-    if ((fp = mg_fopen(path, oft == 0 ? "wb" : "ab")) == NULL) {
-      mg_http_reply(c, 400, "", "fopen(%s): %d", name, errno);
+    LOG(LL_DEBUG, ("%lu %s %d bytes @ %d [%s]", c->id,
+                   complete ? "writing" : "streaming",
+                   complete ? (int) len : -1, (int) oft, name));
+    if ((u = upload_open(path, oft, is_chunked ? 0 : len)) == NULL) {
+      mg_http_reply(c, 400, "", "open(%s): %d", name, errno);
       return -2;
+    } else if (!complete) {
+      p->upload = u;
+      p->is_streaming = true;
+      return 0;
+    } else if (upload_write(u, 0, hm->body) != 0) {
+      mg_http_reply(c, 500, "", "write(%s): %d", name, errno);
+      upload_close(c, u, 0, false);
+      return -3;
     } else {
-      fwrite(hm->body.ptr, 1, hm->body.len, fp);
-      fclose(fp);
+      upload_close(c, u, hm->body.len, true);
       mg_http_reply(c, 200, "", "");
-      return hm->body.len;
+      return (int) hm->body.len;
     }
   }
 }
@@ -723,6 +1053,12 @@ static void static_cb(struct mg_connection *c, int ev, void *ev_data,
   (void) ev_data;
 }
 
+#if MG_ENABLE_SENDFILE
+static void fclose_cb(void *fp) {
+  fclose((FILE *) fp);
+}
+#endif
+
 static const char *guess_content_type(const char *filename) {
   size_t n = strlen(filename);
 #define MIME_ENTRY(_ext, _type) \
@@ -807,6 +1143,11 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
               mime, etag, (int64_t) st.st_size, hdrs ? hdrs : "");
     if (mg_vcasecmp(&hm->method, "HEAD") == 0) {
       fclose(fp);
+#if MG_ENABLE_SENDFILE
+    } else if (mg_send_file(c, fileno(fp), 0, (size_t) st.st_size, fclose_cb,
+                            fp) > 0) {
+      // Queued, sent by sendfile() as the socket becomes writable
+#endif
     } else {
       struct http_data *d = (struct http_data *) calloc(1, sizeof(*d));
       if (d == NULL) {
@@ -1134,6 +1475,17 @@ void mg_http_serve_dir(struct mg_connection *c, struct mg_http_message *hm,
     }
   }
 }
+#else
+struct http_upload;
+static void upload_close(struct mg_connection *c, struct http_upload *u,
+                         size_t len, bool ok) {
+  (void) c, (void) u, (void) len, (void) ok;
+}
+
+static void http_upload(struct mg_connection *c, int ev,
+                        struct mg_http_message *hm) {
+  (void) c, (void) ev, (void) hm;
+}
 #endif
 
 static bool mg_is_url_safe(int c) {
@@ -1190,12 +1542,178 @@ bool mg_http_match_uri(const struct mg_http_message *hm, const char *glob) {
   return mg_globmatch(glob, strlen(glob), hm->uri.ptr, hm->uri.len);
 }
 
+// Decoded body data ends here. Chunk framing that follows it is dropped when
+// http_chunks() returns, so a deleted chunk only moves this position back
+static size_t http_decoded_end(struct mg_http_parser *p) {
+  return p->head + p->decoded - p->deleted;
+}
+
+void mg_http_delete_chunk(struct mg_connection *c, struct mg_http_message *hm) {
+  size_t ofs = (size_t) ((unsigned char *) hm->chunk.ptr - c->recv.buf);
+  struct mg_http_parser *p = c->http;
+  if (hm->chunk.len == 0 || p == NULL || !p->is_chunked) return;
+  if (ofs + hm->chunk.len != http_decoded_end(p)) return;  // Not the last
+  p->deleted += hm->chunk.len;
+  hm->body.len -= hm->chunk.len;
+  hm->chunk.len = 0;
+}
+
+// Decode complete chunks of a chunked body in place: move chunk data next to
+// the previously decoded data, and fire MG_EV_HTTP_CHUNK. When streaming,
+// any part of a chunk that arrived is delivered, so chunks of any size fit.
+// The read position runs ahead over chunk framing, and the gap is closed
+// once, on return.
+// Return -1 on error, 0 if more data is needed, or the length of request
+// once the last chunk is seen, in which case hm describes the whole message
+static int http_chunks(struct mg_connection *c, struct mg_http_message *hm) {
+  struct mg_http_parser *p = c->http;
+  size_t r = http_decoded_end(p), w;  // Read and write positions
+  int res = 0;
+  for (;;) {
+    char *buf = (char *) c->recv.buf, *s = buf + r;
+    size_t i = 0, e, n = 0, len = c->recv.len - r, ofs;
+    w = http_decoded_end(p);
+    if (p->owed > 2) {
+      // Inside a chunk: deliver the part of it that has arrived
+      if ((n = len < p->owed - 2 ? len : p->owed - 2) == 0) break;
+      memmove(buf + w, s, n);
+      r += n;
+      p->owed -= n;
+      p->decoded += n;
+      mg_http_parse_head(buf, (int) p->head, hm);
+      hm->body = mg_str_n(buf + p->head, w + n - p->head);
+      hm->chunk = mg_str_n(buf + w, n);
+      if (p->upload != NULL) http_upload(c, MG_EV_HTTP_CHUNK, hm);
+      mg_call(c, MG_EV_HTTP_CHUNK, hm);
+      if (c->is_closing || c->pfn != http_cb) break;
+      if (p->is_streaming) mg_http_delete_chunk(c, hm);
+      continue;
+    } else if (p->owed > 0) {
+      // Chunk data is over, skip the CRLF that follows it
+      if (len < p->owed) break;
+      if (memcmp(s, &"\r\n"[2 - p->owed], p->owed) != 0) {
+        res = -1;
+        break;
+      }
+      r += p->owed;
+      p->owed = 0;
+      continue;
+    }
+    while (i < len && i < sizeof(n) * 2 - 1 && isxdigit((unsigned char) s[i])) {
+      n = (n << 4) | (size_t) mg_unhexn(&s[i++], 1);
+    }
+    if (i < len && (i == 0 || isxdigit((unsigned char) s[i]))) {
+      res = -1;
+      break;
+    }
+    while (i < len && s[i] != '\n') i++;  // Skip chunk extensions
+    if (i >= len) break;
+    ofs = i + 1;
+    if (n == 0) {
+      // Last chunk, followed by optional trailers and an empty line
+      for (i = ofs;; i = e + 1) {
+        for (e = i; e < len && s[e] != '\n';) e++;
+        if (e >= len || e == i || (e == i + 1 && s[i] == '\r')) break;
+      }
+      if (e >= len) break;
+      r += e + 1;
+      mg_http_parse_head(buf, (int) p->head, hm);
+      hm->body = mg_str_n(buf + p->head, w - p->head);
+      hm->message.len = w;
+      res = (int) p->head;
+      break;
+    }
+    // A buffered chunk is delivered whole, a streamed one as it arrives
+    if (!p->is_streaming && len < ofs + n + 2) break;
+    r += ofs;
+    p->owed = n + 2;
+  }
+  w = http_decoded_end(p);
+  mg_iobuf_cut(&c->recv, w, r - w);
+  return res;
+}
+
+// Deliver body data as it arrives, and delete it from the receive buffer.
+// Return 0 if more data is needed, or the length of request once the whole
+// body was delivered, in which case hm describes the message without body
+static int http_stream(struct mg_connection *c, struct mg_http_message *hm) {
+  struct mg_http_parser *p = c->http;
+  size_t n = c->recv.len - p->head, left = p->body - p->decoded;
+  if (n > left) n = left;  // The rest is the next message
+  // Upload writes full blocks. A body read until close is written as is
+  if (p->upload != NULL && p->body != (size_t) ~0 && n < left &&
+      n < MG_UPLOAD_BLOCK) {
+    return 0;
+  }
+  if (n > 0) {
+    char *buf = (char *) c->recv.buf;
+    mg_http_parse_head(buf, (int) p->head, hm);
+    hm->body = hm->chunk = mg_str_n(buf + p->head, n);
+    p->decoded += n;
+    if (p->upload != NULL) http_upload(c, MG_EV_HTTP_CHUNK, hm);
+    mg_call(c, MG_EV_HTTP_CHUNK, hm);
+    if (c->is_closing || c->pfn != http_cb) return 0;
+    mg_iobuf_cut(&c->recv, p->head, n);
+    p->deleted += n;
+  }
+  if (p->decoded < p->body) return 0;
+  mg_http_parse_head((char *) c->recv.buf, (int) p->head, hm);
+  hm->body.len = 0;
+  hm->message.len = p->head;
+  return (int) p->head;
+}
+
+// Message is consumed: abort an upload the handler left open, and end
+// streaming, which lasts for one message
+static void http_done(struct mg_connection *c) {
+  struct mg_http_parser *p = c->http;
+  if (p->upload != NULL) {
+    upload_close(c, (struct http_upload *) p->upload, p->decoded, false);
+    p->upload = NULL;
+  }
+  p->is_streaming = false;
+  http_reset(p);
+}
+
+// Allocate parser state on first use. It is freed when the connection closes
+static struct mg_http_parser *http_parser(struct mg_connection *c) {
+  if (c->http == NULL) {
+    c->http = (struct mg_http_parser *) mg_alloc(sizeof(*c->http));
+    if (c->http != NULL) memset(c->http, 0, sizeof(*c->http));
+  }
+  return c->http;
+}
+
 static void http_cb(struct mg_connection *c, int ev, void *ev_data,
                     void *fn_data) {
   if (ev == MG_EV_READ || ev == MG_EV_CLOSE) {
     struct mg_http_message hm;
+    struct mg_http_parser *p = ev == MG_EV_READ ? http_parser(c) : c->http;
+    if (p == NULL) {
+      if (ev == MG_EV_READ) LOG(LL_ERROR, ("%lu OOM", c->id));
+      c->is_closing = 1;
+      return;
+    }
     for (;;) {
-      int n = mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
+      char *buf = (char *) c->recv.buf;
+      size_t head = p->head;
+      int n;
+      // A chunked or streamed body, cut short by close, is not a message
+      if (ev == MG_EV_CLOSE &&
+          (p->is_chunked || (p->is_streaming && p->body != (size_t) ~0))) {
+        break;
+      }
+      n = ev == MG_EV_CLOSE ? mg_http_parse(buf, c->recv.len, &hm)
+                            : mg_http_feed(p, buf, c->recv.len, &hm);
+      if (n >= 0 && ev == MG_EV_READ && head == 0 && p->head > 0) {
+        mg_call(c, MG_EV_HTTP_HDRS, &hm);  // Handler may set is_streaming
+        if (c->is_closing || c->pfn != http_cb) break;
+      }
+      if (n >= 0 && ev == MG_EV_READ && p->is_chunked) {
+        if ((n = http_chunks(c, &hm)) == 0) break;
+      } else if (n >= 0 && ev == MG_EV_READ && p->is_streaming && p->head > 0) {
+        if ((n = http_stream(c, &hm)) == 0) break;
+      }
       if (ev == MG_EV_CLOSE) {
         hm.message.len = c->recv.len;
         hm.body.len = hm.message.len - (hm.body.ptr - hm.message.ptr);
@@ -1227,23 +1745,31 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data,
           }
           mg_http_write_chunk(c, "", 0);
           mg_iobuf_delete(&c->recv, hm.message.len);
+          http_done(c);
           continue;
         }
 #endif
+        if (p->upload != NULL) http_upload(c, MG_EV_HTTP_MSG, &hm);
         mg_call(c, MG_EV_HTTP_MSG, &hm);
         mg_iobuf_delete(&c->recv, hm.message.len);
+        http_done(c);
       } else {
         break;
       }
     }
+    if (ev == MG_EV_CLOSE && p->upload != NULL) {
+      http_upload(c, MG_EV_CLOSE, NULL);  // Unfinished upload
+    }
   }
   (void) fn_data;
   (void) ev_data;
 }
 
-struct mg_connection *mg_http_connect(struct mg_mgr *mgr, const char *url,
-                                      mg_event_handler_t fn, void *fn_data) {
-  struct mg_connection *c = mg_connect(mgr, url, fn, fn_data);
+struct mg_connection *mg_http_connect_opts(struct mg_mgr *mgr, const char *url,
+                                           const struct mg_sock_opts *opts,
+                                           mg_event_handler_t fn,
+                                           void *fn_data) {
+  struct mg_connection *c = mg_connect_opts(mgr, url, opts, fn, fn_data);
   if (c != NULL) c->pfn = http_cb, c->pfn_data = mgr;
 #if MG_ENABLE_HTTP_DEBUG_ENDPOINT
   snprintf(c->label, sizeof(c->label) - 1, "->%s", url);
@@ -1251,9 +1777,11 @@ struct mg_connection *mg_http_connect(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
-struct mg_connection *mg_http_listen(struct mg_mgr *mgr, const char *url,
-                                     mg_event_handler_t fn, void *fn_data) {
-  struct mg_connection *c = mg_listen(mgr, url, fn, fn_data);
+struct mg_connection *mg_http_listen_opts(struct mg_mgr *mgr, const char *url,
+                                          const struct mg_sock_opts *opts,
+                                          mg_event_handler_t fn,
+                                          void *fn_data) {
+  struct mg_connection *c = mg_listen_opts(mgr, url, opts, fn, fn_data);
   if (c != NULL) c->pfn = http_cb, c->pfn_data = mgr;
 #if MG_ENABLE_HTTP_DEBUG_ENDPOINT
   if (c != NULL) snprintf(c->label, sizeof(c->label) - 1, "<-LSN");
@@ -1261,29 +1789,70 @@ struct mg_connection *mg_http_listen(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
+struct mg_connection *mg_http_connect(struct mg_mgr *mgr, const char *url,
+                                      mg_event_handler_t fn, void *fn_data) {
+  return mg_http_connect_opts(mgr, url, NULL, fn, fn_data);
+}
+
+struct mg_connection *mg_http_listen(struct mg_mgr *mgr, const char *url,
+                                     mg_event_handler_t fn, void *fn_data) {
+  return mg_http_listen_opts(mgr, url, NULL, fn, fn_data);
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/iobuf.c"
 #endif
 
 
 
+
 #include <string.h>
 
+// Start of the allocated block
+static void *mg_iobuf_block(struct mg_iobuf *io) {
+  return io->buf == NULL ? NULL : io->buf - io->off;
+}
+
+// Move data to the beginning of the allocated block, making space consumed
+// by mg_iobuf_delete() available again
+static void mg_iobuf_compact(struct mg_iobuf *io) {
+  if (io->off > 0) {
+    memmove(io->buf - io->off, io->buf, io->len);
+    io->buf -= io->off;
+    io->size += io->off;
+    io->off = 0;
+  }
+}
+
 int mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
   int ok = 1;
   if (new_size == 0) {
-    free(io->buf);
+    mg_dealloc(mg_iobuf_block(io));
     io->buf = NULL;
-    io->len = io->size = 0;
-  } else if (new_size != io->size) {
-    // NOTE(lsm): do not use realloc here. Use malloc/free only, to ease the
-    // porting to some obscure platforms like FreeRTOS
-    void *p = malloc(new_size);
+    io->len = io->size = io->off = 0;
+    return ok;
+  }
+  mg_iobuf_compact(io);  // new_size and the length cut apply to the block
+  if (new_size != io->size) {
+    // NOTE(lsm): realloc is used only if MG_ENABLE_REALLOC is set, to ease
+    // the porting to some obscure platforms like FreeRTOS
+    void *p = NULL;
+#if MG_ENABLE_REALLOC
+    if (io->buf != NULL && (p = mg_realloc(io->buf, new_size)) != NULL) {
+      io->buf = (unsigned char *) p;
+      io->size = new_size;
+      if (io->len > new_size) io->len = new_size;
+      return ok;
+    }
+#endif
+    p = mg_alloc(new_size);
     if (p != NULL) {
-      memcpy(p, io->buf, io->size < new_size ? io->size : new_size);
-      free(io->buf);
+      if (io->len > new_size) io->len = new_size;
+      memcpy(p, io->buf, io->len);
+      mg_dealloc(mg_iobuf_block(io));
       io->buf = (unsigned char *) p;
       io->size = new_size;
+      io->off = 0;
     } else {
       ok = 0;
       LOG(LL_ERROR,
@@ -1297,20 +1866,52 @@ int mg_iobuf_init(struct mg_iobuf *io, size_t size) {
   return mg_iobuf_resize(io, size);
 }
 
+// Make space for len more bytes. The allocation grows by its current size,
+// but by no more than max_step bytes, unless more is needed
+int mg_iobuf_reserve(struct mg_iobuf *io, size_t len, size_t chunk_size,
+                     size_t max_step) {
+  size_t need = io->len + len, new_size = io->size + io->off;
+  if (need <= io->size) return 1;
+  new_size += new_size < max_step ? new_size : max_step;
+  if (new_size < need) new_size = need;
+  new_size = (new_size + chunk_size - 1) / chunk_size * chunk_size;
+  return mg_iobuf_resize(io, new_size);
+}
+
 size_t mg_iobuf_append(struct mg_iobuf *io, const void *buf, size_t len,
                        size_t chunk_size) {
-  size_t new_size = io->len + len + chunk_size;
-  new_size -= new_size % chunk_size;
-  if (new_size != io->size) mg_iobuf_resize(io, new_size);
-  if (new_size != io->size) len = 0;  // Realloc failure, append nothing
+  if (io->len + len > io->size && io->len + len <= io->size + io->off) {
+    mg_iobuf_compact(io);  // Fits into the existing block, no need to copy
+  } else if (io->len + len > io->size) {
+    size_t new_size = io->len + len + chunk_size;
+    mg_iobuf_resize(io, new_size - new_size % chunk_size);
+  }
+  if (io->len + len > io->size) len = 0;  // Realloc failure, append nothing
   if (buf != NULL) memmove(io->buf + io->len, buf, len);
   io->len += len;
   return len;
 }
 
+// Consume len bytes from the beginning. Data is not moved: buf advances, and
+// the consumed space is reclaimed later, when more space is needed
 size_t mg_iobuf_delete(struct mg_iobuf *io, size_t len) {
   if (len > io->len) len = 0;
-  memmove(io->buf, io->buf + len, io->len - len);
+  io->len -= len;
+  if (io->len == 0) {
+    mg_iobuf_compact(io);  // Nothing to move, rewind to the block start
+  } else {
+    io->buf += len;
+    io->size -= len;
+    io->off += len;
+  }
+  return len;
+}
+
+// Remove len bytes at offset ofs, moving the rest of the data down
+size_t mg_iobuf_cut(struct mg_iobuf *io, size_t ofs, size_t len) {
+  if (ofs > io->len || len > io->len - ofs) len = 0;
+  if (len == 0) return 0;
+  memmove(io->buf + ofs, io->buf + ofs + len, io->len - ofs - len);
   io->len -= len;
   return len;
 }
@@ -1519,10 +2120,13 @@ static struct mg_connection *mg_mkconn(const char *url) {
   return c;
 }
 
-struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
-                                 mg_event_handler_t fn, void *fn_data) {
+// Socket options are not supported by LWIP, opts is ignored
+struct mg_connection *mg_connect_opts(struct mg_mgr *mgr, const char *url,
+                                      const struct mg_sock_opts *opts,
+                                      mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = mg_mkconn(url);
   struct mg_str host = mg_url_host(url);
+  (void) opts;
   if (c == NULL) return c;
   c->next = mgr->conns;
   mgr->conns = c;
@@ -1567,13 +2171,15 @@ static err_t accept_cb(void *arg, struct tcp_pcb *pcb, err_t e) {
   return ERR_OK;
 }
 
-struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
-                                mg_event_handler_t fn, void *fn_data) {
+struct mg_connection *mg_listen_opts(struct mg_mgr *mgr, const char *url,
+                                     const struct mg_sock_opts *opts,
+                                     mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = mg_mkconn(url);
   struct mg_str host = mg_url_host(url);
   uint16_t port = mg_url_port(url);
   uint32_t ipaddr;
   err_t err;
+  (void) opts;
   if (c == NULL) return c;
   mg_aton(host.ptr, &ipaddr);
   if (!mg_vcasecmp(&host, "localhost")) ipaddr = mg_htonl(0x7f000001);
@@ -1589,7 +2195,7 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   LOG(LL_DEBUG, ("%p %d", mgr, ms));
   mg_usleep(200 * 1000);
-  mg_timer_poll(mg_millis());
+  mg_timer_poll(&mgr->timers, mg_millis());
 }
 #endif
 
@@ -2059,6 +2665,7 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
 
 
 
+
 int mg_vprintf(struct mg_connection *c, const char *fmt, va_list ap) {
   char mem[256], *buf = mem;
   int len = mg_vasprintf(&buf, sizeof(mem), fmt, ap);
@@ -2168,13 +2775,202 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr) {
   return mg_atonl(str, addr) || mg_aton4(str, addr) || mg_aton6(str, addr);
 }
 
+struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
+                                mg_event_handler_t fn, void *fn_data) {
+  return mg_listen_opts(mgr, url, NULL, fn, fn_data);
+}
+
+struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
+                                 mg_event_handler_t fn, void *fn_data) {
+  return mg_connect_opts(mgr, url, NULL, fn, fn_data);
+}
+
+// Queue connection for processing by the next mg_mgr_poll() iteration
+void mg_ready(struct mg_connection *c) {
+  if (c->is_ready || c->mgr == NULL) return;
+  c->is_ready = 1;
+  c->rnext = c->mgr->ready;
+  c->rprev = &c->mgr->ready;
+  if (c->rnext != NULL) c->rnext->rprev = &c->rnext;
+  c->mgr->ready = c;
+}
+
+// Remove connection from the ready queue in O(1), wherever the queue head is
+void mg_unready(struct mg_connection *c) {
+  if (!c->is_ready) return;
+  *c->rprev = c->rnext;
+  if (c->rnext != NULL) c->rnext->rprev = c->rprev;
+  c->is_ready = 0;
+}
+
+// Preallocate n connection objects in one block. Closed connections that
+// come from the block are put back on the spare list instead of being freed
+bool mg_mgr_prealloc(struct mg_mgr *mgr, size_t n) {
+  struct mg_connection *slab;
+  size_t i;
+  if (mgr->slab != NULL || n == 0) return false;
+  if ((slab = (struct mg_connection *) mg_alloc(n * sizeof(*slab))) == NULL) {
+    return false;
+  }
+  for (i = n; i > 0; i--) {
+    slab[i - 1].next = mgr->spare;
+    mgr->spare = &slab[i - 1];
+  }
+  mgr->slab = slab;
+  mgr->slabsize = n;
+  return true;
+}
+
+// Return zeroed connection object: from the spare list, or from the heap
+struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
+  struct mg_connection *c = mgr->spare;
+  if (c != NULL) {
+    mgr->spare = c->next;
+  } else {
+    c = (struct mg_connection *) mg_alloc(sizeof(*c));
+  }
+  if (c != NULL) memset(c, 0, sizeof(*c));
+  return c;
+}
+
+void mg_free_conn(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  struct mg_connection *slab = (struct mg_connection *) mgr->slab;
+  memset(c, 0, sizeof(*c));
+  if (slab != NULL && c >= slab && c < slab + mgr->slabsize) {
+    c->next = mgr->spare;
+    mgr->spare = c;
+  } else {
+    mg_dealloc(c);
+  }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MG_ATOMIC_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_ACQ_REL)
+#else
+#define MG_ATOMIC_ADD(p, n) (*(p) += (n))
+#endif
+
+// Allocate shared buffer with reference count 1. If buf is NULL, the data
+// is left for the caller to fill in
+struct mg_shared *mg_shared_new(const void *buf, size_t len) {
+  struct mg_shared *s = (struct mg_shared *) mg_alloc(sizeof(*s) + len);
+  if (s != NULL) {
+    s->refcnt = 1;
+    s->len = len;
+    s->buf = (char *) (s + 1);
+    if (buf != NULL) memcpy(s->buf, buf, len);
+  }
+  return s;
+}
+
+void mg_shared_ref(struct mg_shared *s) {
+  MG_ATOMIC_ADD(&s->refcnt, 1);
+}
+
+void mg_shared_release(struct mg_shared *s) {
+  if (s != NULL && MG_ATOMIC_ADD(&s->refcnt, -1) == 0) mg_dealloc(s);
+}
+
+// Free an empty IO buffer, unless it is small enough to be reused. Buffers
+// grown by a burst are released, small ones are not reallocated all the time
+void mg_io_drained(struct mg_mgr *mgr, struct mg_iobuf *io) {
+  if (io->len == 0 && io->size > mgr->iokeep) mg_iobuf_free(io);
+}
+
+// Rebuild the ID hash table with nbuckets buckets, a power of two
+static void mg_ids_resize(struct mg_mgr *mgr, size_t nbuckets) {
+  size_t size = nbuckets * sizeof(*mgr->ids);
+  struct mg_connection **ids = (struct mg_connection **) mg_alloc(size), *c;
+  if (ids == NULL) return;  // Keep the old table, chains just get longer
+  memset(ids, 0, size);
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    struct mg_connection **b = &ids[c->id & (nbuckets - 1)];
+    c->hnext = *b;
+    *b = c;
+  }
+  mg_dealloc(mgr->ids);
+  mgr->ids = ids;
+  mgr->idsize = nbuckets;
+}
+
+// Link new connection into the connection list and the ID hash table
+void mg_add_conn(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  if (mgr->nconns >= mgr->idsize) {
+    mg_ids_resize(mgr, mgr->idsize == 0 ? 16 : mgr->idsize * 2);
+  }
+  c->prev = NULL;
+  c->next = mgr->conns;
+  if (c->next != NULL) c->next->prev = c;
+  mgr->conns = c;
+  mgr->nconns++;
+  if (mgr->ids != NULL) {
+    struct mg_connection **b = &mgr->ids[c->id & (mgr->idsize - 1)];
+    c->hnext = *b;
+    *b = c;
+  }
+}
+
+void mg_del_conn(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+  } else {
+    mgr->conns = c->next;
+  }
+  if (c->next != NULL) c->next->prev = c->prev;
+  mgr->nconns--;
+  if (mgr->ids != NULL) {
+    struct mg_connection **p = &mgr->ids[c->id & (mgr->idsize - 1)];
+    while (*p != NULL && *p != c) p = &(*p)->hnext;
+    if (*p != NULL) *p = c->hnext;
+  }
+  c->next = c->prev = c->hnext = NULL;
+}
+
+struct mg_connection *mg_conn_by_id(struct mg_mgr *mgr, unsigned long id) {
+  struct mg_connection *c;
+  if (mgr->ids == NULL) {
+    for (c = mgr->conns; c != NULL && c->id != id; c = c->next) (void) 0;
+  } else {
+    c = mgr->ids[id & (mgr->idsize - 1)];
+    while (c != NULL && c->id != id) c = c->hnext;
+  }
+  return c;
+}
+
 void mg_mgr_free(struct mg_mgr *mgr) {
   struct mg_connection *c;
+#if MG_ENABLE_SOCKET && MG_ENABLE_WORKERS
+  mg_workers_free(mgr);  // Workers post to the wakeup channel, stop them first
+#endif
   for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
+  mgr->pollinterval = 0;  // Make sure every connection is visited
   mg_mgr_poll(mgr, 0);
 #if MG_ARCH == MG_ARCH_FREERTOS
   FreeRTOS_DeleteSocketSet(mgr->ss);
 #endif
+#if MG_ENABLE_EPOLL
+  if (mgr->epoll_fd >= 0) close(mgr->epoll_fd);
+  mgr->epoll_fd = -1;
+#endif
+#if MG_ENABLE_SOCKET && MG_ENABLE_IO_URING
+  mg_uring_close(mgr);
+#endif
+#if MG_ENABLE_SOCKET && MG_ENABLE_WAKEUP
+  mg_wakeup_free(mgr);
+#endif
+#if MG_ENABLE_MMSG
+  mg_dealloc(mgr->udpbuf);
+  mgr->udpbuf = NULL;
+#endif
+  mg_dealloc(mgr->ids);
+  mgr->ids = NULL;
+  mgr->idsize = 0;
+  mg_dealloc(mgr->slab);
+  mgr->slab = mgr->spare = NULL;
+  mgr->slabsize = 0;
   LOG(LL_INFO, ("All connections closed"));
 }
 
@@ -2191,27 +2987,155 @@ void mg_mgr_init(struct mg_mgr *mgr) {
 #endif
   memset(mgr, 0, sizeof(*mgr));
   mgr->dnstimeout = 3000;
+  mgr->timers.now = mg_millis();
+  mgr->iogrow = MG_IO_GROW;
+  mgr->iokeep = MG_IO_KEEP;
   mgr->dns4.url = "udp://8.8.8.8:53";
   mgr->dns6.url = "udp://[2001:4860:4860::8888]:53";
+#if MG_ENABLE_WAKEUP
+  mgr->wakeup_fd = -1;
+#endif
+#if MG_ENABLE_EPOLL
+  if ((mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    LOG(LL_ERROR, ("epoll_create1: %d", errno));
+  }
+#endif
+#if MG_ENABLE_SOCKET && MG_ENABLE_IO_URING
+  mgr->uring = mg_uring_new(MG_IO_URING_ENTRIES, MG_IO_URING_BUFS,
+                            MG_IO_URING_BUF_SIZE);
+#endif
 }
 
 #ifdef MG_ENABLE_LINES
-#line 1 "src/sha1.c"
+#line 1 "src/reactor.c"
 #endif
-/* Copyright(c) By Steve Reid <steve@edmweb.com> */
-/* 100% Public Domain */
 
-#include <string.h>
 
-/*
- * clang with std=-c99 uses __LITTLE_ENDIAN, by default
- * while for ex, RTOS gcc - LITTLE_ENDIAN, by default
- * it depends on __USE_BSD, but let's have everything
- */
-#if !defined(BYTE_ORDER) && defined(__BYTE_ORDER)
-#define BYTE_ORDER __BYTE_ORDER
-#ifndef LITTLE_ENDIAN
-#define LITTLE_ENDIAN __LITTLE_ENDIAN
+
+
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_REACTORS
+#if defined(__linux__)
+#include <sys/syscall.h>
+
+static void mg_pin_thread(int cpu) {
+  unsigned long mask[16];
+  size_t bits = sizeof(mask[0]) * 8;
+  memset(mask, 0, sizeof(mask));
+  mask[((size_t) cpu / bits) % 16] |= 1UL << ((size_t) cpu % bits);
+  if (syscall(__NR_sched_setaffinity, 0, sizeof(mask), mask) != 0) {
+    LOG(LL_ERROR, ("sched_setaffinity(%d): %d", cpu, errno));
+  }
+}
+#else
+#define mg_pin_thread(cpu)
+#endif
+
+static void *mg_reactor_thread(void *param) {
+  struct mg_reactors *r = (struct mg_reactors *) param;
+  struct mg_mgr mgr;
+  mg_mgr_init(&mgr);
+  mgr.reactors = r;
+  mgr.reactor_id = r->started;  // Reactors are set up one by one
+  if (r->flags & MG_REACTORS_PIN) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    mg_pin_thread((int) (mgr.reactor_id % (ncpus > 0 ? ncpus : 1)));
+  }
+  mg_mgr_wakeup_init(&mgr);  // Lets mg_reactors_stop() interrupt the poll
+  r->fn(&mgr, r->fn_data);
+  LOG(LL_DEBUG, ("reactor %d started", mgr.reactor_id));
+  pthread_mutex_lock(&r->lock);
+  r->mgrs[mgr.reactor_id] = &mgr;
+  r->started++;
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) mg_mgr_poll(&mgr, 50);
+  // Leave the group before mgr goes away, so that nobody wakes it up after
+  pthread_mutex_lock(&r->lock);
+  r->mgrs[mgr.reactor_id] = NULL;
+  pthread_mutex_unlock(&r->lock);
+  mg_mgr_free(&mgr);
+  return NULL;
+}
+
+// Start n event loops, each on its own thread with its own manager. fn is
+// called in the reactor thread to create listeners, before the event loop
+// starts. Listeners on the same URL share the port via SO_REUSEPORT.
+// Reactors are set up one at a time, so listeners join SO_REUSEPORT groups
+// in reactor order
+struct mg_reactors *mg_reactors_start(int n, int flags,
+                                      void (*fn)(struct mg_mgr *, void *),
+                                      void *fn_data) {
+  struct mg_reactors *r = (struct mg_reactors *) calloc(1, sizeof(*r));
+  if (r == NULL || n <= 0 ||
+      (r->threads = (pthread_t *) calloc((size_t) n, sizeof(pthread_t))) ==
+          NULL ||
+      (r->mgrs = (struct mg_mgr **) calloc((size_t) n, sizeof(*r->mgrs))) ==
+          NULL) {
+    if (r != NULL) free(r->threads);
+    free(r);
+    return NULL;
+  }
+  r->n = n;
+  r->flags = flags;
+  r->fn = fn;
+  r->fn_data = fn_data;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  for (r->nthreads = 0; r->nthreads < n; r->nthreads++) {
+    pthread_t *t = &r->threads[r->nthreads];
+    if (pthread_create(t, NULL, mg_reactor_thread, r) != 0) {
+      LOG(LL_ERROR, ("pthread_create: %d", errno));
+      break;
+    }
+    pthread_mutex_lock(&r->lock);
+    while (r->started <= r->nthreads) pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+  }
+  if (r->nthreads < n) {
+    mg_reactors_stop(r);
+    r = NULL;
+  }
+  return r;
+}
+
+// Stop all reactors, close their connections and wait for their threads
+void mg_reactors_stop(struct mg_reactors *r) {
+  int i;
+  if (r == NULL) return;
+  __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+  // Wake reactors up, so they see stop now rather than after a poll timeout
+  pthread_mutex_lock(&r->lock);
+  for (i = 0; i < r->n; i++) {
+    if (r->mgrs[i] != NULL) mg_mgr_wakeup(r->mgrs[i], 0, NULL, 0);
+  }
+  pthread_mutex_unlock(&r->lock);
+  for (i = 0; i < r->nthreads; i++) pthread_join(r->threads[i], NULL);
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+  free(r->mgrs);
+  free(r->threads);
+  free(r);
+}
+#endif
+
+#ifdef MG_ENABLE_LINES
+#line 1 "src/sha1.c"
+#endif
+/* Copyright(c) By Steve Reid <steve@edmweb.com> */
+/* 100% Public Domain */
+
+#include <string.h>
+
+/*
+ * clang with std=-c99 uses __LITTLE_ENDIAN, by default
+ * while for ex, RTOS gcc - LITTLE_ENDIAN, by default
+ * it depends on __USE_BSD, but let's have everything
+ */
+#if !defined(BYTE_ORDER) && defined(__BYTE_ORDER)
+#define BYTE_ORDER __BYTE_ORDER
+#ifndef LITTLE_ENDIAN
+#define LITTLE_ENDIAN __LITTLE_ENDIAN
 #endif /* LITTLE_ENDIAN */
 #ifndef BIG_ENDIAN
 #define BIG_ENDIAN __LITTLE_ENDIAN
@@ -2603,21 +3527,594 @@ static int mg_sock_failed(void) {
       ;
 }
 
+// Maximum number of send queue chunks written by a single syscall
+#define MG_SEND_IOV 16
+
+// Send queue segment, see mg_send_ref() and mg_send_file(). Goes out after
+// the first `at` bytes of c->send, so that it keeps its place among data
+// copied by mg_send()
+struct mg_seg {
+  struct mg_seg *next;      // Next segment
+  const char *buf;          // Data not sent yet, NULL for a file segment
+  size_t len;               // Length of data not sent yet
+  size_t at;                // Bytes of c->send that go before this segment
+  int fd;                   // File descriptor of a file segment
+  int64_t off;              // File offset of data not sent yet
+  void (*release)(void *);  // Called when sent or when connection closes
+  void *arg;                // Argument for release()
+};
+
+// Two connections bound by mg_relay(). Data from c[i] goes to c[1 - i],
+// either through IO buffers, or through a kernel pipe with splice()
+struct mg_relay {
+  struct mg_connection *c[2];  // Relayed connections
+  int pipe[2][2];              // Pipe for data from c[i], or -1
+  size_t inpipe[2];            // Bytes in pipe[i]
+  bool eof[2];                 // c[i] has no more data to send
+  bool shut[2];                // Write side of c[1 - i] is shut down
+  bool splice;                 // Relay with splice()
+};
+
+// Bytes spliced from the relay peer that wait for the socket to be writable
+static size_t mg_relay_pending(struct mg_connection *c) {
+  struct mg_relay *r = (struct mg_relay *) c->relay;
+  return r == NULL ? 0 : r->inpipe[r->c[0] == c ? 1 : 0];
+}
+
+// True if connection reads from the socket: not paused by the application
+// or by mg_relay(), and the recv buffer is below the high watermark
+static bool mg_want_read(struct mg_connection *c) {
+  return !c->is_paused && !c->is_recv_full;
+}
+
+// True if connection waits for the socket to become writable
+static bool mg_want_write(struct mg_connection *c) {
+  return c->is_connecting ||
+         ((c->send.len > 0 || c->segs != NULL || mg_relay_pending(c) > 0) &&
+          c->is_tls_hs == 0);
+}
+
+// Append segment to the send queue. Segments leave from the head only, so
+// the tail link stays valid for as long as the queue is not empty
+static void mg_segs_add(struct mg_connection *c, struct mg_seg *s) {
+  if (c->segs == NULL) c->segs_tail = &c->segs;
+  *c->segs_tail = s;
+  c->segs_tail = &s->next;
+}
+
+static void mg_segs_free(struct mg_connection *c) {
+  struct mg_seg *s;
+  while ((s = c->segs) != NULL) {
+    c->segs = s->next;
+    if (s->release != NULL) s->release(s->arg);
+    mg_dealloc(s);
+  }
+}
+
+// Split outstanding data into at most max chunks, in sending order. Stop at
+// a file segment, it is sent separately
+static int mg_send_chunks(struct mg_connection *c, struct mg_str *v, int max) {
+  struct mg_seg *s;
+  size_t pos = 0;
+  int n = 0;
+  for (s = c->segs; s != NULL && n < max; s = s->next) {
+    if (s->at > pos) v[n++] = mg_str_n((char *) c->send.buf + pos, s->at - pos);
+    pos = s->at;
+    if (s->buf == NULL) return n;
+    if (n < max) v[n++] = mg_str_n(s->buf, s->len);
+  }
+  if (n < max && c->send.len > pos) {
+    v[n++] = mg_str_n((char *) c->send.buf + pos, c->send.len - pos);
+  }
+  return n;
+}
+
+// Discard n sent bytes, releasing fully sent segments
+static void mg_send_consume(struct mg_connection *c, size_t n) {
+  struct mg_seg *s;
+  while (n > 0 && (s = c->segs) != NULL) {
+    if (s->at > 0) {
+      size_t k = n < s->at ? n : s->at;
+      mg_iobuf_delete(&c->send, k);
+      for (; s != NULL; s = s->next) s->at -= k;
+      n -= k;
+    } else {
+      size_t k = n < s->len ? n : s->len;
+      if (s->buf == NULL) {
+        s->off += (int64_t) k;
+      } else {
+        s->buf += k;
+      }
+      s->len -= k, n -= k;
+      if (s->len == 0) {
+        c->segs = s->next;
+        if (s->release != NULL) s->release(s->arg);
+        mg_dealloc(s);
+      }
+    }
+  }
+  if (n > 0) mg_iobuf_delete(&c->send, n);
+}
+
+#if MG_ENABLE_IO_URING
+// Copy all segments into the send buffer, for IO paths that need the data
+// in one piece
+static void mg_segs_flatten(struct mg_connection *c) {
+  struct mg_iobuf io = {NULL, 0, 0, 0};
+  struct mg_str v[MG_SEND_IOV];
+  while (c->segs != NULL) {
+    int i, n = mg_send_chunks(c, v, MG_SEND_IOV);
+    size_t len = 0;
+    for (i = 0; i < n; i++) {
+      mg_iobuf_reserve(&io, v[i].len, MG_IO_SIZE, c->mgr->iogrow);
+      len += mg_iobuf_append(&io, v[i].ptr, v[i].len, MG_IO_SIZE);
+    }
+    mg_send_consume(c, len);
+    if (len == 0) break;  // Out of memory, keep the rest queued
+  }
+  if (c->segs != NULL) {
+    mg_iobuf_free(&io);
+  } else {
+    mg_iobuf_append(&io, c->send.buf, c->send.len, MG_IO_SIZE);
+    mg_iobuf_free(&c->send);
+    c->send = io;
+  }
+}
+#endif
+
+#if MG_ENABLE_IO_URING
+// In-flight io_uring operations. Operation type is stored in the low bits of
+// the SQE user_data, the rest is a pointer to struct mg_uring_conn
+enum { URING_RECV, URING_SEND, URING_ACCEPT, URING_POLLIN, URING_POLLOUT };
+#define URING_OP_MASK 7UL
+
+struct mg_uring_conn {
+  struct mg_uring_conn *next;  // Linkage in struct mg_uring :: zombies
+  struct mg_connection *c;     // Our connection, NULL when closed
+  struct mg_iobuf tx;          // Data handed to the kernel for sending
+  size_t sent;                 // Sent bytes, not yet reported by MG_EV_WRITE
+  int rx_bid;                  // Received buffer ID, or -1 if none
+  int rx_len, rx_ofs;          // Received buffer length and read offset
+  int err;                     // Sticky socket error, -1 on EOF
+  SOCKET afd;                  // Accepted socket
+  union usa addr;              // Accepted peer address
+  socklen_t alen;              // Accepted peer address length
+  unsigned pending;            // Bitmask of in-flight operations
+};
+
+// Plain TCP data connections do IO through io_uring. Other connections, like
+// TLS or UDP, use io_uring only to wait for readiness and do IO as usual
+static bool mg_uring_io(struct mg_connection *c) {
+#if MG_ENABLE_WAKEUP
+  if (c == c->mgr->wakeup) return false;
+#endif
+  return c->uring != NULL && !c->is_tls && !c->is_udp && !c->is_listening &&
+         !c->is_connecting;
+}
+
+static struct io_uring_sqe *mg_uring_prep(struct mg_connection *c, int op,
+                                          int opcode) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  struct io_uring_sqe *sqe = mg_uring_sqe(c->mgr->uring);
+  if (sqe != NULL) {
+    sqe->opcode = (uint8_t) opcode;
+    sqe->fd = FD(c);
+    sqe->user_data = (uint64_t) (uintptr_t) u | (uint64_t) op;
+    u->pending |= 1U << op;
+  }
+  return sqe;
+}
+
+static void mg_uring_free_conn(struct mg_uring_conn *u) {
+  mg_iobuf_free(&u->tx);
+  free(u);
+}
+
+static void mg_uring_arm(struct mg_connection *c) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  struct io_uring_sqe *sqe;
+  if (u == NULL) {
+    if ((u = (struct mg_uring_conn *) calloc(1, sizeof(*u))) == NULL) return;
+    u->c = c;
+    u->rx_bid = -1;
+    u->afd = INVALID_SOCKET;
+    c->uring = u;
+  }
+  if (c->is_listening && !c->is_udp) {
+    if (!(u->pending & (1U << URING_ACCEPT)) && u->afd == INVALID_SOCKET &&
+        (sqe = mg_uring_prep(c, URING_ACCEPT, IORING_OP_ACCEPT)) != NULL) {
+      u->alen = sizeof(u->addr);
+      sqe->addr = (uint64_t) (uintptr_t) &u->addr;
+      sqe->addr2 = (uint64_t) (uintptr_t) &u->alen;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+  } else if (mg_uring_io(c)) {
+    if (!(u->pending & (1U << URING_RECV)) && u->rx_bid < 0 && u->err == 0 &&
+        mg_want_read(c) &&
+        (sqe = mg_uring_prep(c, URING_RECV, IORING_OP_RECV)) != NULL) {
+      sqe->len = c->mgr->uring->bufsize;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = 0;
+    }
+    if (!(u->pending & (1U << URING_SEND)) && u->err == 0) {
+      // Take over the send buffer, so that mg_send() can safely grow a new
+      // one while the kernel reads from this one
+      if (u->tx.len == 0 && c->segs != NULL) mg_segs_flatten(c);
+      if (u->tx.len == 0 && c->send.len > 0) {
+        struct mg_iobuf tmp = u->tx;
+        u->tx = c->send;
+        c->send = tmp;
+      }
+      if (u->tx.len > 0 &&
+          (sqe = mg_uring_prep(c, URING_SEND, IORING_OP_SEND)) != NULL) {
+        sqe->addr = (uint64_t) (uintptr_t) u->tx.buf;
+        sqe->len = (uint32_t) u->tx.len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+      }
+    }
+  } else {
+    if (!(u->pending & (1U << URING_POLLIN)) && mg_want_read(c) &&
+        (sqe = mg_uring_prep(c, URING_POLLIN, IORING_OP_POLL_ADD)) != NULL) {
+      sqe->poll32_events = POLLIN;
+    }
+    if (!(u->pending & (1U << URING_POLLOUT)) && mg_want_write(c) &&
+        (sqe = mg_uring_prep(c, URING_POLLOUT, IORING_OP_POLL_ADD)) != NULL) {
+      sqe->poll32_events = POLLOUT;
+    }
+  }
+}
+
+// Turn results of completed, but not yet consumed operations into readiness
+// flags. Return true if there are any
+static bool mg_uring_results(struct mg_connection *c) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  bool rd, wr;
+  if (u == NULL) return false;
+  rd = ((u->rx_bid >= 0 || u->err != 0) && mg_want_read(c)) ||
+       u->afd != INVALID_SOCKET;
+  wr = u->sent > 0 || u->err > 0;
+  if (rd) c->is_readable = 1;
+  if (wr) c->is_writable = 1;
+  return rd || wr;
+}
+
+static bool mg_uring_failed(int res) {
+  return res != -EAGAIN && res != -EINTR && res != -ENOBUFS &&
+         res != -ECANCELED;
+}
+
+static void mg_uring_complete(struct mg_uring *r, struct io_uring_cqe *cqe) {
+  struct mg_uring_conn *u =
+      (struct mg_uring_conn *) (uintptr_t) (cqe->user_data & ~URING_OP_MASK);
+  struct mg_connection *c;
+  int op = (int) (cqe->user_data & URING_OP_MASK), res = cqe->res;
+  if (u == NULL) return;  // Buffer or cancel request, ignore
+  u->pending &= ~(1U << op);
+  c = u->c;
+  if (op == URING_RECV && res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    u->rx_bid = (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    u->rx_len = res;
+    u->rx_ofs = 0;
+    if (c == NULL) mg_uring_provide(r, (unsigned) u->rx_bid), u->rx_bid = -1;
+  } else if (op == URING_RECV) {
+    if (res == 0) u->err = -1;
+    if (res < 0 && mg_uring_failed(res)) u->err = -res;
+  } else if (op == URING_SEND) {
+    if (res > 0) {
+      mg_iobuf_delete(&u->tx, (size_t) res);
+      if (c != NULL) mg_io_drained(c->mgr, &u->tx);
+      u->sent += (size_t) res;
+    } else if (mg_uring_failed(res)) {
+      u->err = res == 0 ? -1 : -res;
+    }
+  } else if (op == URING_ACCEPT) {
+    if (res >= 0 && c == NULL) closesocket(res);
+    if (res >= 0 && c != NULL) u->afd = (SOCKET) res;
+    if (res < 0 && mg_uring_failed(res)) {
+      LOG(LL_ERROR, ("%lu accept failed, errno %d", c ? c->id : 0, -res));
+    }
+  } else if (c != NULL && op == URING_POLLIN) {
+    c->is_readable = 1;
+  } else if (c != NULL && op == URING_POLLOUT) {
+    if (mg_want_write(c)) c->is_writable = 1;
+  }
+  if (c != NULL) {
+    mg_uring_results(c);
+    mg_ready(c);
+  } else if (u->pending == 0) {
+    LIST_DELETE(struct mg_uring_conn, &r->zombies, u);
+    mg_uring_free_conn(u);
+  }
+}
+
+static void mg_uring_iotest(struct mg_mgr *mgr, int ms) {
+  struct io_uring_cqe *cqe;
+  struct mg_connection *c;
+
+  // Only queued connections may need new operations, or have unconsumed
+  // results. Completions queue their connections by themselves
+  for (c = mgr->ready; c != NULL; c = c->rnext) {
+    if (c->is_closing) ms = 0;
+    if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
+    mg_uring_arm(c);
+    if (mg_uring_results(c)) ms = 0;
+  }
+
+  // Submit everything and wait for completions with a single syscall
+  mg_uring_enter(mgr->uring, ms);
+  while ((cqe = mg_uring_cqe(mgr->uring)) != NULL) {
+    mg_uring_complete(mgr->uring, cqe);
+    mg_uring_cqe_done(mgr->uring);
+  }
+}
+
+static int mg_uring_recv(struct mg_connection *c, void *buf, int len,
+                         int *fail) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  int n = 0;
+  if (u->rx_bid >= 0) {
+    n = u->rx_len - u->rx_ofs;
+    if (n > len) n = len;
+    memcpy(buf, mg_uring_buf(c->mgr->uring, (unsigned) u->rx_bid) + u->rx_ofs,
+           (size_t) n);
+    u->rx_ofs += n;
+    if (u->rx_ofs >= u->rx_len) {
+      mg_uring_provide(c->mgr->uring, (unsigned) u->rx_bid);
+      u->rx_bid = -1;
+    }
+  }
+  *fail = n == 0 && u->err != 0;
+  return n;
+}
+
+// Data is already sent by the kernel, report it to the application
+static int mg_uring_write_conn(struct mg_connection *c) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  int rc = (int) u->sent;
+  u->sent = 0;
+  if (rc > 0) mg_call(c, MG_EV_WRITE, &rc);
+  if (u->err > 0) c->is_closing = 1;
+  return rc;
+}
+
+// Cancel in-flight operations of a closing connection. The state is kept
+// until all of them complete, because the kernel may still use it
+static void mg_uring_detach(struct mg_connection *c) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  struct mg_uring *r = c->mgr->uring;
+  int op;
+  if (u == NULL) return;
+  c->uring = NULL;
+  u->c = NULL;
+  if (u->rx_bid >= 0) mg_uring_provide(r, (unsigned) u->rx_bid);
+  if (u->afd != INVALID_SOCKET) closesocket(u->afd);
+  if (u->pending == 0) {
+    mg_uring_free_conn(u);
+    return;
+  }
+  for (op = URING_RECV; op <= URING_POLLOUT; op++) {
+    struct io_uring_sqe *sqe;
+    if (!(u->pending & (1U << op)) || (sqe = mg_uring_sqe(r)) == NULL) continue;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) (uintptr_t) u | (uint64_t) op;
+  }
+  LIST_ADD_HEAD(struct mg_uring_conn, &r->zombies, u);
+}
+
+void mg_uring_close(struct mg_mgr *mgr) {
+  struct mg_uring *r = mgr->uring;
+  struct io_uring_cqe *cqe;
+  int i;
+  if (r == NULL) return;
+  // Let cancellations complete, but do not wait forever
+  for (i = 0; i < 100 && r->zombies != NULL; i++) {
+    mg_uring_enter(r, 1);
+    while ((cqe = mg_uring_cqe(r)) != NULL) {
+      mg_uring_complete(r, cqe);
+      mg_uring_cqe_done(r);
+    }
+  }
+  while (r->zombies != NULL) {
+    struct mg_uring_conn *u = r->zombies;
+    r->zombies = u->next;
+    mg_uring_free_conn(u);
+  }
+  mg_uring_free(r);
+  mgr->uring = NULL;
+}
+#endif
+
 static struct mg_connection *alloc_conn(struct mg_mgr *mgr, int is_client,
                                         SOCKET fd) {
-  struct mg_connection *c = (struct mg_connection *) calloc(1, sizeof(*c));
+  struct mg_connection *c = mg_alloc_conn(mgr);
   if (c != NULL) {
     c->is_client = is_client;
     c->fd = (void *) (long) fd;
     c->mgr = mgr;
     c->id = ++mgr->nextid;
+    c->lastio = c->since = mgr->timers.now;
   }
   return c;
 }
 
+// Virtual connections of a demultiplexing UDP listener, see mg_udp_demux()
+struct mg_udp_peer {
+  struct mg_udp_peer *next;   // Hash chain
+  struct mg_connection *c;    // Virtual connection of this peer
+  struct mg_connection *lsn;  // Listener, NULL when closed
+  unsigned long last;         // Last datagram to or from the peer, in ms
+};
+
+struct mg_udp_table {
+  struct mg_udp_peer **buckets;  // Peers by address
+  size_t size;                   // Number of buckets, a power of two
+  size_t count;                  // Number of peers
+  unsigned long idle_ms;         // Close idle peers, 0: never
+};
+
+static size_t mg_addr_hash(const struct mg_addr *a) {
+  uint32_t h = 2166136261U ^ a->port;
+  size_t i;
+  if (a->is_ip6) {
+    for (i = 0; i < sizeof(a->ip6); i++) h = (h ^ a->ip6[i]) * 16777619U;
+  } else {
+    h = (h ^ a->ip) * 16777619U;
+  }
+  return (size_t) (h ^ (h >> 16));
+}
+
+static bool mg_addr_eq(const struct mg_addr *a, const struct mg_addr *b) {
+  if (a->port != b->port || a->is_ip6 != b->is_ip6) return false;
+  return a->is_ip6 ? memcmp(a->ip6, b->ip6, sizeof(a->ip6)) == 0
+                   : a->ip == b->ip;
+}
+
+static bool mg_udp_virtual(struct mg_connection *c) {
+  return c->udp != NULL && !c->is_listening;
+}
+
+// Socket that carries datagrams of a UDP connection: its own, or that of the
+// listener for a virtual one. NULL if the listener is gone
+static struct mg_connection *mg_udp_sock(struct mg_connection *c) {
+  return mg_udp_virtual(c) ? ((struct mg_udp_peer *) c->udp)->lsn : c;
+}
+
+static void mg_udp_resize(struct mg_udp_table *t, size_t nbuckets) {
+  size_t i, size = nbuckets * sizeof(*t->buckets);
+  struct mg_udp_peer **b = (struct mg_udp_peer **) mg_alloc(size), *p;
+  if (b == NULL) return;  // Keep the old table, chains just get longer
+  memset(b, 0, size);
+  for (i = 0; i < t->size; i++) {
+    while ((p = t->buckets[i]) != NULL) {
+      t->buckets[i] = p->next;
+      p->next = b[mg_addr_hash(&p->c->peer) & (nbuckets - 1)];
+      b[mg_addr_hash(&p->c->peer) & (nbuckets - 1)] = p;
+    }
+  }
+  mg_dealloc(t->buckets);
+  t->buckets = b;
+  t->size = nbuckets;
+}
+
+bool mg_udp_demux(struct mg_connection *c, unsigned long idle_ms) {
+  struct mg_udp_table *t;
+  if (!c->is_listening || !c->is_udp || c->udp != NULL) return false;
+  if ((t = (struct mg_udp_table *) mg_alloc(sizeof(*t))) == NULL) return false;
+  memset(t, 0, sizeof(*t));
+  t->idle_ms = idle_ms;
+  mg_udp_resize(t, 16);
+  if (t->buckets == NULL) {
+    mg_dealloc(t);
+    return false;
+  }
+  c->udp = t;
+  return true;
+}
+
+// Virtual connection for the sender of the last datagram, in lsn->peer.
+// A new peer gets a new connection, announced by MG_EV_ACCEPT
+static struct mg_connection *mg_udp_peer(struct mg_connection *lsn) {
+  struct mg_udp_table *t = (struct mg_udp_table *) lsn->udp;
+  struct mg_udp_peer *p, **b;
+  struct mg_connection *c;
+  b = &t->buckets[mg_addr_hash(&lsn->peer) & (t->size - 1)];
+  for (p = *b; p != NULL; p = p->next) {
+    if (mg_addr_eq(&p->c->peer, &lsn->peer)) break;
+  }
+  if (p != NULL) {
+    p->last = lsn->mgr->timers.now;
+    return p->c;
+  }
+  p = (struct mg_udp_peer *) mg_alloc(sizeof(*p));
+  c = p == NULL ? NULL : alloc_conn(lsn->mgr, 0, INVALID_SOCKET);
+  if (c == NULL) {
+    LOG(LL_ERROR, ("%lu OOM", lsn->id));
+    mg_dealloc(p);
+    return NULL;
+  }
+  if (t->count >= t->size) {
+    mg_udp_resize(t, t->size * 2);
+    b = &t->buckets[mg_addr_hash(&lsn->peer) & (t->size - 1)];
+  }
+  p->c = c;
+  p->lsn = lsn;
+  p->last = lsn->mgr->timers.now;
+  p->next = *b;
+  *b = p;
+  t->count++;
+  c->peer = lsn->peer;
+  c->udp = p;
+  c->is_udp = 1;
+  c->is_accepted = 1;
+  c->is_hexdumping = lsn->is_hexdumping;
+  c->recv_high = lsn->recv_high, c->recv_low = lsn->recv_low;
+  c->pfn = lsn->pfn;
+  c->pfn_data = lsn->pfn_data;
+  c->fn = lsn->fn;
+  c->fn_data = lsn->fn_data;
+  mg_add_conn(c);
+  mg_call(c, MG_EV_ACCEPT, NULL);
+  return c;
+}
+
+// Pass a datagram from lsn->peer to its virtual connection, or to the
+// listener itself if it does not demultiplex. Datagrams for a peer that
+// does not read are dropped
+static void mg_udp_deliver(struct mg_connection *lsn, const void *buf,
+                           size_t len) {
+  struct mg_connection *c = lsn->udp == NULL ? lsn : mg_udp_peer(lsn);
+  struct mg_str evd;
+  if (c == NULL || c->is_closing || (c != lsn && !mg_want_read(c))) return;
+  if (!mg_iobuf_reserve(&c->recv, len, MG_IO_SIZE, c->mgr->iogrow)) {
+    c->is_closing = 1;
+    return;
+  }
+  evd = mg_str_n((char *) c->recv.buf + c->recv.len, len);
+  mg_iobuf_append(&c->recv, buf, len, MG_IO_SIZE);
+  mg_call(c, MG_EV_READ, &evd);
+  if (c != lsn) {
+    mg_io_drained(c->mgr, &c->recv);
+    mg_ready(c);  // Apply watermarks, close if asked to
+  }
+}
+
+// Closing virtual connection leaves the listener's table. Closing listener
+// closes all its virtual connections
+static void mg_udp_free(struct mg_connection *c) {
+  if (c->udp == NULL) {
+  } else if (c->is_listening) {
+    struct mg_udp_table *t = (struct mg_udp_table *) c->udp;
+    struct mg_udp_peer *p;
+    size_t i;
+    for (i = 0; i < t->size; i++) {
+      for (p = t->buckets[i]; p != NULL; p = p->next) {
+        p->lsn = NULL;
+        p->c->is_closing = 1;
+        mg_ready(p->c);
+      }
+    }
+    mg_dealloc(t->buckets);
+    mg_dealloc(t);
+  } else {
+    struct mg_udp_peer *p = (struct mg_udp_peer *) c->udp, **b;
+    if (p->lsn != NULL) {
+      struct mg_udp_table *t = (struct mg_udp_table *) p->lsn->udp;
+      b = &t->buckets[mg_addr_hash(&c->peer) & (t->size - 1)];
+      while (*b != NULL && *b != p) b = &(*b)->next;
+      if (*b != NULL) *b = p->next;
+      t->count--;
+    }
+    mg_dealloc(p);
+  }
+  c->udp = NULL;
+}
+
 static int mg_sock_recv(struct mg_connection *c, void *buf, int len,
                         int *fail) {
   int n = 0;
+#if MG_ENABLE_IO_URING
+  if (mg_uring_io(c)) return mg_uring_recv(c, buf, len, fail);
+#endif
   if (c->is_udp) {
     union usa usa;
     socklen_t slen = sizeof(usa.sin);
@@ -2649,10 +4146,15 @@ static int mg_sock_send(struct mg_connection *c, const void *buf, int len,
   if (c->is_udp) {
     union usa usa = tousa(&c->peer);
     socklen_t slen = sizeof(usa.sin);
+    struct mg_connection *s = mg_udp_sock(c);
 #if MG_ENABLE_IPV6
     if (c->peer.is_ip6) slen = sizeof(usa.sin6);
 #endif
-    n = sendto(FD(c), (char *) buf, len, 0, &usa.sa, slen);
+    if (s == NULL) {
+      *fail = 1;  // The listener is gone. No syscall ran, errno is stale
+      return -1;
+    }
+    n = sendto(FD(s), (char *) buf, len, 0, &usa.sa, slen);
   } else {
     n = send(FD(c), (char *) buf, len, MSG_NONBLOCKING);
   }
@@ -2660,6 +4162,13 @@ static int mg_sock_send(struct mg_connection *c, const void *buf, int len,
   return n;
 }
 
+static void mg_hexdump_io(struct mg_connection *c, const char *dir,
+                          const void *buf, size_t len) {
+  char *s = mg_hexdump(buf, len);
+  LOG(LL_INFO, ("\n-- %lu %s %s %d\n%s--", c->id, c->label, dir, (int) len, s));
+  free(s);
+}
+
 static int ll_read(struct mg_connection *c, void *buf, int len, int *fail) {
   int n = c->is_tls ? mg_tls_recv(c, buf, len, fail)
                     : mg_sock_recv(c, buf, len, fail);
@@ -2667,11 +4176,7 @@ static int ll_read(struct mg_connection *c, void *buf, int len, int *fail) {
       ("%lu %c%c%c %d/%d %d %d", c->id, c->is_tls ? 'T' : 't',
        c->is_udp ? 'U' : 'u', c->is_connecting ? 'C' : 'c', n, len,
        MG_SOCK_ERRNO, *fail));
-  if (n > 0 && c->is_hexdumping) {
-    char *s = mg_hexdump(buf, n);
-    LOG(LL_INFO, ("\n-- %lu %s %s %d\n%s--", c->id, c->label, "<-", n, s));
-    free(s);
-  }
+  if (n > 0 && c->is_hexdumping) mg_hexdump_io(c, "<-", buf, (size_t) n);
   return n;
 }
 
@@ -2683,19 +4188,284 @@ static int ll_write(struct mg_connection *c, const void *buf, int len,
       ("%lu %c%c%c %d/%d %d", c->id, c->is_tls ? 'T' : 't',
        c->is_udp ? 'U' : 'u', c->is_connecting ? 'C' : 'c', n, len,
        MG_SOCK_ERRNO));
-  if (n > 0 && c->is_hexdumping) {
-    char *s = mg_hexdump(buf, len);
-    LOG(LL_INFO, ("\n-- %lu %s %s %d\n%s--", c->id, c->label, "->", len, s));
-    free(s);
-  }
+  if (n > 0 && c->is_hexdumping) mg_hexdump_io(c, "->", buf, (size_t) len);
   return n;
 }
 
+// Write several chunks with one syscall. Where that is not possible, like
+// with TLS, write the first chunk only
+static int ll_writev(struct mg_connection *c, struct mg_str *v, int n,
+                     int *fail) {
+#if MG_ENABLE_POSIX
+  if (!c->is_tls) {
+    struct iovec iov[MG_SEND_IOV];
+    struct msghdr msg;
+    int i, rc;
+    for (i = 0; i < n; i++) {
+      iov[i].iov_base = (void *) v[i].ptr;
+      iov[i].iov_len = v[i].len;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) n;
+    rc = (int) sendmsg(FD(c), &msg, MSG_NONBLOCKING);
+    *fail = (rc == 0) || (rc < 0 && mg_sock_failed());
+    LOG(*fail ? LL_ERROR : LL_VERBOSE_DEBUG,
+        ("%lu writev %d chunks: %d %d", c->id, n, rc, MG_SOCK_ERRNO));
+    if (rc > 0 && c->is_hexdumping) {
+      int left = rc;
+      for (i = 0; i < n && left > 0; i++) {
+        int len = (int) v[i].len < left ? (int) v[i].len : left;
+        mg_hexdump_io(c, "->", v[i].ptr, (size_t) len);
+        left -= len;
+      }
+    }
+    return rc;
+  }
+#endif
+  return ll_write(c, v[0].ptr, (SOCKET) v[0].len, fail);
+}
+
+// Send file segment data straight from the page cache
+static int ll_sendfile(struct mg_connection *c, struct mg_seg *s, int *fail) {
+  int rc = -1;
+#if MG_ENABLE_SENDFILE
+  off_t off = (off_t) s->off;
+  size_t len = s->len < (1U << 30) ? s->len : (1U << 30);
+  rc = (int) sendfile(FD(c), s->fd, &off, len);
+  *fail = (rc == 0) || (rc < 0 && mg_sock_failed());
+  LOG(*fail ? LL_ERROR : LL_VERBOSE_DEBUG,
+      ("%lu sendfile %d %lu: %d %d", c->id, s->fd, (unsigned long) len, rc,
+       MG_SOCK_ERRNO));
+#else
+  *fail = 1;
+  (void) c, (void) s;
+#endif
+  return rc;
+}
+
+#if MG_ENABLE_MMSG
+// Datagram queued in c->send, data follows
+struct mg_dgram {
+  struct mg_addr peer;  // Destination
+  size_t len;           // Data length
+};
+
+// struct mmsghdr. glibc declares it only with _GNU_SOURCE, which mongoose
+// does not define, so that it does not change the user's libc interfaces
+struct mg_mmsghdr {
+  struct msghdr msg_hdr;  // Message
+  unsigned int msg_len;   // Bytes sent or received
+};
+
+static socklen_t mg_usa_len(struct mg_addr *a) {
+#if MG_ENABLE_IPV6
+  if (a->is_ip6) return sizeof(struct sockaddr_in6);
+#endif
+  (void) a;
+  return sizeof(struct sockaddr_in);
+}
+
+// Queue a datagram to peer. Replies to many peers, e.g. from a UDP
+// listener, go out together with a single sendmmsg()
+static int mg_udp_queue(struct mg_connection *c, struct mg_addr *peer,
+                        const void *buf, size_t len) {
+  struct mg_dgram d;
+  size_t step = c->mgr == NULL ? MG_IO_GROW : c->mgr->iogrow;
+  d.peer = *peer;
+  d.len = len;
+  if (!mg_iobuf_reserve(&c->send, sizeof(d) + len, MG_IO_SIZE, step)) return 0;
+  mg_iobuf_append(&c->send, &d, sizeof(d), MG_IO_SIZE);
+  mg_iobuf_append(&c->send, buf, len, MG_IO_SIZE);
+  mg_ready(c);
+  return (int) len;
+}
+
+// Send queued datagrams, MG_UDP_BATCH per syscall, until the socket buffer
+// is full. A datagram that cannot be sent is dropped and counted
+static void mg_udp_flush(struct mg_connection *c) {
+  struct mg_mmsghdr msgs[MG_UDP_BATCH];
+  struct iovec iov[MG_UDP_BATCH];
+  union usa usa[MG_UDP_BATCH];
+  size_t ends[MG_UDP_BATCH];
+  while (c->send.len > 0) {
+    size_t ofs = 0;
+    int i, n = 0, rc, err;
+    bool fail;
+    memset(msgs, 0, sizeof(msgs));
+    while (n < MG_UDP_BATCH && ofs < c->send.len) {
+      struct mg_dgram d;
+      memcpy(&d, c->send.buf + ofs, sizeof(d));
+      usa[n] = tousa(&d.peer);
+      iov[n].iov_base = c->send.buf + ofs + sizeof(d);
+      iov[n].iov_len = d.len;
+      msgs[n].msg_hdr.msg_name = &usa[n].sa;
+      msgs[n].msg_hdr.msg_namelen = mg_usa_len(&d.peer);
+      msgs[n].msg_hdr.msg_iov = &iov[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+      ofs += sizeof(d) + d.len;
+      ends[n++] = ofs;
+    }
+    rc = (int) syscall(__NR_sendmmsg, FD(c), msgs, (unsigned) n, 0);
+    err = MG_SOCK_ERRNO;  // Logging may change errno
+    fail = rc < 0 && mg_sock_failed();
+    LOG(LL_VERBOSE_DEBUG, ("%lu sendmmsg %d: %d %d", c->id, n, rc, err));
+    if (rc < 0 && !fail) break;  // Try again when writable
+    if (rc < 0) {
+      // The first datagram failed, e.g. with EMSGSIZE. Drop it, send the rest
+      LOG(LL_ERROR, ("%lu sendmmsg: %d, %lu bytes dropped", c->id, err,
+                     (unsigned long) iov[0].iov_len));
+      c->udp_dropped++;
+      mg_iobuf_delete(&c->send, ends[0]);
+      continue;
+    }
+    for (i = 0; i < rc && c->is_hexdumping; i++) {
+      mg_hexdump_io(c, "->", iov[i].iov_base, iov[i].iov_len);
+    }
+    mg_iobuf_delete(&c->send, ends[rc - 1]);
+  }
+  mg_io_drained(c->mgr, &c->send);
+}
+
+// Read up to MG_UDP_BATCH datagrams with a single syscall. Every datagram
+// is delivered by its own MG_EV_READ, with c->peer set to its sender
+static void mg_udp_read(struct mg_connection *c) {
+  struct mg_mmsghdr msgs[MG_UDP_BATCH];
+  struct iovec iov[MG_UDP_BATCH];
+  union usa usa[MG_UDP_BATCH];
+  unsigned char *buf = c->mgr->udpbuf;
+  int i, rc, err;
+  bool fail;
+  if (buf == NULL) {
+    buf = (unsigned char *) mg_alloc(MG_UDP_BATCH * MG_UDP_MSG_SIZE);
+    if ((c->mgr->udpbuf = buf) == NULL) {
+      mg_error(c, "OOM");
+      return;
+    }
+  }
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < MG_UDP_BATCH; i++) {
+    iov[i].iov_base = buf + i * MG_UDP_MSG_SIZE;
+    iov[i].iov_len = MG_UDP_MSG_SIZE;
+    msgs[i].msg_hdr.msg_name = &usa[i].sa;
+    msgs[i].msg_hdr.msg_namelen = sizeof(usa[i]);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  rc = (int) syscall(__NR_recvmmsg, FD(c), msgs, MG_UDP_BATCH, 0, NULL);
+  err = MG_SOCK_ERRNO;  // Logging may change errno
+  fail = rc < 0 && mg_sock_failed();
+  LOG(LL_VERBOSE_DEBUG, ("%lu recvmmsg: %d %d", c->id, rc, err));
+  if (fail) c->is_closing = 1;
+  for (i = 0; i < rc && !c->is_closing; i++) {
+    size_t len = msgs[i].msg_len;
+    c->peer.is_ip6 = usa[i].sa.sa_family != AF_INET;
+    if (c->peer.is_ip6) {
+#if MG_ENABLE_IPV6
+      memcpy(c->peer.ip6, &usa[i].sin6.sin6_addr, sizeof(c->peer.ip6));
+      c->peer.port = usa[i].sin6.sin6_port;
+#endif
+    } else {
+      c->peer.ip = *(uint32_t *) &usa[i].sin.sin_addr;
+      c->peer.port = usa[i].sin.sin_port;
+    }
+    if (c->is_hexdumping) mg_hexdump_io(c, "<-", iov[i].iov_base, len);
+    mg_udp_deliver(c, iov[i].iov_base, len);
+  }
+  mg_io_drained(c->mgr, &c->recv);
+}
+#else
+// Read one datagram for a demultiplexing listener
+static void mg_udp_read(struct mg_connection *c) {
+  char buf[MG_UDP_MSG_SIZE];
+  int fail, n = ll_read(c, buf, (int) sizeof(buf), &fail);
+  if (n > 0) {
+    mg_udp_deliver(c, buf, (size_t) n);
+  } else if (fail) {
+    c->is_closing = 1;
+  }
+}
+#endif
+
 int mg_send(struct mg_connection *c, const void *buf, size_t len) {
-  int fail, n = c->is_udp
-                    ? ll_write(c, buf, (SOCKET) len, &fail)
-                    : (int) mg_iobuf_append(&c->send, buf, len, MG_IO_SIZE);
-  if (len > 0 && n == 0) fail = 1;
+  int n;
+  if (c->is_udp) {
+#if MG_ENABLE_MMSG
+    struct mg_connection *s = mg_udp_sock(c);
+    n = s == NULL ? 0 : mg_udp_queue(s, &c->peer, buf, len);
+#else
+    int fail;
+    n = ll_write(c, buf, (SOCKET) len, &fail);
+#endif
+    if (mg_udp_virtual(c)) {
+      ((struct mg_udp_peer *) c->udp)->last = c->mgr->timers.now;
+    }
+  } else {
+    size_t step = c->mgr == NULL ? MG_IO_GROW : c->mgr->iogrow;
+    mg_iobuf_reserve(&c->send, len, MG_IO_SIZE, step);
+    n = (int) mg_iobuf_append(&c->send, buf, len, MG_IO_SIZE);
+  }
+  if (n > 0 && !c->is_udp) mg_ready(c);  // Let the IO backend see new data
+  return n;
+}
+
+int mg_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                void (*release)(void *), void *arg) {
+  struct mg_seg *s;
+  if (c->is_udp) {
+    int n = mg_send(c, buf, len);
+    if (n > 0 && release != NULL) release(arg);
+    return n > 0 ? n : 0;
+  }
+  if (len == 0 || (s = (struct mg_seg *) mg_alloc(sizeof(*s))) == NULL) {
+    return 0;
+  }
+  memset(s, 0, sizeof(*s));
+  s->buf = (const char *) buf;
+  s->len = len;
+  s->at = c->send.len;
+  s->fd = -1;
+  s->release = release;
+  s->arg = arg;
+  mg_segs_add(c, s);
+  mg_ready(c);
+  return (int) len;
+}
+
+int mg_send_file(struct mg_connection *c, int fd, int64_t offset, size_t len,
+                 void (*release)(void *), void *arg) {
+#if MG_ENABLE_SENDFILE
+  struct mg_seg *s;
+  if (c->is_tls || c->is_udp || len == 0) return 0;
+#if MG_ENABLE_IO_URING
+  if (c->mgr->uring != NULL) return 0;  // io_uring sends from memory only
+#endif
+  if ((s = (struct mg_seg *) mg_alloc(sizeof(*s))) == NULL) return 0;
+  memset(s, 0, sizeof(*s));
+  s->len = len;
+  s->at = c->send.len;
+  s->fd = fd;
+  s->off = offset;
+  s->release = release;
+  s->arg = arg;
+  mg_segs_add(c, s);
+  mg_ready(c);
+  return (int) len;
+#else
+  (void) c, (void) fd, (void) offset, (void) len, (void) release, (void) arg;
+  return 0;
+#endif
+}
+
+static void mg_shared_unref(void *arg) {
+  mg_shared_release((struct mg_shared *) arg);
+}
+
+int mg_send_shared(struct mg_connection *c, struct mg_shared *sh) {
+  int n;
+  mg_shared_ref(sh);
+  n = mg_send_ref(c, sh->buf, sh->len, mg_shared_unref, sh);
+  if (n == 0) mg_shared_release(sh);
   return n;
 }
 
@@ -2712,9 +4482,46 @@ static void mg_set_non_blocking_mode(SOCKET fd) {
 #endif
 }
 
-SOCKET mg_open_listener(const char *url) {
+#if MG_ENABLE_EPOLL
+// Register socket in the epoll set. Read interest stays unless reading is
+// paused, write interest is toggled by mg_epoll_sync()
+static void mg_epoll_add(struct mg_connection *c) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  if (epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, FD(c), &ev) != 0) {
+    LOG(LL_ERROR, ("%lu epoll_ctl(ADD): %d", c->id, MG_SOCK_ERRNO));
+  }
+  c->is_epollin = 1;
+  c->is_epollout = 0;
+}
+
+// Update EPOLLIN and EPOLLOUT, but only when interest actually changes
+static void mg_epoll_sync(struct mg_connection *c) {
+  bool rd = mg_want_read(c), wr = mg_want_write(c);
+  if (rd != (bool) c->is_epollin || wr != (bool) c->is_epollout) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    if (rd) ev.events |= EPOLLIN;
+    if (wr) ev.events |= EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, FD(c), &ev) != 0) {
+      LOG(LL_ERROR, ("%lu epoll_ctl(MOD): %d", c->id, MG_SOCK_ERRNO));
+    }
+    c->is_epollin = rd;
+    c->is_epollout = wr;
+  }
+}
+#else
+#define mg_epoll_add(c)
+#endif
+
+SOCKET mg_open_listener(const char *url, const struct mg_sock_opts *o,
+                        bool reuseport) {
   struct mg_addr addr;
   SOCKET fd = INVALID_SOCKET;
+  int backlog = o != NULL && o->backlog > 0 ? o->backlog : 128;
 
   memset(&addr, 0, sizeof(addr));
   addr.port = mg_htons(mg_url_port(url));
@@ -2747,21 +4554,67 @@ SOCKET mg_open_listener(const char *url) {
         //! &&
         !setsockopt(fd, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (char *) &on,
                     sizeof(on)) &&
+#endif
+#if defined(SO_REUSEPORT)
+        // Several sockets share the port, kernel balances connections
+        (!reuseport ||
+         !setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on))) &&
 #endif
         bind(fd, &usa.sa, slen) == 0 &&
         // NOTE(lsm): FreeRTOS uses backlog value as a connection limit
-        (type == SOCK_DGRAM || listen(fd, 128) == 0)) {
+        (type == SOCK_DGRAM || listen(fd, backlog) == 0)) {
       mg_set_non_blocking_mode(fd);
+#if defined(TCP_DEFER_ACCEPT)
+      // Accept connections only when they have data to read
+      if (o != NULL && o->defer_accept > 0 && type == SOCK_STREAM) {
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &o->defer_accept,
+                   sizeof(o->defer_accept));
+      }
+#endif
+#if defined(TCP_FASTOPEN)
+      if (o != NULL && o->fastopen > 0 && type == SOCK_STREAM) {
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (char *) &o->fastopen,
+                   sizeof(o->fastopen));
+      }
+#endif
     } else if (fd != INVALID_SOCKET) {
       LOG(LL_ERROR, ("Failed to listen on %s, errno %d", url, MG_SOCK_ERRNO));
       closesocket(fd);
       fd = INVALID_SOCKET;
     }
   }
+  (void) reuseport;
 
   return fd;
 }
 
+#if MG_ENABLE_REACTORS && defined(SO_ATTACH_REUSEPORT_CBPF)
+// Steer new connections to the reactor that runs on the CPU which received
+// them. Sockets join the SO_REUSEPORT group in reactor order, so the index
+// of a reactor's listener is the reactor index: CPU number modulo N
+static void mg_reactors_steer(struct mg_connection *c) {
+  struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t) (SKF_AD_OFF + SKF_AD_CPU)},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t) c->mgr->reactors->n},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog;
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  if (setsockopt(FD(c), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                 sizeof(prog)) != 0) {
+    LOG(LL_ERROR, ("%lu SO_ATTACH_REUSEPORT_CBPF: %d", c->id, MG_SOCK_ERRNO));
+  }
+}
+#endif
+
+// Growth step limit for a recv buffer of given size: stay within
+// MG_MAX_RECV_BUF_SIZE
+static size_t mg_io_step(struct mg_mgr *mgr, size_t size) {
+  size_t room = MG_MAX_RECV_BUF_SIZE - size;
+  return mgr->iogrow < room ? mgr->iogrow : room;
+}
+
 static void read_conn(struct mg_connection *c,
                       int (*fn)(struct mg_connection *, void *, int, int *)) {
   unsigned char *buf;
@@ -2771,7 +4624,8 @@ static void read_conn(struct mg_connection *c,
   // (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data
   if (c->recv.size - c->recv.len < MG_IO_SIZE &&
       c->recv.size < MG_MAX_RECV_BUF_SIZE &&
-      !mg_iobuf_resize(&c->recv, c->recv.size + MG_IO_SIZE)) {
+      !mg_iobuf_reserve(&c->recv, MG_IO_SIZE, MG_IO_SIZE,
+                        mg_io_step(c->mgr, c->recv.size))) {
     c->is_closing = 1;
   }
   buf = c->recv.buf + c->recv.len;
@@ -2781,16 +4635,28 @@ static void read_conn(struct mg_connection *c,
     struct mg_str evd = mg_str_n((char *) buf, rc);
     c->recv.len += rc;
     mg_call(c, MG_EV_READ, &evd);
+    mg_io_drained(c->mgr, &c->recv);
   } else {
     if (fail) c->is_closing = 1;
   }
 }
 
 static int write_conn(struct mg_connection *c) {
-  int fail, rc = ll_write(c, c->send.buf, (SOCKET) c->send.len, &fail);
+  int fail, rc;
+#if MG_ENABLE_IO_URING
+  if (mg_uring_io(c)) return mg_uring_write_conn(c);
+#endif
+  if (c->segs != NULL) {
+    struct mg_str v[MG_SEND_IOV];
+    int n = mg_send_chunks(c, v, MG_SEND_IOV);
+    rc = n > 0 ? ll_writev(c, v, n, &fail) : ll_sendfile(c, c->segs, &fail);
+    if (rc > 0) mg_send_consume(c, (size_t) rc);
+  } else {
+    rc = ll_write(c, c->send.buf, (SOCKET) c->send.len, &fail);
+    if (rc > 0) mg_iobuf_delete(&c->send, rc);
+  }
   if (rc > 0) {
-    mg_iobuf_delete(&c->send, rc);
-    if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
+    mg_io_drained(c->mgr, &c->send);
     mg_call(c, MG_EV_WRITE, &rc);
   } else if (fail) {
     c->is_closing = 1;
@@ -2798,55 +4664,134 @@ static int write_conn(struct mg_connection *c) {
   return rc;
 }
 
+// Unbind a closing connection from its relay peer, which then sends what it
+// has got and closes, too
+static void mg_relay_free(struct mg_connection *c) {
+  struct mg_relay *r = (struct mg_relay *) c->relay;
+  struct mg_connection *peer;
+  if (r == NULL) return;
+  peer = r->c[r->c[0] == c ? 1 : 0];
+  c->relay = peer->relay = NULL;
+  peer->is_paused = 0;
+  peer->is_draining = 1;
+  mg_ready(peer);
+#if MG_ENABLE_SPLICE
+  {
+    int i;
+    for (i = 0; i < 4; i++) {
+      if (r->pipe[i / 2][i % 2] >= 0) close(r->pipe[i / 2][i % 2]);
+    }
+  }
+#endif
+  mg_dealloc(r);
+}
+
 static void close_conn(struct mg_connection *c) {
-  // Unlink this connection from the list
-  LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
+  mg_del_conn(c);
   mg_resolve_cancel(c);
   if (c == c->mgr->dns4.c) c->mgr->dns4.c = NULL;
   if (c == c->mgr->dns6.c) c->mgr->dns6.c = NULL;
+#if MG_ENABLE_WAKEUP
+  if (c == c->mgr->wakeup) c->mgr->wakeup = NULL;
+#endif
   mg_call(c, MG_EV_CLOSE, NULL);
+  if (c->is_ready) mg_unready(c);  // MG_EV_CLOSE handler may have sent data
   // while (c->callbacks != NULL) mg_fn_del(c, c->callbacks->fn);
   LOG(LL_DEBUG, ("%lu closed", c->id));
   if (FD(c) != INVALID_SOCKET) {
+#if MG_ENABLE_MMSG
+    if (c->is_udp) mg_udp_flush(c);  // Datagrams queued just before closing
+#endif
     closesocket(FD(c));
 #if MG_ARCH == MG_ARCH_FREERTOS
     FreeRTOS_FD_CLR(c->fd, c->mgr->ss, eSELECT_ALL);
 #endif
   }
+#if MG_ENABLE_IO_URING
+  mg_uring_detach(c);
+#endif
+  mg_relay_free(c);
+  mg_udp_free(c);
+  mg_timer_free(&c->timer);
+  mg_dealloc(c->sockopts);
+  mg_dealloc(c->http);
   mg_tls_free(c);
-  free(c->recv.buf);
-  free(c->send.buf);
-  memset(c, 0, sizeof(*c));
-  free(c);
+  mg_segs_free(c);
+  mg_iobuf_free(&c->recv);
+  mg_iobuf_free(&c->send);
+  mg_free_conn(c);
 }
 
-static void setsockopts(struct mg_connection *c) {
+// Apply socket options, o can be NULL. Options specific to listening
+// sockets are set by mg_open_listener()
+static void setsockopts(struct mg_connection *c, const struct mg_sock_opts *o) {
 #if MG_ARCH == MG_ARCH_FREERTOS
   FreeRTOS_FD_SET(c->fd, c->mgr->ss, eSELECT_READ | eSELECT_EXCEPT);
+  (void) o;
 #else
-  int on = 1;
+  int on = 1, idle = 60, cnt = 3, intvl = 20;
 #if !defined(SOL_TCP)
 #define SOL_TCP IPPROTO_TCP
 #endif
-  setsockopt(FD(c), SOL_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+  if (o != NULL && o->keepidle != 0) idle = o->keepidle;
+  if (o != NULL && o->keepcnt > 0) cnt = o->keepcnt;
+  if (o != NULL && o->keepintvl > 0) intvl = o->keepintvl;
+  if (o == NULL || !o->nagle) {
+    setsockopt(FD(c), SOL_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+  }
 #if defined(TCP_QUICKACK)
   setsockopt(FD(c), SOL_TCP, TCP_QUICKACK, (char *) &on, sizeof(on));
 #endif
-  setsockopt(FD(c), SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof(on));
+  if (idle > 0) {
+    setsockopt(FD(c), SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof(on));
 #if ESP32 || ESP8266 || defined(__linux__)
-  int idle = 60;
-  setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
 #endif
 #ifndef _WIN32
-  {
-    int cnt = 3, intvl = 20;
     setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
     setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+#endif
+  }
+  if (o == NULL) return;
+  if (o->rcvbuf > 0) {
+    setsockopt(FD(c), SOL_SOCKET, SO_RCVBUF, (char *) &o->rcvbuf,
+               sizeof(o->rcvbuf));
+  }
+  if (o->sndbuf > 0) {
+    setsockopt(FD(c), SOL_SOCKET, SO_SNDBUF, (char *) &o->sndbuf,
+               sizeof(o->sndbuf));
+  }
+#if defined(SO_BUSY_POLL)
+  if (o->busy_poll > 0) {
+    setsockopt(FD(c), SOL_SOCKET, SO_BUSY_POLL, &o->busy_poll,
+               sizeof(o->busy_poll));
+  }
+#endif
+#if defined(TCP_NOTSENT_LOWAT)
+  if (o->notsent_lowat > 0) {
+    setsockopt(FD(c), IPPROTO_TCP, TCP_NOTSENT_LOWAT, &o->notsent_lowat,
+               sizeof(o->notsent_lowat));
+  }
+#endif
+#if defined(TCP_FASTOPEN_CONNECT)
+  // Client data goes out with SYN, if the server supports it
+  if (o->fastopen > 0 && c->is_client) {
+    setsockopt(FD(c), IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
   }
 #endif
 #endif
 }
 
+// Copy of socket options for a new connection, which may outlive opts
+static struct mg_sock_opts *mg_sockopts_dup(const struct mg_sock_opts *opts) {
+  struct mg_sock_opts *o = NULL;
+  if (opts != NULL &&
+      (o = (struct mg_sock_opts *) mg_alloc(sizeof(*o))) != NULL) {
+    *o = *opts;
+  }
+  return o;
+}
+
 void mg_connect_resolved(struct mg_connection *c) {
   char buf[40];
   int type = c->is_udp ? SOCK_DGRAM : SOCK_STREAM;
@@ -2854,6 +4799,7 @@ void mg_connect_resolved(struct mg_connection *c) {
 #if MG_ENABLE_IPV6
   if (c->peer.is_ip6) af = AF_INET6;
 #endif
+  c->since = c->mgr->timers.now;  // Handshake timeout starts now
   mg_straddr(c, buf, sizeof(buf));
   c->fd = (void *) (long) socket(af, type, 0);
   if (FD(c) == INVALID_SOCKET) {
@@ -2862,6 +4808,7 @@ void mg_connect_resolved(struct mg_connection *c) {
   }
 
   mg_set_non_blocking_mode(FD(c));
+  mg_epoll_add(c);
   mg_call(c, MG_EV_RESOLVE, NULL);
   if (type == SOCK_STREAM) {
     union usa usa = tousa(&c->peer);
@@ -2870,27 +4817,29 @@ void mg_connect_resolved(struct mg_connection *c) {
         c->peer.is_ip6 ? sizeof(usa.sin6) :
 #endif
                        sizeof(usa.sin);
-    int rc = connect(FD(c), &usa.sa, slen);
-    int fail = rc < 0 && mg_sock_failed() ? MG_SOCK_ERRNO : 0;
-    if (fail) {
-      mg_error(c, "connect: %d", MG_SOCK_ERRNO);
-    } else {
-      setsockopts(c);
-    }
+    int rc, fail;
+    // Buffer sizes must be set before SYN
+    setsockopts(c, c->sockopts);
+    rc = connect(FD(c), &usa.sa, slen);
+    fail = rc < 0 && mg_sock_failed() ? MG_SOCK_ERRNO : 0;
+    if (fail) mg_error(c, "connect: %d", MG_SOCK_ERRNO);
     if (rc < 0) c->is_connecting = 1;
   }
+  mg_ready(c);
 }
 
-struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
-                                 mg_event_handler_t fn, void *fn_data) {
+struct mg_connection *mg_connect_opts(struct mg_mgr *mgr, const char *url,
+                                      const struct mg_sock_opts *opts,
+                                      mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = NULL;
   if ((c = alloc_conn(mgr, 1, INVALID_SOCKET)) == NULL) {
     LOG(LL_ERROR, ("OOM"));
   } else {
     struct mg_str host = mg_url_host(url);
-    LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    mg_add_conn(c);
     c->is_udp = (strncmp(url, "udp:", 4) == 0);
     c->peer.port = mg_htons(mg_url_port(url));
+    c->sockopts = mg_sockopts_dup(opts);
     c->fn = fn;
     c->fn_data = fn_data;
     LOG(LL_DEBUG, ("%lu -> %s", c->id, url));
@@ -2899,15 +4848,53 @@ struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
-static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+static SOCKET ll_accept(struct mg_connection *lsn, union usa *usa,
+                        socklen_t *len) {
+#if MG_ENABLE_IO_URING
+  struct mg_uring_conn *u = (struct mg_uring_conn *) lsn->uring;
+  if (u != NULL) {  // io_uring accepts one socket per completion
+    SOCKET fd = u->afd;
+    *usa = u->addr;
+    *len = u->alen;
+    u->afd = INVALID_SOCKET;
+    if (fd == INVALID_SOCKET) errno = EWOULDBLOCK;
+    return fd;
+  }
+#endif
+#if defined(__linux__)
+  // accept4() is declared only with _GNU_SOURCE, which is left to the user
+  return (SOCKET) syscall(__NR_accept4, FD(lsn), &usa->sa, len,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  return accept(FD(lsn), &usa->sa, len);
+#endif
+}
+
+#if !defined(_WIN32) && !MG_ENABLE_EPOLL
+// Return true if fd is too large for select(). io_uring, when available at
+// runtime, does not use select() and takes any descriptor
+static bool mg_fd_too_large(struct mg_mgr *mgr, SOCKET fd) {
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) return false;
+#endif
+  (void) mgr;
+  return fd >= FD_SETSIZE;
+}
+#endif
+
+// Accept one connection. Return false if there is nothing to accept
+static bool accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   struct mg_connection *c = NULL;
   union usa usa;
   socklen_t sa_len = sizeof(usa);
-  SOCKET fd = accept(FD(lsn), &usa.sa, &sa_len);
+  SOCKET fd = ll_accept(lsn, &usa, &sa_len);
   if (fd == INVALID_SOCKET) {
-    LOG(LL_ERROR, ("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERRNO));
-#if !defined(_WIN32)
-  } else if (fd >= FD_SETSIZE) {
+    if (mg_sock_failed()) {
+      LOG(LL_ERROR, ("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERRNO));
+    }
+    return false;
+#if !defined(_WIN32) && !MG_ENABLE_EPOLL
+  } else if (mg_fd_too_large(mgr, fd)) {
     LOG(LL_ERROR, ("%ld > %ld", (long) fd, (long) FD_SETSIZE));
     closesocket(fd);
 #endif
@@ -2927,17 +4914,32 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
 #endif
     mg_straddr(c, buf, sizeof(buf));
     LOG(LL_DEBUG, ("%lu accepted %s", c->id, buf));
-    mg_set_non_blocking_mode(FD(c));
-    setsockopts(c);
-    LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+#if !defined(__linux__)
+    mg_set_non_blocking_mode(FD(c));  // On Linux, accept4() does that
+#endif
+    // Not all options are inherited from the listener, e.g. TCP_QUICKACK
+    setsockopts(c, lsn->sockopts);
+    mg_epoll_add(c);
+    mg_ready(c);
+    mg_add_conn(c);
     c->is_accepted = 1;
     c->is_hexdumping = lsn->is_hexdumping;
+    c->recv_high = lsn->recv_high, c->recv_low = lsn->recv_low;
+    c->send_high = lsn->send_high, c->send_low = lsn->send_low;
     c->pfn = lsn->pfn;
     c->pfn_data = lsn->pfn_data;
     c->fn = lsn->fn;
     c->fn_data = lsn->fn_data;
     mg_call(c, MG_EV_ACCEPT, NULL);
   }
+  return true;
+}
+
+// Accept pending connections, but not too many at once, so that a storm of
+// new connections does not starve established ones
+static void accept_conns(struct mg_connection *lsn) {
+  int i;
+  for (i = 0; i < MG_ACCEPT_BUDGET && accept_conn(lsn->mgr, lsn); i++) (void) 0;
 }
 
 #if MG_ENABLE_SOCKETPAIR
@@ -2982,11 +4984,146 @@ bool mg_socketpair(int *s1, int *s2) {
 }
 #endif
 
-struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
-                                mg_event_handler_t fn, void *fn_data) {
+#if MG_ENABLE_WAKEUP
+// Message posted by mg_mgr_wakeup(), data follows the structure
+struct mg_wakeup_msg {
+  struct mg_wakeup_msg *next;  // Linkage in struct mg_mgr :: mailbox
+  unsigned long id;            // Destination connection ID
+  int ev;                      // Event to deliver
+  size_t len;                  // Data length
+};
+
+// Create the wakeup channel. Must be called by the thread that polls mgr,
+// before other threads call mg_mgr_wakeup()
+bool mg_mgr_wakeup_init(struct mg_mgr *mgr) {
+  struct mg_connection *c;
+  int fds[2] = {-1, -1};
+  if (mgr->wakeup != NULL) return true;
+#if defined(__linux__)
+  fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fds[0] < 0) {
+#else
+  if (pipe(fds) != 0) {
+#endif
+    LOG(LL_ERROR, ("wakeup channel: %d", errno));
+    return false;
+  }
+  if ((c = alloc_conn(mgr, 0, (SOCKET) fds[0])) == NULL) {
+    LOG(LL_ERROR, ("OOM"));
+    close(fds[0]);
+    if (fds[1] != fds[0]) close(fds[1]);
+    return false;
+  }
+  mg_set_non_blocking_mode((SOCKET) fds[0]);
+  mg_set_non_blocking_mode((SOCKET) fds[1]);
+  snprintf(c->label, sizeof(c->label), "%s", "WAKEUP");
+  mg_epoll_add(c);
+  mg_ready(c);
+  mg_add_conn(c);
+  mgr->wakeup = c;
+  mgr->wakeup_fd = fds[1];
+  return true;
+}
+
+bool mg_wakeup_post(struct mg_mgr *mgr, unsigned long id, int ev,
+                    const void *buf, size_t len) {
+  struct mg_wakeup_msg *m;
+  void *head;
+  if (mgr->wakeup == NULL) return false;
+  m = (struct mg_wakeup_msg *) mg_alloc(sizeof(*m) + len);
+  if (m == NULL) return false;
+  m->id = id;
+  m->ev = ev;
+  m->len = len;
+  if (len > 0) memcpy(m + 1, buf, len);
+  // Lock-free push. Only the first message of a batch notifies the loop
+  head = __atomic_load_n(&mgr->mailbox, __ATOMIC_RELAXED);
+  do {
+    m->next = (struct mg_wakeup_msg *) head;
+  } while (!__atomic_compare_exchange_n(&mgr->mailbox, &head, (void *) m, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (head == NULL) {
+    uint64_t one = 1;
+    if (write(mgr->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      LOG(LL_ERROR, ("wakeup: %d", errno));
+    }
+  }
+  return true;
+}
+
+// Post a message to connection with the given ID: it gets MG_EV_WAKEUP with
+// the data on the next poll iteration. With ID 0, just wake up mg_mgr_poll().
+// Can be called by any thread
+bool mg_mgr_wakeup(struct mg_mgr *mgr, unsigned long id, const void *buf,
+                   size_t len) {
+  return mg_wakeup_post(mgr, id, MG_EV_WAKEUP, buf, len);
+}
+
+// Message data is a pointer that the receiver owns. Free it if nobody takes
+static void *mg_wakeup_arg(struct mg_wakeup_msg *m) {
+  void *arg;
+  memcpy(&arg, m + 1, sizeof(arg));
+  return arg;
+}
+
+static struct mg_wakeup_msg *mg_wakeup_take(struct mg_mgr *mgr) {
+  struct mg_wakeup_msg *m, *list = NULL, *tmp;
+  m = (struct mg_wakeup_msg *) __atomic_exchange_n(&mgr->mailbox, (void *) NULL,
+                                                   __ATOMIC_ACQUIRE);
+  // Messages are pushed to the head, restore posting order
+  for (; m != NULL; m = tmp) tmp = m->next, m->next = list, list = m;
+  return list;
+}
+
+static void mg_wakeup_read(struct mg_connection *c) {
+  struct mg_wakeup_msg *m, *tmp;
+  char buf[64];
+  // Consume the notification before taking messages, so that messages posted
+  // after that notify again
+  while (read(FD(c), buf, sizeof(buf)) > 0) continue;
+  for (m = mg_wakeup_take(c->mgr); m != NULL; m = tmp) {
+    struct mg_connection *t = m->id == 0 ? NULL : mg_conn_by_id(c->mgr, m->id);
+    tmp = m->next;
+    if (m->ev == MG_EV_WORK_DONE) {
+      if (t != NULL && !t->is_closing) {
+        mg_call(t, m->ev, mg_wakeup_arg(m));
+        mg_ready(t);
+      } else {
+        free(mg_wakeup_arg(m));
+      }
+    } else if (t != NULL && !t->is_closing) {
+      struct mg_str data = mg_str_n((char *) (m + 1), m->len);
+      mg_call(t, m->ev, &data);
+      mg_ready(t);
+    }
+    mg_dealloc(m);
+  }
+}
+
+void mg_wakeup_free(struct mg_mgr *mgr) {
+  struct mg_wakeup_msg *m, *tmp;
+  for (m = mg_wakeup_take(mgr); m != NULL; m = tmp) {
+    tmp = m->next;
+    if (m->ev == MG_EV_WORK_DONE) free(mg_wakeup_arg(m));
+    mg_dealloc(m);
+  }
+#if !defined(__linux__)
+  if (mgr->wakeup_fd >= 0) close(mgr->wakeup_fd);  // eventfd is closed already
+#endif
+  mgr->wakeup_fd = -1;
+}
+#endif
+
+struct mg_connection *mg_listen_opts(struct mg_mgr *mgr, const char *url,
+                                     const struct mg_sock_opts *opts,
+                                     mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = NULL;
   int is_udp = strncmp(url, "udp:", 4) == 0;
-  SOCKET fd = mg_open_listener(url);
+#if MG_ENABLE_REACTORS
+  SOCKET fd = mg_open_listener(url, opts, mgr->reactors != NULL);
+#else
+  SOCKET fd = mg_open_listener(url, opts, false);
+#endif
   if (fd == INVALID_SOCKET) {
   } else if ((c = alloc_conn(mgr, 0, fd)) == NULL) {
     LOG(LL_ERROR, ("OOM %s", url));
@@ -2995,8 +5132,16 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
     c->fd = (void *) (long) fd;
     c->is_listening = 1;
     c->is_udp = is_udp;
-    setsockopts(c);
-    LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    c->sockopts = mg_sockopts_dup(opts);
+    setsockopts(c, c->sockopts);
+#if MG_ENABLE_REACTORS && defined(SO_ATTACH_REUSEPORT_CBPF)
+    if (mgr->reactors != NULL && (mgr->reactors->flags & MG_REACTORS_PIN)) {
+      mg_reactors_steer(c);
+    }
+#endif
+    mg_epoll_add(c);
+    mg_ready(c);
+    mg_add_conn(c);
     c->fn = fn;
     c->fn_data = fn_data;
     LOG(LL_INFO, ("%lu accepting on %s", c->id, url));
@@ -3005,18 +5150,49 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
 }
 
 static void mg_iotest(struct mg_mgr *mgr, int ms) {
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) {
+    mg_uring_iotest(mgr, ms);
+    return;
+  }
+#endif
 #if MG_ARCH == MG_ARCH_FREERTOS
   struct mg_connection *c;
   for (c = mgr->conns; c != NULL; c = c->next) {
     FreeRTOS_FD_CLR(c->fd, mgr->ss, eSELECT_WRITE);
-    if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
-      FreeRTOS_FD_SET(c->fd, mgr->ss, eSELECT_WRITE);
+    if (mg_want_write(c)) FreeRTOS_FD_SET(c->fd, mgr->ss, eSELECT_WRITE);
   }
   FreeRTOS_select(mgr->ss, pdMS_TO_TICKS(ms));
   for (c = mgr->conns; c != NULL; c = c->next) {
     EventBits_t bits = FreeRTOS_FD_ISSET(c->fd, mgr->ss);
     c->is_readable = bits & (eSELECT_READ | eSELECT_EXCEPT) ? 1 : 0;
     c->is_writable = bits & eSELECT_WRITE ? 1 : 0;
+    if (c->is_readable || c->is_writable) mg_ready(c);
+  }
+#elif MG_ENABLE_EPOLL
+  struct epoll_event evs[MG_EPOLL_MAX_EVENTS];
+  struct mg_connection *c;
+  int i, n;
+
+  // Interest can change only for queued connections: those that have been
+  // processed, got new data to send, or have just been created
+  for (c = mgr->ready; c != NULL; c = c->rnext) {
+    if (c->is_closing) ms = 0;
+    if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
+    mg_epoll_sync(c);
+  }
+
+  if ((n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_MAX_EVENTS, ms)) < 0) {
+    LOG(LL_DEBUG, ("epoll_wait: %d %d", n, MG_SOCK_ERRNO));
+    n = 0;
+  }
+
+  // Only connections reported by the kernel are touched here
+  for (i = 0; i < n; i++) {
+    c = (struct mg_connection *) evs[i].data.ptr;
+    if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) c->is_readable = 1;
+    if (evs[i].events & EPOLLOUT) c->is_writable = 1;
+    mg_ready(c);
   }
 #else
   struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
@@ -3033,10 +5209,9 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     // TLS might have stuff buffered, so dig everything
     // c->is_readable = c->is_tls && c->is_readable ? 1 : 0;
     if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
-    FD_SET(FD(c), &rset);
+    if (mg_want_read(c)) FD_SET(FD(c), &rset);
     if (FD(c) > maxfd) maxfd = FD(c);
-    if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
-      FD_SET(FD(c), &wset);
+    if (mg_want_write(c)) FD_SET(FD(c), &wset);
   }
 
   if ((rc = select(maxfd + 1, &rset, &wset, NULL, &tv)) < 0) {
@@ -3051,8 +5226,114 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
                          ? 1
                          : FD(c) != INVALID_SOCKET && FD_ISSET(FD(c), &rset);
     c->is_writable = FD(c) != INVALID_SOCKET && FD_ISSET(FD(c), &wset);
+    if (c->is_readable || c->is_writable) mg_ready(c);
+  }
+#endif
+}
+
+// True if connection has outstanding data to send
+static bool mg_sending(struct mg_connection *c) {
+#if MG_ENABLE_IO_URING
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  if (u != NULL && u->tx.len > 0 && u->err == 0) return true;
+#endif
+  return c->send.len > 0 || c->segs != NULL;
+}
+
+// Number of bytes queued for sending
+static size_t mg_queued(struct mg_connection *c) {
+  struct mg_seg *s;
+  size_t n = c->send.len;
+#if MG_ENABLE_IO_URING
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  if (u != NULL) n += u->tx.len;
+#endif
+  for (s = c->segs; s != NULL; s = s->next) n += s->len;
+  return n;
+}
+
+// Apply watermarks once the connection is processed: pause or resume
+// reading, and tell the application when the send queue is full or drained
+static void mg_watermarks(struct mg_connection *c) {
+  if (c->recv_high > 0 && c->recv.len >= c->recv_high) {
+    c->is_recv_full = 1;
+  } else if (c->recv.len <= c->recv_low) {
+    c->is_recv_full = 0;
+  }
+  if (c->send_high > 0 || c->is_send_full) {
+    size_t n = mg_queued(c);
+    if (!c->is_send_full && c->send_high > 0 && n >= c->send_high) {
+      c->is_send_full = 1;
+      mg_call(c, MG_EV_FULL, &n);
+    } else if (c->is_send_full && n <= c->send_low) {
+      c->is_send_full = 0;
+      mg_call(c, MG_EV_DRAIN, &n);
+    }
+  }
+}
+
+static bool mg_handshaking(struct mg_connection *c) {
+  return c->is_connecting || c->is_tls_hs;
+}
+
+static bool mg_timed_out(unsigned long since, int ms, unsigned long now) {
+  return ms > 0 && (long) (now - since - (unsigned long) ms) >= 0;
+}
+
+// Time at which the connection times out in its current state, 0: never.
+// Timestamps are kept up to date by poll_conn(), the timer is armed lazily:
+// when it fires, it checks the deadline again
+static unsigned long mg_deadline(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  unsigned long d = 0, hs = 0;
+  if (mg_udp_virtual(c)) {
+    struct mg_udp_peer *p = (struct mg_udp_peer *) c->udp;
+    struct mg_udp_table *t =
+        p->lsn == NULL ? NULL : (struct mg_udp_table *) p->lsn->udp;
+    if (t != NULL && t->idle_ms > 0) d = p->last + t->idle_ms;
+    return d;
   }
+#if MG_ENABLE_WAKEUP
+  if (c == mgr->wakeup) return 0;
 #endif
+  if (c->is_listening || c->is_resolving || FD(c) == INVALID_SOCKET) return 0;
+  if (mgr->idletimeout > 0) d = c->lastio + (unsigned long) mgr->idletimeout;
+  if (mgr->hstimeout > 0 && mg_handshaking(c)) {
+    hs = c->since + (unsigned long) mgr->hstimeout;
+  } else if (mgr->reqtimeout > 0 && c->is_accepted && c->recv.len > 0) {
+    hs = c->since + (unsigned long) mgr->reqtimeout;
+  }
+  return d == 0 || (hs != 0 && (long) (hs - d) < 0) ? hs : d;
+}
+
+static void mg_timeout(void *arg) {
+  struct mg_connection *c = (struct mg_connection *) arg;
+  struct mg_mgr *mgr = c->mgr;
+  unsigned long now = mgr->timers.now, d = mg_deadline(c);
+  if (d == 0 || c->is_closing) {
+    // Timeout does not apply now, poll_conn() arms it again when it does
+  } else if ((long) (d - now) > 0) {
+    mg_timers_add(&mgr->timers, &c->timer, d);  // There was IO since
+  } else if (mg_handshaking(c) && mg_timed_out(c->since, mgr->hstimeout, now)) {
+    mg_error(c, "handshake timeout");
+  } else if (!mg_handshaking(c) && c->is_accepted && c->recv.len > 0 &&
+             mg_timed_out(c->since, mgr->reqtimeout, now)) {
+    mg_error(c, "request timeout");
+  } else {
+    LOG(LL_DEBUG, ("%lu idle", c->id));
+    c->is_closing = 1;
+    mg_ready(c);
+  }
+}
+
+// Arm the timeout, unless it is armed to fire not later than needed
+static void mg_arm_timeout(struct mg_connection *c) {
+  unsigned long d = mg_deadline(c);
+  if (d != 0 && (c->timer.pprev == NULL || (long) (d - c->timer.expire) < 0)) {
+    c->timer.fn = mg_timeout;
+    c->timer.arg = c;
+    mg_timers_add(&c->mgr->timers, &c->timer, d);
+  }
 }
 
 static void connect_conn(struct mg_connection *c) {
@@ -3070,37 +5351,245 @@ static void connect_conn(struct mg_connection *c) {
   }
 }
 
+// Update IO backend interest after the connection has been processed
+static void mg_io_sync(struct mg_connection *c) {
+  if (c->is_resolving || FD(c) == INVALID_SOCKET) return;
+#if MG_ENABLE_IO_URING
+  if (c->mgr->uring != NULL) {
+    mg_uring_arm(c);
+    if (mg_uring_results(c)) mg_ready(c);
+    return;
+  }
+#endif
+#if MG_ENABLE_EPOLL
+  mg_epoll_sync(c);
+#endif
+}
+
+#if MG_ENABLE_SPLICE
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+#endif
+
+static long mg_splice(int from, int to, size_t len) {
+  return (long) syscall(__NR_splice, from, NULL, to, NULL, len,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+static bool mg_relay_pipe(int *fds) {
+  if (pipe(fds) != 0) {
+    fds[0] = fds[1] = -1;
+    return false;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return true;
+}
+
+// Move incoming data of c[i] into its pipe. Stop reading when the pipe is
+// full, or when the peer does not take data fast enough
+static void mg_relay_in(struct mg_relay *r, int i) {
+  struct mg_connection *c = r->c[i];
+  long n = mg_splice(FD(c), r->pipe[i][1], MG_RELAY_SIZE - r->inpipe[i]);
+  bool again = n < 0 && !mg_sock_failed();
+  LOG(LL_VERBOSE_DEBUG, ("%lu splice in: %ld %d", c->id, n, MG_SOCK_ERRNO));
+  if (n > 0) r->inpipe[i] += (size_t) n;
+  if (n == 0) r->eof[i] = true;
+  if (n < 0 && !again) {
+    LOG(LL_DEBUG, ("%lu splice: %d", c->id, MG_SOCK_ERRNO));
+    c->is_closing = 1;
+  }
+  c->is_paused = r->eof[i] || r->inpipe[i] >= MG_RELAY_SIZE ||
+                 (again && r->inpipe[i] > 0);
+}
+
+// Move data from pipe i to c[1 - i], which must send its own data first.
+// Once c[i] is done and the pipe is empty, shut down the write side of
+// c[1 - i]: the other direction still works
+static void mg_relay_out(struct mg_relay *r, int i) {
+  struct mg_connection *src = r->c[i], *dst = r->c[1 - i];
+  if (dst->is_connecting || dst->is_closing || mg_sending(dst)) return;
+  if (r->inpipe[i] > 0) {
+    long n = mg_splice(r->pipe[i][0], FD(dst), r->inpipe[i]);
+    LOG(LL_VERBOSE_DEBUG, ("%lu splice out: %ld %d", dst->id, n,
+                           MG_SOCK_ERRNO));
+    if (n > 0) {
+      r->inpipe[i] -= (size_t) n;
+      if (!r->eof[i]) src->is_paused = 0;
+    } else if (n == 0 || mg_sock_failed()) {
+      LOG(LL_DEBUG, ("%lu splice: %d", dst->id, MG_SOCK_ERRNO));
+      dst->is_closing = 1;
+      mg_ready(dst);
+    }
+  }
+  if (r->eof[i] && r->inpipe[i] == 0 && !r->shut[i]) {
+    shutdown(FD(dst), SHUT_WR);
+    r->shut[i] = true;
+    if (r->shut[1 - i]) {
+      src->is_draining = dst->is_draining = 1;
+      mg_ready(src);
+      mg_ready(dst);
+    }
+  }
+}
+#endif
+
+// Relay connection is ready: move data both ways. Spliced data bypasses
+// IO buffers. Buffered data is read as usual, so that MG_EV_READ is still
+// delivered, then moved to the peer's send buffer
+static void mg_relay_poll(struct mg_connection *c) {
+  struct mg_relay *r = (struct mg_relay *) c->relay;
+  int i = r->c[0] == c ? 0 : 1;
+  struct mg_connection *peer = r->c[1 - i];
+#if MG_ENABLE_SPLICE
+  if (r->splice) {
+    if (c->is_writable && mg_sending(c)) write_conn(c);
+    if (c->is_readable && mg_want_read(c) && !r->eof[i]) mg_relay_in(r, i);
+    mg_relay_out(r, i);
+    mg_relay_out(r, 1 - i);
+    if (!peer->is_closing) mg_io_sync(peer);
+    return;
+  }
+#endif
+  if (c->is_readable && mg_want_read(c)) read_conn(c, ll_read);
+  if (c->recv.len > 0 && !peer->is_closing) {
+    mg_send(peer, c->recv.buf, c->recv.len);
+    mg_iobuf_delete(&c->recv, c->recv.len);
+    mg_io_drained(c->mgr, &c->recv);
+    if (peer->send.len >= MG_RELAY_SIZE) c->is_paused = 1;
+  }
+  if (c->is_writable) write_conn(c);
+  if (peer->is_paused && c->send.len < MG_RELAY_SIZE / 2) {
+    // Peer has been waiting for us. With TLS, it may have data buffered
+    peer->is_paused = 0;
+    if (peer->is_tls) peer->is_readable = 1;
+    mg_ready(peer);
+  }
+}
+
+// Bind two connections: data received by one is sent by the other, until
+// one of them closes
+bool mg_relay(struct mg_connection *a, struct mg_connection *b) {
+  struct mg_relay *r;
+  int i;
+  if (a == b || a->mgr != b->mgr || a->relay != NULL || b->relay != NULL ||
+      a->is_listening || b->is_listening) {
+    return false;
+  }
+  if ((r = (struct mg_relay *) mg_alloc(sizeof(*r))) == NULL) return false;
+  memset(r, 0, sizeof(*r));
+  r->c[0] = a, r->c[1] = b;
+  r->pipe[0][0] = r->pipe[0][1] = r->pipe[1][0] = r->pipe[1][1] = -1;
+#if MG_ENABLE_SPLICE
+  r->splice = !a->is_tls && !b->is_tls && !a->is_udp && !b->is_udp;
+#if MG_ENABLE_IO_URING
+  if (a->mgr->uring != NULL) r->splice = false;  // io_uring does its own IO
+#endif
+  if (r->splice) {
+    r->splice = mg_relay_pipe(r->pipe[0]) && mg_relay_pipe(r->pipe[1]);
+  }
+#endif
+  LOG(LL_DEBUG, ("%lu <-> %lu relay%s", a->id, b->id,
+                 r->splice ? ", splice" : ""));
+  for (i = 0; i < 2; i++) {
+    struct mg_connection *c = r->c[i];
+    c->relay = r;
+    c->pfn = NULL;  // Protocol handlers must not consume relayed data
+    if (c->recv.len > 0) {  // Already received data goes first
+      mg_send(r->c[1 - i], c->recv.buf, c->recv.len);
+      mg_iobuf_delete(&c->recv, c->recv.len);
+    }
+    mg_ready(c);
+  }
+  return true;
+}
+
+static void poll_conn(struct mg_connection *c) {
+  size_t had = c->recv.len;
+  LOG(LL_VERBOSE_DEBUG,
+      ("%lu %c%c %c%c%c%c%c", c->id, c->is_readable ? 'r' : '-',
+       c->is_writable ? 'w' : '-', c->is_tls ? 'T' : 't',
+       c->is_connecting ? 'C' : 'c', c->is_tls_hs ? 'H' : 'h',
+       c->is_resolving ? 'R' : 'r', c->is_closing ? 'C' : 'c'));
+  if (c->is_resolving || c->is_closing) {
+    // Do nothing
+#if MG_ENABLE_WAKEUP
+  } else if (c == c->mgr->wakeup) {
+    if (c->is_readable) mg_wakeup_read(c);
+#endif
+  } else if (c->is_listening && c->is_udp == 0) {
+    if (c->is_readable) accept_conns(c);
+  } else if (c->is_connecting) {
+    if (c->is_readable || c->is_writable) connect_conn(c);
+  } else if (c->is_tls_hs) {
+    if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
+  } else if (c->relay != NULL) {
+    mg_relay_poll(c);
+#if MG_ENABLE_MMSG
+  } else if (c->is_udp) {
+    if (c->is_readable && mg_want_read(c)) mg_udp_read(c);
+    if (c->send.len > 0 && !c->is_closing) mg_udp_flush(c);
+#else
+  } else if (c->udp != NULL) {
+    if (c->is_readable && mg_want_read(c)) mg_udp_read(c);
+#endif
+  } else {
+    if (c->is_readable && mg_want_read(c)) read_conn(c, ll_read);
+    if (c->is_writable) write_conn(c);
+  }
+
+  if (c->is_readable || c->is_writable) c->lastio = c->mgr->timers.now;
+  if (!mg_handshaking(c) && (had == 0 || c->recv.len == 0)) {
+    c->since = c->mgr->timers.now;  // Partial request, if any, starts now
+  }
+  if (!c->is_closing) mg_watermarks(c);
+  if (c->is_draining && !mg_sending(c)) c->is_closing = 1;
+  if (c->is_closing) {
+    close_conn(c);
+  } else {
+    // Readiness is consumed. TLS might have stuff buffered, so dig everything
+    c->is_writable = 0;
+    if (c->is_tls && c->is_readable && mg_want_read(c)) {
+      mg_ready(c);
+    } else {
+      c->is_readable = 0;
+    }
+    mg_io_sync(c);
+    mg_arm_timeout(c);
+  }
+}
+
+// Every mgr->pollinterval milliseconds, all connections get MG_EV_POLL and
+// are checked for closing. In between, only connections queued by the IO
+// backend, or by mg_send(), mg_error() and friends, are processed
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
   unsigned long now;
 
-  mg_iotest(mgr, ms);
+  // Do not sleep past the next timer or connection timeout
+  mg_iotest(mgr, mg_timers_wait(&mgr->timers, mg_millis(), ms));
   now = mg_millis();
-  mg_timer_poll(now);
-
-  for (c = mgr->conns; c != NULL; c = tmp) {
-    tmp = c->next;
-    mg_call(c, MG_EV_POLL, &now);
-    LOG(LL_VERBOSE_DEBUG,
-        ("%lu %c%c %c%c%c%c%c", c->id, c->is_readable ? 'r' : '-',
-         c->is_writable ? 'w' : '-', c->is_tls ? 'T' : 't',
-         c->is_connecting ? 'C' : 'c', c->is_tls_hs ? 'H' : 'h',
-         c->is_resolving ? 'R' : 'r', c->is_closing ? 'C' : 'c'));
-    if (c->is_resolving || c->is_closing) {
-      // Do nothing
-    } else if (c->is_listening && c->is_udp == 0) {
-      if (c->is_readable) accept_conn(mgr, c);
-    } else if (c->is_connecting) {
-      if (c->is_readable || c->is_writable) connect_conn(c);
-    } else if (c->is_tls_hs) {
-      if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
-    } else {
-      if (c->is_readable) read_conn(c, ll_read);
-      if (c->is_writable) write_conn(c);
+  mg_timer_poll(&mgr->timers, now);
+
+  if (mgr->pollinterval <= 0 ||
+      now - mgr->lastpoll >= (unsigned long) mgr->pollinterval) {
+    mgr->lastpoll = now;
+    while ((c = mgr->ready) != NULL) mgr->ready = c->rnext, c->is_ready = 0;
+    for (c = mgr->conns; c != NULL; c = tmp) {
+      tmp = c->next;
+      mg_call(c, MG_EV_POLL, &now);
+      poll_conn(c);
+    }
+  } else {
+    // Detach the queue: connections processed now may queue themselves again
+    struct mg_connection *list = mgr->ready;
+    mgr->ready = NULL;
+    if (list != NULL) list->rprev = &list;
+    while ((c = list) != NULL) {
+      mg_unready(c);
+      poll_conn(c);
     }
-
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
-    if (c->is_closing) close_conn(c);
   }
 }
 #endif
@@ -3118,7 +5607,7 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
 
 #if MG_ENABLE_SSI
 static char *mg_ssi(const char *path, const char *root, int depth) {
-  struct mg_iobuf b = {NULL, 0, 0};
+  struct mg_iobuf b = {NULL, 0, 0, 0};
   FILE *fp = mg_fopen(path, "rb");
   if (fp != NULL) {
     char buf[BUFSIZ], arg[sizeof(buf)];
@@ -3134,7 +5623,7 @@ static char *mg_ssi(const char *path, const char *root, int depth) {
           if (depth < MG_MAX_SSI_DEPTH &&
               (data = mg_ssi(tmp, root, depth + 1)) != NULL) {
             mg_iobuf_append(&b, data, strlen(data), align);
-            free(data);
+            mg_dealloc(data);
           } else {
             LOG(LL_ERROR, ("%s: file=%s error or too deep", path, arg));
           }
@@ -3144,7 +5633,7 @@ static char *mg_ssi(const char *path, const char *root, int depth) {
           if (depth < MG_MAX_SSI_DEPTH &&
               (data = mg_ssi(tmp, root, depth + 1)) != NULL) {
             mg_iobuf_append(&b, data, strlen(data), align);
-            free(data);
+            mg_dealloc(data);
           } else {
             LOG(LL_ERROR, ("%s: virtual=%s error or too deep", path, arg));
           }
@@ -3189,7 +5678,7 @@ void mg_http_serve_ssi(struct mg_connection *c, const char *root,
                        const char *fullpath) {
   char *data = mg_ssi(fullpath, root, 0);
   mg_http_reply(c, 200, "", "%s", data == NULL ? "" : data);
-  free(data);
+  mg_dealloc(data);
 }
 #endif
 
@@ -3294,42 +5783,127 @@ struct mg_str mg_strstrip(struct mg_str s) {
 
 
 
-struct mg_timer *g_timers;
+#define MG_TIMER_MASK (MG_TIMER_SLOTS - 1)
+
+static void mg_timer_link(struct mg_timer **head, struct mg_timer *t) {
+  t->next = *head;
+  if (t->next != NULL) t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+}
+
+// Move all timers from one list to another
+static void mg_timer_splice(struct mg_timer **from, struct mg_timer **to) {
+  struct mg_timer *t;
+  while ((t = *from) != NULL) {
+    mg_timer_free(t);
+    mg_timer_link(to, t);
+  }
+}
 
-void mg_timer_init(struct mg_timer *t, int ms, int flags, void (*fn)(void *),
-                   void *arg) {
-  struct mg_timer tmp = {ms, flags, fn, arg, 0UL, g_timers};
+void mg_timer_init(struct mg_timers *w, struct mg_timer *t, int ms, int flags,
+                   void (*fn)(void *), void *arg) {
+  struct mg_timer tmp = {ms, flags, fn, arg, 0UL, NULL, NULL};
   *t = tmp;
-  g_timers = t;
+  mg_timer_link(&w->due, t);  // Expiration time is set by next poll
   if (flags & MG_TIMER_RUN_NOW) fn(arg);
 }
 
 void mg_timer_free(struct mg_timer *t) {
-  struct mg_timer **head = &g_timers;
-  while (*head && *head != t) head = &(*head)->next;
-  if (*head) *head = t->next;
+  if (t->pprev == NULL) return;
+  *t->pprev = t->next;
+  if (t->next != NULL) t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+// Arm timer to expire at a given time. A level is picked so that the slot is
+// visited not before the timer's time range begins, and at most once before
+// the timer expires, when it moves on to a finer level
+void mg_timers_add(struct mg_timers *w, struct mg_timer *t,
+                   unsigned long expire) {
+  struct mg_timer **head = &w->due;
+  mg_timer_free(t);
+  t->expire = expire;
+  if (expire > w->now) {
+    unsigned long delta = expire - w->now;
+    int shift = 0;
+    while (shift < (MG_TIMER_LEVELS - 1) * MG_TIMER_BITS &&
+           delta >> (shift + MG_TIMER_BITS) != 0) {
+      shift += MG_TIMER_BITS;
+    }
+    head = &w->slots[shift / MG_TIMER_BITS][(expire >> shift) & MG_TIMER_MASK];
+  }
+  mg_timer_link(head, t);
+}
+
+// Milliseconds from now_ms until the earliest timer expires, but not more
+// than ms. Timers in a slot expire before those in later slots of the same
+// level, so only the first non-empty slot of every level is looked at
+int mg_timers_wait(struct mg_timers *w, unsigned long now_ms, int ms) {
+  struct mg_timer *t;
+  int i, level;
+  if (w->due != NULL) return 0;
+  for (level = 0; level < MG_TIMER_LEVELS && ms > 0; level++) {
+    unsigned long cur = w->now >> (level * MG_TIMER_BITS);
+    for (i = 1; i <= MG_TIMER_SLOTS; i++) {
+      if ((t = w->slots[level][(cur + (unsigned long) i) & MG_TIMER_MASK])) {
+        break;
+      }
+    }
+    for (; t != NULL && ms > 0; t = t->next) {
+      if (t->expire <= now_ms) return 0;
+      if (t->expire - now_ms < (unsigned long) ms) {
+        ms = (int) (t->expire - now_ms);
+      }
+    }
+  }
+  return ms;
 }
 
-void mg_timer_poll(unsigned long now_ms) {
-  // If time goes back (wrapped around), reset timers
-  struct mg_timer *t, *tmp;
-  static unsigned long oldnow;  // Timestamp in a previous invocation
-  if (oldnow > now_ms) {        // If it is wrapped, reset timers
-    for (t = g_timers; t != NULL; t = t->next) t->expire = 0;
+// Collect timers from slots whose time range has begun since the last poll,
+// run expired ones and re-arm the rest on finer levels
+void mg_timer_poll(struct mg_timers *w, unsigned long now_ms) {
+  struct mg_timer *list = NULL, *t;
+  int i, level;
+  if (now_ms < w->now) {
+    // Time went back (wrapped around): restart all timers from now
+    for (level = 0; level < MG_TIMER_LEVELS; level++) {
+      for (i = 0; i < MG_TIMER_SLOTS; i++) {
+        mg_timer_splice(&w->slots[level][i], &list);
+      }
+    }
+    for (t = list; t != NULL; t = t->next) t->expire = 0;
+  }
+  for (level = 0; level < MG_TIMER_LEVELS && now_ms > w->now; level++) {
+    unsigned long from = w->now >> (level * MG_TIMER_BITS);
+    unsigned long to = now_ms >> (level * MG_TIMER_BITS), n;
+    if (from == to) break;  // Coarser levels have not moved either
+    if (to - from > MG_TIMER_SLOTS) from = to - MG_TIMER_SLOTS;
+    for (n = from + 1; n <= to; n++) {
+      mg_timer_splice(&w->slots[level][n & MG_TIMER_MASK], &list);
+    }
   }
-  oldnow = now_ms;
+  mg_timer_splice(&w->due, &list);
+  w->now = now_ms;
 
-  for (t = g_timers; t != NULL; t = tmp) {
-    tmp = t->next;
-    if (t->expire == 0) t->expire = now_ms + t->period_ms;
-    if (t->expire > now_ms) continue;
-    t->fn(t->arg);
+  while ((t = list) != NULL) {
+    mg_timer_free(t);
+    if (t->expire == 0) t->expire = now_ms + (unsigned long) t->period_ms;
+    if (t->expire > now_ms) {
+      mg_timers_add(w, t, t->expire);
+      continue;
+    }
     // Try to tick timers with the given period as accurate as possible,
     // even if this polling function is called with some random period.
-    t->expire = now_ms - t->expire > (unsigned long) t->period_ms
-                    ? now_ms + t->period_ms
-                    : t->expire + t->period_ms;
-    if (!(t->flags & MG_TIMER_REPEAT)) mg_timer_free(t);
+    // Re-arm before the call, which may free or re-arm the timer itself
+    if (t->flags & MG_TIMER_REPEAT) {
+      mg_timers_add(w, t,
+                    now_ms - t->expire > (unsigned long) t->period_ms
+                        ? now_ms + (unsigned long) t->period_ms
+                        : t->expire + (unsigned long) t->period_ms);
+    }
+    t->fn(t->arg);
   }
 }
 
@@ -3700,6 +6274,184 @@ int mg_tls_send(struct mg_connection *c, const void *buf, size_t len,
 
 #endif
 
+#ifdef MG_ENABLE_LINES
+#line 1 "src/uring.c"
+#endif
+
+
+
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static void mg_uring_unmap(struct mg_uring *r) {
+  if (r->sqes != NULL) munmap(r->sqes, r->sqes_len);
+  if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+  if (r->sq_ptr != NULL) munmap(r->sq_ptr, r->sq_len);
+  if (r->fd >= 0) close(r->fd);
+  free(r->bufs);
+  free(r->lost);
+  free(r);
+}
+
+struct mg_uring *mg_uring_new(unsigned entries, unsigned nbufs,
+                              unsigned bufsize) {
+  struct io_uring_params p;
+  struct mg_uring *r = (struct mg_uring *) calloc(1, sizeof(*r));
+  if (r == NULL) return NULL;
+  memset(&p, 0, sizeof(p));
+  r->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    LOG(LL_INFO, ("io_uring unavailable, fd %d, errno %d", r->fd, errno));
+    mg_uring_unmap(r);
+    return NULL;
+  }
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+    r->cq_len = r->sq_len;
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq_ptr = mmap(0, r->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) r->sq_ptr = NULL;
+  r->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP)
+                  ? r->sq_ptr
+                  : mmap(0, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  if (r->cq_ptr == MAP_FAILED) r->cq_ptr = NULL;
+  r->sqes = (struct io_uring_sqe *) mmap(0, r->sqes_len, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, r->fd,
+                                         IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) r->sqes = NULL;
+  r->bufs = (unsigned char *) malloc((size_t) nbufs * bufsize);
+  r->lost = (unsigned *) malloc(nbufs * sizeof(*r->lost));
+  if (r->sq_ptr == NULL || r->cq_ptr == NULL || r->sqes == NULL ||
+      r->bufs == NULL || r->lost == NULL) {
+    LOG(LL_ERROR, ("io_uring setup failed, errno %d", errno));
+    mg_uring_unmap(r);
+    return NULL;
+  } else {
+    char *sq = (char *) r->sq_ptr, *cq = (char *) r->cq_ptr;
+    struct io_uring_sqe *sqe;
+    r->sq_head = (unsigned *) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->nbufs = nbufs;
+    r->bufsize = bufsize;
+    // Hand all receive buffers to the kernel, as buffer group 0
+    if ((sqe = mg_uring_sqe(r)) != NULL) {
+      sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd = (int) nbufs;
+      sqe->addr = (unsigned long) r->bufs;
+      sqe->len = bufsize;
+      sqe->off = 0;
+      sqe->buf_group = 0;
+    }
+  }
+  return r;
+}
+
+void mg_uring_free(struct mg_uring *r) {
+  if (r != NULL) mg_uring_unmap(r);
+}
+
+// Return next free submission entry, zeroed. If the submission queue is full,
+// flush it to the kernel first
+struct io_uring_sqe *mg_uring_sqe(struct mg_uring *r) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *r->sq_tail, idx;
+  struct io_uring_sqe *sqe;
+  if (tail - head >= r->sq_entries) {
+    if (mg_uring_enter(r, 0) < 0) return NULL;
+    head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= r->sq_entries) return NULL;
+  }
+  idx = tail & *r->sq_mask;
+  sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static unsigned mg_uring_queued(struct mg_uring *r) {
+  return *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// Submit all prepared entries with a single syscall. If wait_ms is not 0,
+// also wait up to wait_ms milliseconds for at least one completion
+int mg_uring_enter(struct mg_uring *r, int wait_ms) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = IORING_ENTER_EXT_ARG, min_complete = 0, n;
+  int rc;
+  // Retry buffers that did not fit into the SQ before. There is room for
+  // them, so this does not recurse into mg_uring_enter()
+  while (r->nlost > 0 && mg_uring_queued(r) < r->sq_entries) {
+    mg_uring_provide(r, r->lost[--r->nlost]);
+  }
+  n = mg_uring_queued(r);
+  memset(&arg, 0, sizeof(arg));
+  if (wait_ms > 0) {
+    ts.tv_sec = wait_ms / 1000;
+    ts.tv_nsec = (long long) (wait_ms % 1000) * 1000000;
+    arg.ts = (unsigned long) &ts;
+    flags |= IORING_ENTER_GETEVENTS;
+    min_complete = 1;
+  }
+  rc = (int) syscall(__NR_io_uring_enter, r->fd, n, min_complete, flags, &arg,
+                     sizeof(arg));
+  if (rc < 0 && (errno == ETIME || errno == EINTR)) {
+    rc = 0;
+  } else if (rc < 0) {
+    LOG(LL_ERROR, ("io_uring_enter: %d", errno));
+  }
+  return rc;
+}
+
+// Return next completion entry, or NULL if the completion queue is empty
+struct io_uring_cqe *mg_uring_cqe(struct mg_uring *r) {
+  unsigned head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void mg_uring_cqe_done(struct mg_uring *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned char *mg_uring_buf(struct mg_uring *r, unsigned bid) {
+  return r->bufs + (size_t) bid * r->bufsize;
+}
+
+// Give a consumed receive buffer back to the kernel. If the SQ is full even
+// after a flush, remember the buffer and retry on the next enter, otherwise
+// the pool would shrink until every receive fails with ENOBUFS
+void mg_uring_provide(struct mg_uring *r, unsigned bid) {
+  struct io_uring_sqe *sqe = mg_uring_sqe(r);
+  if (sqe == NULL) {
+    if (r->nlost < r->nbufs) r->lost[r->nlost++] = bid;
+  } else {
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (unsigned long) mg_uring_buf(r, bid);
+    sqe->len = r->bufsize;
+    sqe->off = bid;
+    sqe->buf_group = 0;
+  }
+}
+#endif
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/url.c"
 #endif
@@ -3798,6 +6550,39 @@ struct mg_str mg_url_pass(const char *url) {
 
 
 
+static struct mg_allocator s_allocator;
+
+void mg_set_allocator(const struct mg_allocator *allocator) {
+  if (allocator == NULL) {
+    memset(&s_allocator, 0, sizeof(s_allocator));
+  } else {
+    s_allocator = *allocator;
+  }
+}
+
+void *mg_alloc(size_t size) {
+  if (s_allocator.alloc != NULL) {
+    return s_allocator.alloc(size, s_allocator.userdata);
+  }
+  return malloc(size);
+}
+
+// Resize memory returned by mg_alloc(). Custom allocators cannot resize, so
+// then NULL is returned, like on failure, and ptr stays valid
+void *mg_realloc(void *ptr, size_t size) {
+  if (s_allocator.alloc != NULL) return NULL;
+  return realloc(ptr, size);
+}
+
+void mg_dealloc(void *ptr) {
+  if (ptr == NULL) return;
+  if (s_allocator.dealloc != NULL) {
+    s_allocator.dealloc(ptr, s_allocator.userdata);
+  } else {
+    free(ptr);
+  }
+}
+
 #if MG_ENABLE_FS
 int mg_stat(const char *path, mg_stat_t *st) {
 #ifdef _WIN32
@@ -4122,6 +6907,118 @@ unsigned long mg_millis(void) {
 #endif
 }
 
+#ifdef MG_ENABLE_LINES
+#line 1 "src/worker.c"
+#endif
+
+
+
+
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_WORKERS
+static void *mg_worker_thread(void *param) {
+  struct mg_workers *w = (struct mg_workers *) param;
+  for (;;) {
+    struct mg_work *wk;
+    pthread_mutex_lock(&w->lock);
+    while (w->queue == NULL && !w->stop) pthread_cond_wait(&w->cond, &w->lock);
+    if ((wk = w->stop ? NULL : w->queue) != NULL) {
+      if ((w->queue = wk->next) == NULL) w->tail = &w->queue;
+      w->queued--;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (wk == NULL) break;
+    wk->fn(wk->arg);
+    // Hand arg back to the event loop, it owns it from now on
+    if (!mg_wakeup_post(w->mgr, wk->id, MG_EV_WORK_DONE, &wk->arg,
+                        sizeof(wk->arg))) {
+      LOG(LL_ERROR, ("%lu lost work result", wk->id));
+      free(wk->arg);
+    }
+    free(wk);
+  }
+  return NULL;
+}
+
+// Start nthreads worker threads that run work submitted by mg_submit().
+// At most max_queued submitted items can wait for a free worker
+bool mg_workers_init(struct mg_mgr *mgr, int nthreads, int max_queued) {
+  struct mg_workers *w;
+  if (mgr->workers != NULL || nthreads <= 0 || !mg_mgr_wakeup_init(mgr)) {
+    return mgr->workers != NULL;
+  }
+  if ((w = (struct mg_workers *) calloc(1, sizeof(*w))) == NULL ||
+      (w->threads = (pthread_t *) calloc((size_t) nthreads,
+                                         sizeof(pthread_t))) == NULL) {
+    free(w);
+    return false;
+  }
+  w->mgr = mgr;
+  w->tail = &w->queue;
+  w->max_queued = max_queued;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  mgr->workers = w;
+  for (w->nthreads = 0; w->nthreads < nthreads; w->nthreads++) {
+    pthread_t *t = &w->threads[w->nthreads];
+    if (pthread_create(t, NULL, mg_worker_thread, w) != 0) {
+      LOG(LL_ERROR, ("pthread_create: %d", errno));
+      break;
+    }
+  }
+  if (w->nthreads == 0) mg_workers_free(mgr);
+  return mgr->workers != NULL;
+}
+
+// Queue fn(arg) for a worker thread. When it returns, connection with the
+// given ID gets MG_EV_WORK_DONE with arg. Return false if the queue is full
+bool mg_submit(struct mg_mgr *mgr, unsigned long id, void (*fn)(void *),
+               void *arg) {
+  struct mg_workers *w = mgr->workers;
+  struct mg_work *wk;
+  bool ok = false;
+  if (w == NULL) return false;
+  if ((wk = (struct mg_work *) calloc(1, sizeof(*wk))) == NULL) return false;
+  wk->id = id;
+  wk->fn = fn;
+  wk->arg = arg;
+  pthread_mutex_lock(&w->lock);
+  if (w->queued < w->max_queued) {
+    *w->tail = wk;
+    w->tail = &wk->next;
+    w->queued++;
+    ok = true;
+    pthread_cond_signal(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  if (!ok) free(wk);
+  return ok;
+}
+
+// Stop workers. Running work is finished, queued work is dropped
+void mg_workers_free(struct mg_mgr *mgr) {
+  struct mg_workers *w = mgr->workers;
+  struct mg_work *wk;
+  int i;
+  if (w == NULL) return;
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  for (i = 0; i < w->nthreads; i++) pthread_join(w->threads[i], NULL);
+  while ((wk = w->queue) != NULL) {
+    w->queue = wk->next;
+    free(wk->arg);
+    free(wk);
+  }
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  free(w->threads);
+  free(w);
+  mgr->workers = NULL;
+}
+#endif
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/ws.c"
 #endif
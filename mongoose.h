@@ -223,8 +223,43 @@ static inline int ff_vfprintf(FF_FILE *fp, const char *fmt, va_list ap) {
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
+#if MG_ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+#if MG_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#endif
+#if (MG_ENABLE_WAKEUP || MG_ENABLE_WORKERS || MG_ENABLE_REACTORS) && \
+    defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#if MG_ENABLE_REACTORS || MG_ENABLE_WORKERS
+#include <pthread.h>
+#endif
+#if MG_ENABLE_REACTORS && defined(__linux__)
+#include <linux/filter.h>
+#endif
 #define MG_DIRSEP '/'
 #define MG_ENABLE_POSIX 1
+#ifndef MG_ENABLE_REALLOC
+#define MG_ENABLE_REALLOC 1
+#endif
+#if !defined(MG_ENABLE_SENDFILE) && defined(__linux__)
+#define MG_ENABLE_SENDFILE 1
+#endif
+#if MG_ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#if !defined(MG_ENABLE_SPLICE) && defined(__linux__)
+#define MG_ENABLE_SPLICE 1
+#endif
+#if !defined(MG_ENABLE_MMSG) && defined(__linux__)
+#define MG_ENABLE_MMSG 1
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 #define MG_INT64_FMT "%" PRId64
 
 #endif
@@ -283,6 +318,9 @@ typedef int socklen_t;
 #endif
 
 #define MG_INT64_FMT "%I64d"
+#ifndef MG_ENABLE_REALLOC
+#define MG_ENABLE_REALLOC 1
+#endif
 
 #endif
 
@@ -341,11 +379,126 @@ typedef int socklen_t;
 #define MG_ENABLE_SOCKETPAIR 0
 #endif
 
+// Use Linux epoll() instead of select() in mg_mgr_poll()
+#ifndef MG_ENABLE_EPOLL
+#define MG_ENABLE_EPOLL 0
+#endif
+
+// Use Linux io_uring for socket IO, fall back to select()/epoll() at runtime
+#ifndef MG_ENABLE_IO_URING
+#define MG_ENABLE_IO_URING 0
+#endif
+
+// Size of the io_uring submission queue
+#ifndef MG_IO_URING_ENTRIES
+#define MG_IO_URING_ENTRIES 256
+#endif
+
+// Number and size of receive buffers shared by all io_uring connections
+#ifndef MG_IO_URING_BUFS
+#define MG_IO_URING_BUFS 128
+#endif
+
+#ifndef MG_IO_URING_BUF_SIZE
+#define MG_IO_URING_BUF_SIZE (4 * MG_IO_SIZE)
+#endif
+
+// Enable mg_workers_init(): worker thread pool, requires MG_ENABLE_WAKEUP
+#ifndef MG_ENABLE_WORKERS
+#define MG_ENABLE_WORKERS 0
+#endif
+
+// Enable mg_reactors_start(): event loops on several threads, SO_REUSEPORT.
+// Requires MG_ENABLE_WAKEUP
+#ifndef MG_ENABLE_REACTORS
+#define MG_ENABLE_REACTORS 0
+#endif
+
+// Enable mg_mgr_wakeup(): post messages to a manager from other threads
+#ifndef MG_ENABLE_WAKEUP
+#define MG_ENABLE_WAKEUP (MG_ENABLE_WORKERS || MG_ENABLE_REACTORS)
+#endif
+
+#if MG_ENABLE_WORKERS && !MG_ENABLE_WAKEUP
+#error "MG_ENABLE_WORKERS requires MG_ENABLE_WAKEUP"
+#endif
+
+#if MG_ENABLE_REACTORS && !MG_ENABLE_WAKEUP
+#error "MG_ENABLE_REACTORS requires MG_ENABLE_WAKEUP"
+#endif
+
+// Maximum number of events fetched by a single epoll_wait() call
+#ifndef MG_EPOLL_MAX_EVENTS
+#define MG_EPOLL_MAX_EVENTS 256
+#endif
+
+// Maximum number of connections accepted by a listener at once
+#ifndef MG_ACCEPT_BUDGET
+#define MG_ACCEPT_BUDGET 64
+#endif
+
 // Granularity of the send/recv IO buffer growth
 #ifndef MG_IO_SIZE
 #define MG_IO_SIZE 512
 #endif
 
+// Maximum IO buffer growth step. Buffers double in size until the step
+// reaches this limit. 0 disables geometric growth
+#ifndef MG_IO_GROW
+#define MG_IO_GROW (1024 * 1024)
+#endif
+
+// Streamed uploads collect this many bytes in the recv buffer before writing
+// them to disk, which also lets the buffer grow for larger reads
+#ifndef MG_UPLOAD_BLOCK
+#define MG_UPLOAD_BLOCK (64 * 1024)
+#endif
+
+// Drained IO buffers not larger than this stay allocated for reuse
+#ifndef MG_IO_KEEP
+#define MG_IO_KEEP (2 * MG_IO_SIZE)
+#endif
+
+// Grow IO buffers with realloc(). Set by arch headers where it is available
+#ifndef MG_ENABLE_REALLOC
+#define MG_ENABLE_REALLOC 0
+#endif
+
+// Send files with sendfile(), see mg_send_file(). Set by arch headers
+#ifndef MG_ENABLE_SENDFILE
+#define MG_ENABLE_SENDFILE 0
+#endif
+
+// Relay connections with splice(), see mg_relay(). Set by arch headers
+#ifndef MG_ENABLE_SPLICE
+#define MG_ENABLE_SPLICE 0
+#endif
+
+// Data in flight between relayed connections, per direction
+#ifndef MG_RELAY_SIZE
+#define MG_RELAY_SIZE 65536
+#endif
+
+// Batch UDP IO with recvmmsg() and sendmmsg(). Set by arch headers
+#ifndef MG_ENABLE_MMSG
+#define MG_ENABLE_MMSG 0
+#endif
+
+// Maximum number of datagrams read or sent by one batched UDP syscall
+#ifndef MG_UDP_BATCH
+#define MG_UDP_BATCH 32
+#endif
+
+// Maximum size of a datagram read by a batched UDP read
+#ifndef MG_UDP_MSG_SIZE
+#define MG_UDP_MSG_SIZE 2048
+#endif
+
+// Scan HTTP headers with SSE2/AVX2 or NEON instructions, where available
+#ifndef MG_ENABLE_SIMD
+#define MG_ENABLE_SIMD 1
+#endif
+
 // Maximum size of the recv IO buffer
 #ifndef MG_MAX_RECV_BUF_SIZE
 #define MG_MAX_RECV_BUF_SIZE (3 * 1024 * 1024)
@@ -414,19 +567,43 @@ struct mg_timer {
   void (*fn)(void *);       // Function to call
   void *arg;                // Function agrument
   unsigned long expire;     // Expiration timestamp in milliseconds
-  struct mg_timer *next;    // Linkage in g_timers list
+  struct mg_timer *next;    // Linkage in a struct mg_timers slot
+  struct mg_timer **pprev;  // Link that points to us, NULL if not armed
 };
 
-extern struct mg_timer *g_timers;  // Global list of timers
+// Hierarchical timing wheel. Level 0 has a slot per millisecond, every next
+// level is MG_TIMER_SLOTS times coarser. Arming and cancelling is O(1)
+#define MG_TIMER_BITS 6
+#define MG_TIMER_SLOTS (1 << MG_TIMER_BITS)
+#define MG_TIMER_LEVELS 4
 
-void mg_timer_init(struct mg_timer *, int ms, int, void (*fn)(void *), void *);
+struct mg_timers {
+  struct mg_timer *slots[MG_TIMER_LEVELS][MG_TIMER_SLOTS];  // Armed timers
+  struct mg_timer *due;  // Expired or new timers, run by the next poll
+  unsigned long now;     // Time of the last poll, in milliseconds
+};
+
+void mg_timer_init(struct mg_timers *, struct mg_timer *, int ms, int flags,
+                   void (*fn)(void *), void *arg);
 void mg_timer_free(struct mg_timer *);
-void mg_timer_poll(unsigned long uptime_ms);
+void mg_timer_poll(struct mg_timers *, unsigned long uptime_ms);
+void mg_timers_add(struct mg_timers *, struct mg_timer *, unsigned long expire);
+int mg_timers_wait(struct mg_timers *, unsigned long now_ms, int ms);
 
 
 
 
 
+struct mg_allocator {
+  void *(*alloc)(size_t size, void *userdata);  // Allocate size bytes
+  void (*dealloc)(void *ptr, void *userdata);   // Release allocated memory
+  void *userdata;                               // Passed to both functions
+};
+
+void mg_set_allocator(const struct mg_allocator *allocator);
+void *mg_alloc(size_t size);
+void mg_dealloc(void *ptr);
+void *mg_realloc(void *ptr, size_t size);
 char *mg_file_read(const char *path);
 int64_t mg_file_size(const char *path);
 bool mg_file_write(const char *path, const void *buf, size_t len);
@@ -520,15 +697,19 @@ const char *mg_url_uri(const char *url);
 #include <stddef.h>
 
 struct mg_iobuf {
-  unsigned char *buf;
-  size_t size, len;
+  unsigned char *buf;  // Pointer to stored data
+  size_t size;         // Space available at buf
+  size_t len;          // Data length
+  size_t off;          // Consumed space before buf, see mg_iobuf_delete()
 };
 
 int mg_iobuf_init(struct mg_iobuf *, size_t);
 int mg_iobuf_resize(struct mg_iobuf *, size_t);
+int mg_iobuf_reserve(struct mg_iobuf *, size_t, size_t, size_t);
 void mg_iobuf_free(struct mg_iobuf *);
 size_t mg_iobuf_append(struct mg_iobuf *, const void *, size_t, size_t);
 size_t mg_iobuf_delete(struct mg_iobuf *, size_t);
+size_t mg_iobuf_cut(struct mg_iobuf *, size_t, size_t);
 
 int mg_base64_update(unsigned char p, char *to, int len);
 int mg_base64_final(char *to, int len);
@@ -581,6 +762,8 @@ enum {
   MG_EV_WRITE,      // Data written to socket       int *num_bytes_written
   MG_EV_CLOSE,      // Connection closed            NULL
   MG_EV_HTTP_MSG,   // HTTP request/response        struct mg_http_message *
+  MG_EV_HTTP_CHUNK, // HTTP chunk (partial msg)     struct mg_http_message *
+  MG_EV_HTTP_HDRS,  // HTTP headers received        struct mg_http_message *
   MG_EV_WS_OPEN,    // Websocket handshake done     struct mg_http_message *
   MG_EV_WS_MSG,     // Websocket msg, text or bin   struct mg_ws_message *
   MG_EV_WS_CTL,     // Websocket control msg        struct mg_ws_message *
@@ -588,6 +771,10 @@ enum {
   MG_EV_MQTT_MSG,   // MQTT PUBLISH received        struct mg_mqtt_message *
   MG_EV_MQTT_OPEN,  // MQTT CONNACK received        int *connack_status_code
   MG_EV_SNTP_TIME,  // SNTP time received           struct timeval *
+  MG_EV_WAKEUP,     // mg_mgr_wakeup() data         struct mg_str *
+  MG_EV_WORK_DONE,  // mg_submit() work is done     void *arg
+  MG_EV_FULL,       // Queued data >= send_high     size_t *queued_bytes
+  MG_EV_DRAIN,      // Queued data <= send_low      size_t *queued_bytes
   MG_EV_USER,       // Starting ID for user events
 };
 
@@ -597,6 +784,8 @@ enum {
 
 
 
+
+
 struct mg_dns {
   const char *url;          // DNS server URL
   struct mg_connection *c;  // DNS server connection
@@ -609,60 +798,190 @@ struct mg_addr {
   bool is_ip6;      // True when address is IPv6 address
 };
 
+// Socket options for new connections, see mg_listen_opts(). Zero fields keep
+// Mongoose defaults
+struct mg_sock_opts {
+  int backlog;        // Listen backlog, 0: 128
+  int rcvbuf;         // SO_RCVBUF, bytes
+  int sndbuf;         // SO_SNDBUF, bytes
+  int busy_poll;      // SO_BUSY_POLL, microseconds
+  int notsent_lowat;  // TCP_NOTSENT_LOWAT, bytes
+  int defer_accept;   // TCP_DEFER_ACCEPT for listeners, seconds
+  int fastopen;       // TCP_FASTOPEN queue for listeners, or on for clients
+  int keepidle;       // TCP_KEEPIDLE, seconds, 0: 60, -1: no keepalive
+  int keepintvl;      // TCP_KEEPINTVL, seconds, 0: 20
+  int keepcnt;        // TCP_KEEPCNT, 0: 3
+  bool nagle;         // Keep Nagle's algorithm, do not set TCP_NODELAY
+};
+
 struct mg_mgr {
   struct mg_connection *conns;  // List of active connections
   struct mg_dns dns4;           // DNS for IPv4
   struct mg_dns dns6;           // DNS for IPv6
   int dnstimeout;               // DNS resolve timeout in milliseconds
+  int idletimeout;              // Close connections idle for ms, 0: never
+  int hstimeout;                // Connect and TLS handshake timeout, 0: none
+  int reqtimeout;               // Partial request timeout, ms, 0: none
+  struct mg_timers timers;      // Timers and connection timeouts
   unsigned long nextid;         // Next connection ID
+  struct mg_connection *ready;  // Connections to process on next poll
+  int pollinterval;             // MG_EV_POLL interval in ms, 0: every poll
+  unsigned long lastpoll;       // Time of the last MG_EV_POLL, in ms
+  void *active_dns_requests;    // DNS requests in progress
+  struct mg_connection *spare;  // Unused slab connections, see mg_mgr_prealloc
+  void *slab;                   // Preallocated connection objects
+  size_t slabsize;              // Number of objects in the slab
+  struct mg_connection **ids;   // Connections by ID, see mg_conn_by_id()
+  size_t idsize;                // Number of buckets in ids
+  size_t nconns;                // Number of connections in the list
+  size_t iogrow;                // Max IO buffer growth step, see MG_IO_GROW
+  size_t iokeep;                // Drained IO buffers up to this size are kept
 #if MG_ARCH == MG_ARCH_FREERTOS
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
+#if MG_ENABLE_EPOLL
+  int epoll_fd;  // epoll instance, see mg_iotest()
+#endif
+#if MG_ENABLE_IO_URING
+  struct mg_uring *uring;  // io_uring instance, NULL if not available
+#endif
+#if MG_ENABLE_MMSG
+  unsigned char *udpbuf;  // Space for batched UDP reads, see MG_UDP_BATCH
+#endif
+#if MG_ENABLE_WAKEUP
+  struct mg_connection *wakeup;  // Reads wakeup notifications
+  int wakeup_fd;                 // Write side of wakeup notifications
+  void *mailbox;                 // Messages posted by mg_mgr_wakeup()
+#endif
+#if MG_ENABLE_WORKERS
+  struct mg_workers *workers;  // Worker thread pool
+#endif
+#if MG_ENABLE_REACTORS
+  struct mg_reactors *reactors;  // Reactor group, NULL if not in a group
+  int reactor_id;                // Index in the reactor group
+#endif
 };
 
+struct mg_http_parser;
+
 struct mg_connection {
-  struct mg_connection *next;  // Linkage in struct mg_mgr :: connections
-  struct mg_mgr *mgr;          // Our container
-  struct mg_addr peer;         // Remote peer address
-  void *fd;                    // Connected socket, or LWIP data
-  unsigned long id;            // Auto-incrementing unique connection ID
-  struct mg_iobuf recv;        // Incoming data
-  struct mg_iobuf send;        // Outgoing data
-  mg_event_handler_t fn;       // User-specified event handler function
-  void *fn_data;               // User-speficied function parameter
-  mg_event_handler_t pfn;      // Protocol-specific handler function
-  void *pfn_data;              // Protocol-specific function parameter
-  char label[50];              // Arbitrary label
-  void *tls;                   // TLS specific data
-  unsigned is_listening : 1;   // Listening connection
-  unsigned is_client : 1;      // Outbound (client) connection
-  unsigned is_accepted : 1;    // Accepted (server) connection
-  unsigned is_resolving : 1;   // Non-blocking DNS resolv is in progress
-  unsigned is_connecting : 1;  // Non-blocking connect is in progress
-  unsigned is_tls : 1;         // TLS-enabled connection
-  unsigned is_tls_hs : 1;      // TLS handshake is in progress
-  unsigned is_udp : 1;         // UDP connection
-  unsigned is_websocket : 1;   // WebSocket connection
-  unsigned is_hexdumping : 1;  // Hexdump in/out traffic
-  unsigned is_draining : 1;    // Send remaining data, then close and free
-  unsigned is_closing : 1;     // Close and free the connection immediately
-  unsigned is_readable : 1;    // Connection is ready to read
-  unsigned is_writable : 1;    // Connection is ready to write
+  struct mg_connection *next;     // Linkage in struct mg_mgr :: connections
+  struct mg_connection *prev;     // Linkage in struct mg_mgr :: connections
+  struct mg_connection *rnext;    // Linkage in struct mg_mgr :: ready
+  struct mg_connection **rprev;   // Link that points to us in the ready queue
+  struct mg_connection *hnext;    // Linkage in struct mg_mgr :: ids
+  struct mg_mgr *mgr;             // Our container
+  struct mg_addr peer;            // Remote peer address
+  void *fd;                       // Connected socket, or LWIP data
+  unsigned long id;               // Auto-incrementing unique connection ID
+  struct mg_iobuf recv;           // Incoming data
+  struct mg_iobuf send;           // Outgoing data
+  mg_event_handler_t fn;          // User-specified event handler function
+  void *fn_data;                  // User-speficied function parameter
+  mg_event_handler_t pfn;         // Protocol-specific handler function
+  void *pfn_data;                 // Protocol-specific function parameter
+  char label[50];                 // Arbitrary label
+  void *tls;                      // TLS specific data
+  struct mg_seg *segs;            // Send queue segments, see mg_send_ref()
+  struct mg_seg **segs_tail;      // Last link of segs, valid if segs is set
+  void *relay;                    // Relay state, see mg_relay()
+  struct mg_sock_opts *sockopts;  // Own copy of socket options, or NULL
+  void *udp;                      // UDP peer table, see mg_udp_demux()
+  struct mg_http_parser *http;    // HTTP parser state, see mg_http_feed()
+  size_t recv_high;               // Stop reading at this recv.len, 0: never
+  size_t recv_low;                // Read again at this recv.len
+  size_t send_high;               // MG_EV_FULL at this many queued bytes
+  size_t send_low;                // MG_EV_DRAIN at this many queued bytes
+  struct mg_timer timer;          // Timeout, see mgr->idletimeout
+  unsigned long lastio;           // Time of last IO, in ms
+  unsigned long since;            // Start of handshake or partial request
+#if MG_ENABLE_IO_URING
+  void *uring;                    // io_uring specific data
+#endif
+#if MG_ENABLE_MMSG
+  size_t udp_dropped;             // Datagrams that sendmmsg() failed to send
+#endif
+  unsigned is_listening : 1;      // Listening connection
+  unsigned is_client : 1;         // Outbound (client) connection
+  unsigned is_accepted : 1;       // Accepted (server) connection
+  unsigned is_resolving : 1;      // Non-blocking DNS resolv is in progress
+  unsigned is_connecting : 1;     // Non-blocking connect is in progress
+  unsigned is_tls : 1;            // TLS-enabled connection
+  unsigned is_tls_hs : 1;         // TLS handshake is in progress
+  unsigned is_udp : 1;            // UDP connection
+  unsigned is_websocket : 1;      // WebSocket connection
+  unsigned is_hexdumping : 1;     // Hexdump in/out traffic
+  unsigned is_draining : 1;       // Send remaining data, then close and free
+  unsigned is_closing : 1;        // Close and free the connection immediately
+  unsigned is_readable : 1;       // Connection is ready to read
+  unsigned is_writable : 1;       // Connection is ready to write
+  unsigned is_paused : 1;         // Do not read from the socket
+  unsigned is_recv_full : 1;      // Recv buffer reached recv_high
+  unsigned is_send_full : 1;      // Send queue reached send_high
+  unsigned is_epollin : 1;        // EPOLLIN is registered for this socket
+  unsigned is_epollout : 1;       // EPOLLOUT is registered for this socket
+  unsigned is_ready : 1;          // Connection is in struct mg_mgr :: ready
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
 void mg_mgr_init(struct mg_mgr *);
 void mg_mgr_free(struct mg_mgr *);
+bool mg_mgr_prealloc(struct mg_mgr *, size_t n);
 
 struct mg_connection *mg_listen(struct mg_mgr *, const char *url,
                                 mg_event_handler_t fn, void *fn_data);
 struct mg_connection *mg_connect(struct mg_mgr *, const char *url,
                                  mg_event_handler_t fn, void *fn_data);
+struct mg_connection *mg_listen_opts(struct mg_mgr *, const char *url,
+                                     const struct mg_sock_opts *opts,
+                                     mg_event_handler_t fn, void *fn_data);
+struct mg_connection *mg_connect_opts(struct mg_mgr *, const char *url,
+                                      const struct mg_sock_opts *opts,
+                                      mg_event_handler_t fn, void *fn_data);
 int mg_send(struct mg_connection *, const void *, size_t);
 int mg_printf(struct mg_connection *, const char *fmt, ...);
 int mg_vprintf(struct mg_connection *, const char *fmt, va_list ap);
 char *mg_straddr(struct mg_connection *, char *, size_t);
+
+// Reference counted buffer that can be sent to many connections
+struct mg_shared {
+  int refcnt;  // Reference count
+  size_t len;  // Data length
+  char *buf;   // Data, allocated together with this structure
+};
+
+struct mg_shared *mg_shared_new(const void *buf, size_t len);
+void mg_shared_ref(struct mg_shared *);
+void mg_shared_release(struct mg_shared *);
+int mg_send_ref(struct mg_connection *, const void *buf, size_t len,
+                void (*release)(void *), void *arg);
+int mg_send_shared(struct mg_connection *, struct mg_shared *);
+int mg_send_file(struct mg_connection *, int fd, int64_t offset, size_t len,
+                 void (*release)(void *), void *arg);
+bool mg_relay(struct mg_connection *, struct mg_connection *);
+bool mg_udp_demux(struct mg_connection *, unsigned long idle_ms);
 bool mg_socketpair(int *s1, int *s2);
+struct mg_connection *mg_conn_by_id(struct mg_mgr *, unsigned long id);
+
+#if MG_ENABLE_WAKEUP
+bool mg_mgr_wakeup_init(struct mg_mgr *);
+bool mg_mgr_wakeup(struct mg_mgr *, unsigned long id, const void *buf,
+                   size_t len);
+#endif
+
+#if MG_ENABLE_WORKERS
+bool mg_workers_init(struct mg_mgr *, int nthreads, int max_queued);
+bool mg_submit(struct mg_mgr *, unsigned long id, void (*fn)(void *),
+               void *arg);
+#endif
+
+#if MG_ENABLE_REACTORS
+#define MG_REACTORS_PIN 1  // Pin reactor N to CPU N, steer connections by CPU
+struct mg_reactors *mg_reactors_start(int n, int flags,
+                                      void (*fn)(struct mg_mgr *, void *),
+                                      void *fn_data);
+void mg_reactors_stop(struct mg_reactors *);
+#endif
 bool mg_aton(struct mg_str str, struct mg_addr *addr);
 char *mg_ntoa(const struct mg_addr *addr, char *buf, size_t len);
 
@@ -683,10 +1002,24 @@ struct mg_http_message {
   struct mg_str method, uri, query, proto;             // Request/response line
   struct mg_http_header headers[MG_MAX_HTTP_HEADERS];  // Headers
   struct mg_str body;                                  // Body
+  struct mg_str chunk;                                 // Chunk, see below
   struct mg_str head;                                  // Request + headers
   struct mg_str message;  // Request + headers + body
 };
 
+// Incremental HTTP parser state, see mg_http_feed()
+struct mg_http_parser {
+  size_t scanned;     // Bytes checked for the end of headers so far
+  size_t head;        // Request line and headers length, 0: not seen yet
+  size_t body;        // Body length, (size_t) ~0: until connection close
+  size_t decoded;     // Body bytes received, decoded from chunks if chunked
+  size_t deleted;     // Body bytes deleted from the buffer when streaming
+  size_t owed;        // Streamed chunk bytes not received yet, with CRLF
+  bool is_chunked;    // Body uses chunked transfer coding
+  bool is_streaming;  // Deliver body as it arrives, see MG_EV_HTTP_HDRS
+  void *upload;       // Upload sink, see mg_http_upload()
+};
+
 // Parameter for mg_http_serve_dir()
 struct mg_http_serve_opts {
   const char *root_dir;     // Web root directory, must be non-NULL
@@ -695,12 +1028,23 @@ struct mg_http_serve_opts {
 
 int mg_http_parse(const char *s, size_t len, struct mg_http_message *);
 int mg_http_get_request_len(const unsigned char *buf, size_t buf_len);
+int mg_http_feed(struct mg_http_parser *, const char *s, size_t len,
+                 struct mg_http_message *);
 void mg_http_printf_chunk(struct mg_connection *cnn, const char *fmt, ...);
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len);
+void mg_http_delete_chunk(struct mg_connection *, struct mg_http_message *);
 struct mg_connection *mg_http_listen(struct mg_mgr *, const char *url,
                                      mg_event_handler_t fn, void *fn_data);
 struct mg_connection *mg_http_connect(struct mg_mgr *, const char *url,
                                       mg_event_handler_t fn, void *fn_data);
+struct mg_connection *mg_http_listen_opts(struct mg_mgr *, const char *url,
+                                          const struct mg_sock_opts *opts,
+                                          mg_event_handler_t fn,
+                                          void *fn_data);
+struct mg_connection *mg_http_connect_opts(struct mg_mgr *, const char *url,
+                                           const struct mg_sock_opts *opts,
+                                           mg_event_handler_t fn,
+                                           void *fn_data);
 void mg_http_serve_dir(struct mg_connection *, struct mg_http_message *hm,
                        struct mg_http_serve_opts *);
 void mg_http_serve_file(struct mg_connection *, struct mg_http_message *,
@@ -16,8 +16,43 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
+#if MG_ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+#if MG_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#endif
+#if (MG_ENABLE_WAKEUP || MG_ENABLE_WORKERS || MG_ENABLE_REACTORS) && \
+    defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#if MG_ENABLE_REACTORS || MG_ENABLE_WORKERS
+#include <pthread.h>
+#endif
+#if MG_ENABLE_REACTORS && defined(__linux__)
+#include <linux/filter.h>
+#endif
 #define MG_DIRSEP '/'
 #define MG_ENABLE_POSIX 1
+#ifndef MG_ENABLE_REALLOC
+#define MG_ENABLE_REALLOC 1
+#endif
+#if !defined(MG_ENABLE_SENDFILE) && defined(__linux__)
+#define MG_ENABLE_SENDFILE 1
+#endif
+#if MG_ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#if !defined(MG_ENABLE_SPLICE) && defined(__linux__)
+#define MG_ENABLE_SPLICE 1
+#endif
+#if !defined(MG_ENABLE_MMSG) && defined(__linux__)
+#define MG_ENABLE_MMSG 1
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 #define MG_INT64_FMT "%" PRId64
 
 #endif
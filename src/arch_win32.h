@@ -53,5 +53,8 @@ typedef int socklen_t;
 #endif
 
 #define MG_INT64_FMT "%I64d"
+#ifndef MG_ENABLE_REALLOC
+#define MG_ENABLE_REALLOC 1
+#endif
 
 #endif
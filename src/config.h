@@ -54,11 +54,126 @@
 #define MG_ENABLE_SOCKETPAIR 0
 #endif
 
+// Use Linux epoll() instead of select() in mg_mgr_poll()
+#ifndef MG_ENABLE_EPOLL
+#define MG_ENABLE_EPOLL 0
+#endif
+
+// Use Linux io_uring for socket IO, fall back to select()/epoll() at runtime
+#ifndef MG_ENABLE_IO_URING
+#define MG_ENABLE_IO_URING 0
+#endif
+
+// Size of the io_uring submission queue
+#ifndef MG_IO_URING_ENTRIES
+#define MG_IO_URING_ENTRIES 256
+#endif
+
+// Number and size of receive buffers shared by all io_uring connections
+#ifndef MG_IO_URING_BUFS
+#define MG_IO_URING_BUFS 128
+#endif
+
+#ifndef MG_IO_URING_BUF_SIZE
+#define MG_IO_URING_BUF_SIZE (4 * MG_IO_SIZE)
+#endif
+
+// Enable mg_workers_init(): worker thread pool, requires MG_ENABLE_WAKEUP
+#ifndef MG_ENABLE_WORKERS
+#define MG_ENABLE_WORKERS 0
+#endif
+
+// Enable mg_reactors_start(): event loops on several threads, SO_REUSEPORT.
+// Requires MG_ENABLE_WAKEUP
+#ifndef MG_ENABLE_REACTORS
+#define MG_ENABLE_REACTORS 0
+#endif
+
+// Enable mg_mgr_wakeup(): post messages to a manager from other threads
+#ifndef MG_ENABLE_WAKEUP
+#define MG_ENABLE_WAKEUP (MG_ENABLE_WORKERS || MG_ENABLE_REACTORS)
+#endif
+
+#if MG_ENABLE_WORKERS && !MG_ENABLE_WAKEUP
+#error "MG_ENABLE_WORKERS requires MG_ENABLE_WAKEUP"
+#endif
+
+#if MG_ENABLE_REACTORS && !MG_ENABLE_WAKEUP
+#error "MG_ENABLE_REACTORS requires MG_ENABLE_WAKEUP"
+#endif
+
+// Maximum number of events fetched by a single epoll_wait() call
+#ifndef MG_EPOLL_MAX_EVENTS
+#define MG_EPOLL_MAX_EVENTS 256
+#endif
+
+// Maximum number of connections accepted by a listener at once
+#ifndef MG_ACCEPT_BUDGET
+#define MG_ACCEPT_BUDGET 64
+#endif
+
 // Granularity of the send/recv IO buffer growth
 #ifndef MG_IO_SIZE
 #define MG_IO_SIZE 512
 #endif
 
+// Maximum IO buffer growth step. Buffers double in size until the step
+// reaches this limit. 0 disables geometric growth
+#ifndef MG_IO_GROW
+#define MG_IO_GROW (1024 * 1024)
+#endif
+
+// Streamed uploads collect this many bytes in the recv buffer before writing
+// them to disk, which also lets the buffer grow for larger reads
+#ifndef MG_UPLOAD_BLOCK
+#define MG_UPLOAD_BLOCK (64 * 1024)
+#endif
+
+// Drained IO buffers not larger than this stay allocated for reuse
+#ifndef MG_IO_KEEP
+#define MG_IO_KEEP (2 * MG_IO_SIZE)
+#endif
+
+// Grow IO buffers with realloc(). Set by arch headers where it is available
+#ifndef MG_ENABLE_REALLOC
+#define MG_ENABLE_REALLOC 0
+#endif
+
+// Send files with sendfile(), see mg_send_file(). Set by arch headers
+#ifndef MG_ENABLE_SENDFILE
+#define MG_ENABLE_SENDFILE 0
+#endif
+
+// Relay connections with splice(), see mg_relay(). Set by arch headers
+#ifndef MG_ENABLE_SPLICE
+#define MG_ENABLE_SPLICE 0
+#endif
+
+// Data in flight between relayed connections, per direction
+#ifndef MG_RELAY_SIZE
+#define MG_RELAY_SIZE 65536
+#endif
+
+// Batch UDP IO with recvmmsg() and sendmmsg(). Set by arch headers
+#ifndef MG_ENABLE_MMSG
+#define MG_ENABLE_MMSG 0
+#endif
+
+// Maximum number of datagrams read or sent by one batched UDP syscall
+#ifndef MG_UDP_BATCH
+#define MG_UDP_BATCH 32
+#endif
+
+// Maximum size of a datagram read by a batched UDP read
+#ifndef MG_UDP_MSG_SIZE
+#define MG_UDP_MSG_SIZE 2048
+#endif
+
+// Scan HTTP headers with SSE2/AVX2 or NEON instructions, where available
+#ifndef MG_ENABLE_SIMD
+#define MG_ENABLE_SIMD 1
+#endif
+
 // Maximum size of the recv IO buffer
 #ifndef MG_MAX_RECV_BUF_SIZE
 #define MG_MAX_RECV_BUF_SIZE (3 * 1024 * 1024)
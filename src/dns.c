@@ -12,21 +12,21 @@ struct dns_data {
   uint16_t txnid;
 };
 
-static struct dns_data *s_reqs;  // Active DNS requests
-
 static void mg_sendnsreq(struct mg_connection *, struct mg_str *, int,
                          struct mg_dns *, bool);
 
-static void mg_dns_free(struct dns_data *d) {
-  LIST_DELETE(struct dns_data, &s_reqs, d);
+static void mg_dns_free(struct mg_mgr *mgr, struct dns_data *d) {
+  LIST_DELETE(struct dns_data, (struct dns_data **) &mgr->active_dns_requests,
+              d);
   free(d);
 }
 
 void mg_resolve_cancel(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
   struct dns_data *tmp, *d;
-  for (d = s_reqs; d != NULL; d = tmp) {
+  for (d = (struct dns_data *) mgr->active_dns_requests; d != NULL; d = tmp) {
     tmp = d->next;
-    if (d->c == c) mg_dns_free(d);
+    if (d->c == c) mg_dns_free(mgr, d);
   }
 }
 
@@ -132,10 +132,11 @@ bool mg_dns_parse(const uint8_t *buf, size_t len, struct mg_dns_message *dm) {
 
 static void dns_cb(struct mg_connection *c, int ev, void *ev_data,
                    void *fn_data) {
+  struct mg_mgr *mgr = c->mgr;
   struct dns_data *d, *tmp;
   if (ev == MG_EV_POLL) {
     unsigned long now = *(unsigned long *) ev_data;
-    for (d = s_reqs; d != NULL; d = tmp) {
+    for (d = (struct dns_data *) mgr->active_dns_requests; d != NULL; d = tmp) {
       tmp = d->next;
       // LOG(LL_DEBUG, ("%lu %lu dns poll", d->expire, now));
       if (now > d->expire) mg_error(d->c, "DNS timeout");
@@ -149,7 +150,8 @@ static void dns_cb(struct mg_connection *c, int ev, void *ev_data,
       free(s);
     } else {
       LOG(LL_VERBOSE_DEBUG, ("%s %d", dm.name, dm.resolved));
-      for (d = s_reqs; d != NULL; d = tmp) {
+      for (d = (struct dns_data *) mgr->active_dns_requests; d != NULL;
+           d = tmp) {
         tmp = d->next;
         // LOG(LL_INFO, ("d %p %hu %hu", d, d->txnid, dm.txnid));
         if (dm.txnid != d->txnid) continue;
@@ -175,16 +177,16 @@ static void dns_cb(struct mg_connection *c, int ev, void *ev_data,
         } else {
           LOG(LL_ERROR, ("%lu already resolved", d->c->id));
         }
-        mg_dns_free(d);
+        mg_dns_free(mgr, d);
         resolved = 1;
       }
     }
     if (!resolved) LOG(LL_ERROR, ("stray DNS reply"));
     c->recv.len = 0;
   } else if (ev == MG_EV_CLOSE) {
-    for (d = s_reqs; d != NULL; d = tmp) {
+    for (d = (struct dns_data *) mgr->active_dns_requests; d != NULL; d = tmp) {
       tmp = d->next;
-      mg_dns_free(d);
+      mg_dns_free(mgr, d);
     }
   }
   (void) fn_data;
@@ -226,6 +228,7 @@ void mg_dns_send(struct mg_connection *c, const struct mg_str *name,
 
 static void mg_sendnsreq(struct mg_connection *c, struct mg_str *name, int ms,
                          struct mg_dns *dnsc, bool ipv6) {
+  struct mg_mgr *mgr = c->mgr;
   struct dns_data *d = NULL;
   if (dnsc->url == NULL) {
     mg_error(c, "DNS server URL is NULL. Call mg_mgr_init()");
@@ -242,9 +245,10 @@ static void mg_sendnsreq(struct mg_connection *c, struct mg_str *name, int ms,
   } else if ((d = (struct dns_data *) calloc(1, sizeof(*d))) == NULL) {
     mg_error(c, "resolve OOM");
   } else {
-    d->txnid = s_reqs ? s_reqs->txnid + 1 : 1;
-    d->next = s_reqs;
-    s_reqs = d;
+    struct dns_data *reqs = (struct dns_data *) mgr->active_dns_requests;
+    d->txnid = reqs ? reqs->txnid + 1 : 1;
+    d->next = reqs;
+    mgr->active_dns_requests = d;
     d->expire = mg_millis() + ms;
     d->c = c;
     c->is_resolving = 1;
@@ -1,6 +1,7 @@
 #include "event.h"
 #include "log.h"
 #include "net.h"
+#include "private.h"
 #include "util.h"
 
 void mg_call(struct mg_connection *c, int ev, void *ev_data) {
@@ -18,4 +19,5 @@ void mg_error(struct mg_connection *c, const char *fmt, ...) {
   mg_call(c, MG_EV_ERROR, buf);
   if (buf != mem) free(buf);
   c->is_closing = 1;
+  mg_ready(c);
 }
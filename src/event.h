@@ -16,6 +16,8 @@ enum {
   MG_EV_WRITE,      // Data written to socket       int *num_bytes_written
   MG_EV_CLOSE,      // Connection closed            NULL
   MG_EV_HTTP_MSG,   // HTTP request/response        struct mg_http_message *
+  MG_EV_HTTP_CHUNK, // HTTP chunk (partial msg)     struct mg_http_message *
+  MG_EV_HTTP_HDRS,  // HTTP headers received        struct mg_http_message *
   MG_EV_WS_OPEN,    // Websocket handshake done     struct mg_http_message *
   MG_EV_WS_MSG,     // Websocket msg, text or bin   struct mg_ws_message *
   MG_EV_WS_CTL,     // Websocket control msg        struct mg_ws_message *
@@ -23,5 +25,9 @@ enum {
   MG_EV_MQTT_MSG,   // MQTT PUBLISH received        struct mg_mqtt_message *
   MG_EV_MQTT_OPEN,  // MQTT CONNACK received        int *connack_status_code
   MG_EV_SNTP_TIME,  // SNTP time received           struct timeval *
+  MG_EV_WAKEUP,     // mg_mgr_wakeup() data         struct mg_str *
+  MG_EV_WORK_DONE,  // mg_submit() work is done     void *arg
+  MG_EV_FULL,       // Queued data >= send_high     size_t *queued_bytes
+  MG_EV_DRAIN,      // Queued data <= send_low      size_t *queued_bytes
   MG_EV_USER,       // Starting ID for user events
 };
@@ -9,6 +9,14 @@
 #include "version.h"
 #include "ws.h"
 
+#if MG_ENABLE_SIMD && defined(__GNUC__) && defined(__SSE2__)
+#include <immintrin.h>
+#define MG_SIMD_SSE2 1
+#elif MG_ENABLE_SIMD && defined(__GNUC__) && defined(__aarch64__)
+#include <arm_neon.h>
+#define MG_SIMD_NEON 1
+#endif
+
 struct http_data {
   void *old_pfn_data;  // Previous pfn_data
   FILE *fp;            // For static file serving
@@ -94,11 +102,77 @@ int mg_url_decode(const char *src, size_t src_len, char *dst, size_t dst_len,
   return i >= src_len && j < dst_len ? (int) j : -1;
 }
 
-int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
-  size_t i;
-  for (i = 0; i < buf_len; i++) {
-    if (!isprint(buf[i]) && buf[i] != '\r' && buf[i] != '\n' && buf[i] < 128)
-      return -1;
+// Return the number of leading bytes in s, n that are not control characters
+static size_t mg_span_text(const unsigned char *s, size_t n) {
+  size_t i = 0;
+#if MG_SIMD_SSE2 && defined(__AVX2__)
+  const __m256i lim32 = _mm256_set1_epi8(0x1f), del32 = _mm256_set1_epi8(0x7f);
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) (s + i));
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(x, lim32), x),
+                                _mm256_cmpeq_epi8(x, del32));
+    unsigned bits = (unsigned) _mm256_movemask_epi8(m);
+    if (bits != 0) return i + (size_t) __builtin_ctz(bits);
+  }
+#endif
+#if MG_SIMD_SSE2
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i m = _mm_or_si128(
+        _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(0x1f)), x),
+        _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f)));
+    unsigned bits = (unsigned) _mm_movemask_epi8(m);
+    if (bits != 0) return i + (size_t) __builtin_ctz(bits);
+  }
+#elif MG_SIMD_NEON
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t x = vld1q_u8(s + i);
+    uint8x16_t m = vorrq_u8(vcltq_u8(x, vdupq_n_u8(0x20)),
+                            vceqq_u8(x, vdupq_n_u8(0x7f)));
+    if (vmaxvq_u8(m) != 0) break;  // Let the loop below find which byte
+  }
+#endif
+  while (i < n && s[i] >= 0x20 && s[i] != 0x7f) i++;
+  return i;
+}
+
+// Return pointer to the first '\n', NUL or one of d characters in s..e.
+// The vector loops compare 16 bytes at once against up to 4 delimiters
+static const char *mg_span_delim(const char *s, const char *e, const char *d) {
+#if MG_SIMD_SSE2 || MG_SIMD_NEON
+  size_t k, nd = strlen(d);
+  char c[4];
+  for (k = 0; k < 4; k++) c[k] = k < nd ? d[k] : '\n';
+  for (; nd <= 4 && s + 16 <= e; s += 16) {
+#if MG_SIMD_SSE2
+    __m128i x = _mm_loadu_si128((const __m128i *) s);
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')),
+                             _mm_cmpeq_epi8(x, _mm_setzero_si128()));
+    unsigned bits;
+    for (k = 0; k < 4; k++) {
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(c[k])));
+    }
+    bits = (unsigned) _mm_movemask_epi8(m);
+    if (bits != 0) return s + __builtin_ctz(bits);
+#else
+    uint8x16_t x = vld1q_u8((const uint8_t *) s);
+    uint8x16_t m = vorrq_u8(vceqq_u8(x, vdupq_n_u8('\n')), vceqzq_u8(x));
+    for (k = 0; k < 4; k++) m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8(c[k])));
+    if (vmaxvq_u8(m) != 0) break;
+#endif
+  }
+#endif
+  while (s < e && *s != '\n' && strchr(d, *s) == NULL) s++;
+  return s;
+}
+
+// Look for the end of headers, starting at offset i. Bytes before i must
+// have been checked by a previous call
+static int mg_http_scan(const unsigned char *buf, size_t i, size_t buf_len) {
+  for (; i < buf_len; i++) {
+    i += mg_span_text(buf + i, buf_len - i);  // Jump to next control character
+    if (i >= buf_len) break;
+    if (buf[i] != '\r' && buf[i] != '\n') return -1;
     if ((i > 0 && buf[i] == '\n' && buf[i - 1] == '\n') ||
         (i > 3 && buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n'))
       return (int) i + 1;
@@ -106,10 +180,14 @@ int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
   return 0;
 }
 
+int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
+  return mg_http_scan(buf, 0, buf_len);
+}
+
 static const char *skip(const char *s, const char *e, const char *d,
                         struct mg_str *v) {
   v->ptr = s;
-  while (s < e && *s != '\n' && strchr(d, *s) == NULL) s++;
+  s = mg_span_delim(s, e, d);
   v->len = s - v->ptr;
   while (s < e && strchr(d, *s) != NULL) s++;
   return s;
@@ -142,9 +220,17 @@ void mg_http_parse_headers(const char *s, const char *end,
   }
 }
 
-int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
-  int is_response, req_len = mg_http_get_request_len((unsigned char *) s, len);
+static bool mg_http_is_chunked(struct mg_http_message *hm) {
+  struct mg_str *te = mg_http_get_header(hm, "Transfer-Encoding");
+  return te != NULL && te->len >= 7 &&
+         mg_ncasecmp(te->ptr + te->len - 7, "chunked", 7) == 0;
+}
+
+// Parse request line and headers, which are known to be req_len bytes long
+static int mg_http_parse_head(const char *s, int req_len,
+                              struct mg_http_message *hm) {
   const char *end = s + req_len, *qs;
+  int is_response;
   struct mg_str *cl;
 
   memset(hm, 0, sizeof(*hm));
@@ -204,9 +290,42 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
     hm->message.len = req_len;
   }
 
+  // Chunked body length is not known until the last chunk, see http_chunks()
+  if (mg_http_is_chunked(hm)) hm->body.len = hm->message.len = (size_t) ~0;
+
   return req_len;
 }
 
+int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
+  int req_len = mg_http_get_request_len((unsigned char *) s, len);
+  return mg_http_parse_head(s, req_len, hm);
+}
+
+// Forget the current message. Streaming and upload settings are kept
+static void http_reset(struct mg_http_parser *p) {
+  p->scanned = p->head = p->body = p->decoded = p->deleted = p->owed = 0;
+  p->is_chunked = false;
+}
+
+int mg_http_feed(struct mg_http_parser *p, const char *s, size_t len,
+                 struct mg_http_message *hm) {
+  if (len < p->scanned || len < p->head) http_reset(p);
+  if (p->head == 0) {
+    int n = mg_http_scan((unsigned char *) s, p->scanned, len);
+    if (n <= 0) {
+      p->scanned = len;
+      return n;
+    }
+    if (mg_http_parse_head(s, n, hm) < 0) return -1;
+    p->head = (size_t) n;
+    p->body = hm->body.len;
+    p->is_chunked = mg_http_is_chunked(hm);
+    if (hm->body.len != (size_t) ~0 && len - p->head >= p->body) return n;
+  }
+  if (p->body == (size_t) ~0 || len - p->head < p->body) return 0;
+  return mg_http_parse_head(s, (int) p->head, hm);
+}
+
 static void mg_http_vprintf_chunk(struct mg_connection *c, const char *fmt,
                                   va_list ap) {
   char mem[256], *buf = mem;
@@ -244,8 +363,9 @@ void mg_http_reply(struct mg_connection *c, int code, const char *headers,
   if (buf != mem) free(buf);
 }
 
-#if MG_ENABLE_FS
 static void http_cb(struct mg_connection *, int, void *, void *);
+
+#if MG_ENABLE_FS
 static void restore_http_cb(struct mg_connection *c) {
   struct http_data *d = (struct http_data *) c->pfn_data;
   if (d->fp != NULL) fclose(d->fp);
@@ -260,6 +380,116 @@ char *mg_http_etag(char *buf, size_t len, mg_stat_t *st) {
   return buf;
 }
 
+// Upload sink of mg_http_upload(), kept in c->http->upload
+struct http_upload {
+#if MG_ENABLE_POSIX
+  int fd;  // Target file
+#else
+  FILE *fp;  // Target file
+#endif
+  size_t offset;        // File offset of the body start
+  size_t reserved;      // Space allocated up front, 0 if none
+  unsigned long start;  // Upload start time, ms
+};
+
+static struct http_upload *upload_open(const char *path, size_t oft,
+                                       size_t len) {
+  struct http_upload *u = (struct http_upload *) calloc(1, sizeof(*u));
+  if (u == NULL) return NULL;
+  u->offset = oft;
+  u->start = mg_millis();
+#if MG_ENABLE_POSIX
+  if ((u->fd = open(path, O_WRONLY | O_CREAT | (oft == 0 ? O_TRUNC : 0),
+                    0644)) < 0) {
+    free(u);
+    return NULL;
+  }
+#if defined(__linux__)
+  // Reserve space, so the file is less fragmented and a full disk fails early
+  if (len > 0 && len != (size_t) ~0) {
+    int rc = posix_fallocate(u->fd, (off_t) oft, (off_t) len);
+    if (rc == ENOSPC) {
+      close(u->fd);
+      free(u);
+      errno = rc;
+      return NULL;
+    }
+    if (rc == 0) u->reserved = len;
+  }
+#endif
+#else
+  if ((oft == 0 || (u->fp = mg_fopen(path, "r+b")) == NULL) &&
+      (u->fp = mg_fopen(path, "wb")) == NULL) {
+    free(u);
+    return NULL;
+  }
+#endif
+  (void) len;
+  return u;
+}
+
+// Write s at body offset ofs. Return 0 on success, -1 on error
+static int upload_write(struct http_upload *u, size_t ofs, struct mg_str s) {
+  ofs += u->offset;
+#if MG_ENABLE_POSIX
+  while (s.len > 0) {
+    ssize_t n = pwrite(u->fd, s.ptr, s.len, (off_t) ofs);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    s.ptr += n, s.len -= (size_t) n, ofs += (size_t) n;
+  }
+  return 0;
+#else
+  if (fseek(u->fp, (long) ofs, SEEK_SET) != 0) return -1;
+  return fwrite(s.ptr, 1, s.len, u->fp) == s.len ? 0 : -1;
+#endif
+}
+
+// Close upload file that has len body bytes. An unfinished upload is cut at
+// the data received, so space reserved for the rest is released
+static void upload_close(struct mg_connection *c, struct http_upload *u,
+                         size_t len, bool ok) {
+  unsigned long ms = mg_millis() - u->start;
+  LOG(LL_DEBUG, ("%lu %s, %lu bytes in %lu ms", c->id, ok ? "done" : "failed",
+                 (unsigned long) len, ms));
+#if MG_ENABLE_POSIX
+  if (!ok && u->reserved > 0 && ftruncate(u->fd, (off_t) (u->offset + len))) {
+    LOG(LL_ERROR, ("%lu ftruncate: %d", c->id, errno));
+  }
+  close(u->fd);
+#else
+  fclose(u->fp);
+#endif
+  free(u);
+}
+
+// Write streamed body data to the upload file, reply when the body is done.
+// Called before the user handler gets the event
+static void http_upload(struct mg_connection *c, int ev,
+                        struct mg_http_message *hm) {
+  struct mg_http_parser *p = c->http;
+  struct http_upload *u = (struct http_upload *) p->upload;
+  if (ev == MG_EV_HTTP_CHUNK) {
+    if (upload_write(u, p->decoded - hm->chunk.len, hm->chunk) != 0) {
+      mg_http_reply(c, 500, "", "write: %d", errno);
+      c->is_draining = 1;
+      upload_close(c, u, p->decoded - hm->chunk.len, false);
+      p->upload = NULL;
+    }
+  } else {
+    size_t n = c->recv.len - p->head, left = p->body - p->decoded;
+    if (ev == MG_EV_CLOSE && !p->is_chunked && n > 0) {
+      // Keep the last, partial block of an unfinished upload
+      struct mg_str s = mg_str_n((char *) c->recv.buf + p->head, n);
+      if (s.len > left) s.len = left;
+      if (upload_write(u, p->decoded, s) == 0) p->decoded += s.len;
+    }
+    if (ev == MG_EV_HTTP_MSG) mg_http_reply(c, 200, "", "");
+    upload_close(c, u, p->decoded, ev == MG_EV_HTTP_MSG);
+    p->upload = NULL;
+  }
+}
+
 int mg_http_upload(struct mg_connection *c, struct mg_http_message *hm,
                    const char *dir) {
   char offset[40] = "", name[200] = "", path[256];
@@ -269,19 +499,33 @@ int mg_http_upload(struct mg_connection *c, struct mg_http_message *hm,
     mg_http_reply(c, 400, "", "%s", "name required");
     return -1;
   } else {
-    FILE *fp;
+    struct http_upload *u;
     size_t oft = strtoul(offset, NULL, 0);
+    // Body is complete when called on MG_EV_HTTP_MSG, and may be complete
+    // on MG_EV_HTTP_HDRS. Otherwise, the rest is streamed to the file
+    struct mg_http_parser *p = c->http;
+    bool complete = p == NULL || hm->message.len <= c->recv.len;
+    bool is_chunked = p != NULL && p->is_chunked;
+    size_t len = complete ? hm->body.len : p->body;
     snprintf(path, sizeof(path), "%s%c%s", dir, MG_DIRSEP, name);
-    LOG(LL_DEBUG,
-        ("%p %d bytes @ %d [%s]", c->fd, (int) hm->body.len, (int) oft, name));
-    if ((fp = mg_fopen(path, oft == 0 ? "wb" : "ab")) == NULL) {
-      mg_http_reply(c, 400, "", "fopen(%s): %d", name, errno);
+    LOG(LL_DEBUG, ("%lu %s %d bytes @ %d [%s]", c->id,
+                   complete ? "writing" : "streaming",
+                   complete ? (int) len : -1, (int) oft, name));
+    if ((u = upload_open(path, oft, is_chunked ? 0 : len)) == NULL) {
+      mg_http_reply(c, 400, "", "open(%s): %d", name, errno);
       return -2;
+    } else if (!complete) {
+      p->upload = u;
+      p->is_streaming = true;
+      return 0;
+    } else if (upload_write(u, 0, hm->body) != 0) {
+      mg_http_reply(c, 500, "", "write(%s): %d", name, errno);
+      upload_close(c, u, 0, false);
+      return -3;
     } else {
-      fwrite(hm->body.ptr, 1, hm->body.len, fp);
-      fclose(fp);
+      upload_close(c, u, hm->body.len, true);
       mg_http_reply(c, 200, "", "");
-      return hm->body.len;
+      return (int) hm->body.len;
     }
   }
 }
@@ -303,6 +547,12 @@ static void static_cb(struct mg_connection *c, int ev, void *ev_data,
   (void) ev_data;
 }
 
+#if MG_ENABLE_SENDFILE
+static void fclose_cb(void *fp) {
+  fclose((FILE *) fp);
+}
+#endif
+
 static const char *guess_content_type(const char *filename) {
   size_t n = strlen(filename);
 #define MIME_ENTRY(_ext, _type) \
@@ -387,6 +637,11 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
               mime, etag, (int64_t) st.st_size, hdrs ? hdrs : "");
     if (mg_vcasecmp(&hm->method, "HEAD") == 0) {
       fclose(fp);
+#if MG_ENABLE_SENDFILE
+    } else if (mg_send_file(c, fileno(fp), 0, (size_t) st.st_size, fclose_cb,
+                            fp) > 0) {
+      // Queued, sent by sendfile() as the socket becomes writable
+#endif
     } else {
       struct http_data *d = (struct http_data *) calloc(1, sizeof(*d));
       if (d == NULL) {
@@ -714,6 +969,17 @@ void mg_http_serve_dir(struct mg_connection *c, struct mg_http_message *hm,
     }
   }
 }
+#else
+struct http_upload;
+static void upload_close(struct mg_connection *c, struct http_upload *u,
+                         size_t len, bool ok) {
+  (void) c, (void) u, (void) len, (void) ok;
+}
+
+static void http_upload(struct mg_connection *c, int ev,
+                        struct mg_http_message *hm) {
+  (void) c, (void) ev, (void) hm;
+}
 #endif
 
 static bool mg_is_url_safe(int c) {
@@ -770,12 +1036,178 @@ bool mg_http_match_uri(const struct mg_http_message *hm, const char *glob) {
   return mg_globmatch(glob, strlen(glob), hm->uri.ptr, hm->uri.len);
 }
 
+// Decoded body data ends here. Chunk framing that follows it is dropped when
+// http_chunks() returns, so a deleted chunk only moves this position back
+static size_t http_decoded_end(struct mg_http_parser *p) {
+  return p->head + p->decoded - p->deleted;
+}
+
+void mg_http_delete_chunk(struct mg_connection *c, struct mg_http_message *hm) {
+  size_t ofs = (size_t) ((unsigned char *) hm->chunk.ptr - c->recv.buf);
+  struct mg_http_parser *p = c->http;
+  if (hm->chunk.len == 0 || p == NULL || !p->is_chunked) return;
+  if (ofs + hm->chunk.len != http_decoded_end(p)) return;  // Not the last
+  p->deleted += hm->chunk.len;
+  hm->body.len -= hm->chunk.len;
+  hm->chunk.len = 0;
+}
+
+// Decode complete chunks of a chunked body in place: move chunk data next to
+// the previously decoded data, and fire MG_EV_HTTP_CHUNK. When streaming,
+// any part of a chunk that arrived is delivered, so chunks of any size fit.
+// The read position runs ahead over chunk framing, and the gap is closed
+// once, on return.
+// Return -1 on error, 0 if more data is needed, or the length of request
+// once the last chunk is seen, in which case hm describes the whole message
+static int http_chunks(struct mg_connection *c, struct mg_http_message *hm) {
+  struct mg_http_parser *p = c->http;
+  size_t r = http_decoded_end(p), w;  // Read and write positions
+  int res = 0;
+  for (;;) {
+    char *buf = (char *) c->recv.buf, *s = buf + r;
+    size_t i = 0, e, n = 0, len = c->recv.len - r, ofs;
+    w = http_decoded_end(p);
+    if (p->owed > 2) {
+      // Inside a chunk: deliver the part of it that has arrived
+      if ((n = len < p->owed - 2 ? len : p->owed - 2) == 0) break;
+      memmove(buf + w, s, n);
+      r += n;
+      p->owed -= n;
+      p->decoded += n;
+      mg_http_parse_head(buf, (int) p->head, hm);
+      hm->body = mg_str_n(buf + p->head, w + n - p->head);
+      hm->chunk = mg_str_n(buf + w, n);
+      if (p->upload != NULL) http_upload(c, MG_EV_HTTP_CHUNK, hm);
+      mg_call(c, MG_EV_HTTP_CHUNK, hm);
+      if (c->is_closing || c->pfn != http_cb) break;
+      if (p->is_streaming) mg_http_delete_chunk(c, hm);
+      continue;
+    } else if (p->owed > 0) {
+      // Chunk data is over, skip the CRLF that follows it
+      if (len < p->owed) break;
+      if (memcmp(s, &"\r\n"[2 - p->owed], p->owed) != 0) {
+        res = -1;
+        break;
+      }
+      r += p->owed;
+      p->owed = 0;
+      continue;
+    }
+    while (i < len && i < sizeof(n) * 2 - 1 && isxdigit((unsigned char) s[i])) {
+      n = (n << 4) | (size_t) mg_unhexn(&s[i++], 1);
+    }
+    if (i < len && (i == 0 || isxdigit((unsigned char) s[i]))) {
+      res = -1;
+      break;
+    }
+    while (i < len && s[i] != '\n') i++;  // Skip chunk extensions
+    if (i >= len) break;
+    ofs = i + 1;
+    if (n == 0) {
+      // Last chunk, followed by optional trailers and an empty line
+      for (i = ofs;; i = e + 1) {
+        for (e = i; e < len && s[e] != '\n';) e++;
+        if (e >= len || e == i || (e == i + 1 && s[i] == '\r')) break;
+      }
+      if (e >= len) break;
+      r += e + 1;
+      mg_http_parse_head(buf, (int) p->head, hm);
+      hm->body = mg_str_n(buf + p->head, w - p->head);
+      hm->message.len = w;
+      res = (int) p->head;
+      break;
+    }
+    // A buffered chunk is delivered whole, a streamed one as it arrives
+    if (!p->is_streaming && len < ofs + n + 2) break;
+    r += ofs;
+    p->owed = n + 2;
+  }
+  w = http_decoded_end(p);
+  mg_iobuf_cut(&c->recv, w, r - w);
+  return res;
+}
+
+// Deliver body data as it arrives, and delete it from the receive buffer.
+// Return 0 if more data is needed, or the length of request once the whole
+// body was delivered, in which case hm describes the message without body
+static int http_stream(struct mg_connection *c, struct mg_http_message *hm) {
+  struct mg_http_parser *p = c->http;
+  size_t n = c->recv.len - p->head, left = p->body - p->decoded;
+  if (n > left) n = left;  // The rest is the next message
+  // Upload writes full blocks. A body read until close is written as is
+  if (p->upload != NULL && p->body != (size_t) ~0 && n < left &&
+      n < MG_UPLOAD_BLOCK) {
+    return 0;
+  }
+  if (n > 0) {
+    char *buf = (char *) c->recv.buf;
+    mg_http_parse_head(buf, (int) p->head, hm);
+    hm->body = hm->chunk = mg_str_n(buf + p->head, n);
+    p->decoded += n;
+    if (p->upload != NULL) http_upload(c, MG_EV_HTTP_CHUNK, hm);
+    mg_call(c, MG_EV_HTTP_CHUNK, hm);
+    if (c->is_closing || c->pfn != http_cb) return 0;
+    mg_iobuf_cut(&c->recv, p->head, n);
+    p->deleted += n;
+  }
+  if (p->decoded < p->body) return 0;
+  mg_http_parse_head((char *) c->recv.buf, (int) p->head, hm);
+  hm->body.len = 0;
+  hm->message.len = p->head;
+  return (int) p->head;
+}
+
+// Message is consumed: abort an upload the handler left open, and end
+// streaming, which lasts for one message
+static void http_done(struct mg_connection *c) {
+  struct mg_http_parser *p = c->http;
+  if (p->upload != NULL) {
+    upload_close(c, (struct http_upload *) p->upload, p->decoded, false);
+    p->upload = NULL;
+  }
+  p->is_streaming = false;
+  http_reset(p);
+}
+
+// Allocate parser state on first use. It is freed when the connection closes
+static struct mg_http_parser *http_parser(struct mg_connection *c) {
+  if (c->http == NULL) {
+    c->http = (struct mg_http_parser *) mg_alloc(sizeof(*c->http));
+    if (c->http != NULL) memset(c->http, 0, sizeof(*c->http));
+  }
+  return c->http;
+}
+
 static void http_cb(struct mg_connection *c, int ev, void *ev_data,
                     void *fn_data) {
   if (ev == MG_EV_READ || ev == MG_EV_CLOSE) {
     struct mg_http_message hm;
+    struct mg_http_parser *p = ev == MG_EV_READ ? http_parser(c) : c->http;
+    if (p == NULL) {
+      if (ev == MG_EV_READ) LOG(LL_ERROR, ("%lu OOM", c->id));
+      c->is_closing = 1;
+      return;
+    }
     for (;;) {
-      int n = mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
+      char *buf = (char *) c->recv.buf;
+      size_t head = p->head;
+      int n;
+      // A chunked or streamed body, cut short by close, is not a message
+      if (ev == MG_EV_CLOSE &&
+          (p->is_chunked || (p->is_streaming && p->body != (size_t) ~0))) {
+        break;
+      }
+      n = ev == MG_EV_CLOSE ? mg_http_parse(buf, c->recv.len, &hm)
+                            : mg_http_feed(p, buf, c->recv.len, &hm);
+      if (n >= 0 && ev == MG_EV_READ && head == 0 && p->head > 0) {
+        mg_call(c, MG_EV_HTTP_HDRS, &hm);  // Handler may set is_streaming
+        if (c->is_closing || c->pfn != http_cb) break;
+      }
+      if (n >= 0 && ev == MG_EV_READ && p->is_chunked) {
+        if ((n = http_chunks(c, &hm)) == 0) break;
+      } else if (n >= 0 && ev == MG_EV_READ && p->is_streaming && p->head > 0) {
+        if ((n = http_stream(c, &hm)) == 0) break;
+      }
       if (ev == MG_EV_CLOSE) {
         hm.message.len = c->recv.len;
         hm.body.len = hm.message.len - (hm.body.ptr - hm.message.ptr);
@@ -807,23 +1239,31 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data,
           }
           mg_http_write_chunk(c, "", 0);
           mg_iobuf_delete(&c->recv, hm.message.len);
+          http_done(c);
           continue;
         }
 #endif
+        if (p->upload != NULL) http_upload(c, MG_EV_HTTP_MSG, &hm);
         mg_call(c, MG_EV_HTTP_MSG, &hm);
         mg_iobuf_delete(&c->recv, hm.message.len);
+        http_done(c);
       } else {
         break;
       }
     }
+    if (ev == MG_EV_CLOSE && p->upload != NULL) {
+      http_upload(c, MG_EV_CLOSE, NULL);  // Unfinished upload
+    }
   }
   (void) fn_data;
   (void) ev_data;
 }
 
-struct mg_connection *mg_http_connect(struct mg_mgr *mgr, const char *url,
-                                      mg_event_handler_t fn, void *fn_data) {
-  struct mg_connection *c = mg_connect(mgr, url, fn, fn_data);
+struct mg_connection *mg_http_connect_opts(struct mg_mgr *mgr, const char *url,
+                                           const struct mg_sock_opts *opts,
+                                           mg_event_handler_t fn,
+                                           void *fn_data) {
+  struct mg_connection *c = mg_connect_opts(mgr, url, opts, fn, fn_data);
   if (c != NULL) c->pfn = http_cb, c->pfn_data = mgr;
 #if MG_ENABLE_HTTP_DEBUG_ENDPOINT
   snprintf(c->label, sizeof(c->label) - 1, "->%s", url);
@@ -831,12 +1271,24 @@ struct mg_connection *mg_http_connect(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
-struct mg_connection *mg_http_listen(struct mg_mgr *mgr, const char *url,
-                                     mg_event_handler_t fn, void *fn_data) {
-  struct mg_connection *c = mg_listen(mgr, url, fn, fn_data);
+struct mg_connection *mg_http_listen_opts(struct mg_mgr *mgr, const char *url,
+                                          const struct mg_sock_opts *opts,
+                                          mg_event_handler_t fn,
+                                          void *fn_data) {
+  struct mg_connection *c = mg_listen_opts(mgr, url, opts, fn, fn_data);
   if (c != NULL) c->pfn = http_cb, c->pfn_data = mgr;
 #if MG_ENABLE_HTTP_DEBUG_ENDPOINT
   if (c != NULL) snprintf(c->label, sizeof(c->label) - 1, "<-LSN");
 #endif
   return c;
 }
+
+struct mg_connection *mg_http_connect(struct mg_mgr *mgr, const char *url,
+                                      mg_event_handler_t fn, void *fn_data) {
+  return mg_http_connect_opts(mgr, url, NULL, fn, fn_data);
+}
+
+struct mg_connection *mg_http_listen(struct mg_mgr *mgr, const char *url,
+                                     mg_event_handler_t fn, void *fn_data) {
+  return mg_http_listen_opts(mgr, url, NULL, fn, fn_data);
+}
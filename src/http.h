@@ -16,10 +16,24 @@ struct mg_http_message {
   struct mg_str method, uri, query, proto;             // Request/response line
   struct mg_http_header headers[MG_MAX_HTTP_HEADERS];  // Headers
   struct mg_str body;                                  // Body
+  struct mg_str chunk;                                 // Chunk, see below
   struct mg_str head;                                  // Request + headers
   struct mg_str message;  // Request + headers + body
 };
 
+// Incremental HTTP parser state, see mg_http_feed()
+struct mg_http_parser {
+  size_t scanned;     // Bytes checked for the end of headers so far
+  size_t head;        // Request line and headers length, 0: not seen yet
+  size_t body;        // Body length, (size_t) ~0: until connection close
+  size_t decoded;     // Body bytes received, decoded from chunks if chunked
+  size_t deleted;     // Body bytes deleted from the buffer when streaming
+  size_t owed;        // Streamed chunk bytes not received yet, with CRLF
+  bool is_chunked;    // Body uses chunked transfer coding
+  bool is_streaming;  // Deliver body as it arrives, see MG_EV_HTTP_HDRS
+  void *upload;       // Upload sink, see mg_http_upload()
+};
+
 // Parameter for mg_http_serve_dir()
 struct mg_http_serve_opts {
   const char *root_dir;     // Web root directory, must be non-NULL
@@ -28,12 +42,23 @@ struct mg_http_serve_opts {
 
 int mg_http_parse(const char *s, size_t len, struct mg_http_message *);
 int mg_http_get_request_len(const unsigned char *buf, size_t buf_len);
+int mg_http_feed(struct mg_http_parser *, const char *s, size_t len,
+                 struct mg_http_message *);
 void mg_http_printf_chunk(struct mg_connection *cnn, const char *fmt, ...);
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len);
+void mg_http_delete_chunk(struct mg_connection *, struct mg_http_message *);
 struct mg_connection *mg_http_listen(struct mg_mgr *, const char *url,
                                      mg_event_handler_t fn, void *fn_data);
 struct mg_connection *mg_http_connect(struct mg_mgr *, const char *url,
                                       mg_event_handler_t fn, void *fn_data);
+struct mg_connection *mg_http_listen_opts(struct mg_mgr *, const char *url,
+                                          const struct mg_sock_opts *opts,
+                                          mg_event_handler_t fn,
+                                          void *fn_data);
+struct mg_connection *mg_http_connect_opts(struct mg_mgr *, const char *url,
+                                           const struct mg_sock_opts *opts,
+                                           mg_event_handler_t fn,
+                                           void *fn_data);
 void mg_http_serve_dir(struct mg_connection *, struct mg_http_message *hm,
                        struct mg_http_serve_opts *);
 void mg_http_serve_file(struct mg_connection *, struct mg_http_message *,
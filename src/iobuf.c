@@ -1,23 +1,54 @@
 #include "iobuf.h"
 #include "log.h"
+#include "util.h"
 
 #include <string.h>
 
+// Start of the allocated block
+static void *mg_iobuf_block(struct mg_iobuf *io) {
+  return io->buf == NULL ? NULL : io->buf - io->off;
+}
+
+// Move data to the beginning of the allocated block, making space consumed
+// by mg_iobuf_delete() available again
+static void mg_iobuf_compact(struct mg_iobuf *io) {
+  if (io->off > 0) {
+    memmove(io->buf - io->off, io->buf, io->len);
+    io->buf -= io->off;
+    io->size += io->off;
+    io->off = 0;
+  }
+}
+
 int mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
   int ok = 1;
   if (new_size == 0) {
-    free(io->buf);
+    mg_dealloc(mg_iobuf_block(io));
     io->buf = NULL;
-    io->len = io->size = 0;
-  } else if (new_size != io->size) {
-    // NOTE(lsm): do not use realloc here. Use malloc/free only, to ease the
-    // porting to some obscure platforms like FreeRTOS
-    void *p = malloc(new_size);
+    io->len = io->size = io->off = 0;
+    return ok;
+  }
+  mg_iobuf_compact(io);  // new_size and the length cut apply to the block
+  if (new_size != io->size) {
+    // NOTE(lsm): realloc is used only if MG_ENABLE_REALLOC is set, to ease
+    // the porting to some obscure platforms like FreeRTOS
+    void *p = NULL;
+#if MG_ENABLE_REALLOC
+    if (io->buf != NULL && (p = mg_realloc(io->buf, new_size)) != NULL) {
+      io->buf = (unsigned char *) p;
+      io->size = new_size;
+      if (io->len > new_size) io->len = new_size;
+      return ok;
+    }
+#endif
+    p = mg_alloc(new_size);
     if (p != NULL) {
-      memcpy(p, io->buf, io->size < new_size ? io->size : new_size);
-      free(io->buf);
+      if (io->len > new_size) io->len = new_size;
+      memcpy(p, io->buf, io->len);
+      mg_dealloc(mg_iobuf_block(io));
       io->buf = (unsigned char *) p;
       io->size = new_size;
+      io->off = 0;
     } else {
       ok = 0;
       LOG(LL_ERROR,
@@ -31,20 +62,52 @@ int mg_iobuf_init(struct mg_iobuf *io, size_t size) {
   return mg_iobuf_resize(io, size);
 }
 
+// Make space for len more bytes. The allocation grows by its current size,
+// but by no more than max_step bytes, unless more is needed
+int mg_iobuf_reserve(struct mg_iobuf *io, size_t len, size_t chunk_size,
+                     size_t max_step) {
+  size_t need = io->len + len, new_size = io->size + io->off;
+  if (need <= io->size) return 1;
+  new_size += new_size < max_step ? new_size : max_step;
+  if (new_size < need) new_size = need;
+  new_size = (new_size + chunk_size - 1) / chunk_size * chunk_size;
+  return mg_iobuf_resize(io, new_size);
+}
+
 size_t mg_iobuf_append(struct mg_iobuf *io, const void *buf, size_t len,
                        size_t chunk_size) {
-  size_t new_size = io->len + len + chunk_size;
-  new_size -= new_size % chunk_size;
-  if (new_size != io->size) mg_iobuf_resize(io, new_size);
-  if (new_size != io->size) len = 0;  // Realloc failure, append nothing
+  if (io->len + len > io->size && io->len + len <= io->size + io->off) {
+    mg_iobuf_compact(io);  // Fits into the existing block, no need to copy
+  } else if (io->len + len > io->size) {
+    size_t new_size = io->len + len + chunk_size;
+    mg_iobuf_resize(io, new_size - new_size % chunk_size);
+  }
+  if (io->len + len > io->size) len = 0;  // Realloc failure, append nothing
   if (buf != NULL) memmove(io->buf + io->len, buf, len);
   io->len += len;
   return len;
 }
 
+// Consume len bytes from the beginning. Data is not moved: buf advances, and
+// the consumed space is reclaimed later, when more space is needed
 size_t mg_iobuf_delete(struct mg_iobuf *io, size_t len) {
   if (len > io->len) len = 0;
-  memmove(io->buf, io->buf + len, io->len - len);
+  io->len -= len;
+  if (io->len == 0) {
+    mg_iobuf_compact(io);  // Nothing to move, rewind to the block start
+  } else {
+    io->buf += len;
+    io->size -= len;
+    io->off += len;
+  }
+  return len;
+}
+
+// Remove len bytes at offset ofs, moving the rest of the data down
+size_t mg_iobuf_cut(struct mg_iobuf *io, size_t ofs, size_t len) {
+  if (ofs > io->len || len > io->len - ofs) len = 0;
+  if (len == 0) return 0;
+  memmove(io->buf + ofs, io->buf + ofs + len, io->len - ofs - len);
   io->len -= len;
   return len;
 }
@@ -3,12 +3,16 @@
 #include <stddef.h>
 
 struct mg_iobuf {
-  unsigned char *buf;
-  size_t size, len;
+  unsigned char *buf;  // Pointer to stored data
+  size_t size;         // Space available at buf
+  size_t len;          // Data length
+  size_t off;          // Consumed space before buf, see mg_iobuf_delete()
 };
 
 int mg_iobuf_init(struct mg_iobuf *, size_t);
 int mg_iobuf_resize(struct mg_iobuf *, size_t);
+int mg_iobuf_reserve(struct mg_iobuf *, size_t, size_t, size_t);
 void mg_iobuf_free(struct mg_iobuf *);
 size_t mg_iobuf_append(struct mg_iobuf *, const void *, size_t, size_t);
 size_t mg_iobuf_delete(struct mg_iobuf *, size_t);
+size_t mg_iobuf_cut(struct mg_iobuf *, size_t, size_t);
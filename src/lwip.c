@@ -122,10 +122,13 @@ static struct mg_connection *mg_mkconn(const char *url) {
   return c;
 }
 
-struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
-                                 mg_event_handler_t fn, void *fn_data) {
+// Socket options are not supported by LWIP, opts is ignored
+struct mg_connection *mg_connect_opts(struct mg_mgr *mgr, const char *url,
+                                      const struct mg_sock_opts *opts,
+                                      mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = mg_mkconn(url);
   struct mg_str host = mg_url_host(url);
+  (void) opts;
   if (c == NULL) return c;
   c->next = mgr->conns;
   mgr->conns = c;
@@ -170,13 +173,15 @@ static err_t accept_cb(void *arg, struct tcp_pcb *pcb, err_t e) {
   return ERR_OK;
 }
 
-struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
-                                mg_event_handler_t fn, void *fn_data) {
+struct mg_connection *mg_listen_opts(struct mg_mgr *mgr, const char *url,
+                                     const struct mg_sock_opts *opts,
+                                     mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = mg_mkconn(url);
   struct mg_str host = mg_url_host(url);
   uint16_t port = mg_url_port(url);
   uint32_t ipaddr;
   err_t err;
+  (void) opts;
   if (c == NULL) return c;
   mg_aton(host.ptr, &ipaddr);
   if (!mg_vcasecmp(&host, "localhost")) ipaddr = mg_htonl(0x7f000001);
@@ -192,6 +197,6 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   LOG(LL_DEBUG, ("%p %d", mgr, ms));
   mg_usleep(200 * 1000);
-  mg_timer_poll(mg_millis());
+  mg_timer_poll(&mgr->timers, mg_millis());
 }
 #endif
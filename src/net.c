@@ -1,5 +1,6 @@
 #include "log.h"
 #include "net.h"
+#include "private.h"
 #include "util.h"
 
 int mg_vprintf(struct mg_connection *c, const char *fmt, va_list ap) {
@@ -111,13 +112,202 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr) {
   return mg_atonl(str, addr) || mg_aton4(str, addr) || mg_aton6(str, addr);
 }
 
+struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
+                                mg_event_handler_t fn, void *fn_data) {
+  return mg_listen_opts(mgr, url, NULL, fn, fn_data);
+}
+
+struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
+                                 mg_event_handler_t fn, void *fn_data) {
+  return mg_connect_opts(mgr, url, NULL, fn, fn_data);
+}
+
+// Queue connection for processing by the next mg_mgr_poll() iteration
+void mg_ready(struct mg_connection *c) {
+  if (c->is_ready || c->mgr == NULL) return;
+  c->is_ready = 1;
+  c->rnext = c->mgr->ready;
+  c->rprev = &c->mgr->ready;
+  if (c->rnext != NULL) c->rnext->rprev = &c->rnext;
+  c->mgr->ready = c;
+}
+
+// Remove connection from the ready queue in O(1), wherever the queue head is
+void mg_unready(struct mg_connection *c) {
+  if (!c->is_ready) return;
+  *c->rprev = c->rnext;
+  if (c->rnext != NULL) c->rnext->rprev = c->rprev;
+  c->is_ready = 0;
+}
+
+// Preallocate n connection objects in one block. Closed connections that
+// come from the block are put back on the spare list instead of being freed
+bool mg_mgr_prealloc(struct mg_mgr *mgr, size_t n) {
+  struct mg_connection *slab;
+  size_t i;
+  if (mgr->slab != NULL || n == 0) return false;
+  if ((slab = (struct mg_connection *) mg_alloc(n * sizeof(*slab))) == NULL) {
+    return false;
+  }
+  for (i = n; i > 0; i--) {
+    slab[i - 1].next = mgr->spare;
+    mgr->spare = &slab[i - 1];
+  }
+  mgr->slab = slab;
+  mgr->slabsize = n;
+  return true;
+}
+
+// Return zeroed connection object: from the spare list, or from the heap
+struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
+  struct mg_connection *c = mgr->spare;
+  if (c != NULL) {
+    mgr->spare = c->next;
+  } else {
+    c = (struct mg_connection *) mg_alloc(sizeof(*c));
+  }
+  if (c != NULL) memset(c, 0, sizeof(*c));
+  return c;
+}
+
+void mg_free_conn(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  struct mg_connection *slab = (struct mg_connection *) mgr->slab;
+  memset(c, 0, sizeof(*c));
+  if (slab != NULL && c >= slab && c < slab + mgr->slabsize) {
+    c->next = mgr->spare;
+    mgr->spare = c;
+  } else {
+    mg_dealloc(c);
+  }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MG_ATOMIC_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_ACQ_REL)
+#else
+#define MG_ATOMIC_ADD(p, n) (*(p) += (n))
+#endif
+
+// Allocate shared buffer with reference count 1. If buf is NULL, the data
+// is left for the caller to fill in
+struct mg_shared *mg_shared_new(const void *buf, size_t len) {
+  struct mg_shared *s = (struct mg_shared *) mg_alloc(sizeof(*s) + len);
+  if (s != NULL) {
+    s->refcnt = 1;
+    s->len = len;
+    s->buf = (char *) (s + 1);
+    if (buf != NULL) memcpy(s->buf, buf, len);
+  }
+  return s;
+}
+
+void mg_shared_ref(struct mg_shared *s) {
+  MG_ATOMIC_ADD(&s->refcnt, 1);
+}
+
+void mg_shared_release(struct mg_shared *s) {
+  if (s != NULL && MG_ATOMIC_ADD(&s->refcnt, -1) == 0) mg_dealloc(s);
+}
+
+// Free an empty IO buffer, unless it is small enough to be reused. Buffers
+// grown by a burst are released, small ones are not reallocated all the time
+void mg_io_drained(struct mg_mgr *mgr, struct mg_iobuf *io) {
+  if (io->len == 0 && io->size > mgr->iokeep) mg_iobuf_free(io);
+}
+
+// Rebuild the ID hash table with nbuckets buckets, a power of two
+static void mg_ids_resize(struct mg_mgr *mgr, size_t nbuckets) {
+  size_t size = nbuckets * sizeof(*mgr->ids);
+  struct mg_connection **ids = (struct mg_connection **) mg_alloc(size), *c;
+  if (ids == NULL) return;  // Keep the old table, chains just get longer
+  memset(ids, 0, size);
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    struct mg_connection **b = &ids[c->id & (nbuckets - 1)];
+    c->hnext = *b;
+    *b = c;
+  }
+  mg_dealloc(mgr->ids);
+  mgr->ids = ids;
+  mgr->idsize = nbuckets;
+}
+
+// Link new connection into the connection list and the ID hash table
+void mg_add_conn(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  if (mgr->nconns >= mgr->idsize) {
+    mg_ids_resize(mgr, mgr->idsize == 0 ? 16 : mgr->idsize * 2);
+  }
+  c->prev = NULL;
+  c->next = mgr->conns;
+  if (c->next != NULL) c->next->prev = c;
+  mgr->conns = c;
+  mgr->nconns++;
+  if (mgr->ids != NULL) {
+    struct mg_connection **b = &mgr->ids[c->id & (mgr->idsize - 1)];
+    c->hnext = *b;
+    *b = c;
+  }
+}
+
+void mg_del_conn(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+  } else {
+    mgr->conns = c->next;
+  }
+  if (c->next != NULL) c->next->prev = c->prev;
+  mgr->nconns--;
+  if (mgr->ids != NULL) {
+    struct mg_connection **p = &mgr->ids[c->id & (mgr->idsize - 1)];
+    while (*p != NULL && *p != c) p = &(*p)->hnext;
+    if (*p != NULL) *p = c->hnext;
+  }
+  c->next = c->prev = c->hnext = NULL;
+}
+
+struct mg_connection *mg_conn_by_id(struct mg_mgr *mgr, unsigned long id) {
+  struct mg_connection *c;
+  if (mgr->ids == NULL) {
+    for (c = mgr->conns; c != NULL && c->id != id; c = c->next) (void) 0;
+  } else {
+    c = mgr->ids[id & (mgr->idsize - 1)];
+    while (c != NULL && c->id != id) c = c->hnext;
+  }
+  return c;
+}
+
 void mg_mgr_free(struct mg_mgr *mgr) {
   struct mg_connection *c;
+#if MG_ENABLE_SOCKET && MG_ENABLE_WORKERS
+  mg_workers_free(mgr);  // Workers post to the wakeup channel, stop them first
+#endif
   for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
+  mgr->pollinterval = 0;  // Make sure every connection is visited
   mg_mgr_poll(mgr, 0);
 #if MG_ARCH == MG_ARCH_FREERTOS
   FreeRTOS_DeleteSocketSet(mgr->ss);
 #endif
+#if MG_ENABLE_EPOLL
+  if (mgr->epoll_fd >= 0) close(mgr->epoll_fd);
+  mgr->epoll_fd = -1;
+#endif
+#if MG_ENABLE_SOCKET && MG_ENABLE_IO_URING
+  mg_uring_close(mgr);
+#endif
+#if MG_ENABLE_SOCKET && MG_ENABLE_WAKEUP
+  mg_wakeup_free(mgr);
+#endif
+#if MG_ENABLE_MMSG
+  mg_dealloc(mgr->udpbuf);
+  mgr->udpbuf = NULL;
+#endif
+  mg_dealloc(mgr->ids);
+  mgr->ids = NULL;
+  mgr->idsize = 0;
+  mg_dealloc(mgr->slab);
+  mgr->slab = mgr->spare = NULL;
+  mgr->slabsize = 0;
   LOG(LL_INFO, ("All connections closed"));
 }
 
@@ -134,6 +324,21 @@ void mg_mgr_init(struct mg_mgr *mgr) {
 #endif
   memset(mgr, 0, sizeof(*mgr));
   mgr->dnstimeout = 3000;
+  mgr->timers.now = mg_millis();
+  mgr->iogrow = MG_IO_GROW;
+  mgr->iokeep = MG_IO_KEEP;
   mgr->dns4.url = "udp://8.8.8.8:53";
   mgr->dns6.url = "udp://[2001:4860:4860::8888]:53";
+#if MG_ENABLE_WAKEUP
+  mgr->wakeup_fd = -1;
+#endif
+#if MG_ENABLE_EPOLL
+  if ((mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    LOG(LL_ERROR, ("epoll_create1: %d", errno));
+  }
+#endif
+#if MG_ENABLE_SOCKET && MG_ENABLE_IO_URING
+  mgr->uring = mg_uring_new(MG_IO_URING_ENTRIES, MG_IO_URING_BUFS,
+                            MG_IO_URING_BUF_SIZE);
+#endif
 }
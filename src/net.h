@@ -1,9 +1,11 @@
 #pragma once
 
 #include "arch.h"
+#include "config.h"
 #include "event.h"
 #include "iobuf.h"
 #include "str.h"
+#include "timer.h"
 
 struct mg_dns {
   const char *url;          // DNS server URL
@@ -17,59 +19,189 @@ struct mg_addr {
   bool is_ip6;      // True when address is IPv6 address
 };
 
+// Socket options for new connections, see mg_listen_opts(). Zero fields keep
+// Mongoose defaults
+struct mg_sock_opts {
+  int backlog;        // Listen backlog, 0: 128
+  int rcvbuf;         // SO_RCVBUF, bytes
+  int sndbuf;         // SO_SNDBUF, bytes
+  int busy_poll;      // SO_BUSY_POLL, microseconds
+  int notsent_lowat;  // TCP_NOTSENT_LOWAT, bytes
+  int defer_accept;   // TCP_DEFER_ACCEPT for listeners, seconds
+  int fastopen;       // TCP_FASTOPEN queue for listeners, or on for clients
+  int keepidle;       // TCP_KEEPIDLE, seconds, 0: 60, -1: no keepalive
+  int keepintvl;      // TCP_KEEPINTVL, seconds, 0: 20
+  int keepcnt;        // TCP_KEEPCNT, 0: 3
+  bool nagle;         // Keep Nagle's algorithm, do not set TCP_NODELAY
+};
+
 struct mg_mgr {
   struct mg_connection *conns;  // List of active connections
   struct mg_dns dns4;           // DNS for IPv4
   struct mg_dns dns6;           // DNS for IPv6
   int dnstimeout;               // DNS resolve timeout in milliseconds
+  int idletimeout;              // Close connections idle for ms, 0: never
+  int hstimeout;                // Connect and TLS handshake timeout, 0: none
+  int reqtimeout;               // Partial request timeout, ms, 0: none
+  struct mg_timers timers;      // Timers and connection timeouts
   unsigned long nextid;         // Next connection ID
+  struct mg_connection *ready;  // Connections to process on next poll
+  int pollinterval;             // MG_EV_POLL interval in ms, 0: every poll
+  unsigned long lastpoll;       // Time of the last MG_EV_POLL, in ms
+  void *active_dns_requests;    // DNS requests in progress
+  struct mg_connection *spare;  // Unused slab connections, see mg_mgr_prealloc
+  void *slab;                   // Preallocated connection objects
+  size_t slabsize;              // Number of objects in the slab
+  struct mg_connection **ids;   // Connections by ID, see mg_conn_by_id()
+  size_t idsize;                // Number of buckets in ids
+  size_t nconns;                // Number of connections in the list
+  size_t iogrow;                // Max IO buffer growth step, see MG_IO_GROW
+  size_t iokeep;                // Drained IO buffers up to this size are kept
 #if MG_ARCH == MG_ARCH_FREERTOS
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
+#if MG_ENABLE_EPOLL
+  int epoll_fd;  // epoll instance, see mg_iotest()
+#endif
+#if MG_ENABLE_IO_URING
+  struct mg_uring *uring;  // io_uring instance, NULL if not available
+#endif
+#if MG_ENABLE_MMSG
+  unsigned char *udpbuf;  // Space for batched UDP reads, see MG_UDP_BATCH
+#endif
+#if MG_ENABLE_WAKEUP
+  struct mg_connection *wakeup;  // Reads wakeup notifications
+  int wakeup_fd;                 // Write side of wakeup notifications
+  void *mailbox;                 // Messages posted by mg_mgr_wakeup()
+#endif
+#if MG_ENABLE_WORKERS
+  struct mg_workers *workers;  // Worker thread pool
+#endif
+#if MG_ENABLE_REACTORS
+  struct mg_reactors *reactors;  // Reactor group, NULL if not in a group
+  int reactor_id;                // Index in the reactor group
+#endif
 };
 
+struct mg_http_parser;
+
 struct mg_connection {
-  struct mg_connection *next;  // Linkage in struct mg_mgr :: connections
-  struct mg_mgr *mgr;          // Our container
-  struct mg_addr peer;         // Remote peer address
-  void *fd;                    // Connected socket, or LWIP data
-  unsigned long id;            // Auto-incrementing unique connection ID
-  struct mg_iobuf recv;        // Incoming data
-  struct mg_iobuf send;        // Outgoing data
-  mg_event_handler_t fn;       // User-specified event handler function
-  void *fn_data;               // User-speficied function parameter
-  mg_event_handler_t pfn;      // Protocol-specific handler function
-  void *pfn_data;              // Protocol-specific function parameter
-  char label[50];              // Arbitrary label
-  void *tls;                   // TLS specific data
-  unsigned is_listening : 1;   // Listening connection
-  unsigned is_client : 1;      // Outbound (client) connection
-  unsigned is_accepted : 1;    // Accepted (server) connection
-  unsigned is_resolving : 1;   // Non-blocking DNS resolv is in progress
-  unsigned is_connecting : 1;  // Non-blocking connect is in progress
-  unsigned is_tls : 1;         // TLS-enabled connection
-  unsigned is_tls_hs : 1;      // TLS handshake is in progress
-  unsigned is_udp : 1;         // UDP connection
-  unsigned is_websocket : 1;   // WebSocket connection
-  unsigned is_hexdumping : 1;  // Hexdump in/out traffic
-  unsigned is_draining : 1;    // Send remaining data, then close and free
-  unsigned is_closing : 1;     // Close and free the connection immediately
-  unsigned is_readable : 1;    // Connection is ready to read
-  unsigned is_writable : 1;    // Connection is ready to write
+  struct mg_connection *next;     // Linkage in struct mg_mgr :: connections
+  struct mg_connection *prev;     // Linkage in struct mg_mgr :: connections
+  struct mg_connection *rnext;    // Linkage in struct mg_mgr :: ready
+  struct mg_connection **rprev;   // Link that points to us in the ready queue
+  struct mg_connection *hnext;    // Linkage in struct mg_mgr :: ids
+  struct mg_mgr *mgr;             // Our container
+  struct mg_addr peer;            // Remote peer address
+  void *fd;                       // Connected socket, or LWIP data
+  unsigned long id;               // Auto-incrementing unique connection ID
+  struct mg_iobuf recv;           // Incoming data
+  struct mg_iobuf send;           // Outgoing data
+  mg_event_handler_t fn;          // User-specified event handler function
+  void *fn_data;                  // User-speficied function parameter
+  mg_event_handler_t pfn;         // Protocol-specific handler function
+  void *pfn_data;                 // Protocol-specific function parameter
+  char label[50];                 // Arbitrary label
+  void *tls;                      // TLS specific data
+  struct mg_seg *segs;            // Send queue segments, see mg_send_ref()
+  struct mg_seg **segs_tail;      // Last link of segs, valid if segs is set
+  void *relay;                    // Relay state, see mg_relay()
+  struct mg_sock_opts *sockopts;  // Own copy of socket options, or NULL
+  void *udp;                      // UDP peer table, see mg_udp_demux()
+  struct mg_http_parser *http;    // HTTP parser state, see mg_http_feed()
+  size_t recv_high;               // Stop reading at this recv.len, 0: never
+  size_t recv_low;                // Read again at this recv.len
+  size_t send_high;               // MG_EV_FULL at this many queued bytes
+  size_t send_low;                // MG_EV_DRAIN at this many queued bytes
+  struct mg_timer timer;          // Timeout, see mgr->idletimeout
+  unsigned long lastio;           // Time of last IO, in ms
+  unsigned long since;            // Start of handshake or partial request
+#if MG_ENABLE_IO_URING
+  void *uring;                    // io_uring specific data
+#endif
+#if MG_ENABLE_MMSG
+  size_t udp_dropped;             // Datagrams that sendmmsg() failed to send
+#endif
+  unsigned is_listening : 1;      // Listening connection
+  unsigned is_client : 1;         // Outbound (client) connection
+  unsigned is_accepted : 1;       // Accepted (server) connection
+  unsigned is_resolving : 1;      // Non-blocking DNS resolv is in progress
+  unsigned is_connecting : 1;     // Non-blocking connect is in progress
+  unsigned is_tls : 1;            // TLS-enabled connection
+  unsigned is_tls_hs : 1;         // TLS handshake is in progress
+  unsigned is_udp : 1;            // UDP connection
+  unsigned is_websocket : 1;      // WebSocket connection
+  unsigned is_hexdumping : 1;     // Hexdump in/out traffic
+  unsigned is_draining : 1;       // Send remaining data, then close and free
+  unsigned is_closing : 1;        // Close and free the connection immediately
+  unsigned is_readable : 1;       // Connection is ready to read
+  unsigned is_writable : 1;       // Connection is ready to write
+  unsigned is_paused : 1;         // Do not read from the socket
+  unsigned is_recv_full : 1;      // Recv buffer reached recv_high
+  unsigned is_send_full : 1;      // Send queue reached send_high
+  unsigned is_epollin : 1;        // EPOLLIN is registered for this socket
+  unsigned is_epollout : 1;       // EPOLLOUT is registered for this socket
+  unsigned is_ready : 1;          // Connection is in struct mg_mgr :: ready
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
 void mg_mgr_init(struct mg_mgr *);
 void mg_mgr_free(struct mg_mgr *);
+bool mg_mgr_prealloc(struct mg_mgr *, size_t n);
 
 struct mg_connection *mg_listen(struct mg_mgr *, const char *url,
                                 mg_event_handler_t fn, void *fn_data);
 struct mg_connection *mg_connect(struct mg_mgr *, const char *url,
                                  mg_event_handler_t fn, void *fn_data);
+struct mg_connection *mg_listen_opts(struct mg_mgr *, const char *url,
+                                     const struct mg_sock_opts *opts,
+                                     mg_event_handler_t fn, void *fn_data);
+struct mg_connection *mg_connect_opts(struct mg_mgr *, const char *url,
+                                      const struct mg_sock_opts *opts,
+                                      mg_event_handler_t fn, void *fn_data);
 int mg_send(struct mg_connection *, const void *, size_t);
 int mg_printf(struct mg_connection *, const char *fmt, ...);
 int mg_vprintf(struct mg_connection *, const char *fmt, va_list ap);
 char *mg_straddr(struct mg_connection *, char *, size_t);
+
+// Reference counted buffer that can be sent to many connections
+struct mg_shared {
+  int refcnt;  // Reference count
+  size_t len;  // Data length
+  char *buf;   // Data, allocated together with this structure
+};
+
+struct mg_shared *mg_shared_new(const void *buf, size_t len);
+void mg_shared_ref(struct mg_shared *);
+void mg_shared_release(struct mg_shared *);
+int mg_send_ref(struct mg_connection *, const void *buf, size_t len,
+                void (*release)(void *), void *arg);
+int mg_send_shared(struct mg_connection *, struct mg_shared *);
+int mg_send_file(struct mg_connection *, int fd, int64_t offset, size_t len,
+                 void (*release)(void *), void *arg);
+bool mg_relay(struct mg_connection *, struct mg_connection *);
+bool mg_udp_demux(struct mg_connection *, unsigned long idle_ms);
 bool mg_socketpair(int *s1, int *s2);
+struct mg_connection *mg_conn_by_id(struct mg_mgr *, unsigned long id);
+
+#if MG_ENABLE_WAKEUP
+bool mg_mgr_wakeup_init(struct mg_mgr *);
+bool mg_mgr_wakeup(struct mg_mgr *, unsigned long id, const void *buf,
+                   size_t len);
+#endif
+
+#if MG_ENABLE_WORKERS
+bool mg_workers_init(struct mg_mgr *, int nthreads, int max_queued);
+bool mg_submit(struct mg_mgr *, unsigned long id, void (*fn)(void *),
+               void *arg);
+#endif
+
+#if MG_ENABLE_REACTORS
+#define MG_REACTORS_PIN 1  // Pin reactor N to CPU N, steer connections by CPU
+struct mg_reactors *mg_reactors_start(int n, int flags,
+                                      void (*fn)(struct mg_mgr *, void *),
+                                      void *fn_data);
+void mg_reactors_stop(struct mg_reactors *);
+#endif
 bool mg_aton(struct mg_str str, struct mg_addr *addr);
 char *mg_ntoa(const struct mg_addr *addr, char *buf, size_t len);
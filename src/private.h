@@ -1,4 +1,84 @@
 void mg_connect_resolved(struct mg_connection *);
+void mg_ready(struct mg_connection *);
+void mg_unready(struct mg_connection *);
+struct mg_connection *mg_alloc_conn(struct mg_mgr *);
+void mg_free_conn(struct mg_connection *);
+void mg_add_conn(struct mg_connection *);
+void mg_del_conn(struct mg_connection *);
+void mg_io_drained(struct mg_mgr *, struct mg_iobuf *);
+#if MG_ENABLE_SOCKET && MG_ENABLE_WAKEUP
+bool mg_wakeup_post(struct mg_mgr *, unsigned long id, int ev, const void *buf,
+                    size_t len);
+void mg_wakeup_free(struct mg_mgr *);
+#endif
+#if MG_ENABLE_SOCKET && MG_ENABLE_WORKERS
+void mg_workers_free(struct mg_mgr *);
+#endif
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_IO_URING
+struct mg_uring {
+  int fd;  // Ring file descriptor
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;  // Submission queue entries
+  struct io_uring_cqe *cqes;  // Completion queue entries
+  unsigned sq_entries;        // Submission queue size
+  void *sq_ptr, *cq_ptr;      // Mapped rings
+  size_t sq_len, cq_len, sqes_len;
+  unsigned char *bufs;            // Provided receive buffers
+  unsigned nbufs, bufsize;        // Number and size of receive buffers
+  unsigned *lost, nlost;  // Buffers not yet given back, as SQ was full
+  struct mg_uring_conn *zombies;  // Closed connections with in-flight IO
+};
+
+struct mg_uring *mg_uring_new(unsigned entries, unsigned nbufs,
+                              unsigned bufsize);
+void mg_uring_free(struct mg_uring *);
+struct io_uring_sqe *mg_uring_sqe(struct mg_uring *);
+int mg_uring_enter(struct mg_uring *, int wait_ms);
+struct io_uring_cqe *mg_uring_cqe(struct mg_uring *);
+void mg_uring_cqe_done(struct mg_uring *);
+unsigned char *mg_uring_buf(struct mg_uring *, unsigned bid);
+void mg_uring_provide(struct mg_uring *, unsigned bid);
+void mg_uring_close(struct mg_mgr *);
+#endif
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_REACTORS
+struct mg_reactors {
+  int n;                                // Number of reactors
+  int nthreads;                         // Number of threads created
+  int flags;                            // MG_REACTORS_* flags
+  void (*fn)(struct mg_mgr *, void *);  // Sets up listeners of each reactor
+  void *fn_data;                        // Parameter for fn
+  int started;                          // Number of reactors set up so far
+  int stop;                             // Tells reactors to exit, atomic
+  struct mg_mgr **mgrs;                 // Running reactors, to wake them up
+  pthread_mutex_t lock;                 // Protects started and mgrs
+  pthread_cond_t cond;                  // Signalled when started changes
+  pthread_t *threads;                   // Reactor threads
+};
+#endif
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_WORKERS
+struct mg_work {
+  struct mg_work *next;  // Linkage in struct mg_workers :: queue
+  unsigned long id;      // Connection that gets MG_EV_WORK_DONE
+  void (*fn)(void *);    // Work function, runs on a worker thread
+  void *arg;             // Parameter for fn
+};
+
+struct mg_workers {
+  struct mg_mgr *mgr;        // Manager to deliver MG_EV_WORK_DONE to
+  struct mg_work *queue;     // Work not yet picked up by workers
+  struct mg_work **tail;     // Where to append new work
+  int queued, max_queued;    // Queue length and its limit
+  int nthreads;              // Number of worker threads
+  int stop;                  // Tells workers to exit
+  pthread_mutex_t lock;      // Protects everything above
+  pthread_cond_t cond;       // Signalled when work is queued or stop is set
+  pthread_t *threads;        // Worker threads
+};
+#endif
 
 #if MG_ARCH == MG_ARCH_FREERTOS
 static inline void *mg_calloc(int cnt, size_t size) {
@@ -0,0 +1,109 @@
+#include "log.h"
+#include "net.h"
+#include "private.h"
+#include "util.h"
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_REACTORS
+#if defined(__linux__)
+#include <sys/syscall.h>
+
+static void mg_pin_thread(int cpu) {
+  unsigned long mask[16];
+  size_t bits = sizeof(mask[0]) * 8;
+  memset(mask, 0, sizeof(mask));
+  mask[((size_t) cpu / bits) % 16] |= 1UL << ((size_t) cpu % bits);
+  if (syscall(__NR_sched_setaffinity, 0, sizeof(mask), mask) != 0) {
+    LOG(LL_ERROR, ("sched_setaffinity(%d): %d", cpu, errno));
+  }
+}
+#else
+#define mg_pin_thread(cpu)
+#endif
+
+static void *mg_reactor_thread(void *param) {
+  struct mg_reactors *r = (struct mg_reactors *) param;
+  struct mg_mgr mgr;
+  mg_mgr_init(&mgr);
+  mgr.reactors = r;
+  mgr.reactor_id = r->started;  // Reactors are set up one by one
+  if (r->flags & MG_REACTORS_PIN) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    mg_pin_thread((int) (mgr.reactor_id % (ncpus > 0 ? ncpus : 1)));
+  }
+  mg_mgr_wakeup_init(&mgr);  // Lets mg_reactors_stop() interrupt the poll
+  r->fn(&mgr, r->fn_data);
+  LOG(LL_DEBUG, ("reactor %d started", mgr.reactor_id));
+  pthread_mutex_lock(&r->lock);
+  r->mgrs[mgr.reactor_id] = &mgr;
+  r->started++;
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) mg_mgr_poll(&mgr, 50);
+  // Leave the group before mgr goes away, so that nobody wakes it up after
+  pthread_mutex_lock(&r->lock);
+  r->mgrs[mgr.reactor_id] = NULL;
+  pthread_mutex_unlock(&r->lock);
+  mg_mgr_free(&mgr);
+  return NULL;
+}
+
+// Start n event loops, each on its own thread with its own manager. fn is
+// called in the reactor thread to create listeners, before the event loop
+// starts. Listeners on the same URL share the port via SO_REUSEPORT.
+// Reactors are set up one at a time, so listeners join SO_REUSEPORT groups
+// in reactor order
+struct mg_reactors *mg_reactors_start(int n, int flags,
+                                      void (*fn)(struct mg_mgr *, void *),
+                                      void *fn_data) {
+  struct mg_reactors *r = (struct mg_reactors *) calloc(1, sizeof(*r));
+  if (r == NULL || n <= 0 ||
+      (r->threads = (pthread_t *) calloc((size_t) n, sizeof(pthread_t))) ==
+          NULL ||
+      (r->mgrs = (struct mg_mgr **) calloc((size_t) n, sizeof(*r->mgrs))) ==
+          NULL) {
+    if (r != NULL) free(r->threads);
+    free(r);
+    return NULL;
+  }
+  r->n = n;
+  r->flags = flags;
+  r->fn = fn;
+  r->fn_data = fn_data;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  for (r->nthreads = 0; r->nthreads < n; r->nthreads++) {
+    pthread_t *t = &r->threads[r->nthreads];
+    if (pthread_create(t, NULL, mg_reactor_thread, r) != 0) {
+      LOG(LL_ERROR, ("pthread_create: %d", errno));
+      break;
+    }
+    pthread_mutex_lock(&r->lock);
+    while (r->started <= r->nthreads) pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+  }
+  if (r->nthreads < n) {
+    mg_reactors_stop(r);
+    r = NULL;
+  }
+  return r;
+}
+
+// Stop all reactors, close their connections and wait for their threads
+void mg_reactors_stop(struct mg_reactors *r) {
+  int i;
+  if (r == NULL) return;
+  __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+  // Wake reactors up, so they see stop now rather than after a poll timeout
+  pthread_mutex_lock(&r->lock);
+  for (i = 0; i < r->n; i++) {
+    if (r->mgrs[i] != NULL) mg_mgr_wakeup(r->mgrs[i], 0, NULL, 0);
+  }
+  pthread_mutex_unlock(&r->lock);
+  for (i = 0; i < r->nthreads; i++) pthread_join(r->threads[i], NULL);
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+  free(r->mgrs);
+  free(r->threads);
+  free(r);
+}
+#endif
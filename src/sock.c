@@ -69,21 +69,594 @@ static int mg_sock_failed(void) {
       ;
 }
 
+// Maximum number of send queue chunks written by a single syscall
+#define MG_SEND_IOV 16
+
+// Send queue segment, see mg_send_ref() and mg_send_file(). Goes out after
+// the first `at` bytes of c->send, so that it keeps its place among data
+// copied by mg_send()
+struct mg_seg {
+  struct mg_seg *next;      // Next segment
+  const char *buf;          // Data not sent yet, NULL for a file segment
+  size_t len;               // Length of data not sent yet
+  size_t at;                // Bytes of c->send that go before this segment
+  int fd;                   // File descriptor of a file segment
+  int64_t off;              // File offset of data not sent yet
+  void (*release)(void *);  // Called when sent or when connection closes
+  void *arg;                // Argument for release()
+};
+
+// Two connections bound by mg_relay(). Data from c[i] goes to c[1 - i],
+// either through IO buffers, or through a kernel pipe with splice()
+struct mg_relay {
+  struct mg_connection *c[2];  // Relayed connections
+  int pipe[2][2];              // Pipe for data from c[i], or -1
+  size_t inpipe[2];            // Bytes in pipe[i]
+  bool eof[2];                 // c[i] has no more data to send
+  bool shut[2];                // Write side of c[1 - i] is shut down
+  bool splice;                 // Relay with splice()
+};
+
+// Bytes spliced from the relay peer that wait for the socket to be writable
+static size_t mg_relay_pending(struct mg_connection *c) {
+  struct mg_relay *r = (struct mg_relay *) c->relay;
+  return r == NULL ? 0 : r->inpipe[r->c[0] == c ? 1 : 0];
+}
+
+// True if connection reads from the socket: not paused by the application
+// or by mg_relay(), and the recv buffer is below the high watermark
+static bool mg_want_read(struct mg_connection *c) {
+  return !c->is_paused && !c->is_recv_full;
+}
+
+// True if connection waits for the socket to become writable
+static bool mg_want_write(struct mg_connection *c) {
+  return c->is_connecting ||
+         ((c->send.len > 0 || c->segs != NULL || mg_relay_pending(c) > 0) &&
+          c->is_tls_hs == 0);
+}
+
+// Append segment to the send queue. Segments leave from the head only, so
+// the tail link stays valid for as long as the queue is not empty
+static void mg_segs_add(struct mg_connection *c, struct mg_seg *s) {
+  if (c->segs == NULL) c->segs_tail = &c->segs;
+  *c->segs_tail = s;
+  c->segs_tail = &s->next;
+}
+
+static void mg_segs_free(struct mg_connection *c) {
+  struct mg_seg *s;
+  while ((s = c->segs) != NULL) {
+    c->segs = s->next;
+    if (s->release != NULL) s->release(s->arg);
+    mg_dealloc(s);
+  }
+}
+
+// Split outstanding data into at most max chunks, in sending order. Stop at
+// a file segment, it is sent separately
+static int mg_send_chunks(struct mg_connection *c, struct mg_str *v, int max) {
+  struct mg_seg *s;
+  size_t pos = 0;
+  int n = 0;
+  for (s = c->segs; s != NULL && n < max; s = s->next) {
+    if (s->at > pos) v[n++] = mg_str_n((char *) c->send.buf + pos, s->at - pos);
+    pos = s->at;
+    if (s->buf == NULL) return n;
+    if (n < max) v[n++] = mg_str_n(s->buf, s->len);
+  }
+  if (n < max && c->send.len > pos) {
+    v[n++] = mg_str_n((char *) c->send.buf + pos, c->send.len - pos);
+  }
+  return n;
+}
+
+// Discard n sent bytes, releasing fully sent segments
+static void mg_send_consume(struct mg_connection *c, size_t n) {
+  struct mg_seg *s;
+  while (n > 0 && (s = c->segs) != NULL) {
+    if (s->at > 0) {
+      size_t k = n < s->at ? n : s->at;
+      mg_iobuf_delete(&c->send, k);
+      for (; s != NULL; s = s->next) s->at -= k;
+      n -= k;
+    } else {
+      size_t k = n < s->len ? n : s->len;
+      if (s->buf == NULL) {
+        s->off += (int64_t) k;
+      } else {
+        s->buf += k;
+      }
+      s->len -= k, n -= k;
+      if (s->len == 0) {
+        c->segs = s->next;
+        if (s->release != NULL) s->release(s->arg);
+        mg_dealloc(s);
+      }
+    }
+  }
+  if (n > 0) mg_iobuf_delete(&c->send, n);
+}
+
+#if MG_ENABLE_IO_URING
+// Copy all segments into the send buffer, for IO paths that need the data
+// in one piece
+static void mg_segs_flatten(struct mg_connection *c) {
+  struct mg_iobuf io = {NULL, 0, 0, 0};
+  struct mg_str v[MG_SEND_IOV];
+  while (c->segs != NULL) {
+    int i, n = mg_send_chunks(c, v, MG_SEND_IOV);
+    size_t len = 0;
+    for (i = 0; i < n; i++) {
+      mg_iobuf_reserve(&io, v[i].len, MG_IO_SIZE, c->mgr->iogrow);
+      len += mg_iobuf_append(&io, v[i].ptr, v[i].len, MG_IO_SIZE);
+    }
+    mg_send_consume(c, len);
+    if (len == 0) break;  // Out of memory, keep the rest queued
+  }
+  if (c->segs != NULL) {
+    mg_iobuf_free(&io);
+  } else {
+    mg_iobuf_append(&io, c->send.buf, c->send.len, MG_IO_SIZE);
+    mg_iobuf_free(&c->send);
+    c->send = io;
+  }
+}
+#endif
+
+#if MG_ENABLE_IO_URING
+// In-flight io_uring operations. Operation type is stored in the low bits of
+// the SQE user_data, the rest is a pointer to struct mg_uring_conn
+enum { URING_RECV, URING_SEND, URING_ACCEPT, URING_POLLIN, URING_POLLOUT };
+#define URING_OP_MASK 7UL
+
+struct mg_uring_conn {
+  struct mg_uring_conn *next;  // Linkage in struct mg_uring :: zombies
+  struct mg_connection *c;     // Our connection, NULL when closed
+  struct mg_iobuf tx;          // Data handed to the kernel for sending
+  size_t sent;                 // Sent bytes, not yet reported by MG_EV_WRITE
+  int rx_bid;                  // Received buffer ID, or -1 if none
+  int rx_len, rx_ofs;          // Received buffer length and read offset
+  int err;                     // Sticky socket error, -1 on EOF
+  SOCKET afd;                  // Accepted socket
+  union usa addr;              // Accepted peer address
+  socklen_t alen;              // Accepted peer address length
+  unsigned pending;            // Bitmask of in-flight operations
+};
+
+// Plain TCP data connections do IO through io_uring. Other connections, like
+// TLS or UDP, use io_uring only to wait for readiness and do IO as usual
+static bool mg_uring_io(struct mg_connection *c) {
+#if MG_ENABLE_WAKEUP
+  if (c == c->mgr->wakeup) return false;
+#endif
+  return c->uring != NULL && !c->is_tls && !c->is_udp && !c->is_listening &&
+         !c->is_connecting;
+}
+
+static struct io_uring_sqe *mg_uring_prep(struct mg_connection *c, int op,
+                                          int opcode) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  struct io_uring_sqe *sqe = mg_uring_sqe(c->mgr->uring);
+  if (sqe != NULL) {
+    sqe->opcode = (uint8_t) opcode;
+    sqe->fd = FD(c);
+    sqe->user_data = (uint64_t) (uintptr_t) u | (uint64_t) op;
+    u->pending |= 1U << op;
+  }
+  return sqe;
+}
+
+static void mg_uring_free_conn(struct mg_uring_conn *u) {
+  mg_iobuf_free(&u->tx);
+  free(u);
+}
+
+static void mg_uring_arm(struct mg_connection *c) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  struct io_uring_sqe *sqe;
+  if (u == NULL) {
+    if ((u = (struct mg_uring_conn *) calloc(1, sizeof(*u))) == NULL) return;
+    u->c = c;
+    u->rx_bid = -1;
+    u->afd = INVALID_SOCKET;
+    c->uring = u;
+  }
+  if (c->is_listening && !c->is_udp) {
+    if (!(u->pending & (1U << URING_ACCEPT)) && u->afd == INVALID_SOCKET &&
+        (sqe = mg_uring_prep(c, URING_ACCEPT, IORING_OP_ACCEPT)) != NULL) {
+      u->alen = sizeof(u->addr);
+      sqe->addr = (uint64_t) (uintptr_t) &u->addr;
+      sqe->addr2 = (uint64_t) (uintptr_t) &u->alen;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+  } else if (mg_uring_io(c)) {
+    if (!(u->pending & (1U << URING_RECV)) && u->rx_bid < 0 && u->err == 0 &&
+        mg_want_read(c) &&
+        (sqe = mg_uring_prep(c, URING_RECV, IORING_OP_RECV)) != NULL) {
+      sqe->len = c->mgr->uring->bufsize;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = 0;
+    }
+    if (!(u->pending & (1U << URING_SEND)) && u->err == 0) {
+      // Take over the send buffer, so that mg_send() can safely grow a new
+      // one while the kernel reads from this one
+      if (u->tx.len == 0 && c->segs != NULL) mg_segs_flatten(c);
+      if (u->tx.len == 0 && c->send.len > 0) {
+        struct mg_iobuf tmp = u->tx;
+        u->tx = c->send;
+        c->send = tmp;
+      }
+      if (u->tx.len > 0 &&
+          (sqe = mg_uring_prep(c, URING_SEND, IORING_OP_SEND)) != NULL) {
+        sqe->addr = (uint64_t) (uintptr_t) u->tx.buf;
+        sqe->len = (uint32_t) u->tx.len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+      }
+    }
+  } else {
+    if (!(u->pending & (1U << URING_POLLIN)) && mg_want_read(c) &&
+        (sqe = mg_uring_prep(c, URING_POLLIN, IORING_OP_POLL_ADD)) != NULL) {
+      sqe->poll32_events = POLLIN;
+    }
+    if (!(u->pending & (1U << URING_POLLOUT)) && mg_want_write(c) &&
+        (sqe = mg_uring_prep(c, URING_POLLOUT, IORING_OP_POLL_ADD)) != NULL) {
+      sqe->poll32_events = POLLOUT;
+    }
+  }
+}
+
+// Turn results of completed, but not yet consumed operations into readiness
+// flags. Return true if there are any
+static bool mg_uring_results(struct mg_connection *c) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  bool rd, wr;
+  if (u == NULL) return false;
+  rd = ((u->rx_bid >= 0 || u->err != 0) && mg_want_read(c)) ||
+       u->afd != INVALID_SOCKET;
+  wr = u->sent > 0 || u->err > 0;
+  if (rd) c->is_readable = 1;
+  if (wr) c->is_writable = 1;
+  return rd || wr;
+}
+
+static bool mg_uring_failed(int res) {
+  return res != -EAGAIN && res != -EINTR && res != -ENOBUFS &&
+         res != -ECANCELED;
+}
+
+static void mg_uring_complete(struct mg_uring *r, struct io_uring_cqe *cqe) {
+  struct mg_uring_conn *u =
+      (struct mg_uring_conn *) (uintptr_t) (cqe->user_data & ~URING_OP_MASK);
+  struct mg_connection *c;
+  int op = (int) (cqe->user_data & URING_OP_MASK), res = cqe->res;
+  if (u == NULL) return;  // Buffer or cancel request, ignore
+  u->pending &= ~(1U << op);
+  c = u->c;
+  if (op == URING_RECV && res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    u->rx_bid = (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    u->rx_len = res;
+    u->rx_ofs = 0;
+    if (c == NULL) mg_uring_provide(r, (unsigned) u->rx_bid), u->rx_bid = -1;
+  } else if (op == URING_RECV) {
+    if (res == 0) u->err = -1;
+    if (res < 0 && mg_uring_failed(res)) u->err = -res;
+  } else if (op == URING_SEND) {
+    if (res > 0) {
+      mg_iobuf_delete(&u->tx, (size_t) res);
+      if (c != NULL) mg_io_drained(c->mgr, &u->tx);
+      u->sent += (size_t) res;
+    } else if (mg_uring_failed(res)) {
+      u->err = res == 0 ? -1 : -res;
+    }
+  } else if (op == URING_ACCEPT) {
+    if (res >= 0 && c == NULL) closesocket(res);
+    if (res >= 0 && c != NULL) u->afd = (SOCKET) res;
+    if (res < 0 && mg_uring_failed(res)) {
+      LOG(LL_ERROR, ("%lu accept failed, errno %d", c ? c->id : 0, -res));
+    }
+  } else if (c != NULL && op == URING_POLLIN) {
+    c->is_readable = 1;
+  } else if (c != NULL && op == URING_POLLOUT) {
+    if (mg_want_write(c)) c->is_writable = 1;
+  }
+  if (c != NULL) {
+    mg_uring_results(c);
+    mg_ready(c);
+  } else if (u->pending == 0) {
+    LIST_DELETE(struct mg_uring_conn, &r->zombies, u);
+    mg_uring_free_conn(u);
+  }
+}
+
+static void mg_uring_iotest(struct mg_mgr *mgr, int ms) {
+  struct io_uring_cqe *cqe;
+  struct mg_connection *c;
+
+  // Only queued connections may need new operations, or have unconsumed
+  // results. Completions queue their connections by themselves
+  for (c = mgr->ready; c != NULL; c = c->rnext) {
+    if (c->is_closing) ms = 0;
+    if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
+    mg_uring_arm(c);
+    if (mg_uring_results(c)) ms = 0;
+  }
+
+  // Submit everything and wait for completions with a single syscall
+  mg_uring_enter(mgr->uring, ms);
+  while ((cqe = mg_uring_cqe(mgr->uring)) != NULL) {
+    mg_uring_complete(mgr->uring, cqe);
+    mg_uring_cqe_done(mgr->uring);
+  }
+}
+
+static int mg_uring_recv(struct mg_connection *c, void *buf, int len,
+                         int *fail) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  int n = 0;
+  if (u->rx_bid >= 0) {
+    n = u->rx_len - u->rx_ofs;
+    if (n > len) n = len;
+    memcpy(buf, mg_uring_buf(c->mgr->uring, (unsigned) u->rx_bid) + u->rx_ofs,
+           (size_t) n);
+    u->rx_ofs += n;
+    if (u->rx_ofs >= u->rx_len) {
+      mg_uring_provide(c->mgr->uring, (unsigned) u->rx_bid);
+      u->rx_bid = -1;
+    }
+  }
+  *fail = n == 0 && u->err != 0;
+  return n;
+}
+
+// Data is already sent by the kernel, report it to the application
+static int mg_uring_write_conn(struct mg_connection *c) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  int rc = (int) u->sent;
+  u->sent = 0;
+  if (rc > 0) mg_call(c, MG_EV_WRITE, &rc);
+  if (u->err > 0) c->is_closing = 1;
+  return rc;
+}
+
+// Cancel in-flight operations of a closing connection. The state is kept
+// until all of them complete, because the kernel may still use it
+static void mg_uring_detach(struct mg_connection *c) {
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  struct mg_uring *r = c->mgr->uring;
+  int op;
+  if (u == NULL) return;
+  c->uring = NULL;
+  u->c = NULL;
+  if (u->rx_bid >= 0) mg_uring_provide(r, (unsigned) u->rx_bid);
+  if (u->afd != INVALID_SOCKET) closesocket(u->afd);
+  if (u->pending == 0) {
+    mg_uring_free_conn(u);
+    return;
+  }
+  for (op = URING_RECV; op <= URING_POLLOUT; op++) {
+    struct io_uring_sqe *sqe;
+    if (!(u->pending & (1U << op)) || (sqe = mg_uring_sqe(r)) == NULL) continue;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) (uintptr_t) u | (uint64_t) op;
+  }
+  LIST_ADD_HEAD(struct mg_uring_conn, &r->zombies, u);
+}
+
+void mg_uring_close(struct mg_mgr *mgr) {
+  struct mg_uring *r = mgr->uring;
+  struct io_uring_cqe *cqe;
+  int i;
+  if (r == NULL) return;
+  // Let cancellations complete, but do not wait forever
+  for (i = 0; i < 100 && r->zombies != NULL; i++) {
+    mg_uring_enter(r, 1);
+    while ((cqe = mg_uring_cqe(r)) != NULL) {
+      mg_uring_complete(r, cqe);
+      mg_uring_cqe_done(r);
+    }
+  }
+  while (r->zombies != NULL) {
+    struct mg_uring_conn *u = r->zombies;
+    r->zombies = u->next;
+    mg_uring_free_conn(u);
+  }
+  mg_uring_free(r);
+  mgr->uring = NULL;
+}
+#endif
+
 static struct mg_connection *alloc_conn(struct mg_mgr *mgr, int is_client,
                                         SOCKET fd) {
-  struct mg_connection *c = (struct mg_connection *) calloc(1, sizeof(*c));
+  struct mg_connection *c = mg_alloc_conn(mgr);
   if (c != NULL) {
     c->is_client = is_client;
     c->fd = (void *) (long) fd;
     c->mgr = mgr;
     c->id = ++mgr->nextid;
+    c->lastio = c->since = mgr->timers.now;
+  }
+  return c;
+}
+
+// Virtual connections of a demultiplexing UDP listener, see mg_udp_demux()
+struct mg_udp_peer {
+  struct mg_udp_peer *next;   // Hash chain
+  struct mg_connection *c;    // Virtual connection of this peer
+  struct mg_connection *lsn;  // Listener, NULL when closed
+  unsigned long last;         // Last datagram to or from the peer, in ms
+};
+
+struct mg_udp_table {
+  struct mg_udp_peer **buckets;  // Peers by address
+  size_t size;                   // Number of buckets, a power of two
+  size_t count;                  // Number of peers
+  unsigned long idle_ms;         // Close idle peers, 0: never
+};
+
+static size_t mg_addr_hash(const struct mg_addr *a) {
+  uint32_t h = 2166136261U ^ a->port;
+  size_t i;
+  if (a->is_ip6) {
+    for (i = 0; i < sizeof(a->ip6); i++) h = (h ^ a->ip6[i]) * 16777619U;
+  } else {
+    h = (h ^ a->ip) * 16777619U;
+  }
+  return (size_t) (h ^ (h >> 16));
+}
+
+static bool mg_addr_eq(const struct mg_addr *a, const struct mg_addr *b) {
+  if (a->port != b->port || a->is_ip6 != b->is_ip6) return false;
+  return a->is_ip6 ? memcmp(a->ip6, b->ip6, sizeof(a->ip6)) == 0
+                   : a->ip == b->ip;
+}
+
+static bool mg_udp_virtual(struct mg_connection *c) {
+  return c->udp != NULL && !c->is_listening;
+}
+
+// Socket that carries datagrams of a UDP connection: its own, or that of the
+// listener for a virtual one. NULL if the listener is gone
+static struct mg_connection *mg_udp_sock(struct mg_connection *c) {
+  return mg_udp_virtual(c) ? ((struct mg_udp_peer *) c->udp)->lsn : c;
+}
+
+static void mg_udp_resize(struct mg_udp_table *t, size_t nbuckets) {
+  size_t i, size = nbuckets * sizeof(*t->buckets);
+  struct mg_udp_peer **b = (struct mg_udp_peer **) mg_alloc(size), *p;
+  if (b == NULL) return;  // Keep the old table, chains just get longer
+  memset(b, 0, size);
+  for (i = 0; i < t->size; i++) {
+    while ((p = t->buckets[i]) != NULL) {
+      t->buckets[i] = p->next;
+      p->next = b[mg_addr_hash(&p->c->peer) & (nbuckets - 1)];
+      b[mg_addr_hash(&p->c->peer) & (nbuckets - 1)] = p;
+    }
+  }
+  mg_dealloc(t->buckets);
+  t->buckets = b;
+  t->size = nbuckets;
+}
+
+bool mg_udp_demux(struct mg_connection *c, unsigned long idle_ms) {
+  struct mg_udp_table *t;
+  if (!c->is_listening || !c->is_udp || c->udp != NULL) return false;
+  if ((t = (struct mg_udp_table *) mg_alloc(sizeof(*t))) == NULL) return false;
+  memset(t, 0, sizeof(*t));
+  t->idle_ms = idle_ms;
+  mg_udp_resize(t, 16);
+  if (t->buckets == NULL) {
+    mg_dealloc(t);
+    return false;
+  }
+  c->udp = t;
+  return true;
+}
+
+// Virtual connection for the sender of the last datagram, in lsn->peer.
+// A new peer gets a new connection, announced by MG_EV_ACCEPT
+static struct mg_connection *mg_udp_peer(struct mg_connection *lsn) {
+  struct mg_udp_table *t = (struct mg_udp_table *) lsn->udp;
+  struct mg_udp_peer *p, **b;
+  struct mg_connection *c;
+  b = &t->buckets[mg_addr_hash(&lsn->peer) & (t->size - 1)];
+  for (p = *b; p != NULL; p = p->next) {
+    if (mg_addr_eq(&p->c->peer, &lsn->peer)) break;
+  }
+  if (p != NULL) {
+    p->last = lsn->mgr->timers.now;
+    return p->c;
+  }
+  p = (struct mg_udp_peer *) mg_alloc(sizeof(*p));
+  c = p == NULL ? NULL : alloc_conn(lsn->mgr, 0, INVALID_SOCKET);
+  if (c == NULL) {
+    LOG(LL_ERROR, ("%lu OOM", lsn->id));
+    mg_dealloc(p);
+    return NULL;
+  }
+  if (t->count >= t->size) {
+    mg_udp_resize(t, t->size * 2);
+    b = &t->buckets[mg_addr_hash(&lsn->peer) & (t->size - 1)];
   }
+  p->c = c;
+  p->lsn = lsn;
+  p->last = lsn->mgr->timers.now;
+  p->next = *b;
+  *b = p;
+  t->count++;
+  c->peer = lsn->peer;
+  c->udp = p;
+  c->is_udp = 1;
+  c->is_accepted = 1;
+  c->is_hexdumping = lsn->is_hexdumping;
+  c->recv_high = lsn->recv_high, c->recv_low = lsn->recv_low;
+  c->pfn = lsn->pfn;
+  c->pfn_data = lsn->pfn_data;
+  c->fn = lsn->fn;
+  c->fn_data = lsn->fn_data;
+  mg_add_conn(c);
+  mg_call(c, MG_EV_ACCEPT, NULL);
   return c;
 }
 
+// Pass a datagram from lsn->peer to its virtual connection, or to the
+// listener itself if it does not demultiplex. Datagrams for a peer that
+// does not read are dropped
+static void mg_udp_deliver(struct mg_connection *lsn, const void *buf,
+                           size_t len) {
+  struct mg_connection *c = lsn->udp == NULL ? lsn : mg_udp_peer(lsn);
+  struct mg_str evd;
+  if (c == NULL || c->is_closing || (c != lsn && !mg_want_read(c))) return;
+  if (!mg_iobuf_reserve(&c->recv, len, MG_IO_SIZE, c->mgr->iogrow)) {
+    c->is_closing = 1;
+    return;
+  }
+  evd = mg_str_n((char *) c->recv.buf + c->recv.len, len);
+  mg_iobuf_append(&c->recv, buf, len, MG_IO_SIZE);
+  mg_call(c, MG_EV_READ, &evd);
+  if (c != lsn) {
+    mg_io_drained(c->mgr, &c->recv);
+    mg_ready(c);  // Apply watermarks, close if asked to
+  }
+}
+
+// Closing virtual connection leaves the listener's table. Closing listener
+// closes all its virtual connections
+static void mg_udp_free(struct mg_connection *c) {
+  if (c->udp == NULL) {
+  } else if (c->is_listening) {
+    struct mg_udp_table *t = (struct mg_udp_table *) c->udp;
+    struct mg_udp_peer *p;
+    size_t i;
+    for (i = 0; i < t->size; i++) {
+      for (p = t->buckets[i]; p != NULL; p = p->next) {
+        p->lsn = NULL;
+        p->c->is_closing = 1;
+        mg_ready(p->c);
+      }
+    }
+    mg_dealloc(t->buckets);
+    mg_dealloc(t);
+  } else {
+    struct mg_udp_peer *p = (struct mg_udp_peer *) c->udp, **b;
+    if (p->lsn != NULL) {
+      struct mg_udp_table *t = (struct mg_udp_table *) p->lsn->udp;
+      b = &t->buckets[mg_addr_hash(&c->peer) & (t->size - 1)];
+      while (*b != NULL && *b != p) b = &(*b)->next;
+      if (*b != NULL) *b = p->next;
+      t->count--;
+    }
+    mg_dealloc(p);
+  }
+  c->udp = NULL;
+}
+
 static int mg_sock_recv(struct mg_connection *c, void *buf, int len,
                         int *fail) {
   int n = 0;
+#if MG_ENABLE_IO_URING
+  if (mg_uring_io(c)) return mg_uring_recv(c, buf, len, fail);
+#endif
   if (c->is_udp) {
     union usa usa;
     socklen_t slen = sizeof(usa.sin);
@@ -115,10 +688,15 @@ static int mg_sock_send(struct mg_connection *c, const void *buf, int len,
   if (c->is_udp) {
     union usa usa = tousa(&c->peer);
     socklen_t slen = sizeof(usa.sin);
+    struct mg_connection *s = mg_udp_sock(c);
 #if MG_ENABLE_IPV6
     if (c->peer.is_ip6) slen = sizeof(usa.sin6);
 #endif
-    n = sendto(FD(c), (char *) buf, len, 0, &usa.sa, slen);
+    if (s == NULL) {
+      *fail = 1;  // The listener is gone. No syscall ran, errno is stale
+      return -1;
+    }
+    n = sendto(FD(s), (char *) buf, len, 0, &usa.sa, slen);
   } else {
     n = send(FD(c), (char *) buf, len, MSG_NONBLOCKING);
   }
@@ -126,6 +704,13 @@ static int mg_sock_send(struct mg_connection *c, const void *buf, int len,
   return n;
 }
 
+static void mg_hexdump_io(struct mg_connection *c, const char *dir,
+                          const void *buf, size_t len) {
+  char *s = mg_hexdump(buf, len);
+  LOG(LL_INFO, ("\n-- %lu %s %s %d\n%s--", c->id, c->label, dir, (int) len, s));
+  free(s);
+}
+
 static int ll_read(struct mg_connection *c, void *buf, int len, int *fail) {
   int n = c->is_tls ? mg_tls_recv(c, buf, len, fail)
                     : mg_sock_recv(c, buf, len, fail);
@@ -133,11 +718,7 @@ static int ll_read(struct mg_connection *c, void *buf, int len, int *fail) {
       ("%lu %c%c%c %d/%d %d %d", c->id, c->is_tls ? 'T' : 't',
        c->is_udp ? 'U' : 'u', c->is_connecting ? 'C' : 'c', n, len,
        MG_SOCK_ERRNO, *fail));
-  if (n > 0 && c->is_hexdumping) {
-    char *s = mg_hexdump(buf, n);
-    LOG(LL_INFO, ("\n-- %lu %s %s %d\n%s--", c->id, c->label, "<-", n, s));
-    free(s);
-  }
+  if (n > 0 && c->is_hexdumping) mg_hexdump_io(c, "<-", buf, (size_t) n);
   return n;
 }
 
@@ -149,19 +730,284 @@ static int ll_write(struct mg_connection *c, const void *buf, int len,
       ("%lu %c%c%c %d/%d %d", c->id, c->is_tls ? 'T' : 't',
        c->is_udp ? 'U' : 'u', c->is_connecting ? 'C' : 'c', n, len,
        MG_SOCK_ERRNO));
-  if (n > 0 && c->is_hexdumping) {
-    char *s = mg_hexdump(buf, len);
-    LOG(LL_INFO, ("\n-- %lu %s %s %d\n%s--", c->id, c->label, "->", len, s));
-    free(s);
-  }
+  if (n > 0 && c->is_hexdumping) mg_hexdump_io(c, "->", buf, (size_t) len);
   return n;
 }
 
+// Write several chunks with one syscall. Where that is not possible, like
+// with TLS, write the first chunk only
+static int ll_writev(struct mg_connection *c, struct mg_str *v, int n,
+                     int *fail) {
+#if MG_ENABLE_POSIX
+  if (!c->is_tls) {
+    struct iovec iov[MG_SEND_IOV];
+    struct msghdr msg;
+    int i, rc;
+    for (i = 0; i < n; i++) {
+      iov[i].iov_base = (void *) v[i].ptr;
+      iov[i].iov_len = v[i].len;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) n;
+    rc = (int) sendmsg(FD(c), &msg, MSG_NONBLOCKING);
+    *fail = (rc == 0) || (rc < 0 && mg_sock_failed());
+    LOG(*fail ? LL_ERROR : LL_VERBOSE_DEBUG,
+        ("%lu writev %d chunks: %d %d", c->id, n, rc, MG_SOCK_ERRNO));
+    if (rc > 0 && c->is_hexdumping) {
+      int left = rc;
+      for (i = 0; i < n && left > 0; i++) {
+        int len = (int) v[i].len < left ? (int) v[i].len : left;
+        mg_hexdump_io(c, "->", v[i].ptr, (size_t) len);
+        left -= len;
+      }
+    }
+    return rc;
+  }
+#endif
+  return ll_write(c, v[0].ptr, (SOCKET) v[0].len, fail);
+}
+
+// Send file segment data straight from the page cache
+static int ll_sendfile(struct mg_connection *c, struct mg_seg *s, int *fail) {
+  int rc = -1;
+#if MG_ENABLE_SENDFILE
+  off_t off = (off_t) s->off;
+  size_t len = s->len < (1U << 30) ? s->len : (1U << 30);
+  rc = (int) sendfile(FD(c), s->fd, &off, len);
+  *fail = (rc == 0) || (rc < 0 && mg_sock_failed());
+  LOG(*fail ? LL_ERROR : LL_VERBOSE_DEBUG,
+      ("%lu sendfile %d %lu: %d %d", c->id, s->fd, (unsigned long) len, rc,
+       MG_SOCK_ERRNO));
+#else
+  *fail = 1;
+  (void) c, (void) s;
+#endif
+  return rc;
+}
+
+#if MG_ENABLE_MMSG
+// Datagram queued in c->send, data follows
+struct mg_dgram {
+  struct mg_addr peer;  // Destination
+  size_t len;           // Data length
+};
+
+// struct mmsghdr. glibc declares it only with _GNU_SOURCE, which mongoose
+// does not define, so that it does not change the user's libc interfaces
+struct mg_mmsghdr {
+  struct msghdr msg_hdr;  // Message
+  unsigned int msg_len;   // Bytes sent or received
+};
+
+static socklen_t mg_usa_len(struct mg_addr *a) {
+#if MG_ENABLE_IPV6
+  if (a->is_ip6) return sizeof(struct sockaddr_in6);
+#endif
+  (void) a;
+  return sizeof(struct sockaddr_in);
+}
+
+// Queue a datagram to peer. Replies to many peers, e.g. from a UDP
+// listener, go out together with a single sendmmsg()
+static int mg_udp_queue(struct mg_connection *c, struct mg_addr *peer,
+                        const void *buf, size_t len) {
+  struct mg_dgram d;
+  size_t step = c->mgr == NULL ? MG_IO_GROW : c->mgr->iogrow;
+  d.peer = *peer;
+  d.len = len;
+  if (!mg_iobuf_reserve(&c->send, sizeof(d) + len, MG_IO_SIZE, step)) return 0;
+  mg_iobuf_append(&c->send, &d, sizeof(d), MG_IO_SIZE);
+  mg_iobuf_append(&c->send, buf, len, MG_IO_SIZE);
+  mg_ready(c);
+  return (int) len;
+}
+
+// Send queued datagrams, MG_UDP_BATCH per syscall, until the socket buffer
+// is full. A datagram that cannot be sent is dropped and counted
+static void mg_udp_flush(struct mg_connection *c) {
+  struct mg_mmsghdr msgs[MG_UDP_BATCH];
+  struct iovec iov[MG_UDP_BATCH];
+  union usa usa[MG_UDP_BATCH];
+  size_t ends[MG_UDP_BATCH];
+  while (c->send.len > 0) {
+    size_t ofs = 0;
+    int i, n = 0, rc, err;
+    bool fail;
+    memset(msgs, 0, sizeof(msgs));
+    while (n < MG_UDP_BATCH && ofs < c->send.len) {
+      struct mg_dgram d;
+      memcpy(&d, c->send.buf + ofs, sizeof(d));
+      usa[n] = tousa(&d.peer);
+      iov[n].iov_base = c->send.buf + ofs + sizeof(d);
+      iov[n].iov_len = d.len;
+      msgs[n].msg_hdr.msg_name = &usa[n].sa;
+      msgs[n].msg_hdr.msg_namelen = mg_usa_len(&d.peer);
+      msgs[n].msg_hdr.msg_iov = &iov[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+      ofs += sizeof(d) + d.len;
+      ends[n++] = ofs;
+    }
+    rc = (int) syscall(__NR_sendmmsg, FD(c), msgs, (unsigned) n, 0);
+    err = MG_SOCK_ERRNO;  // Logging may change errno
+    fail = rc < 0 && mg_sock_failed();
+    LOG(LL_VERBOSE_DEBUG, ("%lu sendmmsg %d: %d %d", c->id, n, rc, err));
+    if (rc < 0 && !fail) break;  // Try again when writable
+    if (rc < 0) {
+      // The first datagram failed, e.g. with EMSGSIZE. Drop it, send the rest
+      LOG(LL_ERROR, ("%lu sendmmsg: %d, %lu bytes dropped", c->id, err,
+                     (unsigned long) iov[0].iov_len));
+      c->udp_dropped++;
+      mg_iobuf_delete(&c->send, ends[0]);
+      continue;
+    }
+    for (i = 0; i < rc && c->is_hexdumping; i++) {
+      mg_hexdump_io(c, "->", iov[i].iov_base, iov[i].iov_len);
+    }
+    mg_iobuf_delete(&c->send, ends[rc - 1]);
+  }
+  mg_io_drained(c->mgr, &c->send);
+}
+
+// Read up to MG_UDP_BATCH datagrams with a single syscall. Every datagram
+// is delivered by its own MG_EV_READ, with c->peer set to its sender
+static void mg_udp_read(struct mg_connection *c) {
+  struct mg_mmsghdr msgs[MG_UDP_BATCH];
+  struct iovec iov[MG_UDP_BATCH];
+  union usa usa[MG_UDP_BATCH];
+  unsigned char *buf = c->mgr->udpbuf;
+  int i, rc, err;
+  bool fail;
+  if (buf == NULL) {
+    buf = (unsigned char *) mg_alloc(MG_UDP_BATCH * MG_UDP_MSG_SIZE);
+    if ((c->mgr->udpbuf = buf) == NULL) {
+      mg_error(c, "OOM");
+      return;
+    }
+  }
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < MG_UDP_BATCH; i++) {
+    iov[i].iov_base = buf + i * MG_UDP_MSG_SIZE;
+    iov[i].iov_len = MG_UDP_MSG_SIZE;
+    msgs[i].msg_hdr.msg_name = &usa[i].sa;
+    msgs[i].msg_hdr.msg_namelen = sizeof(usa[i]);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  rc = (int) syscall(__NR_recvmmsg, FD(c), msgs, MG_UDP_BATCH, 0, NULL);
+  err = MG_SOCK_ERRNO;  // Logging may change errno
+  fail = rc < 0 && mg_sock_failed();
+  LOG(LL_VERBOSE_DEBUG, ("%lu recvmmsg: %d %d", c->id, rc, err));
+  if (fail) c->is_closing = 1;
+  for (i = 0; i < rc && !c->is_closing; i++) {
+    size_t len = msgs[i].msg_len;
+    c->peer.is_ip6 = usa[i].sa.sa_family != AF_INET;
+    if (c->peer.is_ip6) {
+#if MG_ENABLE_IPV6
+      memcpy(c->peer.ip6, &usa[i].sin6.sin6_addr, sizeof(c->peer.ip6));
+      c->peer.port = usa[i].sin6.sin6_port;
+#endif
+    } else {
+      c->peer.ip = *(uint32_t *) &usa[i].sin.sin_addr;
+      c->peer.port = usa[i].sin.sin_port;
+    }
+    if (c->is_hexdumping) mg_hexdump_io(c, "<-", iov[i].iov_base, len);
+    mg_udp_deliver(c, iov[i].iov_base, len);
+  }
+  mg_io_drained(c->mgr, &c->recv);
+}
+#else
+// Read one datagram for a demultiplexing listener
+static void mg_udp_read(struct mg_connection *c) {
+  char buf[MG_UDP_MSG_SIZE];
+  int fail, n = ll_read(c, buf, (int) sizeof(buf), &fail);
+  if (n > 0) {
+    mg_udp_deliver(c, buf, (size_t) n);
+  } else if (fail) {
+    c->is_closing = 1;
+  }
+}
+#endif
+
 int mg_send(struct mg_connection *c, const void *buf, size_t len) {
-  int fail, n = c->is_udp
-                    ? ll_write(c, buf, (SOCKET) len, &fail)
-                    : (int) mg_iobuf_append(&c->send, buf, len, MG_IO_SIZE);
-  if (len > 0 && n == 0) fail = 1;
+  int n;
+  if (c->is_udp) {
+#if MG_ENABLE_MMSG
+    struct mg_connection *s = mg_udp_sock(c);
+    n = s == NULL ? 0 : mg_udp_queue(s, &c->peer, buf, len);
+#else
+    int fail;
+    n = ll_write(c, buf, (SOCKET) len, &fail);
+#endif
+    if (mg_udp_virtual(c)) {
+      ((struct mg_udp_peer *) c->udp)->last = c->mgr->timers.now;
+    }
+  } else {
+    size_t step = c->mgr == NULL ? MG_IO_GROW : c->mgr->iogrow;
+    mg_iobuf_reserve(&c->send, len, MG_IO_SIZE, step);
+    n = (int) mg_iobuf_append(&c->send, buf, len, MG_IO_SIZE);
+  }
+  if (n > 0 && !c->is_udp) mg_ready(c);  // Let the IO backend see new data
+  return n;
+}
+
+int mg_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                void (*release)(void *), void *arg) {
+  struct mg_seg *s;
+  if (c->is_udp) {
+    int n = mg_send(c, buf, len);
+    if (n > 0 && release != NULL) release(arg);
+    return n > 0 ? n : 0;
+  }
+  if (len == 0 || (s = (struct mg_seg *) mg_alloc(sizeof(*s))) == NULL) {
+    return 0;
+  }
+  memset(s, 0, sizeof(*s));
+  s->buf = (const char *) buf;
+  s->len = len;
+  s->at = c->send.len;
+  s->fd = -1;
+  s->release = release;
+  s->arg = arg;
+  mg_segs_add(c, s);
+  mg_ready(c);
+  return (int) len;
+}
+
+int mg_send_file(struct mg_connection *c, int fd, int64_t offset, size_t len,
+                 void (*release)(void *), void *arg) {
+#if MG_ENABLE_SENDFILE
+  struct mg_seg *s;
+  if (c->is_tls || c->is_udp || len == 0) return 0;
+#if MG_ENABLE_IO_URING
+  if (c->mgr->uring != NULL) return 0;  // io_uring sends from memory only
+#endif
+  if ((s = (struct mg_seg *) mg_alloc(sizeof(*s))) == NULL) return 0;
+  memset(s, 0, sizeof(*s));
+  s->len = len;
+  s->at = c->send.len;
+  s->fd = fd;
+  s->off = offset;
+  s->release = release;
+  s->arg = arg;
+  mg_segs_add(c, s);
+  mg_ready(c);
+  return (int) len;
+#else
+  (void) c, (void) fd, (void) offset, (void) len, (void) release, (void) arg;
+  return 0;
+#endif
+}
+
+static void mg_shared_unref(void *arg) {
+  mg_shared_release((struct mg_shared *) arg);
+}
+
+int mg_send_shared(struct mg_connection *c, struct mg_shared *sh) {
+  int n;
+  mg_shared_ref(sh);
+  n = mg_send_ref(c, sh->buf, sh->len, mg_shared_unref, sh);
+  if (n == 0) mg_shared_release(sh);
   return n;
 }
 
@@ -178,9 +1024,46 @@ static void mg_set_non_blocking_mode(SOCKET fd) {
 #endif
 }
 
-SOCKET mg_open_listener(const char *url) {
+#if MG_ENABLE_EPOLL
+// Register socket in the epoll set. Read interest stays unless reading is
+// paused, write interest is toggled by mg_epoll_sync()
+static void mg_epoll_add(struct mg_connection *c) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  if (epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, FD(c), &ev) != 0) {
+    LOG(LL_ERROR, ("%lu epoll_ctl(ADD): %d", c->id, MG_SOCK_ERRNO));
+  }
+  c->is_epollin = 1;
+  c->is_epollout = 0;
+}
+
+// Update EPOLLIN and EPOLLOUT, but only when interest actually changes
+static void mg_epoll_sync(struct mg_connection *c) {
+  bool rd = mg_want_read(c), wr = mg_want_write(c);
+  if (rd != (bool) c->is_epollin || wr != (bool) c->is_epollout) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    if (rd) ev.events |= EPOLLIN;
+    if (wr) ev.events |= EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, FD(c), &ev) != 0) {
+      LOG(LL_ERROR, ("%lu epoll_ctl(MOD): %d", c->id, MG_SOCK_ERRNO));
+    }
+    c->is_epollin = rd;
+    c->is_epollout = wr;
+  }
+}
+#else
+#define mg_epoll_add(c)
+#endif
+
+SOCKET mg_open_listener(const char *url, const struct mg_sock_opts *o,
+                        bool reuseport) {
   struct mg_addr addr;
   SOCKET fd = INVALID_SOCKET;
+  int backlog = o != NULL && o->backlog > 0 ? o->backlog : 128;
 
   memset(&addr, 0, sizeof(addr));
   addr.port = mg_htons(mg_url_port(url));
@@ -213,21 +1096,67 @@ SOCKET mg_open_listener(const char *url) {
         //! &&
         !setsockopt(fd, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (char *) &on,
                     sizeof(on)) &&
+#endif
+#if defined(SO_REUSEPORT)
+        // Several sockets share the port, kernel balances connections
+        (!reuseport ||
+         !setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on))) &&
 #endif
         bind(fd, &usa.sa, slen) == 0 &&
         // NOTE(lsm): FreeRTOS uses backlog value as a connection limit
-        (type == SOCK_DGRAM || listen(fd, 128) == 0)) {
+        (type == SOCK_DGRAM || listen(fd, backlog) == 0)) {
       mg_set_non_blocking_mode(fd);
+#if defined(TCP_DEFER_ACCEPT)
+      // Accept connections only when they have data to read
+      if (o != NULL && o->defer_accept > 0 && type == SOCK_STREAM) {
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &o->defer_accept,
+                   sizeof(o->defer_accept));
+      }
+#endif
+#if defined(TCP_FASTOPEN)
+      if (o != NULL && o->fastopen > 0 && type == SOCK_STREAM) {
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (char *) &o->fastopen,
+                   sizeof(o->fastopen));
+      }
+#endif
     } else if (fd != INVALID_SOCKET) {
       LOG(LL_ERROR, ("Failed to listen on %s, errno %d", url, MG_SOCK_ERRNO));
       closesocket(fd);
       fd = INVALID_SOCKET;
     }
   }
+  (void) reuseport;
 
   return fd;
 }
 
+#if MG_ENABLE_REACTORS && defined(SO_ATTACH_REUSEPORT_CBPF)
+// Steer new connections to the reactor that runs on the CPU which received
+// them. Sockets join the SO_REUSEPORT group in reactor order, so the index
+// of a reactor's listener is the reactor index: CPU number modulo N
+static void mg_reactors_steer(struct mg_connection *c) {
+  struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t) (SKF_AD_OFF + SKF_AD_CPU)},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t) c->mgr->reactors->n},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog;
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  if (setsockopt(FD(c), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                 sizeof(prog)) != 0) {
+    LOG(LL_ERROR, ("%lu SO_ATTACH_REUSEPORT_CBPF: %d", c->id, MG_SOCK_ERRNO));
+  }
+}
+#endif
+
+// Growth step limit for a recv buffer of given size: stay within
+// MG_MAX_RECV_BUF_SIZE
+static size_t mg_io_step(struct mg_mgr *mgr, size_t size) {
+  size_t room = MG_MAX_RECV_BUF_SIZE - size;
+  return mgr->iogrow < room ? mgr->iogrow : room;
+}
+
 static void read_conn(struct mg_connection *c,
                       int (*fn)(struct mg_connection *, void *, int, int *)) {
   unsigned char *buf;
@@ -237,7 +1166,8 @@ static void read_conn(struct mg_connection *c,
   // (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data
   if (c->recv.size - c->recv.len < MG_IO_SIZE &&
       c->recv.size < MG_MAX_RECV_BUF_SIZE &&
-      !mg_iobuf_resize(&c->recv, c->recv.size + MG_IO_SIZE)) {
+      !mg_iobuf_reserve(&c->recv, MG_IO_SIZE, MG_IO_SIZE,
+                        mg_io_step(c->mgr, c->recv.size))) {
     c->is_closing = 1;
   }
   buf = c->recv.buf + c->recv.len;
@@ -247,16 +1177,28 @@ static void read_conn(struct mg_connection *c,
     struct mg_str evd = mg_str_n((char *) buf, rc);
     c->recv.len += rc;
     mg_call(c, MG_EV_READ, &evd);
+    mg_io_drained(c->mgr, &c->recv);
   } else {
     if (fail) c->is_closing = 1;
   }
 }
 
 static int write_conn(struct mg_connection *c) {
-  int fail, rc = ll_write(c, c->send.buf, (SOCKET) c->send.len, &fail);
+  int fail, rc;
+#if MG_ENABLE_IO_URING
+  if (mg_uring_io(c)) return mg_uring_write_conn(c);
+#endif
+  if (c->segs != NULL) {
+    struct mg_str v[MG_SEND_IOV];
+    int n = mg_send_chunks(c, v, MG_SEND_IOV);
+    rc = n > 0 ? ll_writev(c, v, n, &fail) : ll_sendfile(c, c->segs, &fail);
+    if (rc > 0) mg_send_consume(c, (size_t) rc);
+  } else {
+    rc = ll_write(c, c->send.buf, (SOCKET) c->send.len, &fail);
+    if (rc > 0) mg_iobuf_delete(&c->send, rc);
+  }
   if (rc > 0) {
-    mg_iobuf_delete(&c->send, rc);
-    if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
+    mg_io_drained(c->mgr, &c->send);
     mg_call(c, MG_EV_WRITE, &rc);
   } else if (fail) {
     c->is_closing = 1;
@@ -264,53 +1206,132 @@ static int write_conn(struct mg_connection *c) {
   return rc;
 }
 
+// Unbind a closing connection from its relay peer, which then sends what it
+// has got and closes, too
+static void mg_relay_free(struct mg_connection *c) {
+  struct mg_relay *r = (struct mg_relay *) c->relay;
+  struct mg_connection *peer;
+  if (r == NULL) return;
+  peer = r->c[r->c[0] == c ? 1 : 0];
+  c->relay = peer->relay = NULL;
+  peer->is_paused = 0;
+  peer->is_draining = 1;
+  mg_ready(peer);
+#if MG_ENABLE_SPLICE
+  {
+    int i;
+    for (i = 0; i < 4; i++) {
+      if (r->pipe[i / 2][i % 2] >= 0) close(r->pipe[i / 2][i % 2]);
+    }
+  }
+#endif
+  mg_dealloc(r);
+}
+
 static void close_conn(struct mg_connection *c) {
-  // Unlink this connection from the list
-  LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
+  mg_del_conn(c);
   mg_resolve_cancel(c);
   if (c == c->mgr->dns4.c) c->mgr->dns4.c = NULL;
   if (c == c->mgr->dns6.c) c->mgr->dns6.c = NULL;
+#if MG_ENABLE_WAKEUP
+  if (c == c->mgr->wakeup) c->mgr->wakeup = NULL;
+#endif
   mg_call(c, MG_EV_CLOSE, NULL);
+  if (c->is_ready) mg_unready(c);  // MG_EV_CLOSE handler may have sent data
   // while (c->callbacks != NULL) mg_fn_del(c, c->callbacks->fn);
   LOG(LL_DEBUG, ("%lu closed", c->id));
   if (FD(c) != INVALID_SOCKET) {
+#if MG_ENABLE_MMSG
+    if (c->is_udp) mg_udp_flush(c);  // Datagrams queued just before closing
+#endif
     closesocket(FD(c));
 #if MG_ARCH == MG_ARCH_FREERTOS
     FreeRTOS_FD_CLR(c->fd, c->mgr->ss, eSELECT_ALL);
 #endif
   }
+#if MG_ENABLE_IO_URING
+  mg_uring_detach(c);
+#endif
+  mg_relay_free(c);
+  mg_udp_free(c);
+  mg_timer_free(&c->timer);
+  mg_dealloc(c->sockopts);
+  mg_dealloc(c->http);
   mg_tls_free(c);
-  free(c->recv.buf);
-  free(c->send.buf);
-  memset(c, 0, sizeof(*c));
-  free(c);
+  mg_segs_free(c);
+  mg_iobuf_free(&c->recv);
+  mg_iobuf_free(&c->send);
+  mg_free_conn(c);
 }
 
-static void setsockopts(struct mg_connection *c) {
+// Apply socket options, o can be NULL. Options specific to listening
+// sockets are set by mg_open_listener()
+static void setsockopts(struct mg_connection *c, const struct mg_sock_opts *o) {
 #if MG_ARCH == MG_ARCH_FREERTOS
   FreeRTOS_FD_SET(c->fd, c->mgr->ss, eSELECT_READ | eSELECT_EXCEPT);
+  (void) o;
 #else
-  int on = 1;
+  int on = 1, idle = 60, cnt = 3, intvl = 20;
 #if !defined(SOL_TCP)
 #define SOL_TCP IPPROTO_TCP
 #endif
-  setsockopt(FD(c), SOL_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+  if (o != NULL && o->keepidle != 0) idle = o->keepidle;
+  if (o != NULL && o->keepcnt > 0) cnt = o->keepcnt;
+  if (o != NULL && o->keepintvl > 0) intvl = o->keepintvl;
+  if (o == NULL || !o->nagle) {
+    setsockopt(FD(c), SOL_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+  }
 #if defined(TCP_QUICKACK)
   setsockopt(FD(c), SOL_TCP, TCP_QUICKACK, (char *) &on, sizeof(on));
 #endif
-  setsockopt(FD(c), SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof(on));
+  if (idle > 0) {
+    setsockopt(FD(c), SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof(on));
 #if ESP32 || ESP8266 || defined(__linux__)
-  int idle = 60;
-  setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
 #endif
 #ifndef _WIN32
-  {
-    int cnt = 3, intvl = 20;
     setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
     setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+#endif
+  }
+  if (o == NULL) return;
+  if (o->rcvbuf > 0) {
+    setsockopt(FD(c), SOL_SOCKET, SO_RCVBUF, (char *) &o->rcvbuf,
+               sizeof(o->rcvbuf));
+  }
+  if (o->sndbuf > 0) {
+    setsockopt(FD(c), SOL_SOCKET, SO_SNDBUF, (char *) &o->sndbuf,
+               sizeof(o->sndbuf));
+  }
+#if defined(SO_BUSY_POLL)
+  if (o->busy_poll > 0) {
+    setsockopt(FD(c), SOL_SOCKET, SO_BUSY_POLL, &o->busy_poll,
+               sizeof(o->busy_poll));
   }
 #endif
+#if defined(TCP_NOTSENT_LOWAT)
+  if (o->notsent_lowat > 0) {
+    setsockopt(FD(c), IPPROTO_TCP, TCP_NOTSENT_LOWAT, &o->notsent_lowat,
+               sizeof(o->notsent_lowat));
+  }
+#endif
+#if defined(TCP_FASTOPEN_CONNECT)
+  // Client data goes out with SYN, if the server supports it
+  if (o->fastopen > 0 && c->is_client) {
+    setsockopt(FD(c), IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+  }
 #endif
+#endif
+}
+
+// Copy of socket options for a new connection, which may outlive opts
+static struct mg_sock_opts *mg_sockopts_dup(const struct mg_sock_opts *opts) {
+  struct mg_sock_opts *o = NULL;
+  if (opts != NULL &&
+      (o = (struct mg_sock_opts *) mg_alloc(sizeof(*o))) != NULL) {
+    *o = *opts;
+  }
+  return o;
 }
 
 void mg_connect_resolved(struct mg_connection *c) {
@@ -320,6 +1341,7 @@ void mg_connect_resolved(struct mg_connection *c) {
 #if MG_ENABLE_IPV6
   if (c->peer.is_ip6) af = AF_INET6;
 #endif
+  c->since = c->mgr->timers.now;  // Handshake timeout starts now
   mg_straddr(c, buf, sizeof(buf));
   c->fd = (void *) (long) socket(af, type, 0);
   if (FD(c) == INVALID_SOCKET) {
@@ -328,6 +1350,7 @@ void mg_connect_resolved(struct mg_connection *c) {
   }
 
   mg_set_non_blocking_mode(FD(c));
+  mg_epoll_add(c);
   mg_call(c, MG_EV_RESOLVE, NULL);
   if (type == SOCK_STREAM) {
     union usa usa = tousa(&c->peer);
@@ -336,27 +1359,29 @@ void mg_connect_resolved(struct mg_connection *c) {
         c->peer.is_ip6 ? sizeof(usa.sin6) :
 #endif
                        sizeof(usa.sin);
-    int rc = connect(FD(c), &usa.sa, slen);
-    int fail = rc < 0 && mg_sock_failed() ? MG_SOCK_ERRNO : 0;
-    if (fail) {
-      mg_error(c, "connect: %d", MG_SOCK_ERRNO);
-    } else {
-      setsockopts(c);
-    }
+    int rc, fail;
+    // Buffer sizes must be set before SYN
+    setsockopts(c, c->sockopts);
+    rc = connect(FD(c), &usa.sa, slen);
+    fail = rc < 0 && mg_sock_failed() ? MG_SOCK_ERRNO : 0;
+    if (fail) mg_error(c, "connect: %d", MG_SOCK_ERRNO);
     if (rc < 0) c->is_connecting = 1;
   }
+  mg_ready(c);
 }
 
-struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
-                                 mg_event_handler_t fn, void *fn_data) {
+struct mg_connection *mg_connect_opts(struct mg_mgr *mgr, const char *url,
+                                      const struct mg_sock_opts *opts,
+                                      mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = NULL;
   if ((c = alloc_conn(mgr, 1, INVALID_SOCKET)) == NULL) {
     LOG(LL_ERROR, ("OOM"));
   } else {
     struct mg_str host = mg_url_host(url);
-    LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    mg_add_conn(c);
     c->is_udp = (strncmp(url, "udp:", 4) == 0);
     c->peer.port = mg_htons(mg_url_port(url));
+    c->sockopts = mg_sockopts_dup(opts);
     c->fn = fn;
     c->fn_data = fn_data;
     LOG(LL_DEBUG, ("%lu -> %s", c->id, url));
@@ -365,15 +1390,53 @@ struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
-static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+static SOCKET ll_accept(struct mg_connection *lsn, union usa *usa,
+                        socklen_t *len) {
+#if MG_ENABLE_IO_URING
+  struct mg_uring_conn *u = (struct mg_uring_conn *) lsn->uring;
+  if (u != NULL) {  // io_uring accepts one socket per completion
+    SOCKET fd = u->afd;
+    *usa = u->addr;
+    *len = u->alen;
+    u->afd = INVALID_SOCKET;
+    if (fd == INVALID_SOCKET) errno = EWOULDBLOCK;
+    return fd;
+  }
+#endif
+#if defined(__linux__)
+  // accept4() is declared only with _GNU_SOURCE, which is left to the user
+  return (SOCKET) syscall(__NR_accept4, FD(lsn), &usa->sa, len,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  return accept(FD(lsn), &usa->sa, len);
+#endif
+}
+
+#if !defined(_WIN32) && !MG_ENABLE_EPOLL
+// Return true if fd is too large for select(). io_uring, when available at
+// runtime, does not use select() and takes any descriptor
+static bool mg_fd_too_large(struct mg_mgr *mgr, SOCKET fd) {
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) return false;
+#endif
+  (void) mgr;
+  return fd >= FD_SETSIZE;
+}
+#endif
+
+// Accept one connection. Return false if there is nothing to accept
+static bool accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   struct mg_connection *c = NULL;
   union usa usa;
   socklen_t sa_len = sizeof(usa);
-  SOCKET fd = accept(FD(lsn), &usa.sa, &sa_len);
+  SOCKET fd = ll_accept(lsn, &usa, &sa_len);
   if (fd == INVALID_SOCKET) {
-    LOG(LL_ERROR, ("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERRNO));
-#if !defined(_WIN32)
-  } else if (fd >= FD_SETSIZE) {
+    if (mg_sock_failed()) {
+      LOG(LL_ERROR, ("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERRNO));
+    }
+    return false;
+#if !defined(_WIN32) && !MG_ENABLE_EPOLL
+  } else if (mg_fd_too_large(mgr, fd)) {
     LOG(LL_ERROR, ("%ld > %ld", (long) fd, (long) FD_SETSIZE));
     closesocket(fd);
 #endif
@@ -393,17 +1456,32 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
 #endif
     mg_straddr(c, buf, sizeof(buf));
     LOG(LL_DEBUG, ("%lu accepted %s", c->id, buf));
-    mg_set_non_blocking_mode(FD(c));
-    setsockopts(c);
-    LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+#if !defined(__linux__)
+    mg_set_non_blocking_mode(FD(c));  // On Linux, accept4() does that
+#endif
+    // Not all options are inherited from the listener, e.g. TCP_QUICKACK
+    setsockopts(c, lsn->sockopts);
+    mg_epoll_add(c);
+    mg_ready(c);
+    mg_add_conn(c);
     c->is_accepted = 1;
     c->is_hexdumping = lsn->is_hexdumping;
+    c->recv_high = lsn->recv_high, c->recv_low = lsn->recv_low;
+    c->send_high = lsn->send_high, c->send_low = lsn->send_low;
     c->pfn = lsn->pfn;
     c->pfn_data = lsn->pfn_data;
     c->fn = lsn->fn;
     c->fn_data = lsn->fn_data;
     mg_call(c, MG_EV_ACCEPT, NULL);
   }
+  return true;
+}
+
+// Accept pending connections, but not too many at once, so that a storm of
+// new connections does not starve established ones
+static void accept_conns(struct mg_connection *lsn) {
+  int i;
+  for (i = 0; i < MG_ACCEPT_BUDGET && accept_conn(lsn->mgr, lsn); i++) (void) 0;
 }
 
 #if MG_ENABLE_SOCKETPAIR
@@ -448,11 +1526,146 @@ bool mg_socketpair(int *s1, int *s2) {
 }
 #endif
 
-struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
-                                mg_event_handler_t fn, void *fn_data) {
+#if MG_ENABLE_WAKEUP
+// Message posted by mg_mgr_wakeup(), data follows the structure
+struct mg_wakeup_msg {
+  struct mg_wakeup_msg *next;  // Linkage in struct mg_mgr :: mailbox
+  unsigned long id;            // Destination connection ID
+  int ev;                      // Event to deliver
+  size_t len;                  // Data length
+};
+
+// Create the wakeup channel. Must be called by the thread that polls mgr,
+// before other threads call mg_mgr_wakeup()
+bool mg_mgr_wakeup_init(struct mg_mgr *mgr) {
+  struct mg_connection *c;
+  int fds[2] = {-1, -1};
+  if (mgr->wakeup != NULL) return true;
+#if defined(__linux__)
+  fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fds[0] < 0) {
+#else
+  if (pipe(fds) != 0) {
+#endif
+    LOG(LL_ERROR, ("wakeup channel: %d", errno));
+    return false;
+  }
+  if ((c = alloc_conn(mgr, 0, (SOCKET) fds[0])) == NULL) {
+    LOG(LL_ERROR, ("OOM"));
+    close(fds[0]);
+    if (fds[1] != fds[0]) close(fds[1]);
+    return false;
+  }
+  mg_set_non_blocking_mode((SOCKET) fds[0]);
+  mg_set_non_blocking_mode((SOCKET) fds[1]);
+  snprintf(c->label, sizeof(c->label), "%s", "WAKEUP");
+  mg_epoll_add(c);
+  mg_ready(c);
+  mg_add_conn(c);
+  mgr->wakeup = c;
+  mgr->wakeup_fd = fds[1];
+  return true;
+}
+
+bool mg_wakeup_post(struct mg_mgr *mgr, unsigned long id, int ev,
+                    const void *buf, size_t len) {
+  struct mg_wakeup_msg *m;
+  void *head;
+  if (mgr->wakeup == NULL) return false;
+  m = (struct mg_wakeup_msg *) mg_alloc(sizeof(*m) + len);
+  if (m == NULL) return false;
+  m->id = id;
+  m->ev = ev;
+  m->len = len;
+  if (len > 0) memcpy(m + 1, buf, len);
+  // Lock-free push. Only the first message of a batch notifies the loop
+  head = __atomic_load_n(&mgr->mailbox, __ATOMIC_RELAXED);
+  do {
+    m->next = (struct mg_wakeup_msg *) head;
+  } while (!__atomic_compare_exchange_n(&mgr->mailbox, &head, (void *) m, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (head == NULL) {
+    uint64_t one = 1;
+    if (write(mgr->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      LOG(LL_ERROR, ("wakeup: %d", errno));
+    }
+  }
+  return true;
+}
+
+// Post a message to connection with the given ID: it gets MG_EV_WAKEUP with
+// the data on the next poll iteration. With ID 0, just wake up mg_mgr_poll().
+// Can be called by any thread
+bool mg_mgr_wakeup(struct mg_mgr *mgr, unsigned long id, const void *buf,
+                   size_t len) {
+  return mg_wakeup_post(mgr, id, MG_EV_WAKEUP, buf, len);
+}
+
+// Message data is a pointer that the receiver owns. Free it if nobody takes
+static void *mg_wakeup_arg(struct mg_wakeup_msg *m) {
+  void *arg;
+  memcpy(&arg, m + 1, sizeof(arg));
+  return arg;
+}
+
+static struct mg_wakeup_msg *mg_wakeup_take(struct mg_mgr *mgr) {
+  struct mg_wakeup_msg *m, *list = NULL, *tmp;
+  m = (struct mg_wakeup_msg *) __atomic_exchange_n(&mgr->mailbox, (void *) NULL,
+                                                   __ATOMIC_ACQUIRE);
+  // Messages are pushed to the head, restore posting order
+  for (; m != NULL; m = tmp) tmp = m->next, m->next = list, list = m;
+  return list;
+}
+
+static void mg_wakeup_read(struct mg_connection *c) {
+  struct mg_wakeup_msg *m, *tmp;
+  char buf[64];
+  // Consume the notification before taking messages, so that messages posted
+  // after that notify again
+  while (read(FD(c), buf, sizeof(buf)) > 0) continue;
+  for (m = mg_wakeup_take(c->mgr); m != NULL; m = tmp) {
+    struct mg_connection *t = m->id == 0 ? NULL : mg_conn_by_id(c->mgr, m->id);
+    tmp = m->next;
+    if (m->ev == MG_EV_WORK_DONE) {
+      if (t != NULL && !t->is_closing) {
+        mg_call(t, m->ev, mg_wakeup_arg(m));
+        mg_ready(t);
+      } else {
+        free(mg_wakeup_arg(m));
+      }
+    } else if (t != NULL && !t->is_closing) {
+      struct mg_str data = mg_str_n((char *) (m + 1), m->len);
+      mg_call(t, m->ev, &data);
+      mg_ready(t);
+    }
+    mg_dealloc(m);
+  }
+}
+
+void mg_wakeup_free(struct mg_mgr *mgr) {
+  struct mg_wakeup_msg *m, *tmp;
+  for (m = mg_wakeup_take(mgr); m != NULL; m = tmp) {
+    tmp = m->next;
+    if (m->ev == MG_EV_WORK_DONE) free(mg_wakeup_arg(m));
+    mg_dealloc(m);
+  }
+#if !defined(__linux__)
+  if (mgr->wakeup_fd >= 0) close(mgr->wakeup_fd);  // eventfd is closed already
+#endif
+  mgr->wakeup_fd = -1;
+}
+#endif
+
+struct mg_connection *mg_listen_opts(struct mg_mgr *mgr, const char *url,
+                                     const struct mg_sock_opts *opts,
+                                     mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = NULL;
   int is_udp = strncmp(url, "udp:", 4) == 0;
-  SOCKET fd = mg_open_listener(url);
+#if MG_ENABLE_REACTORS
+  SOCKET fd = mg_open_listener(url, opts, mgr->reactors != NULL);
+#else
+  SOCKET fd = mg_open_listener(url, opts, false);
+#endif
   if (fd == INVALID_SOCKET) {
   } else if ((c = alloc_conn(mgr, 0, fd)) == NULL) {
     LOG(LL_ERROR, ("OOM %s", url));
@@ -461,8 +1674,16 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
     c->fd = (void *) (long) fd;
     c->is_listening = 1;
     c->is_udp = is_udp;
-    setsockopts(c);
-    LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    c->sockopts = mg_sockopts_dup(opts);
+    setsockopts(c, c->sockopts);
+#if MG_ENABLE_REACTORS && defined(SO_ATTACH_REUSEPORT_CBPF)
+    if (mgr->reactors != NULL && (mgr->reactors->flags & MG_REACTORS_PIN)) {
+      mg_reactors_steer(c);
+    }
+#endif
+    mg_epoll_add(c);
+    mg_ready(c);
+    mg_add_conn(c);
     c->fn = fn;
     c->fn_data = fn_data;
     LOG(LL_INFO, ("%lu accepting on %s", c->id, url));
@@ -471,18 +1692,49 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
 }
 
 static void mg_iotest(struct mg_mgr *mgr, int ms) {
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) {
+    mg_uring_iotest(mgr, ms);
+    return;
+  }
+#endif
 #if MG_ARCH == MG_ARCH_FREERTOS
   struct mg_connection *c;
   for (c = mgr->conns; c != NULL; c = c->next) {
     FreeRTOS_FD_CLR(c->fd, mgr->ss, eSELECT_WRITE);
-    if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
-      FreeRTOS_FD_SET(c->fd, mgr->ss, eSELECT_WRITE);
+    if (mg_want_write(c)) FreeRTOS_FD_SET(c->fd, mgr->ss, eSELECT_WRITE);
   }
   FreeRTOS_select(mgr->ss, pdMS_TO_TICKS(ms));
   for (c = mgr->conns; c != NULL; c = c->next) {
     EventBits_t bits = FreeRTOS_FD_ISSET(c->fd, mgr->ss);
     c->is_readable = bits & (eSELECT_READ | eSELECT_EXCEPT) ? 1 : 0;
     c->is_writable = bits & eSELECT_WRITE ? 1 : 0;
+    if (c->is_readable || c->is_writable) mg_ready(c);
+  }
+#elif MG_ENABLE_EPOLL
+  struct epoll_event evs[MG_EPOLL_MAX_EVENTS];
+  struct mg_connection *c;
+  int i, n;
+
+  // Interest can change only for queued connections: those that have been
+  // processed, got new data to send, or have just been created
+  for (c = mgr->ready; c != NULL; c = c->rnext) {
+    if (c->is_closing) ms = 0;
+    if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
+    mg_epoll_sync(c);
+  }
+
+  if ((n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_MAX_EVENTS, ms)) < 0) {
+    LOG(LL_DEBUG, ("epoll_wait: %d %d", n, MG_SOCK_ERRNO));
+    n = 0;
+  }
+
+  // Only connections reported by the kernel are touched here
+  for (i = 0; i < n; i++) {
+    c = (struct mg_connection *) evs[i].data.ptr;
+    if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) c->is_readable = 1;
+    if (evs[i].events & EPOLLOUT) c->is_writable = 1;
+    mg_ready(c);
   }
 #else
   struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
@@ -499,10 +1751,9 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     // TLS might have stuff buffered, so dig everything
     // c->is_readable = c->is_tls && c->is_readable ? 1 : 0;
     if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
-    FD_SET(FD(c), &rset);
+    if (mg_want_read(c)) FD_SET(FD(c), &rset);
     if (FD(c) > maxfd) maxfd = FD(c);
-    if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
-      FD_SET(FD(c), &wset);
+    if (mg_want_write(c)) FD_SET(FD(c), &wset);
   }
 
   if ((rc = select(maxfd + 1, &rset, &wset, NULL, &tv)) < 0) {
@@ -517,10 +1768,116 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
                          ? 1
                          : FD(c) != INVALID_SOCKET && FD_ISSET(FD(c), &rset);
     c->is_writable = FD(c) != INVALID_SOCKET && FD_ISSET(FD(c), &wset);
+    if (c->is_readable || c->is_writable) mg_ready(c);
   }
 #endif
 }
 
+// True if connection has outstanding data to send
+static bool mg_sending(struct mg_connection *c) {
+#if MG_ENABLE_IO_URING
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  if (u != NULL && u->tx.len > 0 && u->err == 0) return true;
+#endif
+  return c->send.len > 0 || c->segs != NULL;
+}
+
+// Number of bytes queued for sending
+static size_t mg_queued(struct mg_connection *c) {
+  struct mg_seg *s;
+  size_t n = c->send.len;
+#if MG_ENABLE_IO_URING
+  struct mg_uring_conn *u = (struct mg_uring_conn *) c->uring;
+  if (u != NULL) n += u->tx.len;
+#endif
+  for (s = c->segs; s != NULL; s = s->next) n += s->len;
+  return n;
+}
+
+// Apply watermarks once the connection is processed: pause or resume
+// reading, and tell the application when the send queue is full or drained
+static void mg_watermarks(struct mg_connection *c) {
+  if (c->recv_high > 0 && c->recv.len >= c->recv_high) {
+    c->is_recv_full = 1;
+  } else if (c->recv.len <= c->recv_low) {
+    c->is_recv_full = 0;
+  }
+  if (c->send_high > 0 || c->is_send_full) {
+    size_t n = mg_queued(c);
+    if (!c->is_send_full && c->send_high > 0 && n >= c->send_high) {
+      c->is_send_full = 1;
+      mg_call(c, MG_EV_FULL, &n);
+    } else if (c->is_send_full && n <= c->send_low) {
+      c->is_send_full = 0;
+      mg_call(c, MG_EV_DRAIN, &n);
+    }
+  }
+}
+
+static bool mg_handshaking(struct mg_connection *c) {
+  return c->is_connecting || c->is_tls_hs;
+}
+
+static bool mg_timed_out(unsigned long since, int ms, unsigned long now) {
+  return ms > 0 && (long) (now - since - (unsigned long) ms) >= 0;
+}
+
+// Time at which the connection times out in its current state, 0: never.
+// Timestamps are kept up to date by poll_conn(), the timer is armed lazily:
+// when it fires, it checks the deadline again
+static unsigned long mg_deadline(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  unsigned long d = 0, hs = 0;
+  if (mg_udp_virtual(c)) {
+    struct mg_udp_peer *p = (struct mg_udp_peer *) c->udp;
+    struct mg_udp_table *t =
+        p->lsn == NULL ? NULL : (struct mg_udp_table *) p->lsn->udp;
+    if (t != NULL && t->idle_ms > 0) d = p->last + t->idle_ms;
+    return d;
+  }
+#if MG_ENABLE_WAKEUP
+  if (c == mgr->wakeup) return 0;
+#endif
+  if (c->is_listening || c->is_resolving || FD(c) == INVALID_SOCKET) return 0;
+  if (mgr->idletimeout > 0) d = c->lastio + (unsigned long) mgr->idletimeout;
+  if (mgr->hstimeout > 0 && mg_handshaking(c)) {
+    hs = c->since + (unsigned long) mgr->hstimeout;
+  } else if (mgr->reqtimeout > 0 && c->is_accepted && c->recv.len > 0) {
+    hs = c->since + (unsigned long) mgr->reqtimeout;
+  }
+  return d == 0 || (hs != 0 && (long) (hs - d) < 0) ? hs : d;
+}
+
+static void mg_timeout(void *arg) {
+  struct mg_connection *c = (struct mg_connection *) arg;
+  struct mg_mgr *mgr = c->mgr;
+  unsigned long now = mgr->timers.now, d = mg_deadline(c);
+  if (d == 0 || c->is_closing) {
+    // Timeout does not apply now, poll_conn() arms it again when it does
+  } else if ((long) (d - now) > 0) {
+    mg_timers_add(&mgr->timers, &c->timer, d);  // There was IO since
+  } else if (mg_handshaking(c) && mg_timed_out(c->since, mgr->hstimeout, now)) {
+    mg_error(c, "handshake timeout");
+  } else if (!mg_handshaking(c) && c->is_accepted && c->recv.len > 0 &&
+             mg_timed_out(c->since, mgr->reqtimeout, now)) {
+    mg_error(c, "request timeout");
+  } else {
+    LOG(LL_DEBUG, ("%lu idle", c->id));
+    c->is_closing = 1;
+    mg_ready(c);
+  }
+}
+
+// Arm the timeout, unless it is armed to fire not later than needed
+static void mg_arm_timeout(struct mg_connection *c) {
+  unsigned long d = mg_deadline(c);
+  if (d != 0 && (c->timer.pprev == NULL || (long) (d - c->timer.expire) < 0)) {
+    c->timer.fn = mg_timeout;
+    c->timer.arg = c;
+    mg_timers_add(&c->mgr->timers, &c->timer, d);
+  }
+}
+
 static void connect_conn(struct mg_connection *c) {
   int rc = 0;
   socklen_t len = sizeof(rc);
@@ -536,37 +1893,245 @@ static void connect_conn(struct mg_connection *c) {
   }
 }
 
+// Update IO backend interest after the connection has been processed
+static void mg_io_sync(struct mg_connection *c) {
+  if (c->is_resolving || FD(c) == INVALID_SOCKET) return;
+#if MG_ENABLE_IO_URING
+  if (c->mgr->uring != NULL) {
+    mg_uring_arm(c);
+    if (mg_uring_results(c)) mg_ready(c);
+    return;
+  }
+#endif
+#if MG_ENABLE_EPOLL
+  mg_epoll_sync(c);
+#endif
+}
+
+#if MG_ENABLE_SPLICE
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+#endif
+
+static long mg_splice(int from, int to, size_t len) {
+  return (long) syscall(__NR_splice, from, NULL, to, NULL, len,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+static bool mg_relay_pipe(int *fds) {
+  if (pipe(fds) != 0) {
+    fds[0] = fds[1] = -1;
+    return false;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return true;
+}
+
+// Move incoming data of c[i] into its pipe. Stop reading when the pipe is
+// full, or when the peer does not take data fast enough
+static void mg_relay_in(struct mg_relay *r, int i) {
+  struct mg_connection *c = r->c[i];
+  long n = mg_splice(FD(c), r->pipe[i][1], MG_RELAY_SIZE - r->inpipe[i]);
+  bool again = n < 0 && !mg_sock_failed();
+  LOG(LL_VERBOSE_DEBUG, ("%lu splice in: %ld %d", c->id, n, MG_SOCK_ERRNO));
+  if (n > 0) r->inpipe[i] += (size_t) n;
+  if (n == 0) r->eof[i] = true;
+  if (n < 0 && !again) {
+    LOG(LL_DEBUG, ("%lu splice: %d", c->id, MG_SOCK_ERRNO));
+    c->is_closing = 1;
+  }
+  c->is_paused = r->eof[i] || r->inpipe[i] >= MG_RELAY_SIZE ||
+                 (again && r->inpipe[i] > 0);
+}
+
+// Move data from pipe i to c[1 - i], which must send its own data first.
+// Once c[i] is done and the pipe is empty, shut down the write side of
+// c[1 - i]: the other direction still works
+static void mg_relay_out(struct mg_relay *r, int i) {
+  struct mg_connection *src = r->c[i], *dst = r->c[1 - i];
+  if (dst->is_connecting || dst->is_closing || mg_sending(dst)) return;
+  if (r->inpipe[i] > 0) {
+    long n = mg_splice(r->pipe[i][0], FD(dst), r->inpipe[i]);
+    LOG(LL_VERBOSE_DEBUG, ("%lu splice out: %ld %d", dst->id, n,
+                           MG_SOCK_ERRNO));
+    if (n > 0) {
+      r->inpipe[i] -= (size_t) n;
+      if (!r->eof[i]) src->is_paused = 0;
+    } else if (n == 0 || mg_sock_failed()) {
+      LOG(LL_DEBUG, ("%lu splice: %d", dst->id, MG_SOCK_ERRNO));
+      dst->is_closing = 1;
+      mg_ready(dst);
+    }
+  }
+  if (r->eof[i] && r->inpipe[i] == 0 && !r->shut[i]) {
+    shutdown(FD(dst), SHUT_WR);
+    r->shut[i] = true;
+    if (r->shut[1 - i]) {
+      src->is_draining = dst->is_draining = 1;
+      mg_ready(src);
+      mg_ready(dst);
+    }
+  }
+}
+#endif
+
+// Relay connection is ready: move data both ways. Spliced data bypasses
+// IO buffers. Buffered data is read as usual, so that MG_EV_READ is still
+// delivered, then moved to the peer's send buffer
+static void mg_relay_poll(struct mg_connection *c) {
+  struct mg_relay *r = (struct mg_relay *) c->relay;
+  int i = r->c[0] == c ? 0 : 1;
+  struct mg_connection *peer = r->c[1 - i];
+#if MG_ENABLE_SPLICE
+  if (r->splice) {
+    if (c->is_writable && mg_sending(c)) write_conn(c);
+    if (c->is_readable && mg_want_read(c) && !r->eof[i]) mg_relay_in(r, i);
+    mg_relay_out(r, i);
+    mg_relay_out(r, 1 - i);
+    if (!peer->is_closing) mg_io_sync(peer);
+    return;
+  }
+#endif
+  if (c->is_readable && mg_want_read(c)) read_conn(c, ll_read);
+  if (c->recv.len > 0 && !peer->is_closing) {
+    mg_send(peer, c->recv.buf, c->recv.len);
+    mg_iobuf_delete(&c->recv, c->recv.len);
+    mg_io_drained(c->mgr, &c->recv);
+    if (peer->send.len >= MG_RELAY_SIZE) c->is_paused = 1;
+  }
+  if (c->is_writable) write_conn(c);
+  if (peer->is_paused && c->send.len < MG_RELAY_SIZE / 2) {
+    // Peer has been waiting for us. With TLS, it may have data buffered
+    peer->is_paused = 0;
+    if (peer->is_tls) peer->is_readable = 1;
+    mg_ready(peer);
+  }
+}
+
+// Bind two connections: data received by one is sent by the other, until
+// one of them closes
+bool mg_relay(struct mg_connection *a, struct mg_connection *b) {
+  struct mg_relay *r;
+  int i;
+  if (a == b || a->mgr != b->mgr || a->relay != NULL || b->relay != NULL ||
+      a->is_listening || b->is_listening) {
+    return false;
+  }
+  if ((r = (struct mg_relay *) mg_alloc(sizeof(*r))) == NULL) return false;
+  memset(r, 0, sizeof(*r));
+  r->c[0] = a, r->c[1] = b;
+  r->pipe[0][0] = r->pipe[0][1] = r->pipe[1][0] = r->pipe[1][1] = -1;
+#if MG_ENABLE_SPLICE
+  r->splice = !a->is_tls && !b->is_tls && !a->is_udp && !b->is_udp;
+#if MG_ENABLE_IO_URING
+  if (a->mgr->uring != NULL) r->splice = false;  // io_uring does its own IO
+#endif
+  if (r->splice) {
+    r->splice = mg_relay_pipe(r->pipe[0]) && mg_relay_pipe(r->pipe[1]);
+  }
+#endif
+  LOG(LL_DEBUG, ("%lu <-> %lu relay%s", a->id, b->id,
+                 r->splice ? ", splice" : ""));
+  for (i = 0; i < 2; i++) {
+    struct mg_connection *c = r->c[i];
+    c->relay = r;
+    c->pfn = NULL;  // Protocol handlers must not consume relayed data
+    if (c->recv.len > 0) {  // Already received data goes first
+      mg_send(r->c[1 - i], c->recv.buf, c->recv.len);
+      mg_iobuf_delete(&c->recv, c->recv.len);
+    }
+    mg_ready(c);
+  }
+  return true;
+}
+
+static void poll_conn(struct mg_connection *c) {
+  size_t had = c->recv.len;
+  LOG(LL_VERBOSE_DEBUG,
+      ("%lu %c%c %c%c%c%c%c", c->id, c->is_readable ? 'r' : '-',
+       c->is_writable ? 'w' : '-', c->is_tls ? 'T' : 't',
+       c->is_connecting ? 'C' : 'c', c->is_tls_hs ? 'H' : 'h',
+       c->is_resolving ? 'R' : 'r', c->is_closing ? 'C' : 'c'));
+  if (c->is_resolving || c->is_closing) {
+    // Do nothing
+#if MG_ENABLE_WAKEUP
+  } else if (c == c->mgr->wakeup) {
+    if (c->is_readable) mg_wakeup_read(c);
+#endif
+  } else if (c->is_listening && c->is_udp == 0) {
+    if (c->is_readable) accept_conns(c);
+  } else if (c->is_connecting) {
+    if (c->is_readable || c->is_writable) connect_conn(c);
+  } else if (c->is_tls_hs) {
+    if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
+  } else if (c->relay != NULL) {
+    mg_relay_poll(c);
+#if MG_ENABLE_MMSG
+  } else if (c->is_udp) {
+    if (c->is_readable && mg_want_read(c)) mg_udp_read(c);
+    if (c->send.len > 0 && !c->is_closing) mg_udp_flush(c);
+#else
+  } else if (c->udp != NULL) {
+    if (c->is_readable && mg_want_read(c)) mg_udp_read(c);
+#endif
+  } else {
+    if (c->is_readable && mg_want_read(c)) read_conn(c, ll_read);
+    if (c->is_writable) write_conn(c);
+  }
+
+  if (c->is_readable || c->is_writable) c->lastio = c->mgr->timers.now;
+  if (!mg_handshaking(c) && (had == 0 || c->recv.len == 0)) {
+    c->since = c->mgr->timers.now;  // Partial request, if any, starts now
+  }
+  if (!c->is_closing) mg_watermarks(c);
+  if (c->is_draining && !mg_sending(c)) c->is_closing = 1;
+  if (c->is_closing) {
+    close_conn(c);
+  } else {
+    // Readiness is consumed. TLS might have stuff buffered, so dig everything
+    c->is_writable = 0;
+    if (c->is_tls && c->is_readable && mg_want_read(c)) {
+      mg_ready(c);
+    } else {
+      c->is_readable = 0;
+    }
+    mg_io_sync(c);
+    mg_arm_timeout(c);
+  }
+}
+
+// Every mgr->pollinterval milliseconds, all connections get MG_EV_POLL and
+// are checked for closing. In between, only connections queued by the IO
+// backend, or by mg_send(), mg_error() and friends, are processed
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
   unsigned long now;
 
-  mg_iotest(mgr, ms);
+  // Do not sleep past the next timer or connection timeout
+  mg_iotest(mgr, mg_timers_wait(&mgr->timers, mg_millis(), ms));
   now = mg_millis();
-  mg_timer_poll(now);
-
-  for (c = mgr->conns; c != NULL; c = tmp) {
-    tmp = c->next;
-    mg_call(c, MG_EV_POLL, &now);
-    LOG(LL_VERBOSE_DEBUG,
-        ("%lu %c%c %c%c%c%c%c", c->id, c->is_readable ? 'r' : '-',
-         c->is_writable ? 'w' : '-', c->is_tls ? 'T' : 't',
-         c->is_connecting ? 'C' : 'c', c->is_tls_hs ? 'H' : 'h',
-         c->is_resolving ? 'R' : 'r', c->is_closing ? 'C' : 'c'));
-    if (c->is_resolving || c->is_closing) {
-      // Do nothing
-    } else if (c->is_listening && c->is_udp == 0) {
-      if (c->is_readable) accept_conn(mgr, c);
-    } else if (c->is_connecting) {
-      if (c->is_readable || c->is_writable) connect_conn(c);
-    } else if (c->is_tls_hs) {
-      if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
-    } else {
-      if (c->is_readable) read_conn(c, ll_read);
-      if (c->is_writable) write_conn(c);
-    }
+  mg_timer_poll(&mgr->timers, now);
 
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
-    if (c->is_closing) close_conn(c);
+  if (mgr->pollinterval <= 0 ||
+      now - mgr->lastpoll >= (unsigned long) mgr->pollinterval) {
+    mgr->lastpoll = now;
+    while ((c = mgr->ready) != NULL) mgr->ready = c->rnext, c->is_ready = 0;
+    for (c = mgr->conns; c != NULL; c = tmp) {
+      tmp = c->next;
+      mg_call(c, MG_EV_POLL, &now);
+      poll_conn(c);
+    }
+  } else {
+    // Detach the queue: connections processed now may queue themselves again
+    struct mg_connection *list = mgr->ready;
+    mgr->ready = NULL;
+    if (list != NULL) list->rprev = &list;
+    while ((c = list) != NULL) {
+      mg_unready(c);
+      poll_conn(c);
+    }
   }
 }
 #endif
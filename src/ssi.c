@@ -8,7 +8,7 @@
 
 #if MG_ENABLE_SSI
 static char *mg_ssi(const char *path, const char *root, int depth) {
-  struct mg_iobuf b = {NULL, 0, 0};
+  struct mg_iobuf b = {NULL, 0, 0, 0};
   FILE *fp = mg_fopen(path, "rb");
   if (fp != NULL) {
     char buf[BUFSIZ], arg[sizeof(buf)];
@@ -24,7 +24,7 @@ static char *mg_ssi(const char *path, const char *root, int depth) {
           if (depth < MG_MAX_SSI_DEPTH &&
               (data = mg_ssi(tmp, root, depth + 1)) != NULL) {
             mg_iobuf_append(&b, data, strlen(data), align);
-            free(data);
+            mg_dealloc(data);
           } else {
             LOG(LL_ERROR, ("%s: file=%s error or too deep", path, arg));
           }
@@ -34,7 +34,7 @@ static char *mg_ssi(const char *path, const char *root, int depth) {
           if (depth < MG_MAX_SSI_DEPTH &&
               (data = mg_ssi(tmp, root, depth + 1)) != NULL) {
             mg_iobuf_append(&b, data, strlen(data), align);
-            free(data);
+            mg_dealloc(data);
           } else {
             LOG(LL_ERROR, ("%s: virtual=%s error or too deep", path, arg));
           }
@@ -79,6 +79,6 @@ void mg_http_serve_ssi(struct mg_connection *c, const char *root,
                        const char *fullpath) {
   char *data = mg_ssi(fullpath, root, 0);
   mg_http_reply(c, 200, "", "%s", data == NULL ? "" : data);
-  free(data);
+  mg_dealloc(data);
 }
 #endif
@@ -4,41 +4,126 @@
 #include "timer.h"
 #include "arch.h"
 
-struct mg_timer *g_timers;
+#define MG_TIMER_MASK (MG_TIMER_SLOTS - 1)
 
-void mg_timer_init(struct mg_timer *t, int ms, int flags, void (*fn)(void *),
-                   void *arg) {
-  struct mg_timer tmp = {ms, flags, fn, arg, 0UL, g_timers};
+static void mg_timer_link(struct mg_timer **head, struct mg_timer *t) {
+  t->next = *head;
+  if (t->next != NULL) t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+}
+
+// Move all timers from one list to another
+static void mg_timer_splice(struct mg_timer **from, struct mg_timer **to) {
+  struct mg_timer *t;
+  while ((t = *from) != NULL) {
+    mg_timer_free(t);
+    mg_timer_link(to, t);
+  }
+}
+
+void mg_timer_init(struct mg_timers *w, struct mg_timer *t, int ms, int flags,
+                   void (*fn)(void *), void *arg) {
+  struct mg_timer tmp = {ms, flags, fn, arg, 0UL, NULL, NULL};
   *t = tmp;
-  g_timers = t;
+  mg_timer_link(&w->due, t);  // Expiration time is set by next poll
   if (flags & MG_TIMER_RUN_NOW) fn(arg);
 }
 
 void mg_timer_free(struct mg_timer *t) {
-  struct mg_timer **head = &g_timers;
-  while (*head && *head != t) head = &(*head)->next;
-  if (*head) *head = t->next;
+  if (t->pprev == NULL) return;
+  *t->pprev = t->next;
+  if (t->next != NULL) t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
 }
 
-void mg_timer_poll(unsigned long now_ms) {
-  // If time goes back (wrapped around), reset timers
-  struct mg_timer *t, *tmp;
-  static unsigned long oldnow;  // Timestamp in a previous invocation
-  if (oldnow > now_ms) {        // If it is wrapped, reset timers
-    for (t = g_timers; t != NULL; t = t->next) t->expire = 0;
+// Arm timer to expire at a given time. A level is picked so that the slot is
+// visited not before the timer's time range begins, and at most once before
+// the timer expires, when it moves on to a finer level
+void mg_timers_add(struct mg_timers *w, struct mg_timer *t,
+                   unsigned long expire) {
+  struct mg_timer **head = &w->due;
+  mg_timer_free(t);
+  t->expire = expire;
+  if (expire > w->now) {
+    unsigned long delta = expire - w->now;
+    int shift = 0;
+    while (shift < (MG_TIMER_LEVELS - 1) * MG_TIMER_BITS &&
+           delta >> (shift + MG_TIMER_BITS) != 0) {
+      shift += MG_TIMER_BITS;
+    }
+    head = &w->slots[shift / MG_TIMER_BITS][(expire >> shift) & MG_TIMER_MASK];
   }
-  oldnow = now_ms;
+  mg_timer_link(head, t);
+}
 
-  for (t = g_timers; t != NULL; t = tmp) {
-    tmp = t->next;
-    if (t->expire == 0) t->expire = now_ms + t->period_ms;
-    if (t->expire > now_ms) continue;
-    t->fn(t->arg);
+// Milliseconds from now_ms until the earliest timer expires, but not more
+// than ms. Timers in a slot expire before those in later slots of the same
+// level, so only the first non-empty slot of every level is looked at
+int mg_timers_wait(struct mg_timers *w, unsigned long now_ms, int ms) {
+  struct mg_timer *t;
+  int i, level;
+  if (w->due != NULL) return 0;
+  for (level = 0; level < MG_TIMER_LEVELS && ms > 0; level++) {
+    unsigned long cur = w->now >> (level * MG_TIMER_BITS);
+    for (i = 1; i <= MG_TIMER_SLOTS; i++) {
+      if ((t = w->slots[level][(cur + (unsigned long) i) & MG_TIMER_MASK])) {
+        break;
+      }
+    }
+    for (; t != NULL && ms > 0; t = t->next) {
+      if (t->expire <= now_ms) return 0;
+      if (t->expire - now_ms < (unsigned long) ms) {
+        ms = (int) (t->expire - now_ms);
+      }
+    }
+  }
+  return ms;
+}
+
+// Collect timers from slots whose time range has begun since the last poll,
+// run expired ones and re-arm the rest on finer levels
+void mg_timer_poll(struct mg_timers *w, unsigned long now_ms) {
+  struct mg_timer *list = NULL, *t;
+  int i, level;
+  if (now_ms < w->now) {
+    // Time went back (wrapped around): restart all timers from now
+    for (level = 0; level < MG_TIMER_LEVELS; level++) {
+      for (i = 0; i < MG_TIMER_SLOTS; i++) {
+        mg_timer_splice(&w->slots[level][i], &list);
+      }
+    }
+    for (t = list; t != NULL; t = t->next) t->expire = 0;
+  }
+  for (level = 0; level < MG_TIMER_LEVELS && now_ms > w->now; level++) {
+    unsigned long from = w->now >> (level * MG_TIMER_BITS);
+    unsigned long to = now_ms >> (level * MG_TIMER_BITS), n;
+    if (from == to) break;  // Coarser levels have not moved either
+    if (to - from > MG_TIMER_SLOTS) from = to - MG_TIMER_SLOTS;
+    for (n = from + 1; n <= to; n++) {
+      mg_timer_splice(&w->slots[level][n & MG_TIMER_MASK], &list);
+    }
+  }
+  mg_timer_splice(&w->due, &list);
+  w->now = now_ms;
+
+  while ((t = list) != NULL) {
+    mg_timer_free(t);
+    if (t->expire == 0) t->expire = now_ms + (unsigned long) t->period_ms;
+    if (t->expire > now_ms) {
+      mg_timers_add(w, t, t->expire);
+      continue;
+    }
     // Try to tick timers with the given period as accurate as possible,
     // even if this polling function is called with some random period.
-    t->expire = now_ms - t->expire > (unsigned long) t->period_ms
-                    ? now_ms + t->period_ms
-                    : t->expire + t->period_ms;
-    if (!(t->flags & MG_TIMER_REPEAT)) mg_timer_free(t);
+    // Re-arm before the call, which may free or re-arm the timer itself
+    if (t->flags & MG_TIMER_REPEAT) {
+      mg_timers_add(w, t,
+                    now_ms - t->expire > (unsigned long) t->period_ms
+                        ? now_ms + (unsigned long) t->period_ms
+                        : t->expire + (unsigned long) t->period_ms);
+    }
+    t->fn(t->arg);
   }
 }
@@ -8,11 +8,25 @@ struct mg_timer {
   void (*fn)(void *);       // Function to call
   void *arg;                // Function agrument
   unsigned long expire;     // Expiration timestamp in milliseconds
-  struct mg_timer *next;    // Linkage in g_timers list
+  struct mg_timer *next;    // Linkage in a struct mg_timers slot
+  struct mg_timer **pprev;  // Link that points to us, NULL if not armed
 };
 
-extern struct mg_timer *g_timers;  // Global list of timers
+// Hierarchical timing wheel. Level 0 has a slot per millisecond, every next
+// level is MG_TIMER_SLOTS times coarser. Arming and cancelling is O(1)
+#define MG_TIMER_BITS 6
+#define MG_TIMER_SLOTS (1 << MG_TIMER_BITS)
+#define MG_TIMER_LEVELS 4
 
-void mg_timer_init(struct mg_timer *, int ms, int, void (*fn)(void *), void *);
+struct mg_timers {
+  struct mg_timer *slots[MG_TIMER_LEVELS][MG_TIMER_SLOTS];  // Armed timers
+  struct mg_timer *due;  // Expired or new timers, run by the next poll
+  unsigned long now;     // Time of the last poll, in milliseconds
+};
+
+void mg_timer_init(struct mg_timers *, struct mg_timer *, int ms, int flags,
+                   void (*fn)(void *), void *arg);
 void mg_timer_free(struct mg_timer *);
-void mg_timer_poll(unsigned long uptime_ms);
+void mg_timer_poll(struct mg_timers *, unsigned long uptime_ms);
+void mg_timers_add(struct mg_timers *, struct mg_timer *, unsigned long expire);
+int mg_timers_wait(struct mg_timers *, unsigned long now_ms, int ms);
@@ -0,0 +1,174 @@
+#include "log.h"
+#include "net.h"
+#include "private.h"
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static void mg_uring_unmap(struct mg_uring *r) {
+  if (r->sqes != NULL) munmap(r->sqes, r->sqes_len);
+  if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+  if (r->sq_ptr != NULL) munmap(r->sq_ptr, r->sq_len);
+  if (r->fd >= 0) close(r->fd);
+  free(r->bufs);
+  free(r->lost);
+  free(r);
+}
+
+struct mg_uring *mg_uring_new(unsigned entries, unsigned nbufs,
+                              unsigned bufsize) {
+  struct io_uring_params p;
+  struct mg_uring *r = (struct mg_uring *) calloc(1, sizeof(*r));
+  if (r == NULL) return NULL;
+  memset(&p, 0, sizeof(p));
+  r->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    LOG(LL_INFO, ("io_uring unavailable, fd %d, errno %d", r->fd, errno));
+    mg_uring_unmap(r);
+    return NULL;
+  }
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+    r->cq_len = r->sq_len;
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq_ptr = mmap(0, r->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) r->sq_ptr = NULL;
+  r->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP)
+                  ? r->sq_ptr
+                  : mmap(0, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  if (r->cq_ptr == MAP_FAILED) r->cq_ptr = NULL;
+  r->sqes = (struct io_uring_sqe *) mmap(0, r->sqes_len, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, r->fd,
+                                         IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) r->sqes = NULL;
+  r->bufs = (unsigned char *) malloc((size_t) nbufs * bufsize);
+  r->lost = (unsigned *) malloc(nbufs * sizeof(*r->lost));
+  if (r->sq_ptr == NULL || r->cq_ptr == NULL || r->sqes == NULL ||
+      r->bufs == NULL || r->lost == NULL) {
+    LOG(LL_ERROR, ("io_uring setup failed, errno %d", errno));
+    mg_uring_unmap(r);
+    return NULL;
+  } else {
+    char *sq = (char *) r->sq_ptr, *cq = (char *) r->cq_ptr;
+    struct io_uring_sqe *sqe;
+    r->sq_head = (unsigned *) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->nbufs = nbufs;
+    r->bufsize = bufsize;
+    // Hand all receive buffers to the kernel, as buffer group 0
+    if ((sqe = mg_uring_sqe(r)) != NULL) {
+      sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd = (int) nbufs;
+      sqe->addr = (unsigned long) r->bufs;
+      sqe->len = bufsize;
+      sqe->off = 0;
+      sqe->buf_group = 0;
+    }
+  }
+  return r;
+}
+
+void mg_uring_free(struct mg_uring *r) {
+  if (r != NULL) mg_uring_unmap(r);
+}
+
+// Return next free submission entry, zeroed. If the submission queue is full,
+// flush it to the kernel first
+struct io_uring_sqe *mg_uring_sqe(struct mg_uring *r) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *r->sq_tail, idx;
+  struct io_uring_sqe *sqe;
+  if (tail - head >= r->sq_entries) {
+    if (mg_uring_enter(r, 0) < 0) return NULL;
+    head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= r->sq_entries) return NULL;
+  }
+  idx = tail & *r->sq_mask;
+  sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static unsigned mg_uring_queued(struct mg_uring *r) {
+  return *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// Submit all prepared entries with a single syscall. If wait_ms is not 0,
+// also wait up to wait_ms milliseconds for at least one completion
+int mg_uring_enter(struct mg_uring *r, int wait_ms) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = IORING_ENTER_EXT_ARG, min_complete = 0, n;
+  int rc;
+  // Retry buffers that did not fit into the SQ before. There is room for
+  // them, so this does not recurse into mg_uring_enter()
+  while (r->nlost > 0 && mg_uring_queued(r) < r->sq_entries) {
+    mg_uring_provide(r, r->lost[--r->nlost]);
+  }
+  n = mg_uring_queued(r);
+  memset(&arg, 0, sizeof(arg));
+  if (wait_ms > 0) {
+    ts.tv_sec = wait_ms / 1000;
+    ts.tv_nsec = (long long) (wait_ms % 1000) * 1000000;
+    arg.ts = (unsigned long) &ts;
+    flags |= IORING_ENTER_GETEVENTS;
+    min_complete = 1;
+  }
+  rc = (int) syscall(__NR_io_uring_enter, r->fd, n, min_complete, flags, &arg,
+                     sizeof(arg));
+  if (rc < 0 && (errno == ETIME || errno == EINTR)) {
+    rc = 0;
+  } else if (rc < 0) {
+    LOG(LL_ERROR, ("io_uring_enter: %d", errno));
+  }
+  return rc;
+}
+
+// Return next completion entry, or NULL if the completion queue is empty
+struct io_uring_cqe *mg_uring_cqe(struct mg_uring *r) {
+  unsigned head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void mg_uring_cqe_done(struct mg_uring *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned char *mg_uring_buf(struct mg_uring *r, unsigned bid) {
+  return r->bufs + (size_t) bid * r->bufsize;
+}
+
+// Give a consumed receive buffer back to the kernel. If the SQ is full even
+// after a flush, remember the buffer and retry on the next enter, otherwise
+// the pool would shrink until every receive fails with ENOBUFS
+void mg_uring_provide(struct mg_uring *r, unsigned bid) {
+  struct io_uring_sqe *sqe = mg_uring_sqe(r);
+  if (sqe == NULL) {
+    if (r->nlost < r->nbufs) r->lost[r->nlost++] = bid;
+  } else {
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (unsigned long) mg_uring_buf(r, bid);
+    sqe->len = r->bufsize;
+    sqe->off = bid;
+    sqe->buf_group = 0;
+  }
+}
+#endif
@@ -1,6 +1,39 @@
 #include "config.h"
 #include "util.h"
 
+static struct mg_allocator s_allocator;
+
+void mg_set_allocator(const struct mg_allocator *allocator) {
+  if (allocator == NULL) {
+    memset(&s_allocator, 0, sizeof(s_allocator));
+  } else {
+    s_allocator = *allocator;
+  }
+}
+
+void *mg_alloc(size_t size) {
+  if (s_allocator.alloc != NULL) {
+    return s_allocator.alloc(size, s_allocator.userdata);
+  }
+  return malloc(size);
+}
+
+// Resize memory returned by mg_alloc(). Custom allocators cannot resize, so
+// then NULL is returned, like on failure, and ptr stays valid
+void *mg_realloc(void *ptr, size_t size) {
+  if (s_allocator.alloc != NULL) return NULL;
+  return realloc(ptr, size);
+}
+
+void mg_dealloc(void *ptr) {
+  if (ptr == NULL) return;
+  if (s_allocator.dealloc != NULL) {
+    s_allocator.dealloc(ptr, s_allocator.userdata);
+  } else {
+    free(ptr);
+  }
+}
+
 #if MG_ENABLE_FS
 int mg_stat(const char *path, mg_stat_t *st) {
 #ifdef _WIN32
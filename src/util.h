@@ -3,6 +3,16 @@
 #include "arch.h"
 #include "str.h"
 
+struct mg_allocator {
+  void *(*alloc)(size_t size, void *userdata);  // Allocate size bytes
+  void (*dealloc)(void *ptr, void *userdata);   // Release allocated memory
+  void *userdata;                               // Passed to both functions
+};
+
+void mg_set_allocator(const struct mg_allocator *allocator);
+void *mg_alloc(size_t size);
+void mg_dealloc(void *ptr);
+void *mg_realloc(void *ptr, size_t size);
 char *mg_file_read(const char *path);
 int64_t mg_file_size(const char *path);
 bool mg_file_write(const char *path, const void *buf, size_t len);
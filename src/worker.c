@@ -0,0 +1,108 @@
+#include "event.h"
+#include "log.h"
+#include "net.h"
+#include "private.h"
+
+#if MG_ENABLE_SOCKET && MG_ENABLE_WORKERS
+static void *mg_worker_thread(void *param) {
+  struct mg_workers *w = (struct mg_workers *) param;
+  for (;;) {
+    struct mg_work *wk;
+    pthread_mutex_lock(&w->lock);
+    while (w->queue == NULL && !w->stop) pthread_cond_wait(&w->cond, &w->lock);
+    if ((wk = w->stop ? NULL : w->queue) != NULL) {
+      if ((w->queue = wk->next) == NULL) w->tail = &w->queue;
+      w->queued--;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (wk == NULL) break;
+    wk->fn(wk->arg);
+    // Hand arg back to the event loop, it owns it from now on
+    if (!mg_wakeup_post(w->mgr, wk->id, MG_EV_WORK_DONE, &wk->arg,
+                        sizeof(wk->arg))) {
+      LOG(LL_ERROR, ("%lu lost work result", wk->id));
+      free(wk->arg);
+    }
+    free(wk);
+  }
+  return NULL;
+}
+
+// Start nthreads worker threads that run work submitted by mg_submit().
+// At most max_queued submitted items can wait for a free worker
+bool mg_workers_init(struct mg_mgr *mgr, int nthreads, int max_queued) {
+  struct mg_workers *w;
+  if (mgr->workers != NULL || nthreads <= 0 || !mg_mgr_wakeup_init(mgr)) {
+    return mgr->workers != NULL;
+  }
+  if ((w = (struct mg_workers *) calloc(1, sizeof(*w))) == NULL ||
+      (w->threads = (pthread_t *) calloc((size_t) nthreads,
+                                         sizeof(pthread_t))) == NULL) {
+    free(w);
+    return false;
+  }
+  w->mgr = mgr;
+  w->tail = &w->queue;
+  w->max_queued = max_queued;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  mgr->workers = w;
+  for (w->nthreads = 0; w->nthreads < nthreads; w->nthreads++) {
+    pthread_t *t = &w->threads[w->nthreads];
+    if (pthread_create(t, NULL, mg_worker_thread, w) != 0) {
+      LOG(LL_ERROR, ("pthread_create: %d", errno));
+      break;
+    }
+  }
+  if (w->nthreads == 0) mg_workers_free(mgr);
+  return mgr->workers != NULL;
+}
+
+// Queue fn(arg) for a worker thread. When it returns, connection with the
+// given ID gets MG_EV_WORK_DONE with arg. Return false if the queue is full
+bool mg_submit(struct mg_mgr *mgr, unsigned long id, void (*fn)(void *),
+               void *arg) {
+  struct mg_workers *w = mgr->workers;
+  struct mg_work *wk;
+  bool ok = false;
+  if (w == NULL) return false;
+  if ((wk = (struct mg_work *) calloc(1, sizeof(*wk))) == NULL) return false;
+  wk->id = id;
+  wk->fn = fn;
+  wk->arg = arg;
+  pthread_mutex_lock(&w->lock);
+  if (w->queued < w->max_queued) {
+    *w->tail = wk;
+    w->tail = &wk->next;
+    w->queued++;
+    ok = true;
+    pthread_cond_signal(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  if (!ok) free(wk);
+  return ok;
+}
+
+// Stop workers. Running work is finished, queued work is dropped
+void mg_workers_free(struct mg_mgr *mgr) {
+  struct mg_workers *w = mgr->workers;
+  struct mg_work *wk;
+  int i;
+  if (w == NULL) return;
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  for (i = 0; i < w->nthreads; i++) pthread_join(w->threads[i], NULL);
+  while ((wk = w->queue) != NULL) {
+    w->queue = wk->next;
+    free(wk->arg);
+    free(wk);
+  }
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  free(w->threads);
+  free(w);
+  mgr->workers = NULL;
+}
+#endif
@@ -195,7 +195,7 @@ static void test_base64(void) {
 }
 
 static void test_iobuf(void) {
-  struct mg_iobuf io = {0, 0, 0};
+  struct mg_iobuf io = {0, 0, 0, 0};
   ASSERT(io.buf == NULL && io.size == 0 && io.len == 0);
   mg_iobuf_resize(&io, 1);
   ASSERT(io.buf != NULL && io.size == 1 && io.len == 0);
@@ -206,6 +206,76 @@ static void test_iobuf(void) {
   ASSERT(io.buf != NULL && io.size == 10 && io.len == 3);
   ASSERT(memcmp(io.buf, "hi!", 3) == 0);
   free(io.buf);
+
+  // Delete does not move data, space is reclaimed when needed
+  memset(&io, 0, sizeof(io));
+  mg_iobuf_append(&io, "abcdefgh", 8, 10);
+  ASSERT(io.size == 10 && io.len == 8 && io.off == 0);
+  ASSERT(mg_iobuf_delete(&io, 3) == 3);
+  ASSERT(io.size == 7 && io.len == 5 && io.off == 3);
+  ASSERT(memcmp(io.buf, "defgh", 5) == 0);
+  ASSERT(mg_iobuf_delete(&io, 6) == 0);
+  mg_iobuf_append(&io, "ij", 2, 10);
+  ASSERT(io.size == 7 && io.len == 7 && io.off == 3);
+  ASSERT(memcmp(io.buf, "defghij", 7) == 0);
+  mg_iobuf_append(&io, "kl", 2, 10);  // No space at the tail, compacts
+  ASSERT(io.size == 10 && io.len == 9 && io.off == 0);
+  ASSERT(memcmp(io.buf, "defghijkl", 9) == 0);
+  mg_iobuf_delete(&io, 4);
+  ASSERT(mg_iobuf_resize(&io, 8) == 1);  // Compacts, then resizes
+  ASSERT(io.size == 8 && io.len == 5 && io.off == 0);
+  ASSERT(memcmp(io.buf, "hijkl", 5) == 0);
+  mg_iobuf_delete(&io, 1);
+  ASSERT(mg_iobuf_resize(&io, 3) == 1);  // Length is cut, as with no offset
+  ASSERT(io.size == 3 && io.len == 3 && io.off == 0);
+  ASSERT(memcmp(io.buf, "ijk", 3) == 0);
+  mg_iobuf_delete(&io, 2);
+  ASSERT(mg_iobuf_delete(&io, 1) == 1);  // Empty, rewinds
+  ASSERT(io.size == 3 && io.len == 0 && io.off == 0);
+  mg_iobuf_delete(&io, 1);
+  mg_iobuf_append(&io, "abcdef", 6, 10);
+  ASSERT(mg_iobuf_cut(&io, 1, 3) == 3);
+  ASSERT(io.len == 3 && memcmp(io.buf, "aef", 3) == 0);
+  ASSERT(mg_iobuf_cut(&io, 2, 2) == 0);
+  ASSERT(mg_iobuf_cut(&io, 2, 1) == 1);
+  ASSERT(io.len == 2 && memcmp(io.buf, "ae", 2) == 0);
+  mg_iobuf_free(&io);
+  ASSERT(io.buf == NULL && io.size == 0 && io.off == 0);
+
+  // Geometric growth, limited by the step
+  ASSERT(mg_iobuf_reserve(&io, 100, 16, 1000) == 1);
+  ASSERT(io.size == 112 && io.len == 0);
+  io.len = 100;
+  ASSERT(mg_iobuf_reserve(&io, 20, 16, 1000) == 1);
+  ASSERT(io.size == 224 && io.len == 100);
+  ASSERT(mg_iobuf_reserve(&io, 10, 16, 1000) == 1);
+  ASSERT(io.size == 224);
+  io.len = 224;
+  ASSERT(mg_iobuf_reserve(&io, 1, 16, 100) == 1);
+  ASSERT(io.size == 336);
+  ASSERT(mg_iobuf_reserve(&io, 1000, 16, 0) == 1);
+  ASSERT(io.size == 1232);
+  mg_iobuf_free(&io);
+}
+
+static void test_send_growth(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c;
+  static char data[100000];
+  size_t i, n = 0;
+  mg_mgr_init(&mgr);
+  ASSERT(mgr.iogrow == MG_IO_GROW && mgr.iokeep == MG_IO_KEEP);
+  c = mg_connect(&mgr, "tcp://127.0.0.1:12384", NULL, NULL);
+  ASSERT(c != NULL);
+  for (i = 0; i < sizeof(data); i += 100) n += mg_send(c, &data[i], 100);
+  ASSERT(n == sizeof(data) && c->send.len == sizeof(data));
+  ASSERT(c->send.size < 2 * sizeof(data) + MG_IO_SIZE);
+  mg_iobuf_free(&c->send);
+  mgr.iogrow = 0;  // Grow by what is needed only
+  for (i = 0; i < 1000; i += 100) mg_send(c, &data[i], 100);
+  ASSERT(c->send.len == 1000 && c->send.size == 1024);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
 }
 
 static void sntp_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
@@ -723,6 +793,876 @@ static void test_http_pipeline(void) {
   ASSERT(mgr.conns == NULL);
 }
 
+// Server streams request chunks and replies with a chunked response, client
+// gets the reassembled body
+static void f19(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  char *buf = (char *) fn_data;
+  if (ev == MG_EV_HTTP_CHUNK && c->is_accepted) {
+    size_t n = strlen(buf);
+    snprintf(buf + n, 100 - n, "%.*s.", (int) hm->chunk.len, hm->chunk.ptr);
+    mg_http_delete_chunk(c, hm);
+    ASSERT(hm->body.len == 0);
+  } else if (ev == MG_EV_HTTP_MSG && c->is_accepted) {
+    mg_printf(c, "%s", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+    mg_http_printf_chunk(c, "%.*s", (int) hm->uri.len, hm->uri.ptr);
+    mg_http_printf_chunk(c, "[%d]", (int) hm->body.len);
+    mg_http_write_chunk(c, "", 0);
+  } else if (ev == MG_EV_HTTP_MSG) {
+    size_t n = strlen(buf);
+    snprintf(buf + n, 100 - n, "%.*s;", (int) hm->body.len, hm->body.ptr);
+  }
+}
+
+static void test_http_chunked(void) {
+  struct mg_mgr mgr;
+  const char *url = "http://127.0.0.1:12395";
+  struct mg_connection *c;
+  char sbuf[100] = "", cbuf[100] = "";
+  const char *s, *req =
+      "POST /c HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+      "2\r\nxy\r\n0\r\n\r\n";
+  int i;
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, f19, sbuf);
+  c = mg_http_connect(&mgr, url, f19, cbuf);
+  mg_printf(c, "%s",
+            "POST /a HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+            "3\r\nabc\r\nA;x=y\r\n0123456789\r\n0\r\nX-T: 1\r\n\r\n"
+            "GET /b HTTP/1.1\r\n\r\n");
+  for (i = 0; i < 50 && strlen(cbuf) < 12; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(sbuf, "abc.0123456789.") == 0);
+  ASSERT(strcmp(cbuf, "/a[0];/b[0];") == 0);
+
+  // Same, trickled in byte by byte
+  sbuf[0] = cbuf[0] = '\0';
+  for (s = req; *s != '\0'; s++) {
+    mg_send(c, s, 1);
+    for (i = 0; i < 3; i++) mg_mgr_poll(&mgr, 1);
+  }
+  for (i = 0; i < 50 && strlen(cbuf) < 6; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(sbuf, "xy.") == 0);
+  ASSERT(strcmp(cbuf, "/c[0];") == 0);
+
+  // Broken chunk framing closes the connection
+  mg_printf(c, "%s",
+            "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nz\r\n");
+  for (i = 0; i < 50 && mgr.conns->next != NULL; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(mgr.conns->next == NULL);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+struct stream_stats {
+  size_t total, max_recv, errors;
+  char buf[100];
+};
+
+// Server streams bodies of all but /x requests, client collects replies
+static void f20(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  struct stream_stats *s = (struct stream_stats *) fn_data;
+  if (ev == MG_EV_HTTP_HDRS && c->is_accepted) {
+    if (!mg_http_match_uri(hm, "/x")) c->http->is_streaming = true;
+  } else if (ev == MG_EV_HTTP_CHUNK && c->is_accepted) {
+    if (hm->chunk.ptr != hm->body.ptr || hm->chunk.len != hm->body.len ||
+        hm->chunk.ptr[0] != 'a' + (char) (s->total % 26)) {
+      s->errors++;
+    }
+    s->total += hm->chunk.len;
+    if (c->recv.len > s->max_recv) s->max_recv = c->recv.len;
+  } else if (ev == MG_EV_HTTP_MSG && c->is_accepted) {
+    mg_http_reply(c, 200, "", "%.*s %lu %lu", (int) hm->uri.len, hm->uri.ptr,
+                  (unsigned long) s->total, (unsigned long) hm->body.len);
+  } else if (ev == MG_EV_HTTP_MSG) {
+    size_t n = strlen(s->buf);
+    snprintf(s->buf + n, sizeof(s->buf) - n, "%.*s;", (int) hm->body.len,
+             hm->body.ptr);
+  }
+}
+
+static void test_http_stream(void) {
+  struct mg_mgr mgr;
+  const char *url = "http://127.0.0.1:12396";
+  struct stream_stats ss, cs;
+  struct mg_connection *c;
+  unsigned long end = mg_millis() + 10000;
+  size_t i, size = MG_MAX_RECV_BUF_SIZE + 1000000, k = size % 26, n = size - k;
+  char *body = (char *) malloc(size);
+  for (i = 0; i < size; i++) body[i] = (char) ('a' + i % 26);
+  memset(&ss, 0, sizeof(ss));
+  memset(&cs, 0, sizeof(cs));
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, f20, &ss);
+  c = mg_http_connect(&mgr, url, f20, &cs);
+  mg_printf(c, "POST /up HTTP/1.1\r\nContent-Length: %lu\r\n\r\n",
+            (unsigned long) size);
+  mg_send(c, body, size);
+  // One chunk larger than the receive buffer limit, then a small one
+  mg_printf(c, "POST /ch HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+  mg_printf(c, "%lx\r\n", (unsigned long) n);
+  mg_send(c, body + k, n);
+  mg_printf(c, "\r\n3\r\n%.3s\r\n0\r\n\r\n", body + k);
+  mg_printf(c, "%s", "POST /x HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc");
+  while (strchr(cs.buf, 'x') == NULL && mg_millis() < end) mg_mgr_poll(&mgr, 1);
+  snprintf(ss.buf, sizeof(ss.buf), "/up %lu 0;/ch %lu 0;/x %lu 3;",
+           (unsigned long) size, (unsigned long) (size + n + 3),
+           (unsigned long) (size + n + 3));
+  ASSERT(strcmp(cs.buf, ss.buf) == 0);
+  ASSERT(ss.max_recv < size / 4);
+  ASSERT(ss.errors == 0);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  free(body);
+}
+
+// Server streams uploads to files, client collects response codes
+static void f21(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  struct stream_stats *s = (struct stream_stats *) fn_data;
+  if (ev == MG_EV_HTTP_HDRS && c->is_accepted) {
+    if (mg_http_upload(c, hm, ".") > 0) s->total = hm->body.len;
+  } else if (ev == MG_EV_HTTP_CHUNK && c->is_accepted) {
+    if (c->http->decoded <= s->total) s->errors++;  // Progress goes forward
+    s->total = c->http->decoded;
+    if (c->recv.len > s->max_recv) s->max_recv = c->recv.len;
+  } else if (ev == MG_EV_HTTP_MSG && !c->is_accepted) {
+    size_t n = strlen(s->buf);
+    snprintf(s->buf + n, sizeof(s->buf) - n, "%.*s;", (int) hm->uri.len,
+             hm->uri.ptr);
+  }
+}
+
+static void test_http_upload(void) {
+  struct mg_mgr mgr;
+  const char *url = "http://127.0.0.1:12397";
+  struct stream_stats ss, cs;
+  struct mg_connection *c;
+  unsigned long end = mg_millis() + 10000;
+  size_t i, size = MG_MAX_RECV_BUF_SIZE + 1000000;
+  char *body = (char *) malloc(size), *p;
+  for (i = 0; i < size; i++) body[i] = (char) ('a' + i % 26);
+  memset(&ss, 0, sizeof(ss));
+  memset(&cs, 0, sizeof(cs));
+  remove("uploaded.bin");
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, f21, &ss);
+  c = mg_http_connect(&mgr, url, f21, &cs);
+
+  // Large body is streamed to the file, small one written at once
+  mg_printf(c, "POST /u?name=uploaded.bin HTTP/1.1\r\nContent-Length: %lu\r\n",
+            (unsigned long) size);
+  mg_printf(c, "%s", "\r\n");
+  mg_send(c, body, size);
+  while (strlen(cs.buf) < 4 && mg_millis() < end) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(cs.buf, "200;") == 0);
+  ASSERT(ss.total == size);
+  ASSERT(ss.max_recv < size / 4);
+  ASSERT(ss.errors == 0);
+  ASSERT((size_t) mg_file_size("uploaded.bin") == size);
+  ASSERT((p = mg_file_read("uploaded.bin")) != NULL);
+  ASSERT(memcmp(p, body, size) == 0);
+  free(p);
+  mg_printf(c, "%s",
+            "POST /u?name=uploaded.bin&offset=2 HTTP/1.1\r\n"
+            "Content-Length: 3\r\n\r\nXYZ");
+  while (strlen(cs.buf) < 8 && mg_millis() < end) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(cs.buf, "200;200;") == 0);
+  ASSERT(ss.total == 3);
+  ASSERT((p = mg_file_read("uploaded.bin")) != NULL);
+  ASSERT(memcmp(p, "abXYZf", 6) == 0);
+  ASSERT((size_t) mg_file_size("uploaded.bin") == size);
+  free(p);
+
+  // Chunked body
+  ss.total = 0;
+  mg_printf(c, "%s",
+            "POST /u?name=uploaded.bin HTTP/1.1\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n");
+  for (i = 0; i < 3; i++) mg_mgr_poll(&mgr, 1);
+  mg_printf(c, "%s", "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n");
+  while (strlen(cs.buf) < 12 && mg_millis() < end) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(cs.buf, "200;200;200;") == 0);
+  ASSERT(ss.total == 11);
+  ASSERT((p = mg_file_read("uploaded.bin")) != NULL);
+  ASSERT(strcmp(p, "hello world") == 0);
+  free(p);
+
+  // Unfinished upload keeps the data received so far
+  mg_printf(c, "%s",
+            "POST /u?name=uploaded.bin HTTP/1.1\r\n"
+            "Content-Length: 100000\r\n\r\n0123456789");
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+  c->is_closing = 1;
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(mg_file_size("uploaded.bin") == 10);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  remove("uploaded.bin");
+  free(body);
+}
+
+static void f6(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_POLL) (*(int *) fn_data)++;
+  if (ev == MG_EV_HTTP_MSG) mg_http_reply(c, 200, "", "%s", "ok");
+  (void) ev_data;
+}
+
+static int s_released;
+
+static void release_cb(void *arg) {
+  s_released += *(int *) arg;
+}
+
+static void f10(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_ACCEPT) *(struct mg_connection **) fn_data = c;
+  (void) ev_data;
+}
+
+static void test_send_ref(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c, *server = NULL;
+  struct mg_shared *sh;
+  static char big[200000];
+  char expected[sizeof(big) + 20], *p = expected;
+  int i, one = 1, ten = 10;
+  const char *url = "tcp://127.0.0.1:12385";
+  for (i = 0; i < (int) sizeof(big); i++) big[i] = (char) ('a' + i % 26);
+  mg_mgr_init(&mgr);
+  mg_listen(&mgr, url, f10, &server);
+  c = mg_connect(&mgr, url, NULL, NULL);
+  ASSERT(c != NULL);
+  ASSERT((sh = mg_shared_new("shared", 6)) != NULL);
+  ASSERT(mg_send(c, "A", 1) == 1);
+  ASSERT(mg_send_ref(c, "BB", 2, release_cb, &one) == 2);
+  ASSERT(mg_send_ref(c, "", 0, release_cb, &one) == 0);
+  ASSERT(mg_send(c, "C", 1) == 1);
+  ASSERT(mg_send_shared(c, sh) == 6);
+  ASSERT(mg_send_shared(c, sh) == 6);
+  ASSERT(sh->refcnt == 3);
+  mg_shared_release(sh);
+  ASSERT(mg_send_ref(c, big, sizeof(big), release_cb, &ten) == sizeof(big));
+  ASSERT(mg_send(c, "D", 1) == 1);
+  memcpy(p, "ABBCsharedshared", 16), p += 16;
+  memcpy(p, big, sizeof(big)), p += sizeof(big);
+  *p++ = 'D';
+  for (i = 0; i < 1000; i++) {
+    mg_mgr_poll(&mgr, 1);
+    if (server != NULL && server->recv.len >= (size_t) (p - expected)) break;
+  }
+  ASSERT(server != NULL);
+  ASSERT(server->recv.len == (size_t) (p - expected));
+  ASSERT(memcmp(server->recv.buf, expected, (size_t) (p - expected)) == 0);
+  ASSERT(s_released == 11);
+  ASSERT(c->segs == NULL && c->send.len == 0);
+
+  // Unsent segments are released when the connection closes
+  sh = mg_shared_new(NULL, 3);
+  memcpy(sh->buf, "xyz", 3);
+  mg_send_ref(c, "E", 1, release_cb, &ten);
+  mg_send_shared(c, sh);
+  mg_shared_release(sh);
+  ASSERT(sh->refcnt == 1);
+  c->is_closing = 1;
+  mg_mgr_poll(&mgr, 1);
+  ASSERT(s_released == 21);
+  mg_mgr_free(&mgr);
+}
+
+static void f11(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    mg_http_serve_file(c, hm, (char *) fn_data, "application/octet-stream",
+                       NULL);
+  }
+}
+
+static void test_serve_large_file(void) {
+  struct mg_mgr mgr;
+  const char *url = "http://127.0.0.1:12386", *path = "_large_file.bin";
+  static char data[65536], buf[FETCH_BUF_SIZE];
+  struct mg_http_message hm;
+  int i;
+  for (i = 0; i < (int) sizeof(data); i++) data[i] = (char) ('0' + i % 10);
+  ASSERT(mg_file_write(path, data, sizeof(data)));
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, f11, (void *) path);
+  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+  ASSERT(mg_http_parse(buf, strlen(buf), &hm) > 0);
+  ASSERT(hm.body.len == sizeof(data));
+  ASSERT(memcmp(hm.body.ptr, data, sizeof(data)) == 0);
+  ASSERT(fetch(&mgr, buf, url, "HEAD / HTTP/1.0\n\n") == 200);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  remove(path);
+}
+
+static int s_relay_reads;
+
+static void f12(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_READ) {
+    mg_send(c, c->recv.buf, c->recv.len);
+    mg_iobuf_delete(&c->recv, c->recv.len);
+  }
+  (void) ev_data, (void) fn_data;
+}
+
+// Relay backend: connected to the echo server on behalf of fn_data
+static void f13b(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct mg_connection *client = (struct mg_connection *) fn_data;
+  if (ev == MG_EV_CONNECT) ASSERT(mg_relay(client, c));
+  if (ev == MG_EV_READ) s_relay_reads++;
+  (void) ev_data;
+}
+
+static void f13(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_ACCEPT) mg_connect(c->mgr, (char *) fn_data, f13b, c);
+  (void) ev_data;
+}
+
+static void test_relay(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c;
+  const char *echo = "tcp://127.0.0.1:12387", *url = "tcp://127.0.0.1:12388";
+  static char data[300000];
+  int i, n;
+  for (i = 0; i < (int) sizeof(data); i++) data[i] = (char) ('a' + i % 26);
+  mg_mgr_init(&mgr);
+  mg_listen(&mgr, echo, f12, NULL);
+  mg_listen(&mgr, url, f13, (void *) echo);
+  c = mg_connect(&mgr, url, NULL, NULL);
+  ASSERT(c != NULL);
+  mg_send(c, data, sizeof(data));
+  for (i = 0; i < 3000 && c->recv.len < sizeof(data); i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(c->recv.len == sizeof(data));
+  ASSERT(memcmp(c->recv.buf, data, sizeof(data)) == 0);
+#if MG_ENABLE_SPLICE && !MG_ENABLE_IO_URING
+  ASSERT(s_relay_reads == 0);  // Spliced data bypasses IO buffers
+#endif
+
+  // Client leaves: the relay shuts down both directions and closes
+  c->is_draining = 1;
+  for (i = 0; i < 1000; i++) {
+    mg_mgr_poll(&mgr, 1);
+    for (n = 0, c = mgr.conns; c != NULL; c = c->next) n++;
+    if (n == 2) break;
+  }
+  ASSERT(n == 2);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+static void f14(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  int *counts = (int *) fn_data;
+  if (ev == MG_EV_FULL) counts[0]++;
+  if (ev == MG_EV_DRAIN) counts[1]++;
+  if (ev == MG_EV_FULL) ASSERT(*(size_t *) ev_data >= c->send_high);
+  if (ev == MG_EV_DRAIN) ASSERT(*(size_t *) ev_data <= c->send_low);
+  (void) c;
+}
+
+static void test_watermarks(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c, *lsn, *server = NULL;
+  const char *url = "tcp://127.0.0.1:12389";
+  size_t i, size = 8 * 1024 * 1024, total = 0;
+  char *data = (char *) calloc(1, size);
+  int counts[2] = {0, 0};
+  mg_mgr_init(&mgr);
+  lsn = mg_listen(&mgr, url, f10, &server);
+  ASSERT(lsn != NULL);
+  lsn->recv_high = 1000;  // Inherited by accepted connections
+  c = mg_connect(&mgr, url, f14, counts);
+  ASSERT(c != NULL);
+  c->send_high = 65536;
+  c->send_low = 1000;
+  mg_send(c, data, size);
+
+  // Server stops reading, so the client cannot send everything
+  for (i = 0; i < 100; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(server != NULL);
+  ASSERT(server->is_recv_full);
+  ASSERT(server->recv.len >= 1000 && server->recv.len < 8192);
+  ASSERT(counts[0] == 1 && counts[1] == 0);
+  ASSERT(c->is_send_full);
+
+  // Consuming received data resumes reading, and the client drains
+  for (i = 0; i < 100000 && total < size; i++) {
+    total += server->recv.len;
+    mg_iobuf_delete(&server->recv, server->recv.len);
+    mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(total == size);
+  ASSERT(counts[0] == 1 && counts[1] == 1);
+  ASSERT(!c->is_send_full && !server->is_recv_full);
+  mg_mgr_free(&mgr);
+  free(data);
+}
+
+static void test_pollinterval(void) {
+  struct mg_mgr mgr;
+  const char *url = "http://127.0.0.1:12378";
+  char buf[FETCH_BUF_SIZE];
+  int polls = 0;
+  mg_mgr_init(&mgr);
+  mgr.pollinterval = 100000;  // First poll is full, then only ready conns
+  mg_http_listen(&mgr, url, f6, &polls);
+  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, "ok") == 0);
+  ASSERT(fetch(&mgr, buf, url, "GET /x HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, "ok") == 0);
+  ASSERT(polls == 1);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  ASSERT(mgr.ready == NULL);
+}
+
+struct alloc_stats {
+  int allocs, deallocs, conns;
+};
+
+static void *counting_alloc(size_t size, void *userdata) {
+  struct alloc_stats *s = (struct alloc_stats *) userdata;
+  s->allocs++;
+  if (size == sizeof(struct mg_connection)) s->conns++;
+  return malloc(size);
+}
+
+static void counting_dealloc(void *ptr, void *userdata) {
+  ((struct alloc_stats *) userdata)->deallocs++;
+  free(ptr);
+}
+
+static void test_prealloc(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c, *slab;
+  const char *url = "http://127.0.0.1:12382";
+  char buf[FETCH_BUF_SIZE];
+  struct alloc_stats stats = {0, 0, 0};
+  struct mg_allocator a = {counting_alloc, counting_dealloc, NULL};
+  int polls = 0;
+  a.userdata = &stats;
+  mg_set_allocator(&a);
+  mg_mgr_init(&mgr);
+  ASSERT(mg_mgr_prealloc(&mgr, 0) == false);
+  ASSERT(mg_mgr_prealloc(&mgr, 3) == true);
+  ASSERT(mg_mgr_prealloc(&mgr, 3) == false);
+  ASSERT(stats.allocs == 1);
+  slab = (struct mg_connection *) mgr.slab;
+  ASSERT(mgr.spare == &slab[0]);
+  c = mg_http_listen(&mgr, url, f6, &polls);
+  ASSERT(c == &slab[0]);
+  // Listener, client and accepted connection fit in the slab
+  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, "ok") == 0);
+  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+  ASSERT(stats.conns == 0);
+  // Slab is exhausted, the next connection comes from the heap
+  ASSERT(mg_connect(&mgr, url, NULL, NULL) != NULL);
+  ASSERT(mg_connect(&mgr, url, NULL, NULL) != NULL);
+  ASSERT(mgr.spare == NULL);
+  ASSERT(mg_connect(&mgr, url, NULL, NULL) != NULL);
+  ASSERT(stats.conns == 1);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.slab == NULL && mgr.spare == NULL);
+  ASSERT(stats.allocs > 1);
+  ASSERT(stats.allocs == stats.deallocs);
+  mg_set_allocator(NULL);
+}
+
+static void test_conn_by_id(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c, *conns[40];
+  int i;
+  mg_mgr_init(&mgr);
+  ASSERT(mg_conn_by_id(&mgr, 1) == NULL);
+  for (i = 0; i < 40; i++) {
+    conns[i] = mg_connect(&mgr, "udp://127.0.0.1:12383", NULL, NULL);
+    ASSERT(conns[i] != NULL);
+  }
+  ASSERT(mgr.nconns == 40);
+  ASSERT(mgr.idsize >= 40);
+  for (i = 0; i < 40; i++) {
+    ASSERT(mg_conn_by_id(&mgr, conns[i]->id) == conns[i]);
+  }
+  ASSERT(mg_conn_by_id(&mgr, 0) == NULL);
+  ASSERT(mg_conn_by_id(&mgr, conns[0]->id + 1000) == NULL);
+  for (i = 0; i < 40; i += 2) conns[i]->is_closing = 1;
+  mg_mgr_poll(&mgr, 0);
+  ASSERT(mgr.nconns == 20);
+  for (i = 0; i < 40; i++) {
+    c = mg_conn_by_id(&mgr, (unsigned long) i + 1);
+    ASSERT(i % 2 == 0 ? c == NULL : c == conns[i]);
+  }
+  for (i = 0, c = mgr.conns; c != NULL; c = c->next, i++) {
+    ASSERT(c->prev == NULL ? c == mgr.conns : c->prev->next == c);
+  }
+  ASSERT(i == 20);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL && mgr.nconns == 0 && mgr.ids == NULL);
+}
+
+static void f15(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_ACCEPT) {
+    int on = 0, flags = fcntl((int) (long) c->fd, F_GETFL, 0);
+    socklen_t len = sizeof(on);
+    getsockopt((int) (long) c->fd, IPPROTO_TCP, TCP_NODELAY, (char *) &on,
+               &len);
+    ASSERT(on != 0);  // Inherited from the listener
+    ASSERT(flags & O_NONBLOCK);
+    (*(int *) fn_data)++;
+  }
+  (void) ev_data;
+}
+
+static void test_accept(void) {
+  struct mg_mgr mgr;
+  const char *url = "tcp://127.0.0.1:12390";
+  int i, accepted = 0;
+  mg_mgr_init(&mgr);
+  ASSERT(mg_listen(&mgr, url, f15, &accepted) != NULL);
+  for (i = 0; i < 100; i++) ASSERT(mg_connect(&mgr, url, NULL, NULL) != NULL);
+  mg_mgr_poll(&mgr, 50);
+  ASSERT(accepted > 0 && accepted <= MG_ACCEPT_BUDGET);
+  for (i = 0; i < 100 && accepted < 100; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(accepted == 100);
+  mg_mgr_free(&mgr);
+}
+
+static int getsockint(struct mg_connection *c, int level, int name) {
+  int val = -1;
+  socklen_t len = sizeof(val);
+  getsockopt((int) (long) c->fd, level, name, (char *) &val, &len);
+  return val;
+}
+
+static void test_sockopts(void) {
+  struct mg_mgr mgr;
+  struct mg_sock_opts o;
+  struct mg_connection *c, *lsn, *server = NULL;
+  const char *url = "tcp://127.0.0.1:12391";
+  int i;
+  memset(&o, 0, sizeof(o));
+  o.backlog = 16;
+  o.rcvbuf = 256 * 1024;
+  o.defer_accept = 1;
+  o.keepidle = -1;
+  o.nagle = true;
+  mg_mgr_init(&mgr);
+  lsn = mg_listen_opts(&mgr, url, &o, f10, &server);
+  ASSERT(lsn != NULL);
+  ASSERT(lsn->sockopts != NULL && lsn->sockopts != &o);
+  ASSERT(lsn->sockopts->backlog == 16);
+  memset(&o, 0, sizeof(o));  // Listener has its own copy
+  c = mg_connect(&mgr, url, NULL, NULL);
+  ASSERT(c != NULL && c->sockopts == NULL);
+#if defined(__linux__)
+  // Connection without data is not accepted yet
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(server == NULL);
+#endif
+  mg_send(c, "hi", 2);
+  for (i = 0; i < 100 && server == NULL; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(server != NULL);
+  ASSERT(getsockint(server, IPPROTO_TCP, TCP_NODELAY) == 0);
+  ASSERT(getsockint(server, SOL_SOCKET, SO_KEEPALIVE) == 0);
+  ASSERT(getsockint(server, SOL_SOCKET, SO_RCVBUF) >= 256 * 1024);
+  ASSERT(getsockint(c, IPPROTO_TCP, TCP_NODELAY) != 0);  // Defaults
+  ASSERT(getsockint(c, SOL_SOCKET, SO_KEEPALIVE) != 0);
+  o.keepidle = -1;
+  c = mg_http_connect_opts(&mgr, "http://127.0.0.1:12391", &o, NULL, NULL);
+  ASSERT(c != NULL && c->sockopts != NULL && c->sockopts->keepidle == -1);
+  mg_mgr_free(&mgr);
+}
+
+// UDP client: count echoed datagrams, each must be ours and arrive alone
+static void f16(struct mg_connection *c, int ev, void *ev_data,
+                void *fn_data) {
+  int *count = (int *) fn_data;
+  if (ev == MG_EV_READ) {
+    if (c->recv.len == 2 && c->recv.buf[0] == c->label[0]) count[0]++;
+    if (c->recv.len != 2 || c->recv.buf[0] != c->label[0]) count[1]++;
+    mg_iobuf_delete(&c->recv, c->recv.len);
+  }
+  (void) ev_data;
+}
+
+static void test_udp_batch(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *a, *b;
+  const char *url = "udp://127.0.0.1:12392";
+  int i, ca[2] = {0, 0}, cb[2] = {0, 0};
+  char msg[3];
+  mg_mgr_init(&mgr);
+  ASSERT(mg_listen(&mgr, url, f12, NULL) != NULL);
+  a = mg_connect(&mgr, url, f16, ca);
+  b = mg_connect(&mgr, url, f16, cb);
+  ASSERT(a != NULL && b != NULL);
+  a->label[0] = 'A', b->label[0] = 'B';
+  for (i = 0; i < 10; i++) {
+    snprintf(msg, sizeof(msg), "A%d", i);
+    ASSERT(mg_send(a, msg, 2) == 2);
+    msg[0] = 'B';
+    ASSERT(mg_send(b, msg, 2) == 2);
+  }
+  for (i = 0; i < 100 && (ca[0] < 10 || cb[0] < 10); i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(ca[0] == 10 && cb[0] == 10);
+  ASSERT(ca[1] == 0 && cb[1] == 0);
+#if MG_ENABLE_MMSG
+  {
+    // Too large for UDP: dropped and counted, the next datagram still goes
+    size_t len = 70000;
+    char *big = (char *) calloc(1, len);
+    ASSERT(mg_send(a, big, len) == (int) len);
+    ASSERT(mg_send(a, "A0", 2) == 2);
+    for (i = 0; i < 100 && ca[0] < 11; i++) mg_mgr_poll(&mgr, 1);
+    ASSERT(ca[0] == 11 && ca[1] == 0);
+    ASSERT(a->udp_dropped == 1);
+    free(big);
+  }
+#endif
+  mg_mgr_free(&mgr);
+}
+
+// Count timeout errors and closed server connections
+static void f18(struct mg_connection *c, int ev, void *ev_data,
+                void *fn_data) {
+  int *count = (int *) fn_data;
+  if (ev == MG_EV_ERROR && strcmp((char *) ev_data, "request timeout") == 0) {
+    count[0]++;
+  }
+  if (ev == MG_EV_CLOSE && c->is_accepted) count[1]++;
+}
+
+static void test_timeouts(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *a, *b;
+  const char *url = "tcp://127.0.0.1:12394";
+  int i, count[2] = {0, 0};
+  mg_mgr_init(&mgr);
+  mgr.idletimeout = 200;
+  mgr.reqtimeout = 30;
+  ASSERT(mg_listen(&mgr, url, f18, count) != NULL);
+  a = mg_connect(&mgr, url, NULL, NULL);
+  b = mg_connect(&mgr, url, NULL, NULL);
+  ASSERT(a != NULL && b != NULL);
+  mg_printf(b, "GET / HTTP/1.1\r\n");  // Never completed
+  for (i = 0; i < 100 && count[0] == 0; i++) mg_mgr_poll(&mgr, 5);
+  // Slow request is closed, idle connection is not yet
+  ASSERT(count[0] == 1 && count[1] == 1);
+  for (i = 0; i < 10 && mgr.nconns > 3; i++) mg_mgr_poll(&mgr, 5);
+  ASSERT(mgr.nconns == 3);
+  for (i = 0; i < 100 && mgr.nconns > 1; i++) mg_mgr_poll(&mgr, 10);
+  ASSERT(count[1] == 2);
+  ASSERT(mgr.nconns == 1);
+  mg_mgr_free(&mgr);
+}
+
+// Demultiplexing UDP listener: echo, count virtual connections per peer
+static void f17(struct mg_connection *c, int ev, void *ev_data,
+                void *fn_data) {
+  int *count = (int *) fn_data;
+  if (ev == MG_EV_ACCEPT) count[0]++;
+  if (ev == MG_EV_CLOSE && c->is_accepted) count[1]++;
+  if (ev == MG_EV_READ) {
+    ASSERT(c->is_accepted && c->recv.len == 2);
+    if (c->label[0] != '\0' && c->label[0] != c->recv.buf[0]) count[2]++;
+    c->label[0] = (char) c->recv.buf[0];
+    mg_send(c, c->recv.buf, c->recv.len);
+    mg_iobuf_delete(&c->recv, c->recv.len);
+  }
+  (void) ev_data;
+}
+
+static void test_udp_demux(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *lsn, *a, *b;
+  const char *url = "udp://127.0.0.1:12393";
+  int i, ca[2] = {0, 0}, cb[2] = {0, 0}, count[3] = {0, 0, 0};
+  mg_mgr_init(&mgr);
+  lsn = mg_listen(&mgr, url, f17, count);
+  ASSERT(lsn != NULL);
+  ASSERT(mg_udp_demux(lsn, 50) == true);
+  ASSERT(mg_udp_demux(lsn, 50) == false);
+  a = mg_connect(&mgr, url, f16, ca);
+  b = mg_connect(&mgr, url, f16, cb);
+  ASSERT(a != NULL && b != NULL);
+  ASSERT(mg_udp_demux(a, 50) == false);
+  a->label[0] = 'A', b->label[0] = 'B';
+  for (i = 0; i < 10; i++) {
+    mg_send(a, "A", 2);
+    mg_send(b, "B", 2);
+  }
+  for (i = 0; i < 100 && (ca[0] < 10 || cb[0] < 10); i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(ca[0] == 10 && cb[0] == 10);
+  ASSERT(ca[1] == 0 && cb[1] == 0);
+  ASSERT(count[0] == 2 && count[1] == 0 && count[2] == 0);
+  ASSERT(mgr.nconns == 5);
+  // Idle peers are closed, a new datagram makes a new virtual connection
+  for (i = 0; i < 100 && count[1] < 2; i++) mg_mgr_poll(&mgr, 5);
+  ASSERT(count[1] == 2);
+  ASSERT(mgr.nconns == 3);
+  mg_send(a, "A", 2);
+  for (i = 0; i < 100 && ca[0] < 11; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(ca[0] == 11 && count[0] == 3);
+  // Closing listener closes its virtual connections
+  lsn->is_closing = 1;
+  for (i = 0; i < 10 && count[1] < 3; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(count[1] == 3);
+  ASSERT(mgr.nconns == 2);
+  mg_mgr_free(&mgr);
+}
+
+#if MG_ENABLE_WAKEUP
+#include <pthread.h>
+
+struct wakeup_data {
+  struct mg_mgr *mgr;
+  unsigned long id;
+  int count[4];
+  int errors;
+};
+
+static void *wakeup_thread(void *param) {
+  struct wakeup_data *d = (struct wakeup_data *) param;
+  static int seq;
+  int i, n = __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED) % 4;
+  for (i = 0; i < 1000; i++) {
+    int msg[2] = {n, i};
+    mg_mgr_wakeup(d->mgr, d->id, msg, sizeof(msg));
+  }
+  return NULL;
+}
+
+static void f8(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  struct wakeup_data *d = (struct wakeup_data *) fn_data;
+  if (ev == MG_EV_WAKEUP) {
+    struct mg_str *s = (struct mg_str *) ev_data;
+    int msg[2];
+    memcpy(msg, s->ptr, sizeof(msg));
+    // Messages from one thread arrive in order
+    if (s->len != sizeof(msg) || msg[1] != d->count[msg[0]]) d->errors++;
+    d->count[msg[0]]++;
+  }
+  (void) c;
+}
+
+static void test_wakeup(void) {
+  struct mg_mgr mgr;
+  struct wakeup_data d;
+  struct mg_connection *c;
+  pthread_t t[4];
+  int i;
+  memset(&d, 0, sizeof(d));
+  mg_mgr_init(&mgr);
+  ASSERT(mg_mgr_wakeup(&mgr, 0, NULL, 0) == false);
+  ASSERT(mg_mgr_wakeup_init(&mgr) == true);
+  ASSERT(mg_mgr_wakeup_init(&mgr) == true);
+  c = mg_listen(&mgr, "tcp://127.0.0.1:12380", f8, &d);
+  ASSERT(c != NULL);
+  d.mgr = &mgr;
+  d.id = c->id;
+  for (i = 0; i < 4; i++) pthread_create(&t[i], NULL, wakeup_thread, &d);
+  for (i = 0; i < 4; i++) pthread_join(t[i], NULL);
+  ASSERT(mg_mgr_wakeup(&mgr, 12345, "x", 1) == true);  // No such connection
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(d.count[0] == 1000 && d.count[1] == 1000);
+  ASSERT(d.count[2] == 1000 && d.count[3] == 1000);
+  ASSERT(d.errors == 0);
+  ASSERT(mg_mgr_wakeup(&mgr, d.id, "x", 1) == true);  // Freed by mg_mgr_free
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  ASSERT(mgr.wakeup == NULL);
+}
+#endif
+
+#if MG_ENABLE_WORKERS
+static void work_fn(void *arg) {
+  mg_usleep(20000);  // Simulate slow work
+  *(int *) arg = 42;
+}
+
+static void f9(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_WORK_DONE) {
+    if (*(int *) ev_data == 42) (*(int *) fn_data)++;
+    free(ev_data);
+  }
+  (void) c;
+}
+
+static void test_workers(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c;
+  int i, done = 0, accepted = 0;
+  mg_mgr_init(&mgr);
+  ASSERT(mg_submit(&mgr, 0, work_fn, NULL) == false);
+  ASSERT(mg_workers_init(&mgr, 2, 4) == true);
+  c = mg_listen(&mgr, "tcp://127.0.0.1:12381", f9, &done);
+  ASSERT(c != NULL);
+  // A burst is limited by the queue size, the rest is refused
+  for (i = 0; i < 20; i++) {
+    int *arg = (int *) calloc(1, sizeof(*arg));
+    if (mg_submit(&mgr, c->id, work_fn, arg)) {
+      accepted++;
+    } else {
+      free(arg);
+    }
+  }
+  ASSERT(accepted >= 4 && accepted < 20);
+  for (i = 0; i < 100 && done < accepted; i++) mg_mgr_poll(&mgr, 10);
+  ASSERT(done == accepted);
+  // Results for unknown connections, and queued work, are freed
+  ASSERT(mg_submit(&mgr, 12345, work_fn, calloc(1, sizeof(int))) == true);
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 10);
+  for (i = 0; i < 4; i++) mg_submit(&mgr, c->id, work_fn, calloc(1, 4));
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  ASSERT(mgr.workers == NULL);
+}
+#endif
+
+#if MG_ENABLE_REACTORS
+static void f7(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) mg_http_reply(c, 200, "", "%d", c->mgr->reactor_id);
+  (void) ev_data, (void) fn_data;
+}
+
+static void reactor_init(struct mg_mgr *mgr, void *fn_data) {
+  ASSERT(mgr->reactors != NULL);
+  ASSERT(mg_http_listen(mgr, "http://127.0.0.1:12379", f7, NULL) != NULL);
+  (*(int *) fn_data)++;
+}
+
+static void test_reactors(void) {
+  struct mg_mgr mgr;
+  struct mg_reactors *r;
+  const char *url = "http://127.0.0.1:12379";
+  char buf[FETCH_BUF_SIZE];
+  unsigned long start;
+  int i, n = 0;
+  ASSERT(mg_reactors_start(0, 0, reactor_init, &n) == NULL);
+  r = mg_reactors_start(3, MG_REACTORS_PIN, reactor_init, &n);
+  ASSERT(r != NULL);
+  ASSERT(n == 3);
+  mg_mgr_init(&mgr);
+  for (i = 0; i < 10; i++) {
+    struct mg_http_message hm;
+    ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+    ASSERT(mg_http_parse(buf, strlen(buf), &hm) > 0);
+    ASSERT(hm.body.len == 1 && hm.body.ptr[0] >= '0' && hm.body.ptr[0] < '3');
+  }
+  mg_mgr_free(&mgr);
+  start = mg_millis();
+  mg_reactors_stop(r);
+  ASSERT(mg_millis() - start < 40);  // Reactors are woken up, not polled
+}
+#endif
+
 static void test_http_parse(void) {
   struct mg_str *v;
   struct mg_http_message req;
@@ -858,6 +1798,72 @@ static void test_http_parse(void) {
     req = "a\nb\nc\n\n";
     ASSERT(mg_http_parse(req, strlen(req), &hm) < 0);
   }
+
+  {
+    // Feed a message byte by byte, as a slow client would send it
+    struct mg_http_parser p;
+    struct mg_http_message hm;
+    const char *s = "POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\nabcGET";
+    size_t i, head = strlen(s) - 6;
+    memset(&p, 0, sizeof(p));
+    for (i = 0; i < head + 2; i++) {
+      ASSERT(mg_http_feed(&p, s, i, &hm) == 0);
+      ASSERT(p.head == (i < head ? 0 : head));
+    }
+    ASSERT(p.body == 3);
+    ASSERT(mg_http_feed(&p, s, head + 3, &hm) == (int) head);
+    ASSERT(mg_vcmp(&hm.body, "abc") == 0);
+    ASSERT(hm.message.len == head + 3);
+    ASSERT(mg_http_feed(&p, s, strlen(s), &hm) == (int) head);
+
+    // A shorter buffer means the message was consumed: start over
+    ASSERT(mg_http_feed(&p, s + head + 3, 3, &hm) == 0);
+    ASSERT(p.head == 0 && p.scanned == 3);
+
+    // A restart in the middle of the headers keeps streaming and upload state
+    memset(&p, 0, sizeof(p));
+    p.is_streaming = true;
+    p.upload = &p;
+    for (i = 0; i < 10; i++) ASSERT(mg_http_feed(&p, s, i, &hm) == 0);
+    ASSERT(p.scanned == 9);
+    for (i = 0; i < head + 3; i++) ASSERT(mg_http_feed(&p, s, i, &hm) == 0);
+    ASSERT(p.head == head && p.body == 3);
+    ASSERT(mg_http_feed(&p, s, head + 3, &hm) == (int) head);
+    ASSERT(mg_vcmp(&hm.body, "abc") == 0);
+    ASSERT(p.is_streaming && p.upload == &p);
+    memset(&p, 0, sizeof(p));
+    ASSERT(mg_http_feed(&p, "\b23", 3, &hm) == -1);
+  }
+
+  {
+    // Control characters and delimiters at every offset of vector blocks
+    struct mg_http_message hm;
+    char buf[120];
+    size_t i, n;
+    for (i = 0; i < 70; i++) {
+      memset(buf, 'x', sizeof(buf));
+      memcpy(buf, "GET / HTTP/1.1\r\n", 16);
+      memcpy(buf + 90, "\r\n\r\n", 4);
+      buf[16 + i] = (char) 0x80;
+      ASSERT(mg_http_parse(buf, 94, &hm) == 94);
+      buf[16 + i] = '\t';
+      ASSERT(mg_http_parse(buf, 94, &hm) == -1);
+      buf[16 + i] = 0x7f;
+      ASSERT(mg_http_parse(buf, 94, &hm) == -1);
+      buf[16 + i] = ':';
+      ASSERT(mg_http_parse(buf, 94, &hm) == 94);
+      ASSERT(hm.headers[0].name.len == i);
+      ASSERT(hm.headers[0].value.len == (i == 0 ? 0 : 90 - 17 - i));
+      ASSERT(hm.headers[1].name.len == 0);
+    }
+    for (n = 1; n < 40; n++) {
+      memset(buf, 'x', sizeof(buf));
+      memcpy(buf + n, " / HTTP/1.1\n\n", 13);
+      ASSERT(mg_http_parse(buf, n + 13, &hm) == (int) n + 13);
+      ASSERT(hm.method.len == n);
+      ASSERT(mg_vcmp(&hm.proto, "HTTP/1.1") == 0);
+    }
+  }
 }
 
 static void test_http_range(void) {
@@ -910,105 +1916,207 @@ static void f1(void *arg) {
   (*(int *) arg)++;
 }
 
+// Number of timers armed in a timing wheel
+static int num_timers(struct mg_timers *w) {
+  struct mg_timer *t;
+  int i, j, n = 0;
+  for (t = w->due; t != NULL; t = t->next) n++;
+  for (i = 0; i < MG_TIMER_LEVELS; i++) {
+    for (j = 0; j < MG_TIMER_SLOTS; j++) {
+      for (t = w->slots[i][j]; t != NULL; t = t->next) n++;
+    }
+  }
+  return n;
+}
+
 static void test_timer(void) {
   int v1 = 0, v2 = 0, v3 = 0;
   struct mg_timer t1, t2, t3;
+  struct mg_timers w;
 
-  LOG(LL_INFO, ("g_timers: %p", g_timers));
-  ASSERT(g_timers == NULL);
+  memset(&w, 0, sizeof(w));
+  ASSERT(num_timers(&w) == 0);
 
-  mg_timer_init(&t1, 5, MG_TIMER_REPEAT, f1, &v1);
-  mg_timer_init(&t2, 15, 0, f1, &v2);
-  mg_timer_init(&t3, 10, MG_TIMER_REPEAT | MG_TIMER_RUN_NOW, f1, &v3);
+  mg_timer_init(&w, &t1, 5, MG_TIMER_REPEAT, f1, &v1);
+  mg_timer_init(&w, &t2, 15, 0, f1, &v2);
+  mg_timer_init(&w, &t3, 10, MG_TIMER_REPEAT | MG_TIMER_RUN_NOW, f1, &v3);
 
-  ASSERT(g_timers == &t3);
-  ASSERT(g_timers->next == &t2);
+  ASSERT(w.due == &t3);
+  ASSERT(w.due->next == &t2);
+  ASSERT(num_timers(&w) == 3);
 
-  mg_timer_poll(0);
-  mg_timer_poll(1);
+  mg_timer_poll(&w, 0);
+  mg_timer_poll(&w, 1);
   ASSERT(v1 == 0);
   ASSERT(v2 == 0);
   ASSERT(v3 == 1);
 
-  mg_timer_poll(5);
+  mg_timer_poll(&w, 5);
   ASSERT(v1 == 1);
   ASSERT(v2 == 0);
   ASSERT(v3 == 1);
 
-  ASSERT(g_timers == &t3);
-  ASSERT(g_timers->next == &t2);
+  ASSERT(num_timers(&w) == 3);
+  ASSERT(w.due == NULL);
 
   // Simulate long delay - timers must invalidate expiration times
-  mg_timer_poll(100);
+  mg_timer_poll(&w, 100);
   ASSERT(v1 == 2);
   ASSERT(v2 == 1);
   ASSERT(v3 == 2);
 
-  ASSERT(g_timers == &t3);
-  ASSERT(g_timers->next == &t1);  // t2 should be removed
-  ASSERT(g_timers->next->next == NULL);
+  ASSERT(num_timers(&w) == 2);
+  ASSERT(t2.pprev == NULL);  // t2 should be removed
+  ASSERT(t1.pprev != NULL && t3.pprev != NULL);
 
-  mg_timer_poll(107);
+  mg_timer_poll(&w, 107);
   ASSERT(v1 == 3);
   ASSERT(v2 == 1);
   ASSERT(v3 == 2);
 
-  mg_timer_poll(114);
+  mg_timer_poll(&w, 114);
   ASSERT(v1 == 4);
   ASSERT(v2 == 1);
   ASSERT(v3 == 3);
 
-  mg_timer_poll(115);
+  mg_timer_poll(&w, 115);
   ASSERT(v1 == 5);
   ASSERT(v2 == 1);
   ASSERT(v3 == 3);
 
-  mg_timer_init(&t2, 3, 0, f1, &v2);
-  ASSERT(g_timers == &t2);
-  ASSERT(g_timers->next == &t3);
-  ASSERT(g_timers->next->next == &t1);
-  ASSERT(g_timers->next->next->next == NULL);
+  mg_timer_init(&w, &t2, 3, 0, f1, &v2);
+  ASSERT(w.due == &t2);
+  ASSERT(num_timers(&w) == 3);
 
-  mg_timer_poll(120);
+  mg_timer_poll(&w, 120);
   ASSERT(v1 == 6);
   ASSERT(v2 == 1);
   ASSERT(v3 == 4);
 
-  mg_timer_poll(125);
+  mg_timer_poll(&w, 125);
   ASSERT(v1 == 7);
   ASSERT(v2 == 2);
   ASSERT(v3 == 4);
 
   // Test millisecond counter wrap - when time goes back.
-  mg_timer_poll(0);
+  mg_timer_poll(&w, 0);
   ASSERT(v1 == 7);
   ASSERT(v2 == 2);
   ASSERT(v3 == 4);
 
-  ASSERT(g_timers == &t3);
-  ASSERT(g_timers->next == &t1);
-  ASSERT(g_timers->next->next == NULL);
+  ASSERT(num_timers(&w) == 2);
+  ASSERT(t2.pprev == NULL);
 
-  mg_timer_poll(7);
+  mg_timer_poll(&w, 7);
   ASSERT(v1 == 8);
   ASSERT(v2 == 2);
   ASSERT(v3 == 4);
 
-  mg_timer_poll(11);
+  mg_timer_poll(&w, 11);
   ASSERT(v1 == 9);
   ASSERT(v2 == 2);
   ASSERT(v3 == 5);
 
   mg_timer_free(&t1);
-  ASSERT(g_timers == &t3);
-  ASSERT(g_timers->next == NULL);
+  ASSERT(num_timers(&w) == 1);
+  ASSERT(t1.pprev == NULL);
 
   mg_timer_free(&t2);
-  ASSERT(g_timers == &t3);
-  ASSERT(g_timers->next == NULL);
+  ASSERT(num_timers(&w) == 1);
 
   mg_timer_free(&t3);
-  ASSERT(g_timers == NULL);
+  ASSERT(num_timers(&w) == 0);
+}
+
+struct wheel_timer {
+  struct mg_timer t;
+  unsigned long *now;
+  unsigned long fired;
+};
+
+static void f2(void *arg) {
+  struct wheel_timer *wt = (struct wheel_timer *) arg;
+  wt->fired = *wt->now;
+}
+
+static void test_timer_wheel(void) {
+  // Around level boundaries, and past the range of the wheel
+  static const unsigned long delays[] = {
+      1,      2,      63,     64,       65,       4095,    4096,
+      4097,   262143, 262144, 262145, 16777215, 16777216, 20000000};
+  struct mg_timers w;
+  struct wheel_timer wt[sizeof(delays) / sizeof(delays[0])];
+  unsigned long now = 1000, step = 1;
+  size_t i, n = sizeof(wt) / sizeof(wt[0]);
+  memset(&w, 0, sizeof(w));
+  mg_timer_poll(&w, now);
+  for (i = 0; i < n; i++) {
+    memset(&wt[i], 0, sizeof(wt[i]));
+    wt[i].t.fn = f2;
+    wt[i].t.arg = &wt[i];
+    wt[i].now = &now;
+    mg_timers_add(&w, &wt[i].t, now + delays[i]);
+  }
+  ASSERT(num_timers(&w) == (int) n);
+  // Cancel one, it must not fire
+  mg_timer_free(&wt[3].t);
+  ASSERT(num_timers(&w) == (int) n - 1);
+  // Poll with growing, uneven steps. Every timer fires once, at the first
+  // poll past its expiration time
+  while (now < 1000 + 20000000 + step) {
+    unsigned long prev = now;
+    now += step;
+    step = step * 3 / 2 + 1;
+    if (step > 700000) step = 700000;
+    mg_timer_poll(&w, now);
+    for (i = 0; i < n; i++) {
+      unsigned long expire = 1000 + delays[i];
+      if (i == 3) continue;
+      if (expire > prev && expire <= now) ASSERT(wt[i].fired == now);
+      if (expire > now) ASSERT(wt[i].fired == 0);
+    }
+  }
+  ASSERT(wt[3].fired == 0);
+  ASSERT(num_timers(&w) == 0);
+  // Exact, one-millisecond stepping
+  for (i = 0; i < n; i++) {
+    wt[i].fired = 0;
+    mg_timers_add(&w, &wt[i].t, now + (i + 1) * 37);
+  }
+  for (step = 0; step < n * 37 + 1; step++) {
+    mg_timer_poll(&w, ++now);
+  }
+  for (i = 0; i < n; i++) {
+    ASSERT(wt[i].fired == now - n * 37 - 1 + (i + 1) * 37);
+  }
+  ASSERT(num_timers(&w) == 0);
+}
+
+static void test_mgr_timers(void) {
+  struct mg_mgr m1, m2;
+  struct mg_timer t1, t2;
+  int v1 = 0, v2 = 0;
+  unsigned long start;
+  mg_mgr_init(&m1);
+  mg_mgr_init(&m2);
+  ASSERT(mg_timers_wait(&m1.timers, mg_millis(), 1000) == 1000);
+  mg_timer_init(&m1.timers, &t1, 20, 0, f1, &v1);
+  mg_timer_init(&m2.timers, &t2, 20, 0, f1, &v2);
+  ASSERT(mg_timers_wait(&m1.timers, mg_millis(), 1000) == 0);
+  mg_mgr_poll(&m1, 0);  // Sets expiration time
+  ASSERT(mg_timers_wait(&m1.timers, m1.timers.now, 1000) == 20);
+  ASSERT(mg_timers_wait(&m1.timers, m1.timers.now, 5) == 5);
+  // Poll sleeps until the timer expires, not for the given time. Timers of
+  // the other manager are not touched
+  start = mg_millis();
+  mg_mgr_poll(&m1, 1000);
+  if (v1 == 0) mg_mgr_poll(&m1, 1000);  // Woken up a millisecond early
+  ASSERT(v1 == 1 && v2 == 0);
+  ASSERT(mg_millis() - start < 500);
+  ASSERT(t1.pprev == NULL && t2.pprev != NULL);
+  mg_timer_free(&t2);
+  mg_mgr_free(&m1);
+  mg_mgr_free(&m2);
 }
 
 static void test_str(void) {
@@ -1159,9 +2267,12 @@ int main(void) {
   test_dns();
   test_str();
   test_timer();
+  test_timer_wheel();
+  test_mgr_timers();
   test_http_range();
   test_url();
   test_iobuf();
+  test_send_growth();
   test_commalist();
   test_base64();
   test_globmatch();
@@ -1172,6 +2283,30 @@ int main(void) {
   test_http_client();
   test_http_no_content_length();
   test_http_pipeline();
+  test_http_chunked();
+  test_http_stream();
+  test_http_upload();
+  test_pollinterval();
+  test_prealloc();
+  test_conn_by_id();
+  test_accept();
+  test_sockopts();
+  test_udp_batch();
+  test_udp_demux();
+  test_timeouts();
+  test_send_ref();
+  test_serve_large_file();
+  test_relay();
+  test_watermarks();
+#if MG_ENABLE_WAKEUP
+  test_wakeup();
+#endif
+#if MG_ENABLE_WORKERS
+  test_workers();
+#endif
+#if MG_ENABLE_REACTORS
+  test_reactors();
+#endif
   test_mqtt();
   printf("SUCCESS. Total tests: %d\n", s_num_tests);
   return EXIT_SUCCESS;